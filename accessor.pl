@@ -24,12 +24,24 @@
 use strict;
 
 sub dump_accessor_declaration ($);
+sub dump_struct_declaration ($);
+sub dump_struct_accessors ($);
 sub dump_accessor_initialisation ($);
 sub dump_accessor_free ($);
-sub dump_accessor_indexed ($$);
-sub dump_accessor_simple ($$);
+sub dump_accessor_indexed ($$$$);
+sub dump_accessor_simple ($$$$);
+sub is_pointer ($);
+sub is_kept ($);
+sub element ($$);
+sub dump_data_field ($);
+sub dump_data_length ($$);
+sub field_width ($);
+sub dump_field_write ($);
+sub dump_field_read ($);
 
 my @accessors;
+my @structs;
+my $struct;
 
 while(<>) {
 
@@ -39,11 +51,19 @@ while(<>) {
     # Perl comments
     next if /^\s*#/;
 
+    # The rest of this section is kept in a structure
+    if( /^\s*struct\s+(\w+)/ ) {
+      $struct = { name => $1, fields => [ ] };
+      push @structs, $struct;
+      next;
+    }
+
     my $item = { };
 
     # Leading C comment
     if( /^\s*\/\*/ ) {
       $item->{section_comment} = $_;
+      $struct = undef;
     } else {
        # Trailing C comment
        if( /^.+\/\*(.*)\*\// ) {
@@ -52,11 +72,33 @@ while(<>) {
        }
 
        ( $item->{type}, $item->{name}, $item->{indexed}, $item->{value} ) = split;
+       $item->{struct} = $struct;
     }
 
     push @accessors, $item;
 }
 
+# Fields which point to data, and the lengths of that data, stay outside the
+# structures
+my %length_fields = map { $_->{value} => 1 } grep { is_pointer( $_ ) }
+  @accessors;
+
+foreach my $item ( @accessors ) {
+  next unless $item->{struct};
+
+  if( is_pointer( $item ) || $length_fields{ $item->{name} } ) {
+    $item->{struct} = undef;
+    next;
+  }
+
+  push @{ $item->{struct}->{fields} }, $item;
+  $item->{member} = "$item->{struct}->{name}.$item->{name}";
+}
+
+foreach my $item ( @accessors ) {
+  $item->{member} = $item->{name} unless $item->{member};
+}
+
 print << "CODE";
 /* snap_accessors.c: simple accessor functions for libspectrum_snap
    Copyright (c) 2003-2009 Philip Kendall
@@ -95,58 +137,266 @@ foreach my $item ( @accessors ) {
 }
 
 print << "CODE";
+
+  /* Pages kept by libspectrum_snap_reset() for reuse */
+  libspectrum_byte *spare_pages;
+
+  /* Hashes of the data, allocated when first needed */
+  libspectrum_snap_hashes *hash_cache;
+
+  /* Pages shared with another snapshot by libspectrum_snap_clone() */
+  libspectrum_snap_shared *shared;
 };
 
+/* Set every field of a libspectrum_snap structure to its default */
+static void
+initialise( libspectrum_snap *snap )
+{
+  size_t i;
+CODE
+
+foreach my $item ( @accessors ) {
+  dump_accessor_initialisation( $item );
+}
+
+print << "CODE";
+}
+
 /* Initialise a libspectrum_snap structure */
 libspectrum_snap*
 libspectrum_snap_alloc( void )
 {
   libspectrum_snap* snap;
-  size_t i;
 
   snap = libspectrum_new( libspectrum_snap, 1 );
+  snap->spare_pages = NULL;
+  snap->hash_cache = NULL;
+  snap->shared = NULL;
+  initialise( snap );
+
+  return snap;
+}
+
+/* Copy a libspectrum_snap structure, either copying its pages or sharing
+   them with the original */
+libspectrum_snap*
+libspectrum_snap_clone( libspectrum_snap *snap, int flags )
+{
+  libspectrum_snap* clone;
+
+  clone = libspectrum_new( libspectrum_snap, 1 );
+
+  /* Every field at once, then the things which can't just be copied */
+  *clone = *snap;
+  clone->spare_pages = NULL;
+  clone->hash_cache = NULL;
+  clone->shared = NULL;
+  libspectrum_snap_clone_data( clone, flags );
+
+  return clone;
+}
+
+/* Release all memory pointed to by a libspectrum_snap structure; pages
+   of a known size are kept for reuse if `keep' is set */
+static void
+release( libspectrum_snap *snap, int keep )
+{
+  size_t i;
+
+  /* Pages shared with another snapshot are not ours to free */
+  libspectrum_snap_drop_shared_pages( snap );
 CODE
 
 foreach my $item ( @accessors ) {
-  dump_accessor_initialisation( $item );
+  dump_accessor_free( $item );
 }
 
 print << "CODE";
+}
 
-  return snap;
+/* Return a libspectrum_snap structure to the state it was in when
+   allocated, keeping its pages to be handed out again by
+   libspectrum_snap_alloc_page() */
+libspectrum_error
+libspectrum_snap_reset( libspectrum_snap *snap )
+{
+  release( snap, 1 );
+  libspectrum_snap_free_hash_cache( snap );
+  initialise( snap );
+
+  return LIBSPECTRUM_ERROR_NONE;
 }
 
 /* Free all memory used by a libspectrum_snap structure (destructor...) */
 libspectrum_error
 libspectrum_snap_free( libspectrum_snap *snap )
+{
+  release( snap, 0 );
+  libspectrum_snap_free_spare_pages( snap );
+  libspectrum_snap_free_hash_cache( snap );
+
+  libspectrum_free( snap );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* The list of pages kept for reuse */
+libspectrum_byte**
+libspectrum_snap_spare_pages( libspectrum_snap *snap )
+{
+  return &snap->spare_pages;
+}
+
+/* The pages shared with another snapshot */
+libspectrum_snap_shared**
+libspectrum_snap_shared_pages( libspectrum_snap *snap )
+{
+  return &snap->shared;
+}
+
+/* The cached hashes of the data */
+libspectrum_snap_hashes**
+libspectrum_snap_hash_cache( libspectrum_snap *snap )
+{
+  return &snap->hash_cache;
+}
+
+/* Every field which points to data */
+const libspectrum_snap_data_field libspectrum_snap_data_fields[] = {
+CODE
+
+my @data_fields = grep { is_pointer( $_ ) } @accessors;
+
+for( my $i = 0; $i < @data_fields; $i++ ) {
+  $data_fields[$i]->{field} = $i;
+  dump_data_field( $data_fields[$i] );
+}
+
+print << "CODE";
+};
+
+const size_t libspectrum_snap_data_field_count =
+  ARRAY_SIZE( libspectrum_snap_data_fields );
+
+/* Where the pointer to element `idx' of data field `field' is kept */
+libspectrum_byte**
+libspectrum_snap_data( libspectrum_snap *snap, size_t field, size_t idx )
+{
+  switch( field ) {
+CODE
+
+for( my $i = 0; $i < @data_fields; $i++ ) {
+  print "  case $i: return &", element( $data_fields[$i], "idx" ), ";\n";
+}
+
+print << "CODE";
+  }
+
+  return NULL;
+}
+
+/* Where the length of element `idx' of data field `field' is kept, or NULL
+   if the field has a fixed length */
+size_t*
+libspectrum_snap_data_length( libspectrum_snap *snap, size_t field,
+                              size_t idx )
+{
+  switch( field ) {
+CODE
+
+for( my $i = 0; $i < @data_fields; $i++ ) {
+  dump_data_length( $data_fields[$i], $i );
+}
+
+print << "CODE";
+  }
+
+  return NULL;
+}
+
+CODE
+
+# The serialised form of every field which does not point to data
+my @fields = grep { $_->{type} && !is_pointer( $_ ) } @accessors;
+
+my $fields_length = 0;
+my @fields_length_terms;
+
+foreach my $item ( @fields ) {
+  my $width = field_width( $item );
+  if( !$item->{indexed} ) {
+    $fields_length += $width;
+  } elsif( $item->{indexed} =~ /^\d+$/ ) {
+    $fields_length += $width * $item->{indexed};
+  } else {
+    push @fields_length_terms, "$width * $item->{indexed}";
+  }
+}
+
+print "/* The length of the serialised form of the fields */\n";
+print "const size_t libspectrum_snap_fields_length =\n  ",
+  join( " +\n  ", $fields_length, @fields_length_terms ), ";\n";
+
+print << "CODE";
+
+/* Serialise every field which does not point to data */
+void
+libspectrum_snap_write_fields( libspectrum_buffer *buffer,
+                               libspectrum_snap *snap )
 {
   size_t i;
+
 CODE
 
-foreach my $item ( @accessors ) {
-  dump_accessor_free( $item );
+foreach my $item ( @fields ) {
+  dump_field_write( $item );
 }
 
 print << "CODE";
+}
 
-  libspectrum_free( snap );
+/* Restore every field serialised by libspectrum_snap_write_fields(); the
+   caller must check there are libspectrum_snap_fields_length bytes
+   available */
+void
+libspectrum_snap_read_fields( libspectrum_snap *snap,
+                              const libspectrum_byte **buffer )
+{
+  size_t i;
 
-  return LIBSPECTRUM_ERROR_NONE;
+CODE
+
+foreach my $item ( @fields ) {
+  dump_field_read( $item );
 }
 
+print << "CODE";
+}
 CODE
 
 # Dump accessor functions
 foreach my $item ( @accessors ) {
   next if $item->{section_comment};
 
+  # Changing a pointer to data invalidates its hash
+  my $invalidate = is_pointer( $item ) ?
+    sprintf( "  libspectrum_snap_invalidate_data_hash( snap, %d, %s );\n",
+             $item->{field}, $item->{indexed} ? "idx" : "0" ) : "";
+
   if( $item->{indexed} ) {
-    dump_accessor_indexed( $item->{type}, $item->{name} );
+    dump_accessor_indexed( $item->{type}, $item->{name}, $item->{member},
+                           $invalidate );
   } else {
-    dump_accessor_simple( $item->{type}, $item->{name} );
+    dump_accessor_simple( $item->{type}, $item->{name}, $item->{member},
+                          $invalidate );
   }
 }
 
+# Dump the functions for each structure
+foreach my $struct ( @structs ) {
+  dump_struct_accessors( $struct );
+}
+
 sub dump_accessor_declaration ($) {
 
   my( $item ) = @_;
@@ -156,6 +406,13 @@ sub dump_accessor_declaration ($) {
     return;
   }
 
+  # A structure is declared in place of its first field
+  if( $item->{struct} ) {
+    dump_struct_declaration( $item->{struct} )
+      if $item == $item->{struct}->{fields}->[0];
+    return;
+  }
+
   if( $item->{indexed} eq "1" ) {
     print "  $item->{type} $item->{name}\[1\];";
   } elsif( $item->{indexed} ) {
@@ -180,11 +437,12 @@ sub dump_accessor_initialisation ($) {
     return;
   }
 
+  # For pointers, the value is the length of each allocation
   my $value;
-  if( $item->{value} ) {
-    $value = $item->{value};
-  } elsif( $item->{type} =~ /^(.*)\*/ ) {
+  if( $item->{type} =~ /^(.*)\*/ ) {
     $value = "NULL";
+  } elsif( $item->{value} ) {
+    $value = $item->{value};
   } else {
     $value = "0";
   }
@@ -222,56 +480,190 @@ sub dump_accessor_free ($) {
     $new_section = 0;
   }
 
-  if( $item->{indexed} eq "1" ) {
+  die "No length given for $item->{type} $item->{name}" unless $item->{value};
+
+  if( is_kept( $item ) ) {
+    print "  for( i = 0; i < $item->{indexed}; i++ )\n";
+    print "    libspectrum_snap_release_page( snap, snap->$item->{member}\[i\], $item->{value},\n";
+    print "                                   keep );\n";
+  } elsif( $item->{indexed} eq "1" ) {
     print "  libspectrum_free( libspectrum_snap_$item->{name}( snap, 0 ) );\n";
   } elsif( $item->{indexed} ) {
     print "  for( i = 0; i < $item->{indexed}; i++ )\n";
     print "    libspectrum_free( libspectrum_snap_$item->{name}( snap, i ) );\n";
-  } elsif( $item->{name} eq "slt_screen" ) {
+  } else {
     print "  libspectrum_free( libspectrum_snap_$item->{name}( snap ) );\n";
+  }
+}
+
+# Is this a field which points to data?
+sub is_pointer ($) {
+
+  my( $item ) = @_;
+
+  return $item->{type} && $item->{type} =~ /^(.*)\*/;
+}
+
+# Pages of arrays with a fixed length are kept by libspectrum_snap_reset()
+sub is_kept ($) {
+
+  my( $item ) = @_;
+
+  return $item->{value} =~ /^(0x[0-9a-f]+|\d+)$/i &&
+    $item->{indexed} && $item->{indexed} ne "1";
+}
+
+# The C expression for element `$index' of a field
+sub element ($$) {
+
+  my( $item, $index ) = @_;
+
+  return $item->{indexed} ? "snap->$item->{member}\[ $index \]" :
+                            "snap->$item->{member}";
+}
+
+sub dump_data_field ($) {
+
+  my( $item ) = @_;
+
+  my $count = $item->{indexed} ? $item->{indexed} : 1;
+  my $length = $item->{value} =~ /^(0x[0-9a-f]+|\d+)$/i ? $item->{value} : 0;
+
+  print "  { \"$item->{name}\", $count, $length },\n";
+}
+
+sub dump_data_length ($$) {
+
+  my( $item, $field ) = @_;
+
+  return if $item->{value} =~ /^(0x[0-9a-f]+|\d+)$/i;
+
+  my( $length ) = grep { $_->{name} && $_->{name} eq $item->{value} }
+    @accessors;
+  die "Unknown length field $item->{value} for $item->{name}" unless $length;
+
+  print "  case $field: return &", element( $length, "idx" ), ";\n";
+}
+
+# Fields are stored little endian in a byte, word or dword
+sub field_width ($) {
+
+  my( $item ) = @_;
+
+  return 1 if $item->{type} =~ /^libspectrum_(signed_)?byte$/;
+  return 2 if $item->{type} eq "libspectrum_word";
+  return 4;
+}
+
+sub dump_field_write ($) {
+
+  my( $item ) = @_;
+
+  my %function = ( 1 => "byte", 2 => "word", 4 => "dword" );
+  my $width = field_width( $item );
+  my $value = element( $item, "i" );
+
+  $value = "(libspectrum_byte)$value"
+    if $item->{type} eq "libspectrum_signed_byte";
+
+  print "  for( i = 0; i < $item->{indexed}; i++ )\n  " if $item->{indexed};
+  print "  libspectrum_buffer_write_$function{$width}( buffer, $value );\n";
+}
+
+sub dump_field_read ($) {
+
+  my( $item ) = @_;
+
+  my $width = field_width( $item );
+  my $value;
+
+  if( $width == 1 ) {
+    $value = "*(*buffer)++";
+  } elsif( $width == 2 ) {
+    $value = "libspectrum_read_word( buffer )";
   } else {
-    die "Unexpected data declaration: $item->{type} $item->{name}"
+    $value = "libspectrum_read_dword( buffer )";
   }
+
+  $value = "($item->{type})$value"
+    unless $item->{type} =~ /^libspectrum_(byte|word|dword)$/;
+
+  print "  for( i = 0; i < $item->{indexed}; i++ )\n  " if $item->{indexed};
+  print "  ", element( $item, "i" ), " = $value;\n";
+}
+
+sub dump_struct_declaration ($) {
+
+  my( $struct ) = @_;
+
+  print "  libspectrum_snap_$struct->{name}_state $struct->{name};\n";
 }
 
-sub dump_accessor_indexed ($$) {
+sub dump_struct_accessors ($) {
 
-  my( $type, $name ) = @_;
+  my( $struct ) = @_;
+
+  my $name = $struct->{name};
+  my $type = "libspectrum_snap_${name}_state";
+  my $indent = " " x length( "libspectrum_snap_get_${name}_state( " );
+
+  print << "CODE";
+
+void
+libspectrum_snap_get_${name}_state( libspectrum_snap *snap,
+$indent$type *state )
+{
+  *state = snap->$name;
+}
+
+void
+libspectrum_snap_set_${name}_state( libspectrum_snap *snap,
+${indent}const $type *state )
+{
+  snap->$name = *state;
+}
+CODE
+
+}
+
+sub dump_accessor_indexed ($$$$) {
+
+  my( $type, $name, $member, $invalidate ) = @_;
 
   print << "CODE";
 
 $type
 libspectrum_snap_$name( libspectrum_snap *snap, int idx )
 {
-  return snap->$name\[idx\];
+  return snap->$member\[idx\];
 }
 
 void
 libspectrum_snap_set_$name( libspectrum_snap *snap, int idx, $type $name )
 {
-  snap->$name\[idx\] = $name;
-}
+  snap->$member\[idx\] = $name;
+$invalidate}
 CODE
 
 }
 
-sub dump_accessor_simple ($$) {
+sub dump_accessor_simple ($$$$) {
 
-  my( $type, $name ) = @_;
+  my( $type, $name, $member, $invalidate ) = @_;
 
   print << "CODE";
 
 $type
 libspectrum_snap_$name( libspectrum_snap *snap )
 {
-  return snap->$name;
+  return snap->$member;
 }
 
 void
 libspectrum_snap_set_$name( libspectrum_snap *snap, $type $name )
 {
-  snap->$name = $name;
-}
+  snap->$member = $name;
+$invalidate}
 CODE
 
 }
@@ -28,10 +28,105 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif			/* #ifdef HAVE_PTHREAD_H */
+
 #include "internals.h"
 
 static const int DCK_PAGE_SIZE = 0x2000;
 
+/* The flag which may be given to libspectrum_dck_read_with_flags() */
+const int LIBSPECTRUM_FLAG_DCK_SHARE_PAGES = 1 << 0;
+
+/* The data of a .dck file, which holds the ROM pages of every structure
+   read from that file or cloned from one which was */
+typedef struct dck_shared {
+  libspectrum_byte *data;
+  size_t length;
+  size_t refcount;
+} dck_shared;
+
+/* Which shared data each structure is using. libspectrum_dck is public, so
+   this is kept here rather than in the structure itself */
+typedef struct dck_share {
+  const libspectrum_dck *dck;
+  dck_shared *shared;
+  struct dck_share *next;
+} dck_share;
+
+static dck_share *shares = NULL;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t shares_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif			/* #ifdef HAVE_PTHREAD_H */
+
+static void
+lock_shares( void )
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock( &shares_lock );
+#endif			/* #ifdef HAVE_PTHREAD_H */
+}
+
+static void
+unlock_shares( void )
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock( &shares_lock );
+#endif			/* #ifdef HAVE_PTHREAD_H */
+}
+
+/* The shared data used by `dck', if any. Must be called with the lock
+   held */
+static dck_shared*
+get_shared( const libspectrum_dck *dck )
+{
+  dck_share *share;
+
+  for( share = shares; share; share = share->next )
+    if( share->dck == dck ) return share->shared;
+
+  return NULL;
+}
+
+/* Stop `dck' using any shared data, freeing the data if nothing else is
+   using it. Must be called with the lock held */
+static void
+release_shared( const libspectrum_dck *dck )
+{
+  dck_share **ptr, *share;
+
+  for( ptr = &shares; *ptr; ptr = &(*ptr)->next )
+    if( (*ptr)->dck == dck ) break;
+
+  share = *ptr;
+  if( !share ) return;
+
+  *ptr = share->next;
+
+  if( !--share->shared->refcount ) {
+    libspectrum_free( share->shared->data );
+    libspectrum_free( share->shared );
+  }
+  libspectrum_free( share );
+}
+
+/* Make `dck' use `shared'. Must be called with the lock held, and `dck'
+   not using any other shared data */
+static void
+add_shared( const libspectrum_dck *dck, dck_shared *shared )
+{
+  dck_share *share = libspectrum_new( dck_share, 1 );
+
+  share->dck = dck;
+  share->shared = shared;
+  share->next = shares;
+  shares = share;
+
+  shared->refcount++;
+}
+
 /* Initialise a libspectrum_dck_block structure */
 static void
 libspectrum_dck_block_alloc( libspectrum_dck_block **dck )
@@ -47,18 +142,21 @@ libspectrum_dck_block_alloc( libspectrum_dck_block **dck )
   }
 }
 
-/* Free all memory used by a libspectrum_dck_block structure */
+/* Free all memory used by a libspectrum_dck_block structure; shared pages
+   are left to the shared data */
 static libspectrum_error
-libspectrum_dck_block_free( libspectrum_dck_block *dck, int keep_pages )
+libspectrum_dck_block_free( libspectrum_dck *dck, libspectrum_dck_block *block,
+                            int keep_pages )
 {
   size_t i;
 
   if( !keep_pages )
     for( i = 0; i < 8; i++ )
-      if( dck->pages[i] )
-        libspectrum_free( dck->pages[i] );
+      if( block->pages[i] &&
+          !libspectrum_dck_page_is_shared( dck, block->pages[i] ) )
+        libspectrum_free( block->pages[i] );
 
-  libspectrum_free( dck );
+  libspectrum_free( block );
 
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -81,13 +179,68 @@ libspectrum_dck_free( libspectrum_dck *dck, int keep_pages )
 
   for( i=0; i<256; i++ )
     if( dck->dck[i] ) {
-      libspectrum_dck_block_free( dck->dck[i], keep_pages );
+      libspectrum_dck_block_free( dck, dck->dck[i], keep_pages );
       dck->dck[i] = NULL;
     }
 
+  lock_shares();
+  release_shared( dck );
+  unlock_shares();
+
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+int
+libspectrum_dck_page_is_shared( const libspectrum_dck *dck,
+                                const libspectrum_byte *page )
+{
+  const dck_shared *shared;
+  int is_shared;
+
+  lock_shares();
+  shared = get_shared( dck );
+  is_shared = shared && page >= shared->data &&
+              page < shared->data + shared->length;
+  unlock_shares();
+
+  return is_shared;
+}
+
+/* Copy a libspectrum_dck structure, sharing its shared pages */
+libspectrum_dck*
+libspectrum_dck_clone( const libspectrum_dck *dck )
+{
+  libspectrum_dck *clone = libspectrum_dck_alloc();
+  libspectrum_dck_block *block;
+  dck_shared *shared;
+  size_t i, j;
+
+  lock_shares();
+  shared = get_shared( dck );
+  if( shared ) add_shared( clone, shared );
+  unlock_shares();
+
+  for( i = 0; i < 256 && dck->dck[i]; i++ ) {
+    libspectrum_dck_block_alloc( &clone->dck[i] );
+    block = clone->dck[i];
+
+    block->bank = dck->dck[i]->bank;
+    for( j = 0; j < 8; j++ ) {
+      block->access[j] = dck->dck[i]->access[j];
+      if( !dck->dck[i]->pages[j] ) continue;
+
+      if( libspectrum_dck_page_is_shared( dck, dck->dck[i]->pages[j] ) ) {
+        block->pages[j] = dck->dck[i]->pages[j];
+      } else {
+        block->pages[j] = libspectrum_new( libspectrum_byte, DCK_PAGE_SIZE );
+        memcpy( block->pages[j], dck->dck[i]->pages[j], DCK_PAGE_SIZE );
+      }
+    }
+  }
+
+  return clone;
+}
+
 /* Read in the DCK file */
 libspectrum_error
 libspectrum_dck_read( libspectrum_dck *dck, const libspectrum_byte *buffer,
@@ -99,6 +252,15 @@ libspectrum_dck_read( libspectrum_dck *dck, const libspectrum_byte *buffer,
 libspectrum_error
 libspectrum_dck_read2( libspectrum_dck *dck, const libspectrum_byte *buffer,
 		       const size_t clength, const char *filename )
+{
+  return libspectrum_dck_read_with_flags( dck, buffer, clength, filename, 0 );
+}
+
+libspectrum_error
+libspectrum_dck_read_with_flags( libspectrum_dck *dck,
+                                 const libspectrum_byte *buffer,
+                                 const size_t clength, const char *filename,
+                                 int flags )
 {
   int i;
   int num_dck_block = 0;
@@ -107,6 +269,7 @@ libspectrum_dck_read2( libspectrum_dck *dck, const libspectrum_byte *buffer,
   libspectrum_id_t raw_type;
   libspectrum_class_t class;
   libspectrum_byte *new_buffer;
+  dck_shared *shared = NULL;
   size_t length;
 
   /* Ugly but necessary to get around the fact that 'clength' is a const
@@ -133,10 +296,32 @@ libspectrum_dck_read2( libspectrum_dck *dck, const libspectrum_byte *buffer,
     buffer = new_buffer; length = new_length;
   }
 
+  /* ROM pages can't be changed, so they can all point into one copy of
+   the file, which is the decompressed data if there is any */
+  if( flags & LIBSPECTRUM_FLAG_DCK_SHARE_PAGES ) {
+    shared = libspectrum_new( dck_shared, 1 );
+    if( new_buffer ) {
+      shared->data = new_buffer;
+      new_buffer = NULL;
+    } else {
+      shared->data = libspectrum_new( libspectrum_byte, length );
+      memcpy( shared->data, buffer, length );
+    }
+    shared->length = length;
+    shared->refcount = 0;
+    buffer = shared->data;
+  }
+
   end = buffer + length;
 
   for( i=0; i<256; i++ ) dck->dck[i]=NULL;
 
+  /* Any data shared from an earlier read is no longer in use */
+  lock_shares();
+  release_shared( dck );
+  if( shared ) add_shared( dck, shared );
+  unlock_shares();
+
   while( buffer < end ) {
     int pages = 0;
 
@@ -212,6 +397,13 @@ libspectrum_dck_read2( libspectrum_dck *dck, const libspectrum_byte *buffer,
         }
         break;
       case LIBSPECTRUM_DCK_PAGE_ROM:
+        if( shared ) {
+          dck->dck[num_dck_block]->pages[i] =
+            shared->data + ( buffer - shared->data );
+          buffer += DCK_PAGE_SIZE;
+          break;
+        }
+        /* Fall through */
       case LIBSPECTRUM_DCK_PAGE_RAM:
         dck->dck[num_dck_block]->pages[i] =
 	  libspectrum_new( libspectrum_byte, DCK_PAGE_SIZE );
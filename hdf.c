@@ -0,0 +1,349 @@
+/* hdf.c: Access to the data area of HDF hard disk images
+   Copyright (c) 2021 Philip Kendall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: Philip Kendall <philip-fuse@shadowmagic.org.uk>
+
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif			/* #ifdef HAVE_UNISTD_H */
+
+#if defined( HAVE_MMAP ) && defined( HAVE_SYS_MMAN_H )
+#include <sys/mman.h>
+#define USE_MMAP 1
+#endif			/* #if defined( HAVE_MMAP ) && defined( HAVE_SYS_MMAN_H ) */
+
+/* Where available, the data area is accessed with positional I/O on the
+   underlying file descriptor. This never moves the file position, so needs
+   no seeks and can't be confused by stdio buffering */
+#if defined( HAVE_PREAD ) && defined( HAVE_PWRITEV ) && \
+    defined( HAVE_SYS_UIO_H )
+#include <sys/uio.h>
+#define USE_POSITIONAL_IO 1
+#endif
+
+#include "internals.h"
+
+/* The position of a sector within the image file. This is always done in
+   64 bits so large SD card images work everywhere */
+static libspectrum_qword
+sector_position( libspectrum_ide_drive *drv, libspectrum_dword sector )
+{
+  return drv->data_offset + (libspectrum_qword)drv->sector_size * sector;
+}
+
+/* Seek to a 64-bit offset, where the platform allows it */
+int
+libspectrum_ide_file_seek( FILE *f, libspectrum_qword position )
+{
+#ifdef HAVE_FSEEKO
+  return fseeko( f, (off_t)position, SEEK_SET );
+#elif defined( _WIN32 )
+  return _fseeki64( f, (__int64)position, SEEK_SET );
+#else
+  if( position > LONG_MAX ) return -1;
+  return fseek( f, (long)position, SEEK_SET );
+#endif
+}
+
+/* Get the size of the file `f' */
+int
+libspectrum_ide_file_size( FILE *f, libspectrum_qword *size )
+{
+  struct stat info;
+
+  if( fstat( fileno( f ), &info ) ) return -1;
+
+  *size = info.st_size;
+  return 0;
+}
+
+#ifndef USE_POSITIONAL_IO
+
+static int
+seek_sector( libspectrum_ide_drive *drv, libspectrum_dword sector )
+{
+  return libspectrum_ide_file_seek( drv->disk,
+                                    sector_position( drv, sector ) );
+}
+
+#endif			/* #ifndef USE_POSITIONAL_IO */
+
+#ifdef USE_MMAP
+
+/* Map the image in `drv->disk' into memory, returning non-zero if it
+   can't be. This isn't an error as the caller falls back to stdio, so
+   any problem is reported only as a warning */
+static int
+map_image( libspectrum_ide_drive *drv, const char *filename )
+{
+  struct stat info;
+  int prot;
+
+  if( fstat( fileno( drv->disk ), &info ) ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_WARNING, "couldn't stat '%s': %s", filename,
+      strerror( errno )
+    );
+    return 1;
+  }
+
+  if( (libspectrum_qword)info.st_size > SIZE_MAX ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_WARNING, "'%s' is too large to map", filename
+    );
+    return 1;
+  }
+
+  /* Even the read-only mapping is shared so that writes made through the
+     file on commit are visible through it */
+  prot = PROT_READ;
+  if( drv->backend == LIBSPECTRUM_IDE_BACKEND_MMAP_SHARED )
+    prot |= PROT_WRITE;
+
+  drv->map_length = info.st_size;
+  drv->map = mmap( NULL, drv->map_length, prot, MAP_SHARED,
+                   fileno( drv->disk ), 0 );
+  if( drv->map == MAP_FAILED ) {
+    drv->map = NULL;
+    drv->map_length = 0;
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_WARNING, "couldn't map '%s': %s", filename,
+      strerror( errno )
+    );
+    return 1;
+  }
+
+  return 0;
+}
+
+#endif			/* #ifdef USE_MMAP */
+
+/* Set up access to the data area of the image in `drv->disk' using the
+   requested backend, falling back to stdio if it isn't available */
+void
+libspectrum_ide_image_open( libspectrum_ide_drive *drv, const char *filename )
+{
+  drv->backend = drv->requested_backend;
+  drv->map = NULL;
+  drv->map_length = 0;
+
+  /* Sparse images don't store sectors where they could be mapped */
+  if( drv->sparse ) drv->backend = LIBSPECTRUM_IDE_BACKEND_STDIO;
+
+  if( drv->backend == LIBSPECTRUM_IDE_BACKEND_STDIO ) return;
+
+#ifdef USE_MMAP
+  if( !map_image( drv, filename ) ) return;
+#else
+  libspectrum_print_error(
+    LIBSPECTRUM_ERROR_WARNING,
+    "memory mapped hard disk images are not supported on this platform"
+  );
+#endif			/* #ifdef USE_MMAP */
+
+  drv->backend = LIBSPECTRUM_IDE_BACKEND_STDIO;
+}
+
+void
+libspectrum_ide_image_close( libspectrum_ide_drive *drv )
+{
+#ifdef USE_MMAP
+  if( drv->map ) munmap( drv->map, drv->map_length );
+#endif			/* #ifdef USE_MMAP */
+
+  drv->map = NULL;
+  drv->map_length = 0;
+
+  if( drv->sparse ) libspectrum_ide_sparse_close( drv );
+
+  fclose( drv->disk );
+  drv->disk = NULL;
+}
+
+/* Return a pointer to the data for `sector' in the mapped image, or NULL if
+   the image isn't mapped or the sector lies beyond its end */
+libspectrum_byte*
+libspectrum_ide_image_sector( libspectrum_ide_drive *drv,
+                              libspectrum_dword sector )
+{
+  libspectrum_qword position;
+
+  if( !drv->map ) return NULL;
+
+  position = sector_position( drv, sector );
+  if( position + drv->sector_size > drv->map_length ) return NULL;
+
+  return drv->map + position;
+}
+
+/* Read up to `count' packed sectors starting at `first' into `dest',
+   returning the number of whole sectors read */
+size_t
+libspectrum_ide_image_read( libspectrum_ide_drive *drv,
+                            libspectrum_dword first, size_t count,
+                            libspectrum_byte *dest )
+{
+  size_t i;
+
+  if( drv->sparse )
+    return libspectrum_ide_sparse_read( drv, first, count, dest );
+
+  if( drv->map ) {
+    for( i = 0; i < count; i++ ) {
+      libspectrum_byte *src = libspectrum_ide_image_sector( drv, first + i );
+      if( !src ) break;
+      memcpy( dest + i * drv->sector_size, src, drv->sector_size );
+    }
+    return i;
+  }
+
+#ifdef USE_POSITIONAL_IO
+  {
+    size_t length = count * drv->sector_size, done = 0;
+    off_t position = sector_position( drv, first );
+
+    while( done < length ) {
+      ssize_t bytes = pread( fileno( drv->disk ), dest + done, length - done,
+                             position + done );
+      if( bytes < 0 && errno == EINTR ) continue;
+      if( bytes <= 0 ) break;
+      done += bytes;
+    }
+
+    return done / drv->sector_size;
+  }
+#else				/* #ifdef USE_POSITIONAL_IO */
+
+  if( seek_sector( drv, first ) ) {
+    libspectrum_print_error(
+        LIBSPECTRUM_ERROR_WARNING,
+        "Couldn't seek in HDF file\n" );
+    return 0;
+  }
+
+  return fread( dest, drv->sector_size, count, drv->disk );
+
+#endif				/* #ifdef USE_POSITIONAL_IO */
+}
+
+/* Write the `count' consecutive packed sectors starting at `first', whose
+   data is at `sectors[0]' to `sectors[count-1]' */
+int
+libspectrum_ide_image_write( libspectrum_ide_drive *drv,
+                             libspectrum_dword first, size_t count,
+                             libspectrum_byte **sectors )
+{
+  size_t i;
+
+  if( drv->sparse )
+    return libspectrum_ide_sparse_write( drv, first, count, sectors );
+
+  if( drv->backend == LIBSPECTRUM_IDE_BACKEND_MMAP_SHARED ) {
+    for( i = 0; i < count; i++ ) {
+      libspectrum_byte *dest = libspectrum_ide_image_sector( drv, first + i );
+      if( !dest ) return 1;
+      memcpy( dest, sectors[i], drv->sector_size );
+    }
+    return 0;
+  }
+
+#ifdef USE_POSITIONAL_IO
+  {
+    struct iovec iov[ LIBSPECTRUM_IDE_COMMIT_RUN ], *next = iov;
+    off_t position = sector_position( drv, first );
+    int iovcnt = count;
+
+    if( count > LIBSPECTRUM_IDE_COMMIT_RUN ) return 1;
+
+    for( i = 0; i < count; i++ ) {
+      iov[i].iov_base = sectors[i];
+      iov[i].iov_len = drv->sector_size;
+    }
+
+    while( iovcnt ) {
+      ssize_t bytes = pwritev( fileno( drv->disk ), next, iovcnt, position );
+
+      if( bytes < 0 && errno == EINTR ) continue;
+      if( bytes <= 0 ) return 1;
+
+      /* Skip over whatever was written by a short write */
+      position += bytes;
+      while( iovcnt && (size_t)bytes >= next->iov_len ) {
+        bytes -= next->iov_len; next++; iovcnt--;
+      }
+      if( iovcnt ) {
+        next->iov_base = (libspectrum_byte*)next->iov_base + bytes;
+        next->iov_len -= bytes;
+      }
+    }
+  }
+#else				/* #ifdef USE_POSITIONAL_IO */
+
+  /* One seek for the whole run; stdio then coalesces the writes */
+  if( seek_sector( drv, first ) ) return 1;
+
+  for( i = 0; i < count; i++ ) {
+    if( fwrite( sectors[i], drv->sector_size, 1, drv->disk ) != 1 ) return 1;
+  }
+
+#endif				/* #ifdef USE_POSITIONAL_IO */
+
+  return 0;
+}
+
+/* Can the image be written by one thread while another reads from it? This
+   needs the readers to stay away from the stdio stream */
+int
+libspectrum_ide_image_concurrent( libspectrum_ide_drive *drv )
+{
+  if( drv->sparse ) return 0;
+  if( drv->map ) return 1;
+
+#ifdef USE_POSITIONAL_IO
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/* Make sure everything written so far has reached the image file, and is
+   visible through any mapping of it */
+int
+libspectrum_ide_image_sync( libspectrum_ide_drive *drv )
+{
+  if( drv->sparse ) return libspectrum_ide_sparse_sync( drv );
+
+#ifdef USE_MMAP
+  if( drv->backend == LIBSPECTRUM_IDE_BACKEND_MMAP_SHARED )
+    return msync( drv->map, drv->map_length, MS_SYNC );
+#endif			/* #ifdef USE_MMAP */
+
+  return fflush( drv->disk );
+}
@@ -28,6 +28,18 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#define USE_COMMIT_THREAD 1
+#endif			/* #ifdef HAVE_PTHREAD_H */
+
+#ifdef HAVE_CLOCK_GETTIME
+#include <time.h>
+#elif defined( HAVE_GETTIMEOFDAY ) && defined( HAVE_SYS_TIME_H )
+#include <sys/time.h>
+#define USE_GETTIMEOFDAY 1
+#endif
+
 #include "internals.h"
 
 typedef enum libspectrum_ide_command {
@@ -133,18 +145,18 @@ struct libspectrum_ide_channel {
   int sector_number;
 
   /* One write cache for each drive */
-  GHashTable *cache[2];
+  libspectrum_ide_cache *cache[2];
 
 };
 
 /* Private function prototypes */
-static gboolean write_to_disk( gpointer key, gpointer value,
-  gpointer user_data );
-static gboolean clear_cache( gpointer key, gpointer value,
-  gpointer user_data GCC_UNUSED );
+static void write_to_disk( libspectrum_dword sector_number,
+  libspectrum_byte *buffer, void *user_data );
 static int read_hdf( libspectrum_ide_channel *chn );
 static int write_hdf( libspectrum_ide_channel *chn );
+static void end_read_sector( libspectrum_ide_channel *chn );
 static libspectrum_byte read_data( libspectrum_ide_channel *chn );
+static void end_write_sector( libspectrum_ide_channel *chn );
 static void write_data( libspectrum_ide_channel *chn,
   libspectrum_byte data );
 static libspectrum_error seek( libspectrum_ide_channel *chn );
@@ -165,13 +177,11 @@ libspectrum_ide_alloc( libspectrum_ide_databus databus )
   channel = libspectrum_new( libspectrum_ide_channel, 1 );
 
   channel->databus = databus;
-  channel->drive[ LIBSPECTRUM_IDE_MASTER ].disk = NULL;
-  channel->drive[ LIBSPECTRUM_IDE_SLAVE  ].disk = NULL;
+  libspectrum_ide_drive_init( &channel->drive[ LIBSPECTRUM_IDE_MASTER ] );
+  libspectrum_ide_drive_init( &channel->drive[ LIBSPECTRUM_IDE_SLAVE  ] );
 
-  channel->cache[ LIBSPECTRUM_IDE_MASTER ] =
-    g_hash_table_new( g_int_hash, g_int_equal );
-  channel->cache[ LIBSPECTRUM_IDE_SLAVE  ] =
-    g_hash_table_new( g_int_hash, g_int_equal );
+  channel->cache[ LIBSPECTRUM_IDE_MASTER ] = libspectrum_ide_cache_alloc();
+  channel->cache[ LIBSPECTRUM_IDE_SLAVE  ] = libspectrum_ide_cache_alloc();
 
   return channel;
 }
@@ -184,8 +194,8 @@ libspectrum_ide_free( libspectrum_ide_channel *chn )
   libspectrum_ide_eject( chn, LIBSPECTRUM_IDE_MASTER );
   libspectrum_ide_eject( chn, LIBSPECTRUM_IDE_SLAVE  );
 
-  g_hash_table_destroy( chn->cache[ LIBSPECTRUM_IDE_MASTER ] );
-  g_hash_table_destroy( chn->cache[ LIBSPECTRUM_IDE_SLAVE  ] );
+  libspectrum_ide_cache_free( chn->cache[ LIBSPECTRUM_IDE_MASTER ] );
+  libspectrum_ide_cache_free( chn->cache[ LIBSPECTRUM_IDE_SLAVE  ] );
   
   /* Free the channel structure */
   libspectrum_free( chn );
@@ -193,6 +203,25 @@ libspectrum_ide_free( libspectrum_ide_channel *chn )
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* Initialise a drive with no image inserted */
+void
+libspectrum_ide_drive_init( libspectrum_ide_drive *drv )
+{
+  drv->disk = NULL;
+  drv->requested_backend = LIBSPECTRUM_IDE_BACKEND_STDIO;
+  drv->backend = LIBSPECTRUM_IDE_BACKEND_STDIO;
+  drv->map = NULL;
+  drv->map_length = 0;
+  drv->sparse = NULL;
+  drv->read_cache.storage = NULL;
+  drv->read_cache.scratch = NULL;
+  memset( &drv->stats, 0, sizeof( drv->stats ) );
+  memset( &drv->io_stats, 0, sizeof( drv->io_stats ) );
+  drv->flush = NULL;
+  drv->commit_error = LIBSPECTRUM_ERROR_NONE;
+  drv->journal = NULL;
+}
+
 libspectrum_error
 libspectrum_ide_insert_into_drive( libspectrum_ide_drive *drv,
                                    const char *filename )
@@ -222,22 +251,36 @@ libspectrum_ide_insert_into_drive( libspectrum_ide_drive *drv,
     return LIBSPECTRUM_ERROR_UNKNOWN;
   }
   
-  /* Verify the validity of the header */
-  if( memcmp( &drv->hdf.signature, "RS-IDE", 6 ) ||
-      drv->hdf.id != 0x1a                           ) {
-    fclose( f );
-    libspectrum_print_error(
-      LIBSPECTRUM_ERROR_CORRUPT,
-      "libspectrum_ide_insert: '%s' is not a valid HDF file", filename
-    );
-    return LIBSPECTRUM_ERROR_CORRUPT;
+  /* Sparse images carry the HDF header inside their own */
+  if( !memcmp( &drv->hdf.signature, "RS-SHD", 6 ) && drv->hdf.id == 0x1a ) {
+
+    libspectrum_error error = libspectrum_ide_sparse_open( drv, f, filename );
+    if( error ) {
+      fclose( f );
+      return error;
+    }
+
+  } else {
+
+    /* Verify the validity of the header */
+    if( memcmp( &drv->hdf.signature, "RS-IDE", 6 ) ||
+        drv->hdf.id != 0x1a                           ) {
+      fclose( f );
+      libspectrum_print_error(
+        LIBSPECTRUM_ERROR_CORRUPT,
+        "libspectrum_ide_insert: '%s' is not a valid HDF file", filename
+      );
+      return LIBSPECTRUM_ERROR_CORRUPT;
+    }
+
+    drv->data_offset =
+      ( drv->hdf.datastart_hi << 8 ) | ( drv->hdf.datastart_low );
+    drv->sector_size = ( drv->hdf.flags & 0x01 ) ? 256 : 512;
+
   }
   
   /* Extract details from the header */
   drv->disk = f;
-  drv->data_offset =
-    ( drv->hdf.datastart_hi << 8 ) | ( drv->hdf.datastart_low );
-  drv->sector_size = ( drv->hdf.flags & 0x01 ) ? 256 : 512;
   
   /* Extract drive geometry from the drive identity command */
   drv->cylinders = GET_WORD(
@@ -246,6 +289,14 @@ libspectrum_ide_insert_into_drive( libspectrum_ide_drive *drv,
     drv->hdf.drive_identity, LIBSPECTRUM_IDE_IDENTITY_NUM_HEADS );
   drv->sectors = GET_WORD(
     drv->hdf.drive_identity, LIBSPECTRUM_IDE_IDENTITY_NUM_SECTORS );
+
+  libspectrum_ide_image_open( drv, filename );
+
+  /* A mapped image doesn't need the read cache */
+  if( !drv->map )
+    libspectrum_ide_read_cache_init( &drv->read_cache, drv->sector_size );
+  memset( &drv->stats, 0, sizeof( drv->stats ) );
+  memset( &drv->io_stats, 0, sizeof( drv->io_stats ) );
   
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -264,52 +315,449 @@ libspectrum_ide_insert( libspectrum_ide_channel *chn,
   return libspectrum_ide_insert_into_drive( drv, filename );
 }
 
-static gboolean
-write_to_disk( gpointer key, gpointer value, gpointer user_data )
+/* Choose how the next image inserted into a drive will be accessed */
+libspectrum_error
+libspectrum_ide_set_backend( libspectrum_ide_channel *chn,
+                             libspectrum_ide_unit unit,
+                             libspectrum_ide_backend backend )
+{
+  chn->drive[ unit ].requested_backend = backend;
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+typedef struct commit_state {
+
+  libspectrum_ide_drive *drv;
+  libspectrum_ide_cache *cache;
+
+  /* The run of consecutive dirty sectors waiting to be written */
+  libspectrum_dword first;
+  size_t count;
+  libspectrum_byte *sectors[ LIBSPECTRUM_IDE_COMMIT_RUN ];
+
+  libspectrum_dword done, total;
+  libspectrum_ide_progress_fn progress;
+  void *user_data;
+
+  /* Set when writing from the commit thread, which mustn't touch anything
+     the emulation thread may be using */
+  int background;
+
+  int error;
+
+} commit_state;
+
+/* Write out the current run of sectors in one operation */
+static void
+flush_run( commit_state *state )
+{
+  libspectrum_ide_drive *drv = state->drv;
+  size_t i;
+
+  if( !state->count ) return;
+
+  if( libspectrum_ide_image_write( drv, state->first, state->count,
+                                   state->sectors ) ) {
+    /* Sectors which couldn't be written stay dirty */
+    state->error = 1;
+  } else if( !state->background ) {
+    for( i = 0; i < state->count; i++ ) {
+      libspectrum_ide_read_cache_update( &drv->read_cache, state->first + i,
+                                         state->sectors[i] );
+      libspectrum_ide_cache_clean( state->cache, state->first + i );
+    }
+  }
+
+  state->done += state->count;
+  state->count = 0;
+
+  if( state->progress )
+    state->progress( state->done, state->total, state->user_data );
+}
+
+/* Dirty sectors arrive in ascending order; gather adjacent ones into runs */
+static void
+write_to_disk( libspectrum_dword sector_number, libspectrum_byte *buffer,
+               void *user_data )
+{
+  commit_state *state = user_data;
+
+  if( state->count && ( state->count == LIBSPECTRUM_IDE_COMMIT_RUN ||
+                        sector_number != state->first + state->count ) )
+    flush_run( state );
+
+  if( !state->count ) state->first = sector_number;
+  state->sectors[ state->count++ ] = buffer;
+}
+
+/* The current time in microseconds, from an arbitrary starting point */
+static libspectrum_qword
+time_now( void )
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec now;
+
+  if( clock_gettime( CLOCK_MONOTONIC, &now ) ) return 0;
+  return (libspectrum_qword)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#elif defined( USE_GETTIMEOFDAY )
+  struct timeval now;
+
+  if( gettimeofday( &now, NULL ) ) return 0;
+  return (libspectrum_qword)now.tv_sec * 1000000 + now.tv_usec;
+#else
+  /* No clock, so everything appears instantaneous */
+  return 0;
+#endif
+}
+
+/* Add an operation which started at `start' to a latency histogram */
+static void
+record_latency( libspectrum_qword *histogram, libspectrum_qword start )
+{
+  libspectrum_qword now = time_now(), elapsed;
+  size_t bucket = 0;
+
+  elapsed = now > start ? now - start : 0;
+
+  while( elapsed && bucket < LIBSPECTRUM_IDE_LATENCY_BUCKETS - 1 ) {
+    elapsed >>= 1;
+    bucket++;
+  }
+
+  histogram[ bucket ]++;
+}
+
+/* Record a commit of `sectors' sectors which started at `start' */
+static void
+record_commit( libspectrum_ide_drive *drv, libspectrum_dword sectors,
+               libspectrum_qword start )
+{
+  drv->io_stats.commits++;
+  drv->io_stats.bytes_committed += (libspectrum_qword)sectors *
+                                   drv->sector_size;
+  record_latency( drv->io_stats.commit_latency, start );
+}
+
+/* Write all the dirty sectors in `cache' to the image. Returns non-zero if
+   any couldn't be written */
+static int
+write_cache( libspectrum_ide_drive *drv, libspectrum_ide_cache *cache,
+             libspectrum_ide_progress_fn progress, void *user_data,
+             int background )
+{
+  commit_state state;
+
+  state.drv = drv;
+  state.cache = cache;
+  state.count = 0;
+  state.done = 0;
+  state.total = libspectrum_ide_cache_dirty( cache );
+  state.progress = progress;
+  state.user_data = user_data;
+  state.background = background;
+  state.error = 0;
+
+  libspectrum_ide_cache_foreach_dirty( cache, write_to_disk, &state );
+  flush_run( &state );
+
+  if( libspectrum_ide_image_sync( drv ) ) state.error = 1;
+
+  return state.error;
+}
+
+/* Write everything in `cache' to the image itself */
+libspectrum_error
+libspectrum_ide_write_back( libspectrum_ide_drive *drv,
+                            libspectrum_ide_cache *cache,
+                            libspectrum_ide_progress_fn progress,
+                            void *user_data )
+{
+  libspectrum_qword start;
+  libspectrum_dword sectors;
+  int error;
+
+  /* Anything being written in the background is older than `cache', so
+     must reach the image first */
+  libspectrum_ide_commit_drive_wait( drv, cache );
+
+  sectors = libspectrum_ide_cache_dirty( cache );
+
+  start = time_now();
+  error = write_cache( drv, cache, progress, user_data, 0 );
+  if( sectors ) record_commit( drv, sectors, start );
+
+  if( error ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
+                             "Couldn't write to HDF file" );
+    drv->commit_error = LIBSPECTRUM_ERROR_UNKNOWN;
+    return drv->commit_error;
+  }
+
+  libspectrum_ide_cache_clear( cache );
+
+  drv->commit_error = LIBSPECTRUM_ERROR_NONE;
+  return drv->commit_error;
+}
+
+libspectrum_error
+libspectrum_ide_commit_drive( libspectrum_ide_drive *drv,
+                              libspectrum_ide_cache *cache,
+                              libspectrum_ide_progress_fn progress,
+                              void *user_data )
+{
+  if( !drv->disk ) return LIBSPECTRUM_ERROR_NONE;
+
+  /* With a journal, the image is only changed by merging it */
+  if( drv->journal ) return libspectrum_ide_journal_commit( drv, cache );
+
+  return libspectrum_ide_write_back( drv, cache, progress, user_data );
+}
+
+#ifdef USE_COMMIT_THREAD
+
+struct libspectrum_ide_flush {
+
+  libspectrum_ide_drive *drv;
+  libspectrum_ide_cache *cache;		/* The generation being written */
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int done;				/* Protected by `lock' */
+  int error;
+
+  libspectrum_qword start;		/* When the commit started */
+  libspectrum_dword sectors;		/* How many sectors it is writing */
+
+};
+
+static void*
+flush_thread( void *user_data )
+{
+  libspectrum_ide_flush *flush = user_data;
+  int error;
+
+  error = write_cache( flush->drv, flush->cache, NULL, NULL, 1 );
+
+  pthread_mutex_lock( &flush->lock );
+  flush->error = error;
+  flush->done = 1;
+  pthread_mutex_unlock( &flush->lock );
+
+  return NULL;
+}
+
+/* The written data is now what's in the image */
+static void
+update_read_cache( libspectrum_dword sector_number, libspectrum_byte *buffer,
+                   void *user_data )
 {
-  guint sector_number = *(guint*)key;
-  libspectrum_byte *buffer = value;
   libspectrum_ide_drive *drv = user_data;
 
-  long sector_position;
+  libspectrum_ide_read_cache_update( &drv->read_cache, sector_number, buffer );
+}
+
+/* Return a sector which may not have been written to the current write
+   cache generation, unless it has been overwritten since */
+static void
+requeue_sector( libspectrum_dword sector_number, libspectrum_byte *buffer,
+                void *user_data )
+{
+  libspectrum_ide_cache *cache = user_data;
+
+  if( libspectrum_ide_cache_lookup( cache, sector_number ) ) return;
+
+  memcpy( libspectrum_ide_cache_write( cache, sector_number ), buffer,
+          LIBSPECTRUM_IDE_MAX_SECTOR_SIZE );
+}
+
+/* Wait for the commit thread to finish, and tidy up after it */
+static void
+reap_flush( libspectrum_ide_drive *drv, libspectrum_ide_cache *cache )
+{
+  libspectrum_ide_flush *flush = drv->flush;
+
+  pthread_join( flush->thread, NULL );
+  pthread_mutex_destroy( &flush->lock );
+
+  /* The time includes any spent waiting to be reaped, as that's how long
+     the sectors were unavailable to another commit */
+  record_commit( drv, flush->sectors, flush->start );
+
+  if( flush->error ) {
+    libspectrum_ide_cache_foreach_dirty( flush->cache, requeue_sector, cache );
+    libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
+                             "Couldn't write to HDF file" );
+    drv->commit_error = LIBSPECTRUM_ERROR_UNKNOWN;
+  } else {
+    libspectrum_ide_cache_foreach_dirty( flush->cache, update_read_cache,
+                                         drv );
+    drv->commit_error = LIBSPECTRUM_ERROR_NONE;
+  }
+
+  libspectrum_ide_cache_free( flush->cache );
+  libspectrum_free( flush );
+  drv->flush = NULL;
+}
+
+/* Start writing the dirty sectors in `cache' to the image on another
+   thread; `cache' is emptied to receive any further writes */
+libspectrum_error
+libspectrum_ide_commit_drive_async( libspectrum_ide_drive *drv,
+                                    libspectrum_ide_cache *cache )
+{
+  libspectrum_ide_flush *flush;
+  libspectrum_ide_cache generation;
+
+  if( !drv->disk ) return LIBSPECTRUM_ERROR_NONE;
+
+  if( drv->flush ) reap_flush( drv, cache );
 
-  sector_position = drv->data_offset + ( drv->sector_size * sector_number );
+  if( !libspectrum_ide_cache_dirty( cache ) ) return drv->commit_error;
 
-  if( fseek( drv->disk, sector_position, SEEK_SET ) )
-    return FALSE;
+  if( drv->journal || !libspectrum_ide_image_concurrent( drv ) )
+    return libspectrum_ide_commit_drive( drv, cache, NULL, NULL );
 
-  if( fwrite( buffer, 1, drv->sector_size, drv->disk ) != drv->sector_size )
-    return FALSE;
+  flush = libspectrum_new( libspectrum_ide_flush, 1 );
+  flush->drv = drv;
+  flush->cache = libspectrum_ide_cache_alloc();
+  flush->done = 0;
+  flush->error = 0;
+  flush->start = time_now();
+  flush->sectors = libspectrum_ide_cache_dirty( cache );
 
-  libspectrum_free( key ); libspectrum_free( value );
+  generation = *cache; *cache = *flush->cache; *flush->cache = generation;
 
-  return TRUE;	/* TRUE => remove key/value pair from hash */
+  pthread_mutex_init( &flush->lock, NULL );
+
+  if( pthread_create( &flush->thread, NULL, flush_thread, flush ) ) {
+    pthread_mutex_destroy( &flush->lock );
+    generation = *cache; *cache = *flush->cache; *flush->cache = generation;
+    libspectrum_ide_cache_free( flush->cache );
+    libspectrum_free( flush );
+    return libspectrum_ide_commit_drive( drv, cache, NULL, NULL );
+  }
+
+  drv->flush = flush;
+
+  return LIBSPECTRUM_ERROR_NONE;
 }
 
-void
-libspectrum_ide_commit_drive( libspectrum_ide_drive *drv, GHashTable *cache )
+/* Is a background commit still running? */
+int
+libspectrum_ide_commit_drive_pending( libspectrum_ide_drive *drv,
+                                      libspectrum_ide_cache *cache )
 {
-  if( !drv->disk ) return;
+  int done;
+
+  if( !drv->flush ) return 0;
+
+  pthread_mutex_lock( &drv->flush->lock );
+  done = drv->flush->done;
+  pthread_mutex_unlock( &drv->flush->lock );
+
+  if( !done ) return 1;
+
+  reap_flush( drv, cache );
+  return 0;
+}
 
-  g_hash_table_foreach_remove( cache, write_to_disk, drv );
+/* Wait for any background commit to complete */
+libspectrum_error
+libspectrum_ide_commit_drive_wait( libspectrum_ide_drive *drv,
+                                   libspectrum_ide_cache *cache )
+{
+  if( drv->flush ) reap_flush( drv, cache );
+
+  return drv->commit_error;
+}
+
+/* A sector being written in the background, or NULL */
+static libspectrum_byte*
+flush_lookup( libspectrum_ide_drive *drv, libspectrum_dword sector_number )
+{
+  if( !drv->flush ) return NULL;
+
+  return libspectrum_ide_cache_lookup( drv->flush->cache, sector_number );
+}
+
+#else			/* #ifdef USE_COMMIT_THREAD */
+
+/* Without threads, everything is committed immediately */
+
+libspectrum_error
+libspectrum_ide_commit_drive_async( libspectrum_ide_drive *drv,
+                                    libspectrum_ide_cache *cache )
+{
+  return libspectrum_ide_commit_drive( drv, cache, NULL, NULL );
+}
+
+int
+libspectrum_ide_commit_drive_pending( libspectrum_ide_drive *drv,
+                                      libspectrum_ide_cache *cache )
+{
+  return 0;
+}
+
+libspectrum_error
+libspectrum_ide_commit_drive_wait( libspectrum_ide_drive *drv,
+                                   libspectrum_ide_cache *cache )
+{
+  return drv->commit_error;
+}
+
+static libspectrum_byte*
+flush_lookup( libspectrum_ide_drive *drv, libspectrum_dword sector_number )
+{
+  return NULL;
 }
 
+#endif			/* #ifdef USE_COMMIT_THREAD */
+
 /* Commit any pending writes to disk */
 libspectrum_error
 libspectrum_ide_commit( libspectrum_ide_channel *chn,
 			libspectrum_ide_unit unit )
 {
-  libspectrum_ide_commit_drive( &chn->drive[ unit ], chn->cache[ unit ] );
+  return libspectrum_ide_commit_drive( &chn->drive[ unit ], chn->cache[ unit ],
+                                       NULL, NULL );
+}
 
-  return LIBSPECTRUM_ERROR_NONE;
+/* Commit any pending writes to disk, reporting progress as we go */
+libspectrum_error
+libspectrum_ide_commit_with_progress( libspectrum_ide_channel *chn,
+                                      libspectrum_ide_unit unit,
+                                      libspectrum_ide_progress_fn progress,
+                                      void *user_data )
+{
+  return libspectrum_ide_commit_drive( &chn->drive[ unit ], chn->cache[ unit ],
+                                       progress, user_data );
+}
+
+/* Start committing any pending writes to disk in the background */
+libspectrum_error
+libspectrum_ide_commit_async( libspectrum_ide_channel *chn,
+                              libspectrum_ide_unit unit )
+{
+  return libspectrum_ide_commit_drive_async( &chn->drive[ unit ],
+                                             chn->cache[ unit ] );
+}
+
+/* Is a background commit still in progress? */
+int
+libspectrum_ide_commit_pending( libspectrum_ide_channel *chn,
+                                libspectrum_ide_unit unit )
+{
+  return libspectrum_ide_commit_drive_pending( &chn->drive[ unit ],
+                                               chn->cache[ unit ] );
 }
 
-static gboolean
-clear_cache( gpointer key, gpointer value, gpointer user_data GCC_UNUSED )
+/* Wait for a background commit to finish, and return its result */
+libspectrum_error
+libspectrum_ide_commit_wait( libspectrum_ide_channel *chn,
+                             libspectrum_ide_unit unit )
 {
-  libspectrum_free( key );
-  libspectrum_free( value );
-  return TRUE;
+  return libspectrum_ide_commit_drive_wait( &chn->drive[ unit ],
+                                            chn->cache[ unit ] );
 }
 
 /* Is there any dirty data for this disk? */
@@ -317,20 +765,25 @@ int
 libspectrum_ide_dirty( libspectrum_ide_channel *chn,
 		       libspectrum_ide_unit unit )
 {
-  return g_hash_table_size( chn->cache[ unit ] ) != 0;
+  return libspectrum_ide_cache_dirty( chn->cache[ unit ] ) != 0 ||
+         chn->drive[ unit ].flush;
 }
 
 /* Eject a hard disk from a drive and free its cache */
 libspectrum_error
 libspectrum_ide_eject_from_drive( libspectrum_ide_drive *drv,
-                                  GHashTable *cache )
+                                  libspectrum_ide_cache *cache )
 {
   if( !drv->disk ) return LIBSPECTRUM_ERROR_NONE;
 
-  fclose( drv->disk );
-  drv->disk = NULL;
+  libspectrum_ide_commit_drive_wait( drv, cache );
+  libspectrum_ide_journal_detach( drv );
+
+  libspectrum_ide_image_close( drv );
+
+  libspectrum_ide_read_cache_end( &drv->read_cache );
 
-  g_hash_table_foreach_remove( cache, clear_cache, NULL );
+  libspectrum_ide_cache_clear( cache );
   
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -344,6 +797,93 @@ libspectrum_ide_eject( libspectrum_ide_channel *chn,
                                            chn->cache[ unit ] );
 }
 
+/* Send all further writes to a channel / unit combination to a journal
+   rather than to the image */
+libspectrum_error
+libspectrum_ide_attach_journal( libspectrum_ide_channel *chn,
+                                libspectrum_ide_unit unit,
+                                const char *filename )
+{
+  return libspectrum_ide_journal_attach( &chn->drive[ unit ],
+                                         chn->cache[ unit ], filename );
+}
+
+/* Stop using a journal, leaving its contents for the next time */
+libspectrum_error
+libspectrum_ide_detach_journal( libspectrum_ide_channel *chn,
+                                libspectrum_ide_unit unit )
+{
+  libspectrum_error error;
+
+  error = libspectrum_ide_journal_commit( &chn->drive[ unit ],
+                                          chn->cache[ unit ] );
+  if( error ) return error;
+
+  libspectrum_ide_journal_detach( &chn->drive[ unit ] );
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Write the contents of the journal into the image */
+libspectrum_error
+libspectrum_ide_merge_journal( libspectrum_ide_channel *chn,
+                               libspectrum_ide_unit unit )
+{
+  return libspectrum_ide_journal_merge( &chn->drive[ unit ],
+                                        chn->cache[ unit ] );
+}
+
+/* Throw away everything written since the journal was created */
+libspectrum_error
+libspectrum_ide_discard_journal( libspectrum_ide_channel *chn,
+                                 libspectrum_ide_unit unit )
+{
+  return libspectrum_ide_journal_discard( &chn->drive[ unit ],
+                                          chn->cache[ unit ] );
+}
+
+void
+libspectrum_ide_get_drive_io_stats( libspectrum_ide_drive *drv,
+                                    libspectrum_ide_io_stats *stats )
+{
+  *stats = drv->io_stats;
+  stats->cache = drv->stats;
+}
+
+void
+libspectrum_ide_reset_drive_io_stats( libspectrum_ide_drive *drv )
+{
+  memset( &drv->stats, 0, sizeof( drv->stats ) );
+  memset( &drv->io_stats, 0, sizeof( drv->io_stats ) );
+}
+
+/* Get the activity statistics for a channel / unit combination */
+libspectrum_error
+libspectrum_ide_get_io_stats( libspectrum_ide_channel *chn,
+                              libspectrum_ide_unit unit,
+                              libspectrum_ide_io_stats *stats )
+{
+  libspectrum_ide_get_drive_io_stats( &chn->drive[ unit ], stats );
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+libspectrum_error
+libspectrum_ide_reset_io_stats( libspectrum_ide_channel *chn,
+                                libspectrum_ide_unit unit )
+{
+  libspectrum_ide_reset_drive_io_stats( &chn->drive[ unit ] );
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Get the read cache statistics for a channel / unit combination */
+libspectrum_error
+libspectrum_ide_get_cache_stats( libspectrum_ide_channel *chn,
+                                 libspectrum_ide_unit unit,
+                                 libspectrum_ide_cache_stats *stats )
+{
+  *stats = chn->drive[ unit ].stats;
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
 /* Reset an IDE channel */
 libspectrum_error
 libspectrum_ide_reset( libspectrum_ide_channel *chn )
@@ -407,44 +947,125 @@ libspectrum_ide_reset( libspectrum_ide_channel *chn )
   return LIBSPECTRUM_ERROR_NONE;
 }
 
-int
-libspectrum_ide_read_sector_from_hdf( libspectrum_ide_drive *drv,
-    GHashTable *cache, libspectrum_dword sector_number, libspectrum_byte *dest )
+/* Read from the image, recording how long it took */
+static size_t
+timed_image_read( libspectrum_ide_drive *drv, libspectrum_dword first,
+                  size_t count, libspectrum_byte *dest )
 {
-  libspectrum_byte *buffer, packed_buf[512];
+  libspectrum_qword start = time_now();
+  size_t sectors_read;
 
-  /* First look in the write cache */
-  buffer = g_hash_table_lookup( cache, &sector_number );
+  sectors_read = libspectrum_ide_image_read( drv, first, count, dest );
+  record_latency( drv->io_stats.read_latency, start );
 
-  /* If it's not in the write cache, read from the disk image */
-  if( !buffer ) {
+  return sectors_read;
+}
 
-    long sector_position;
+/* Read the extent containing `sector_number' from the image into the read
+   cache, along with any following extents we expect to be wanted soon */
+static int
+fill_read_cache( libspectrum_ide_drive *drv, libspectrum_dword sector_number )
+{
+  libspectrum_ide_read_cache *cache = &drv->read_cache;
+  libspectrum_dword first, extents, i;
+  size_t sectors_read;
 
-    sector_position =
-      drv->data_offset + ( drv->sector_size * sector_number );
+  first = sector_number - sector_number % LIBSPECTRUM_IDE_EXTENT_SECTORS;
 
-    /* Seek to the correct file position */
-    if( fseek( drv->disk, sector_position, SEEK_SET ) ) {
-      libspectrum_print_error(
-          LIBSPECTRUM_ERROR_WARNING,
-          "Couldn't seek in HDF file\n" );
-      return 1;
-    }
+  /* Don't read ahead over anything we've already got */
+  for( extents = 1; extents < cache->readahead; extents++ ) {
+    if( libspectrum_ide_read_cache_contains(
+          cache, first + extents * LIBSPECTRUM_IDE_EXTENT_SECTORS ) )
+      break;
+  }
 
-    /* Read the packed data into a temporary buffer */
-    if ( fread( packed_buf, 1, drv->sector_size, drv->disk ) !=
-	 drv->sector_size                                       ) {
-      libspectrum_print_error(
-          LIBSPECTRUM_ERROR_WARNING,
-          "Couldn't read from HDF file\n" );
-      return 1;
-    }
+  /* Read as many whole sectors as we can; the read may be short at the end
+     of the image */
+  sectors_read = timed_image_read(
+    drv, first, extents * LIBSPECTRUM_IDE_EXTENT_SECTORS, cache->scratch
+  );
+
+  drv->stats.reads++;
+  drv->stats.bytes_read += sectors_read * drv->sector_size;
+
+  if( sectors_read <= sector_number - first ) {
+    libspectrum_print_error(
+        LIBSPECTRUM_ERROR_WARNING,
+        "Couldn't read from HDF file\n" );
+    return 1;
+  }
+
+  if( sectors_read > LIBSPECTRUM_IDE_EXTENT_SECTORS )
+    drv->stats.readahead += sectors_read - LIBSPECTRUM_IDE_EXTENT_SECTORS;
+
+  for( i = 0; i * LIBSPECTRUM_IDE_EXTENT_SECTORS < sectors_read; i++ ) {
+    libspectrum_ide_read_cache_store(
+      cache, first + i * LIBSPECTRUM_IDE_EXTENT_SECTORS,
+      cache->scratch + i * LIBSPECTRUM_IDE_EXTENT_SECTORS * drv->sector_size,
+      sectors_read - i * LIBSPECTRUM_IDE_EXTENT_SECTORS );
+  }
+
+  return 0;
+}
 
-    buffer = packed_buf;
+/* Get the packed data for a sector from the read cache, reading it from the
+   image if necessary */
+static libspectrum_byte*
+read_sector_cached( libspectrum_ide_drive *drv,
+                    libspectrum_dword sector_number )
+{
+  libspectrum_ide_read_cache *cache = &drv->read_cache;
+  libspectrum_byte *buffer;
+  int sequential;
+
+  sequential = sector_number == cache->next_sector;
+  cache->next_sector = sector_number + 1;
+
+  buffer = libspectrum_ide_read_cache_lookup( cache, sector_number );
+  if( buffer ) {
+    drv->stats.hits++;
+    return buffer;
+  }
+
+  drv->stats.misses++;
+
+  /* Double the amount we read ahead for as long as access stays sequential;
+     drop back to a single extent as soon as it doesn't */
+  if( !sequential ) {
+    cache->readahead = 1;
+  } else if( cache->readahead < LIBSPECTRUM_IDE_READAHEAD_MAX ) {
+    cache->readahead <<= 1;
   }
 
-  /* Unpack or copy the data into the sector buffer */
+  if( fill_read_cache( drv, sector_number ) ) return NULL;
+
+  return libspectrum_ide_read_cache_lookup( cache, sector_number );
+}
+
+/* Find `sector_number' in the write cache, journal or commit in progress,
+   setting `*buffer' to its packed data or NULL if it must come from the
+   image. Returns non-zero on error */
+static int
+lookup_written( libspectrum_ide_drive *drv, libspectrum_ide_cache *cache,
+                libspectrum_dword sector_number, libspectrum_byte **buffer )
+{
+  *buffer = libspectrum_ide_cache_lookup( cache, sector_number );
+  if( *buffer ) return 0;
+
+  if( drv->journal &&
+      libspectrum_ide_journal_read( drv, sector_number, buffer ) )
+    return 1;
+  if( *buffer ) return 0;
+
+  *buffer = flush_lookup( drv, sector_number );
+  return 0;
+}
+
+/* Unpack or copy packed sector data into a 512 byte sector buffer */
+static void
+unpack_sector( libspectrum_ide_drive *drv, const libspectrum_byte *buffer,
+               libspectrum_byte *dest )
+{
   if( drv->sector_size == 256 ) {
 
     int i;
@@ -457,6 +1078,132 @@ libspectrum_ide_read_sector_from_hdf( libspectrum_ide_drive *drv,
   } else {
     memcpy( dest, buffer, 512 );
   }
+}
+
+static void
+pack_sector( libspectrum_ide_drive *drv, const libspectrum_byte *src,
+             libspectrum_byte *buffer )
+{
+  if ( drv->sector_size == 256 ) {
+    int i;
+    for( i = 0; i < 256; i++ ) buffer[i] = src[ i * 2 ];
+  } else {
+    memcpy( buffer, src, 512 );
+  }
+}
+
+int
+libspectrum_ide_read_sector_from_hdf( libspectrum_ide_drive *drv,
+    libspectrum_ide_cache *cache, libspectrum_dword sector_number,
+    libspectrum_byte *dest )
+{
+  libspectrum_byte *buffer;
+
+  drv->io_stats.sectors_read++;
+
+  /* First look in the write cache, then in any journal, then at anything
+     being committed */
+  if( lookup_written( drv, cache, sector_number, &buffer ) ) return 1;
+
+  /* If it's not in the write cache, read from the disk image */
+  if( buffer ) {
+    drv->stats.hits++;
+  } else if( drv->map ) {
+
+    /* A mapped image can be copied from directly */
+    buffer = libspectrum_ide_image_sector( drv, sector_number );
+    if( !buffer ) {
+      libspectrum_print_error(
+          LIBSPECTRUM_ERROR_WARNING,
+          "Couldn't read from HDF file\n" );
+      return 1;
+    }
+
+    drv->stats.misses++;
+    drv->stats.reads++;
+    drv->stats.bytes_read += drv->sector_size;
+
+  } else {
+    buffer = read_sector_cached( drv, sector_number );
+    if( !buffer ) return 1;
+  }
+
+  unpack_sector( drv, buffer, dest );
+
+  return 0;
+}
+
+/* Read `count' consecutive sectors from the image with one read, into
+   512 byte sector buffers at `dest' */
+static int
+read_sector_run( libspectrum_ide_drive *drv, libspectrum_dword first,
+                 size_t count, libspectrum_byte *dest )
+{
+  size_t sectors_read;
+
+  sectors_read = timed_image_read( drv, first, count, dest );
+
+  drv->stats.misses += count;
+  drv->stats.reads++;
+  drv->stats.bytes_read += sectors_read * drv->sector_size;
+
+  if( sectors_read != count ) {
+    libspectrum_print_error(
+        LIBSPECTRUM_ERROR_WARNING,
+        "Couldn't read from HDF file\n" );
+    return 1;
+  }
+
+  /* Unpack from the end backwards so nothing is overwritten before it has
+     been moved */
+  if( drv->sector_size == 256 ) {
+    size_t i = count * 256;
+
+    while( i-- ) {
+      dest[ i*2 + 1 ] = 0xff;
+      dest[ i*2 ] = dest[ i ];
+    }
+  }
+
+  return 0;
+}
+
+/* Read `count' consecutive sectors starting at `first' into 512 byte sector
+   buffers at `dest', fetching each run of sectors which haven't been
+   written with a single read from the image */
+int
+libspectrum_ide_read_sectors_from_hdf( libspectrum_ide_drive *drv,
+    libspectrum_ide_cache *cache, libspectrum_dword first, size_t count,
+    libspectrum_byte *dest )
+{
+  libspectrum_dword run_first = first;
+  libspectrum_byte *buffer;
+  size_t i, run = 0;
+
+  drv->io_stats.sectors_read += count;
+
+  for( i = 0; i < count; i++ ) {
+
+    if( lookup_written( drv, cache, first + i, &buffer ) ) return 1;
+
+    if( !buffer ) {
+      if( !run ) run_first = first + i;
+      run++;
+      continue;
+    }
+
+    if( run && read_sector_run( drv, run_first, run,
+                                dest + ( run_first - first ) * 512 ) )
+      return 1;
+    run = 0;
+
+    drv->stats.hits++;
+    unpack_sector( drv, buffer, dest + i * 512 );
+  }
+
+  if( run && read_sector_run( drv, run_first, run,
+                              dest + ( run_first - first ) * 512 ) )
+    return 1;
 
   return 0;
 }
@@ -471,33 +1218,68 @@ read_hdf( libspectrum_ide_channel *chn )
 }
 
 void
-libspectrum_ide_write_sector_to_hdf( libspectrum_ide_drive *drv, GHashTable *cache,
-    libspectrum_dword sector_number, libspectrum_byte *src )
+libspectrum_ide_write_sector_to_hdf( libspectrum_ide_drive *drv,
+    libspectrum_ide_cache *cache, libspectrum_dword sector_number,
+    libspectrum_byte *src )
 {
-  libspectrum_byte *buffer;
+  libspectrum_byte packed[ LIBSPECTRUM_IDE_MAX_SECTOR_SIZE ], *buffer;
 
-  buffer = g_hash_table_lookup( cache, &sector_number );
+  drv->io_stats.sectors_written++;
 
-  /* Add this sector to the write cache if it's not already present */
-  if( !buffer ) {
+  /* With a journal, write straight to that. Sectors which are in the write
+     cache because an earlier journal write failed stay there, so the cache
+     never holds stale data */
+  if( drv->journal && !libspectrum_ide_cache_lookup( cache, sector_number ) ) {
+    buffer = packed;
+  } else {
+    /* Add this sector to the write cache if it's not already present */
+    buffer = libspectrum_ide_cache_write( cache, sector_number );
+  }
 
-    gint *key;
+  /* Pack or copy the data into the write cache */
+  pack_sector( drv, src, buffer );
 
-    key = libspectrum_new( gint, 1 );
-    buffer = libspectrum_new( libspectrum_byte, drv->sector_size );
+  /* If the journal can't be written, hold on to the data until it can */
+  if( buffer == packed &&
+      libspectrum_ide_journal_write( drv, sector_number, 1, packed ) )
+    memcpy( libspectrum_ide_cache_write( cache, sector_number ), packed,
+            drv->sector_size );
+}
 
-    *key = sector_number;
-    g_hash_table_insert( cache, key, buffer );
+/* Write `count' consecutive 512 byte sector buffers from `src', starting at
+   sector `first'. With a journal, the whole range is appended at once */
+void
+libspectrum_ide_write_sectors_to_hdf( libspectrum_ide_drive *drv,
+    libspectrum_ide_cache *cache, libspectrum_dword first, size_t count,
+    libspectrum_byte *src )
+{
+  libspectrum_byte *packed;
+  size_t i;
 
-  }
+  if( drv->journal ) {
 
-  /* Pack or copy the data into the write cache */
-  if ( drv->sector_size == 256 ) {
-    int i;
-    for( i = 0; i < 256; i++ ) buffer[i] = src[ i * 2 ];
-  } else {
-    memcpy( buffer, src, 512 );
+    for( i = 0; i < count; i++ )
+      if( libspectrum_ide_cache_lookup( cache, first + i ) ) break;
+
+    if( i == count ) {
+      packed = libspectrum_new( libspectrum_byte, count * drv->sector_size );
+
+      for( i = 0; i < count; i++ )
+        pack_sector( drv, src + i * 512, packed + i * drv->sector_size );
+
+      i = !libspectrum_ide_journal_write( drv, first, count, packed );
+
+      libspectrum_free( packed );
+      if( i ) {
+        drv->io_stats.sectors_written += count;
+        return;
+      }
+    }
   }
+
+  for( i = 0; i < count; i++ )
+    libspectrum_ide_write_sector_to_hdf( drv, cache, first + i,
+                                         src + i * 512 );
 }
 
 /* Write a sector to the HDF file */
@@ -508,12 +1290,27 @@ write_hdf( libspectrum_ide_channel *chn )
   return 0;
 }
 
+/* Move on to the next sector of a read, or finish if that was the last */
+static void
+end_read_sector( libspectrum_ide_channel *chn )
+{
+  libspectrum_ide_drive *drv = &chn->drive[ chn->selected ];
+
+  if( chn->sector_count ) {
+    /* more sectors to read */
+    readsector( chn );
+  } else {
+    /* all sectors done */
+    chn->phase = LIBSPECTRUM_IDE_PHASE_READY;
+    drv->status &= ~LIBSPECTRUM_IDE_STATUS_DRQ;
+  }
+}
+
 /* Read the data register */
 static libspectrum_byte
 read_data( libspectrum_ide_channel *chn )
 {
   libspectrum_byte data;
-  libspectrum_ide_drive *drv = &chn->drive[ chn->selected ];
   
   /* Meaningful data is only returned in PIO input phase */
   if( chn->phase != LIBSPECTRUM_IDE_PHASE_PIO_IN ) return 0xff;
@@ -547,20 +1344,82 @@ read_data( libspectrum_ide_channel *chn )
   }
 
   /* Check for end of phase */
-  if( chn->datacounter >= 512 ) {
-    if( chn->sector_count ) {
-      /* more sectors to read */
-      readsector( chn );
-    } else {
-      /* all sectors done */
-      chn->phase = LIBSPECTRUM_IDE_PHASE_READY;
-      drv->status &= ~LIBSPECTRUM_IDE_STATUS_DRQ;
-    }
-  }
+  if( chn->datacounter >= 512 ) end_read_sector( chn );
 
   return data;
 }
 
+/* Read up to `length' bytes from the data register into `dest', all from
+   the current sector. Returns the number of bytes read */
+static size_t
+read_data_block( libspectrum_ide_channel *chn, libspectrum_byte *dest,
+                 size_t length )
+{
+  libspectrum_byte *src = &chn->buffer[ chn->datacounter ];
+  size_t i, available = 512 - chn->datacounter;
+
+  switch( chn->databus ) {
+
+  case LIBSPECTRUM_IDE_DATA8:
+    available = ( available + 1 ) / 2;
+    if( length > available ) length = available;
+    for( i = 0; i < length; i++ ) dest[i] = src[ i * 2 ];
+    chn->datacounter += length * 2;
+    break;
+
+  case LIBSPECTRUM_IDE_DATA16:
+    if( length > available ) length = available;
+    memcpy( dest, src, length );
+    chn->datacounter += length;
+    break;
+
+  case LIBSPECTRUM_IDE_DATA16_BYTESWAP:
+    if( length > available ) length = available;
+    for( i = 0; i < length; i++ )
+      dest[i] = chn->buffer[ ( chn->datacounter + i ) ^ 1 ];
+    chn->datacounter += length;
+    break;
+
+  case LIBSPECTRUM_IDE_DATA16_DATA2:
+    /* Pairs of data and secondary data register reads; a final unpaired
+       read of the data register still latches the high byte */
+    if( length > available ) length = available;
+    memcpy( dest, src, length );
+    chn->datacounter += length + ( length & 1 );
+    chn->data2 = chn->buffer[ chn->datacounter - 1 ];
+    break;
+
+  default:
+    length = 0; break;
+
+  }
+
+  return length;
+}
+
+/* Read up to `length' bytes from the data register */
+size_t
+libspectrum_ide_read_block( libspectrum_ide_channel *chn,
+                            libspectrum_byte *dest, size_t length )
+{
+  size_t done = 0, count;
+
+  /* Meaningful data is only returned in PIO input phase */
+  while( done < length && chn->phase == LIBSPECTRUM_IDE_PHASE_PIO_IN ) {
+
+    count = read_data_block( chn, dest + done, length - done );
+    if( !count ) break;
+    done += count;
+
+    /* Check for end of phase */
+    if( chn->datacounter >= 512 ) end_read_sector( chn );
+  }
+
+  memset( dest + done, 0xff, length - done );
+
+  return done;
+}
+
 /* Read the IDE interface */
 libspectrum_byte
 libspectrum_ide_read( libspectrum_ide_channel *chn,
@@ -589,12 +1448,33 @@ libspectrum_ide_read( libspectrum_ide_channel *chn,
 }
 
 
-/* Write the data register */
+/* Write a completed sector to disk and move on to the next sector of a
+   write, or finish if that was the last */
 static void
-write_data( libspectrum_ide_channel *chn, libspectrum_byte data )
+end_write_sector( libspectrum_ide_channel *chn )
 {
   libspectrum_ide_drive *drv = &chn->drive[ chn->selected ];
 
+  /* Write data to disk */
+  if ( write_hdf( chn ) ) {
+    drv->status |= LIBSPECTRUM_IDE_STATUS_ERR;
+    drv->error = LIBSPECTRUM_IDE_ERROR_ABRT | LIBSPECTRUM_IDE_ERROR_UNC;
+  }
+
+  if( chn->sector_count ) {
+    /* more sectors to write */
+    writesector( chn );
+  } else {
+    /* all sectors done */
+    chn->phase = LIBSPECTRUM_IDE_PHASE_READY;
+    drv->status &= ~LIBSPECTRUM_IDE_STATUS_DRQ;
+  }
+}
+
+/* Write the data register */
+static void
+write_data( libspectrum_ide_channel *chn, libspectrum_byte data )
+{
   /* Data register can only be written in PIO output phase */
   if( chn->phase != LIBSPECTRUM_IDE_PHASE_PIO_OUT ) return;
 
@@ -623,24 +1503,83 @@ write_data( libspectrum_ide_channel *chn, libspectrum_byte data )
   }
     
   /* Check for end of phase */
-  if( chn->datacounter >= 512 ) {
+  if( chn->datacounter >= 512 ) end_write_sector( chn );
 
-    /* Write data to disk */
-    if ( write_hdf( chn ) ) {
-      drv->status |= LIBSPECTRUM_IDE_STATUS_ERR;
-      drv->error = LIBSPECTRUM_IDE_ERROR_ABRT | LIBSPECTRUM_IDE_ERROR_UNC;
-    }
+}
 
-    if( chn->sector_count ) {
-      /* more sectors to write */
-      writesector( chn );
-    } else {
-      /* all sectors done */
-      chn->phase = LIBSPECTRUM_IDE_PHASE_READY;
-      drv->status &= ~LIBSPECTRUM_IDE_STATUS_DRQ;
+/* Write up to `length' bytes from `src' to the data register, all into the
+   current sector. Returns the number of bytes written */
+static size_t
+write_data_block( libspectrum_ide_channel *chn, const libspectrum_byte *src,
+                  size_t length )
+{
+  libspectrum_byte *dest = &chn->buffer[ chn->datacounter ];
+  size_t i, available = 512 - chn->datacounter;
+
+  switch( chn->databus ) {
+
+  case LIBSPECTRUM_IDE_DATA8:
+    available = ( available + 1 ) / 2;
+    if( length > available ) length = available;
+    for( i = 0; i < length; i++ ) dest[ i * 2 ] = src[i];
+    chn->datacounter += length * 2;
+    break;
+
+  case LIBSPECTRUM_IDE_DATA16:
+    if( length > available ) length = available;
+    memcpy( dest, src, length );
+    chn->datacounter += length;
+    break;
+
+  case LIBSPECTRUM_IDE_DATA16_BYTESWAP:
+    if( length > available ) length = available;
+    for( i = 0; i < length; i++ )
+      chn->buffer[ ( chn->datacounter + i ) ^ 1 ] = src[i];
+    chn->datacounter += length;
+    break;
+
+  case LIBSPECTRUM_IDE_DATA16_DATA2:
+    /* Pairs of bytes for the data and secondary data registers; a final
+       unpaired write to the data register takes its high byte from the
+       secondary data register as usual */
+    if( length > available ) length = available;
+    memcpy( dest, src, length );
+    if( length & 1 ) {
+      if( length > 1 ) chn->data2 = src[ length - 2 ];
+      dest[ length ] = chn->data2;
+    } else if( length ) {
+      chn->data2 = src[ length - 1 ];
     }
+    chn->datacounter += length + ( length & 1 );
+    break;
+
+  default:
+    length = 0; break;
+
   }
 
+  return length;
+}
+
+/* Write up to `length' bytes to the data register */
+size_t
+libspectrum_ide_write_block( libspectrum_ide_channel *chn,
+                             const libspectrum_byte *src, size_t length )
+{
+  size_t done = 0, count;
+
+  /* Data register can only be written in PIO output phase */
+  while( done < length && chn->phase == LIBSPECTRUM_IDE_PHASE_PIO_OUT ) {
+
+    count = write_data_block( chn, src + done, length - done );
+    if( !count ) break;
+    done += count;
+
+    /* Check for end of phase */
+    if( chn->datacounter >= 512 ) end_write_sector( chn );
+  }
+
+  return done;
 }
 
 /* Seek to the addressed sector */
@@ -654,7 +1593,7 @@ seek( libspectrum_ide_channel *chn )
   /* Calculate sector number, depending upon LBA/CHS mode. */
   if( chn->head & LIBSPECTRUM_IDE_HEAD_LBA ) {
 
-    sectornumber = ( chn->head & LIBSPECTRUM_IDE_HEAD_HEAD << 24 ) +
+    sectornumber = ( ( chn->head & LIBSPECTRUM_IDE_HEAD_HEAD ) << 24 ) +
                    ( chn->cylinder_high << 16 )			   +
                    ( chn->cylinder_low << 8 )			   +
                    ( chn->sector );
@@ -859,6 +1798,8 @@ execute_command( libspectrum_ide_channel *chn, libspectrum_byte data )
   if( !drv->disk ) return;
   chn->phase = LIBSPECTRUM_IDE_PHASE_READY;
 
+  drv->io_stats.commands[ data ]++;
+
   /* Clear error conditions */
   drv->error = LIBSPECTRUM_IDE_ERROR_OK;
   drv->status &= ~(LIBSPECTRUM_IDE_STATUS_ERR | LIBSPECTRUM_IDE_STATUS_BSY);
@@ -0,0 +1,361 @@
+/* ide_cache.c: Caches for HDF hard disk images
+   Copyright (c) 2021 Philip Kendall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: Philip Kendall <philip-fuse@shadowmagic.org.uk>
+
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "internals.h"
+
+/*
+ * The read cache: a small LRU set of aligned, multi-sector extents of the
+ * image. Sectors are held in the packed form in which they are stored in
+ * the HDF file.
+ */
+
+void
+libspectrum_ide_read_cache_init( libspectrum_ide_read_cache *cache,
+                                 size_t sector_size )
+{
+  size_t extent_size = sector_size * LIBSPECTRUM_IDE_EXTENT_SECTORS;
+  size_t i;
+
+  cache->sector_size = sector_size;
+  cache->storage =
+    libspectrum_new( libspectrum_byte,
+                     extent_size * LIBSPECTRUM_IDE_READ_CACHE_EXTENTS );
+  cache->scratch =
+    libspectrum_new( libspectrum_byte,
+                     extent_size * LIBSPECTRUM_IDE_READAHEAD_MAX );
+
+  for( i = 0; i < LIBSPECTRUM_IDE_READ_CACHE_EXTENTS; i++ ) {
+    cache->extents[i].data = cache->storage + i * extent_size;
+  }
+
+  libspectrum_ide_read_cache_invalidate( cache );
+}
+
+void
+libspectrum_ide_read_cache_end( libspectrum_ide_read_cache *cache )
+{
+  libspectrum_free( cache->storage ); cache->storage = NULL;
+  libspectrum_free( cache->scratch ); cache->scratch = NULL;
+}
+
+/* Forget everything held in the cache */
+void
+libspectrum_ide_read_cache_invalidate( libspectrum_ide_read_cache *cache )
+{
+  size_t i;
+
+  for( i = 0; i < LIBSPECTRUM_IDE_READ_CACHE_EXTENTS; i++ ) {
+    cache->extents[i].first = 0;
+    cache->extents[i].count = 0;
+    cache->extents[i].last_used = 0;
+  }
+
+  cache->clock = 0;
+  cache->mru = NULL;
+  cache->next_sector = 0;
+  cache->readahead = 1;
+}
+
+static libspectrum_ide_extent*
+find_extent( libspectrum_ide_read_cache *cache, libspectrum_dword sector )
+{
+  libspectrum_ide_extent *extent;
+  size_t i;
+
+  /* Sequential access nearly always hits the same extent as last time */
+  extent = cache->mru;
+  if( extent && sector - extent->first < extent->count ) return extent;
+
+  for( i = 0, extent = cache->extents;
+       i < LIBSPECTRUM_IDE_READ_CACHE_EXTENTS;
+       i++, extent++ ) {
+    if( sector - extent->first < extent->count ) return extent;
+  }
+
+  return NULL;
+}
+
+/* Return the packed data for `sector' if it is in the cache, or NULL */
+libspectrum_byte*
+libspectrum_ide_read_cache_lookup( libspectrum_ide_read_cache *cache,
+                                   libspectrum_dword sector )
+{
+  libspectrum_ide_extent *extent = find_extent( cache, sector );
+
+  if( !extent ) return NULL;
+
+  extent->last_used = ++cache->clock;
+  cache->mru = extent;
+
+  return extent->data + ( sector - extent->first ) * cache->sector_size;
+}
+
+/* Is the extent starting at `first' already in the cache? */
+int
+libspectrum_ide_read_cache_contains( libspectrum_ide_read_cache *cache,
+                                     libspectrum_dword first )
+{
+  return find_extent( cache, first ) != NULL;
+}
+
+/* Store `count' packed sectors starting at `first' (which must be extent
+   aligned) in the cache, evicting the least recently used extent */
+void
+libspectrum_ide_read_cache_store( libspectrum_ide_read_cache *cache,
+                                  libspectrum_dword first,
+                                  const libspectrum_byte *data, size_t count )
+{
+  libspectrum_ide_extent *extent, *victim;
+  size_t i;
+
+  if( count > LIBSPECTRUM_IDE_EXTENT_SECTORS )
+    count = LIBSPECTRUM_IDE_EXTENT_SECTORS;
+
+  /* Prefer an unused slot, otherwise the least recently used one */
+  victim = cache->extents;
+  for( i = 0, extent = cache->extents;
+       i < LIBSPECTRUM_IDE_READ_CACHE_EXTENTS;
+       i++, extent++ ) {
+    if( !extent->count ) { victim = extent; break; }
+    if( extent->last_used < victim->last_used ) victim = extent;
+  }
+
+  memcpy( victim->data, data, count * cache->sector_size );
+  victim->first = first;
+  victim->count = count;
+  victim->last_used = ++cache->clock;
+}
+
+/* Keep the cache coherent after `data' has been written to `sector' of the
+   image */
+void
+libspectrum_ide_read_cache_update( libspectrum_ide_read_cache *cache,
+                                   libspectrum_dword sector,
+                                   const libspectrum_byte *data )
+{
+  libspectrum_ide_extent *extent;
+
+  if( !cache->storage ) return;
+
+  extent = find_extent( cache, sector );
+  if( !extent ) return;
+
+  memcpy( extent->data + ( sector - extent->first ) * cache->sector_size,
+          data, cache->sector_size );
+}
+
+/*
+ * The write cache: a two-level sparse table mapping sector numbers to
+ * packed sector data, plus a bitmap of dirty sectors. Sector data lives in
+ * slabs, so writing a new sector allocates memory only once per slab, and a
+ * lookup is just two array indexes.
+ */
+
+#define LEAF_SECTORS ( 1 << LIBSPECTRUM_IDE_CACHE_LEAF_BITS )
+#define LEAF_MASK ( LEAF_SECTORS - 1 )
+#define DIRTY_WORDS ( LEAF_SECTORS / 32 )
+
+struct libspectrum_ide_cache_leaf {
+
+  /* Packed data for each sector, or NULL if the sector isn't cached */
+  libspectrum_byte *sectors[ LEAF_SECTORS ];
+
+  /* One bit for each sector which differs from the image */
+  libspectrum_dword dirty[ DIRTY_WORDS ];
+
+};
+
+libspectrum_ide_cache*
+libspectrum_ide_cache_alloc( void )
+{
+  libspectrum_ide_cache *cache = libspectrum_new( libspectrum_ide_cache, 1 );
+
+  cache->leaves = NULL;
+  cache->leaf_count = 0;
+  cache->slabs = NULL;
+  cache->slab_count = 0;
+  cache->slab_used = LIBSPECTRUM_IDE_CACHE_SLAB_SECTORS;
+  cache->dirty = 0;
+
+  return cache;
+}
+
+void
+libspectrum_ide_cache_free( libspectrum_ide_cache *cache )
+{
+  size_t i;
+
+  libspectrum_ide_cache_clear( cache );
+
+  for( i = 0; i < cache->slab_count; i++ ) libspectrum_free( cache->slabs[i] );
+  libspectrum_free( cache->slabs );
+  libspectrum_free( cache->leaves );
+  libspectrum_free( cache );
+}
+
+/* Drop all sectors from the cache. Only the first slab is kept, so a large
+   burst of writes doesn't pin its memory after being committed */
+void
+libspectrum_ide_cache_clear( libspectrum_ide_cache *cache )
+{
+  size_t i;
+
+  for( i = 0; i < cache->leaf_count; i++ ) {
+    libspectrum_free( cache->leaves[i] );
+    cache->leaves[i] = NULL;
+  }
+
+  for( i = 1; i < cache->slab_count; i++ ) libspectrum_free( cache->slabs[i] );
+  if( cache->slab_count > 1 ) cache->slab_count = 1;
+
+  cache->slab_used = cache->slab_count ? 0 : LIBSPECTRUM_IDE_CACHE_SLAB_SECTORS;
+  cache->dirty = 0;
+}
+
+libspectrum_byte*
+libspectrum_ide_cache_lookup( libspectrum_ide_cache *cache,
+                              libspectrum_dword sector )
+{
+  size_t index = sector >> LIBSPECTRUM_IDE_CACHE_LEAF_BITS;
+
+  if( index >= cache->leaf_count || !cache->leaves[ index ] ) return NULL;
+
+  return cache->leaves[ index ]->sectors[ sector & LEAF_MASK ];
+}
+
+static libspectrum_byte*
+allocate_sector( libspectrum_ide_cache *cache )
+{
+  if( cache->slab_used == LIBSPECTRUM_IDE_CACHE_SLAB_SECTORS ) {
+    cache->slabs = libspectrum_renew( libspectrum_byte*, cache->slabs,
+                                      cache->slab_count + 1 );
+    cache->slabs[ cache->slab_count++ ] =
+      libspectrum_new( libspectrum_byte,
+                       LIBSPECTRUM_IDE_CACHE_SLAB_SECTORS *
+                       LIBSPECTRUM_IDE_MAX_SECTOR_SIZE );
+    cache->slab_used = 0;
+  }
+
+  return cache->slabs[ cache->slab_count - 1 ] +
+    cache->slab_used++ * LIBSPECTRUM_IDE_MAX_SECTOR_SIZE;
+}
+
+/* Return the buffer into which the packed data for `sector' should be
+   written, adding the sector to the cache if necessary. The sector is
+   marked as dirty */
+libspectrum_byte*
+libspectrum_ide_cache_write( libspectrum_ide_cache *cache,
+                             libspectrum_dword sector )
+{
+  size_t index = sector >> LIBSPECTRUM_IDE_CACHE_LEAF_BITS, offset;
+  libspectrum_ide_cache_leaf *leaf;
+  libspectrum_dword bit;
+
+  if( index >= cache->leaf_count ) {
+    size_t i;
+
+    cache->leaves = libspectrum_renew( libspectrum_ide_cache_leaf*,
+                                       cache->leaves, index + 1 );
+    for( i = cache->leaf_count; i <= index; i++ ) cache->leaves[i] = NULL;
+    cache->leaf_count = index + 1;
+  }
+
+  leaf = cache->leaves[ index ];
+  if( !leaf ) leaf = cache->leaves[ index ] =
+                libspectrum_new0( libspectrum_ide_cache_leaf, 1 );
+
+  offset = sector & LEAF_MASK;
+  if( !leaf->sectors[ offset ] ) leaf->sectors[ offset ] =
+                                   allocate_sector( cache );
+
+  bit = 1u << ( offset & 31 );
+  if( !( leaf->dirty[ offset >> 5 ] & bit ) ) {
+    leaf->dirty[ offset >> 5 ] |= bit;
+    cache->dirty++;
+  }
+
+  return leaf->sectors[ offset ];
+}
+
+/* Mark `sector' as matching the image once more */
+void
+libspectrum_ide_cache_clean( libspectrum_ide_cache *cache,
+                             libspectrum_dword sector )
+{
+  size_t index = sector >> LIBSPECTRUM_IDE_CACHE_LEAF_BITS, offset;
+  libspectrum_ide_cache_leaf *leaf;
+  libspectrum_dword bit;
+
+  if( index >= cache->leaf_count || !cache->leaves[ index ] ) return;
+
+  leaf = cache->leaves[ index ];
+  offset = sector & LEAF_MASK;
+  bit = 1u << ( offset & 31 );
+
+  if( leaf->dirty[ offset >> 5 ] & bit ) {
+    leaf->dirty[ offset >> 5 ] &= ~bit;
+    cache->dirty--;
+  }
+}
+
+/* Number of sectors which differ from the image */
+size_t
+libspectrum_ide_cache_dirty( libspectrum_ide_cache *cache )
+{
+  return cache->dirty;
+}
+
+/* Call `func' for each dirty sector, in ascending sector order */
+void
+libspectrum_ide_cache_foreach_dirty( libspectrum_ide_cache *cache,
+                                     libspectrum_ide_cache_fn func,
+                                     void *user_data )
+{
+  size_t i, j;
+
+  for( i = 0; i < cache->leaf_count; i++ ) {
+
+    libspectrum_ide_cache_leaf *leaf = cache->leaves[i];
+    if( !leaf ) continue;
+
+    for( j = 0; j < DIRTY_WORDS; j++ ) {
+
+      libspectrum_dword word = leaf->dirty[j];
+      int bit;
+
+      for( bit = 0; word; bit++, word >>= 1 ) {
+        size_t offset;
+
+        if( !( word & 1 ) ) continue;
+
+        offset = j * 32 + bit;
+        func( ( i << LIBSPECTRUM_IDE_CACHE_LEAF_BITS ) + offset,
+              leaf->sectors[ offset ], user_data );
+      }
+    }
+  }
+}
@@ -0,0 +1,477 @@
+/* ide_journal.c: Copy-on-write overlay journals for HDF hard disk images
+   Copyright (c) 2021 Philip Kendall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: Philip Kendall <philip-fuse@shadowmagic.org.uk>
+
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "internals.h"
+
+/*
+ * A journal is an append-only file of sectors written to an image, which
+ * leaves the image itself untouched. The file consists of:
+ *
+ *   Offset  Length  Contents
+ *   0       6       "RS-JNL"
+ *   6       1       0x1a
+ *   7       1       Version (1)
+ *   8       2       Sector size as stored in the image (LSB first)
+ *   10      6       Reserved (0)
+ *
+ * followed by any number of records, each of which is a 4 byte sector
+ * number (LSB first) followed by the packed sector data. Where a sector
+ * appears more than once, the last record wins. An incomplete record at the
+ * end of the file (for example, after a crash) is ignored, but a record for
+ * a sector beyond the end of the image makes the whole journal corrupt.
+ */
+
+static const char *const signature = "RS-JNL";
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_LENGTH 16
+#define JOURNAL_RECORD_HEADER 4
+
+/* Sectors copied into the write cache at a time when merging */
+#define MERGE_BATCH 4096
+
+#define LEAF_SECTORS ( 1 << LIBSPECTRUM_IDE_CACHE_LEAF_BITS )
+#define LEAF_MASK ( LEAF_SECTORS - 1 )
+
+struct libspectrum_ide_journal {
+
+  FILE *file;
+  char *filename;
+
+  /* Where the next record will be written */
+  libspectrum_qword end;
+
+  /* A two-level table giving the file offset of the latest data for each
+     sector, or 0 if the sector isn't in the journal */
+  libspectrum_qword **leaves;
+  size_t leaf_count;
+  size_t sectors;
+
+  libspectrum_byte buffer[ LIBSPECTRUM_IDE_MAX_SECTOR_SIZE ];
+
+};
+
+static libspectrum_qword
+index_lookup( libspectrum_ide_journal *journal, libspectrum_dword sector )
+{
+  size_t index = sector >> LIBSPECTRUM_IDE_CACHE_LEAF_BITS;
+
+  if( index >= journal->leaf_count || !journal->leaves[ index ] ) return 0;
+
+  return journal->leaves[ index ][ sector & LEAF_MASK ];
+}
+
+static void
+index_store( libspectrum_ide_journal *journal, libspectrum_dword sector,
+             libspectrum_qword offset )
+{
+  size_t index = sector >> LIBSPECTRUM_IDE_CACHE_LEAF_BITS;
+  libspectrum_qword *leaf;
+
+  if( index >= journal->leaf_count ) {
+    size_t i;
+
+    journal->leaves = libspectrum_renew( libspectrum_qword*, journal->leaves,
+                                         index + 1 );
+    for( i = journal->leaf_count; i <= index; i++ ) journal->leaves[i] = NULL;
+    journal->leaf_count = index + 1;
+  }
+
+  leaf = journal->leaves[ index ];
+  if( !leaf ) leaf = journal->leaves[ index ] =
+                libspectrum_new0( libspectrum_qword, LEAF_SECTORS );
+
+  if( !leaf[ sector & LEAF_MASK ] ) journal->sectors++;
+  leaf[ sector & LEAF_MASK ] = offset;
+}
+
+static void
+index_clear( libspectrum_ide_journal *journal )
+{
+  size_t i;
+
+  for( i = 0; i < journal->leaf_count; i++ )
+    libspectrum_free( journal->leaves[i] );
+  libspectrum_free( journal->leaves );
+
+  journal->leaves = NULL;
+  journal->leaf_count = 0;
+  journal->sectors = 0;
+}
+
+static int
+write_header( libspectrum_ide_drive *drv, FILE *f )
+{
+  libspectrum_byte header[ JOURNAL_HEADER_LENGTH ];
+
+  memset( header, 0, sizeof( header ) );
+  memcpy( header, signature, 6 );
+  header[6] = 0x1a;
+  header[7] = JOURNAL_VERSION;
+  header[8] = drv->sector_size & 0xff;
+  header[9] = drv->sector_size >> 8;
+
+  return fwrite( header, sizeof( header ), 1, f ) != 1 || fflush( f );
+}
+
+/* Build the index from the records in an existing journal */
+static libspectrum_error
+read_journal( libspectrum_ide_drive *drv, libspectrum_ide_journal *journal )
+{
+  libspectrum_byte header[ JOURNAL_HEADER_LENGTH ];
+  libspectrum_qword position, total_sectors;
+
+  if( fread( header, sizeof( header ), 1, journal->file ) != 1 ||
+      memcmp( header, signature, 6 ) || header[6] != 0x1a ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT, "'%s' is not a valid HDF journal",
+      journal->filename
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  if( header[7] != JOURNAL_VERSION ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_UNKNOWN, "'%s' is an unsupported journal version %d",
+      journal->filename, header[7]
+    );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+  }
+
+  if( ( header[8] | ( header[9] << 8 ) ) != drv->sector_size ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_INVALID,
+      "journal '%s' doesn't match the sector size of the image",
+      journal->filename
+    );
+    return LIBSPECTRUM_ERROR_INVALID;
+  }
+
+  total_sectors = (libspectrum_qword)drv->cylinders * drv->heads *
+    drv->sectors;
+  position = JOURNAL_HEADER_LENGTH;
+
+  while( 1 ) {
+    libspectrum_byte record[ JOURNAL_RECORD_HEADER ];
+    const libspectrum_byte *ptr = record;
+    libspectrum_dword sector;
+
+    if( fread( record, sizeof( record ), 1, journal->file ) != 1 ) break;
+    if( fread( journal->buffer, drv->sector_size, 1, journal->file ) != 1 )
+      break;
+
+    sector = libspectrum_read_dword( &ptr );
+    if( sector >= total_sectors ) {
+      libspectrum_print_error(
+        LIBSPECTRUM_ERROR_CORRUPT,
+        "journal '%s' has a record for sector %lu, beyond the end of the image",
+        journal->filename, (unsigned long)sector
+      );
+      return LIBSPECTRUM_ERROR_CORRUPT;
+    }
+
+    index_store( journal, sector, position + JOURNAL_RECORD_HEADER );
+    position += JOURNAL_RECORD_HEADER + drv->sector_size;
+  }
+
+  /* Any partial record will be overwritten by the next write */
+  journal->end = position;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Attach the journal in `filename' to `drv', creating it if it doesn't
+   exist. Anything in `cache' is moved into the journal */
+libspectrum_error
+libspectrum_ide_journal_attach( libspectrum_ide_drive *drv,
+                                libspectrum_ide_cache *cache,
+                                const char *filename )
+{
+  libspectrum_ide_journal *journal;
+  libspectrum_error error;
+
+  if( !drv->disk ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_INVALID,
+                             "no image to attach a journal to" );
+    return LIBSPECTRUM_ERROR_INVALID;
+  }
+
+  libspectrum_ide_journal_detach( drv );
+  libspectrum_ide_commit_drive_wait( drv, cache );
+
+  journal = libspectrum_new( libspectrum_ide_journal, 1 );
+  journal->filename = libspectrum_new( char, strlen( filename ) + 1 );
+  strcpy( journal->filename, filename );
+  journal->leaves = NULL;
+  journal->leaf_count = 0;
+  journal->sectors = 0;
+
+  journal->file = fopen( filename, "rb+" );
+  if( journal->file ) {
+    error = read_journal( drv, journal );
+  } else {
+    journal->file = fopen( filename, "wb+" );
+    if( !journal->file ) {
+      libspectrum_print_error(
+        LIBSPECTRUM_ERROR_UNKNOWN, "unable to open journal '%s': %s",
+        filename, strerror( errno )
+      );
+      libspectrum_free( journal->filename );
+      libspectrum_free( journal );
+      return LIBSPECTRUM_ERROR_UNKNOWN;
+    }
+
+    error = LIBSPECTRUM_ERROR_NONE;
+    if( write_header( drv, journal->file ) ) {
+      libspectrum_print_error(
+        LIBSPECTRUM_ERROR_UNKNOWN, "unable to write to journal '%s'",
+        filename
+      );
+      error = LIBSPECTRUM_ERROR_UNKNOWN;
+    }
+    journal->end = JOURNAL_HEADER_LENGTH;
+  }
+
+  drv->journal = journal;
+
+  if( error ) {
+    libspectrum_ide_journal_detach( drv );
+    return error;
+  }
+
+  return libspectrum_ide_journal_commit( drv, cache );
+}
+
+void
+libspectrum_ide_journal_detach( libspectrum_ide_drive *drv )
+{
+  libspectrum_ide_journal *journal = drv->journal;
+
+  if( !journal ) return;
+
+  if( journal->file ) fclose( journal->file );
+  index_clear( journal );
+  libspectrum_free( journal->filename );
+  libspectrum_free( journal );
+
+  drv->journal = NULL;
+}
+
+/* Set `*buffer' to the packed data for `sector' if it is in the journal, or
+   NULL if not. Returns non-zero on error */
+int
+libspectrum_ide_journal_read( libspectrum_ide_drive *drv,
+                              libspectrum_dword sector,
+                              libspectrum_byte **buffer )
+{
+  libspectrum_ide_journal *journal = drv->journal;
+  libspectrum_qword offset = index_lookup( journal, sector );
+
+  *buffer = NULL;
+  if( !offset ) return 0;
+
+  if( libspectrum_ide_file_seek( journal->file, offset ) ||
+      fread( journal->buffer, drv->sector_size, 1, journal->file ) != 1 ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
+                             "Couldn't read from journal '%s'",
+                             journal->filename );
+    return 1;
+  }
+
+  *buffer = journal->buffer;
+  return 0;
+}
+
+/* Append the packed data for the `count' sectors starting at `first' to the
+   journal. The records go out with a single flush. Returns non-zero on
+   error, in which case none of the sectors are in the journal */
+int
+libspectrum_ide_journal_write( libspectrum_ide_drive *drv,
+                               libspectrum_dword first, size_t count,
+                               const libspectrum_byte *data )
+{
+  libspectrum_ide_journal *journal = drv->journal;
+  libspectrum_byte record[ JOURNAL_RECORD_HEADER ], *ptr;
+  int error;
+  size_t i;
+
+  error = libspectrum_ide_file_seek( journal->file, journal->end );
+
+  for( i = 0; !error && i < count; i++ ) {
+    ptr = record;
+    libspectrum_write_dword( &ptr, first + i );
+
+    error = fwrite( record, sizeof( record ), 1, journal->file ) != 1 ||
+            fwrite( data + i * drv->sector_size, drv->sector_size, 1,
+                    journal->file ) != 1;
+  }
+
+  if( error || fflush( journal->file ) ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
+                             "Couldn't write to journal '%s'",
+                             journal->filename );
+    return 1;
+  }
+
+  for( i = 0; i < count; i++ ) {
+    index_store( journal, first + i, journal->end + JOURNAL_RECORD_HEADER );
+    journal->end += JOURNAL_RECORD_HEADER + drv->sector_size;
+  }
+
+  return 0;
+}
+
+typedef struct journal_commit_state {
+  libspectrum_ide_drive *drv;
+  libspectrum_ide_cache *cache;
+  int error;
+} journal_commit_state;
+
+static void
+move_to_journal( libspectrum_dword sector, libspectrum_byte *data,
+                 void *user_data )
+{
+  journal_commit_state *state = user_data;
+
+  if( libspectrum_ide_journal_write( state->drv, sector, 1, data ) ) {
+    state->error = 1;
+  } else {
+    libspectrum_ide_cache_clean( state->cache, sector );
+  }
+}
+
+/* Move anything left in the write cache (because it couldn't be written to
+   the journal at the time) into the journal */
+libspectrum_error
+libspectrum_ide_journal_commit( libspectrum_ide_drive *drv,
+                                libspectrum_ide_cache *cache )
+{
+  journal_commit_state state;
+
+  if( !drv->journal ) return LIBSPECTRUM_ERROR_NONE;
+
+  state.drv = drv;
+  state.cache = cache;
+  state.error = 0;
+
+  libspectrum_ide_cache_foreach_dirty( cache, move_to_journal, &state );
+  if( state.error ) return LIBSPECTRUM_ERROR_UNKNOWN;
+
+  libspectrum_ide_cache_clear( cache );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Empty the journal, returning the drive to the contents of the image */
+libspectrum_error
+libspectrum_ide_journal_discard( libspectrum_ide_drive *drv,
+                                 libspectrum_ide_cache *cache )
+{
+  libspectrum_ide_journal *journal = drv->journal;
+  FILE *f;
+
+  if( !journal ) return LIBSPECTRUM_ERROR_NONE;
+
+  libspectrum_ide_cache_clear( cache );
+
+  f = freopen( journal->filename, "wb+", journal->file );
+  journal->file = f;
+  index_clear( journal );
+  journal->end = JOURNAL_HEADER_LENGTH;
+
+  if( !f || write_header( drv, f ) ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
+                             "Couldn't empty journal '%s'",
+                             journal->filename );
+    libspectrum_ide_journal_detach( drv );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Write everything in the journal into the image, then empty it */
+libspectrum_error
+libspectrum_ide_journal_merge( libspectrum_ide_drive *drv,
+                               libspectrum_ide_cache *cache )
+{
+  libspectrum_ide_journal *journal = drv->journal;
+  libspectrum_error error;
+  size_t i, j;
+
+  if( !journal ) return LIBSPECTRUM_ERROR_NONE;
+
+  error = libspectrum_ide_journal_commit( drv, cache );
+  if( error ) return error;
+
+  /* Go through the write cache in batches, so that the image is written in
+     order without needing memory for the whole journal */
+  for( i = 0; i < journal->leaf_count; i++ ) {
+
+    libspectrum_qword *leaf = journal->leaves[i];
+    if( !leaf ) continue;
+
+    for( j = 0; j < LEAF_SECTORS; j++ ) {
+      libspectrum_dword sector = ( i << LIBSPECTRUM_IDE_CACHE_LEAF_BITS ) + j;
+      libspectrum_byte *data;
+
+      if( !leaf[j] ) continue;
+
+      if( libspectrum_ide_journal_read( drv, sector, &data ) ) {
+        libspectrum_ide_cache_clear( cache );
+        return LIBSPECTRUM_ERROR_UNKNOWN;
+      }
+
+      memcpy( libspectrum_ide_cache_write( cache, sector ), data,
+              drv->sector_size );
+
+      if( libspectrum_ide_cache_dirty( cache ) == MERGE_BATCH ) {
+        error = libspectrum_ide_write_back( drv, cache, NULL, NULL );
+        if( error ) {
+          libspectrum_ide_cache_clear( cache );
+          return error;
+        }
+      }
+    }
+  }
+
+  error = libspectrum_ide_write_back( drv, cache, NULL, NULL );
+  if( error ) {
+    libspectrum_ide_cache_clear( cache );
+    return error;
+  }
+
+  return libspectrum_ide_journal_discard( drv, cache );
+}
+
+/* Number of distinct sectors in the journal */
+size_t
+libspectrum_ide_journal_sectors( libspectrum_ide_drive *drv )
+{
+  return drv->journal ? drv->journal->sectors : 0;
+}
@@ -0,0 +1,690 @@
+/* ide_sparse.c: Sparse, optionally compressed, hard disk images
+   Copyright (c) 2021 Philip Kendall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: Philip Kendall <philip-fuse@shadowmagic.org.uk>
+
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "internals.h"
+
+/*
+ * A sparse image stores the data area of an HDF image in fixed size
+ * clusters, only the non-empty ones of which take up space in the file:
+ *
+ *   Offset  Length  Contents
+ *   0       6       "RS-SHD"
+ *   6       1       0x1a
+ *   7       1       Version (1)
+ *   8       1       Flags; bit 0 set if clusters may be deflated
+ *   9       1       log2 of the number of sectors in each cluster
+ *   10      2       Reserved (0)
+ *   12      4       Number of sectors in the image
+ *   16      4       Length of the HDF header (H)
+ *   20      8       Offset of the cluster table
+ *   28      4       Reserved (0)
+ *   32      H       The header of the original HDF image
+ *
+ * All values are stored LSB first. The cluster table has one 12 byte entry
+ * for each cluster: the offset of its data in the file, or 0 if the cluster
+ * is empty (all zeroes), followed by the length of that data. Data whose
+ * length is less than the size of a cluster is deflated.
+ *
+ * Sectors are stored packed, exactly as they are in the HDF image.
+ */
+
+static const char *const signature = "RS-SHD";
+#define SPARSE_VERSION 1
+#define SPARSE_HEADER_LENGTH 32
+#define SPARSE_TABLE_ENTRY 12
+
+#define SPARSE_FLAG_DEFLATE 0x01
+
+/* 128 sectors, or 64 Kb with 512 byte sectors */
+#define SPARSE_CLUSTER_SHIFT 7
+
+typedef struct sparse_entry {
+  libspectrum_qword offset;
+  libspectrum_dword length;
+} sparse_entry;
+
+struct libspectrum_ide_sparse {
+
+  libspectrum_byte flags;
+  libspectrum_dword cluster_sectors;
+  size_t cluster_bytes;
+  libspectrum_dword total_sectors;
+
+  /* The header of the original HDF image */
+  libspectrum_byte *header;
+  libspectrum_dword header_length;
+
+  sparse_entry *table;
+  libspectrum_dword cluster_count;
+  libspectrum_qword table_offset;
+  int table_dirty;
+
+  /* Where newly allocated clusters go */
+  libspectrum_qword end;
+
+  /* The most recently used cluster, unpacked */
+  libspectrum_byte *buffer;
+  libspectrum_dword buffered;	/* Cluster number, or cluster_count if none */
+  int buffer_dirty;
+
+};
+
+static void
+write_qword( libspectrum_byte **ptr, libspectrum_qword q )
+{
+  libspectrum_write_dword( ptr, q & 0xffffffff );
+  libspectrum_write_dword( ptr, q >> 32 );
+}
+
+static libspectrum_qword
+read_qword( const libspectrum_byte **ptr )
+{
+  libspectrum_qword low = libspectrum_read_dword( ptr );
+
+  return low | ( (libspectrum_qword)libspectrum_read_dword( ptr ) << 32 );
+}
+
+/* Get the data to store for a cluster, deflating it if that helps. Returns
+   the deflated data, which must be freed by the caller, or NULL if the
+   cluster should be stored as it is; `*length' is set either way */
+static libspectrum_byte*
+pack_cluster( libspectrum_byte flags, const libspectrum_byte *cluster,
+              size_t cluster_bytes, size_t *length )
+{
+  *length = cluster_bytes;
+
+#ifdef HAVE_ZLIB_H
+  if( flags & SPARSE_FLAG_DEFLATE ) {
+    libspectrum_byte *compressed;
+    size_t compressed_length;
+
+    if( libspectrum_zlib_compress( cluster, cluster_bytes, &compressed,
+                                   &compressed_length ) )
+      return NULL;
+
+    if( compressed_length < cluster_bytes ) {
+      *length = compressed_length;
+      return compressed;
+    }
+
+    libspectrum_free( compressed );
+  }
+#endif			/* #ifdef HAVE_ZLIB_H */
+
+  return NULL;
+}
+
+static void
+write_sparse_header( libspectrum_byte *header, libspectrum_byte flags,
+                     libspectrum_dword total_sectors,
+                     libspectrum_dword header_length,
+                     libspectrum_qword table_offset )
+{
+  libspectrum_byte *ptr;
+
+  memset( header, 0, SPARSE_HEADER_LENGTH );
+  memcpy( header, signature, 6 );
+  header[6] = 0x1a;
+  header[7] = SPARSE_VERSION;
+  header[8] = flags;
+  header[9] = SPARSE_CLUSTER_SHIFT;
+
+  ptr = &header[12];
+  libspectrum_write_dword( &ptr, total_sectors );
+  libspectrum_write_dword( &ptr, header_length );
+  write_qword( &ptr, table_offset );
+}
+
+static int
+write_table( FILE *f, const sparse_entry *table, libspectrum_dword count )
+{
+  libspectrum_byte entry[ SPARSE_TABLE_ENTRY ], *ptr;
+  libspectrum_dword i;
+
+  for( i = 0; i < count; i++ ) {
+    ptr = entry;
+    write_qword( &ptr, table[i].offset );
+    libspectrum_write_dword( &ptr, table[i].length );
+    if( fwrite( entry, sizeof( entry ), 1, f ) != 1 ) return 1;
+  }
+
+  return 0;
+}
+
+/* Set up `drv' to access the sparse image in `f' */
+libspectrum_error
+libspectrum_ide_sparse_open( libspectrum_ide_drive *drv, FILE *f,
+                             const char *filename )
+{
+  libspectrum_byte header[ SPARSE_HEADER_LENGTH ], entry[ SPARSE_TABLE_ENTRY ];
+  const libspectrum_byte *ptr;
+  libspectrum_ide_sparse *sparse;
+  libspectrum_qword file_size;
+  libspectrum_dword i;
+
+  if( libspectrum_ide_file_seek( f, 0 ) ||
+      fread( header, sizeof( header ), 1, f ) != 1 ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "libspectrum_ide_insert: unable to read sparse header from '%s'",
+      filename
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  if( header[7] != SPARSE_VERSION || header[9] > 16 ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_UNKNOWN,
+      "libspectrum_ide_insert: '%s' is an unsupported sparse image", filename
+    );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+  }
+
+#ifndef HAVE_ZLIB_H
+  if( header[8] & SPARSE_FLAG_DEFLATE ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_UNKNOWN,
+      "libspectrum_ide_insert: zlib needed for compressed image '%s'",
+      filename
+    );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+  }
+#endif			/* #ifndef HAVE_ZLIB_H */
+
+  sparse = libspectrum_new( libspectrum_ide_sparse, 1 );
+  sparse->flags = header[8];
+  sparse->cluster_sectors = 1 << header[9];
+
+  ptr = &header[12];
+  sparse->total_sectors = libspectrum_read_dword( &ptr );
+  sparse->header_length = libspectrum_read_dword( &ptr );
+  sparse->table_offset = read_qword( &ptr );
+
+  sparse->header = NULL;
+  sparse->table = NULL;
+  sparse->buffer = NULL;
+
+  /* The original HDF header provides the geometry and sector size */
+  if( sparse->header_length < sizeof( libspectrum_hdf_header ) ||
+      sparse->header_length > 0x10000 ) goto corrupt;
+
+  sparse->header = libspectrum_new( libspectrum_byte, sparse->header_length );
+  if( fread( sparse->header, sparse->header_length, 1, f ) != 1 )
+    goto corrupt;
+
+  memcpy( &drv->hdf, sparse->header, sizeof( libspectrum_hdf_header ) );
+  if( memcmp( &drv->hdf.signature, "RS-IDE", 6 ) || drv->hdf.id != 0x1a )
+    goto corrupt;
+
+  drv->sector_size = ( drv->hdf.flags & 0x01 ) ? 256 : 512;
+  sparse->cluster_bytes = sparse->cluster_sectors * drv->sector_size;
+
+  sparse->cluster_count =
+    ( (libspectrum_qword)sparse->total_sectors + sparse->cluster_sectors -
+      1 ) / sparse->cluster_sectors;
+
+  /* Check the whole table is in the file before allocating space for it */
+  if( libspectrum_ide_file_size( f, &file_size ) ||
+      sparse->table_offset > file_size ||
+      ( file_size - sparse->table_offset ) / SPARSE_TABLE_ENTRY <
+        sparse->cluster_count ) goto corrupt;
+
+  sparse->table = libspectrum_new( sparse_entry, sparse->cluster_count );
+  if( libspectrum_ide_file_seek( f, sparse->table_offset ) ) goto corrupt;
+
+  sparse->end = sparse->table_offset +
+    (libspectrum_qword)sparse->cluster_count * SPARSE_TABLE_ENTRY;
+
+  for( i = 0; i < sparse->cluster_count; i++ ) {
+    if( fread( entry, sizeof( entry ), 1, f ) != 1 ) goto corrupt;
+
+    ptr = entry;
+    sparse->table[i].offset = read_qword( &ptr );
+    sparse->table[i].length = libspectrum_read_dword( &ptr );
+
+    if( sparse->table[i].length > sparse->cluster_bytes ) goto corrupt;
+
+    if( sparse->table[i].offset + sparse->table[i].length > sparse->end )
+      sparse->end = sparse->table[i].offset + sparse->table[i].length;
+  }
+
+  sparse->table_dirty = 0;
+  sparse->buffer = libspectrum_new( libspectrum_byte, sparse->cluster_bytes );
+  sparse->buffered = sparse->cluster_count;
+  sparse->buffer_dirty = 0;
+
+  drv->sparse = sparse;
+  drv->data_offset = 0;
+
+  return LIBSPECTRUM_ERROR_NONE;
+
+ corrupt:
+  libspectrum_free( sparse->header );
+  libspectrum_free( sparse->table );
+  libspectrum_free( sparse );
+  libspectrum_print_error(
+    LIBSPECTRUM_ERROR_CORRUPT,
+    "libspectrum_ide_insert: '%s' is not a valid sparse image", filename
+  );
+  return LIBSPECTRUM_ERROR_CORRUPT;
+}
+
+/* Write the buffered cluster back to the file if it has been changed */
+static int
+flush_cluster( libspectrum_ide_drive *drv )
+{
+  libspectrum_ide_sparse *sparse = drv->sparse;
+  sparse_entry *entry;
+  libspectrum_byte *packed;
+  const libspectrum_byte *data;
+  size_t length;
+  int error = 0;
+
+  if( !sparse->buffer_dirty ) return 0;
+
+  entry = &sparse->table[ sparse->buffered ];
+
+  /* A cluster which has only ever held zeroes needn't be stored */
+  if( !entry->offset &&
+      libspectrum_is_zero( sparse->buffer, sparse->cluster_bytes ) ) {
+    sparse->buffer_dirty = 0;
+    return 0;
+  }
+
+  packed = pack_cluster( sparse->flags, sparse->buffer, sparse->cluster_bytes,
+                         &length );
+  data = packed ? packed : sparse->buffer;
+
+  /* Overwrite the existing data if the new data fits; otherwise append it.
+     Any space left behind is reclaimed by converting the image again */
+  if( !entry->offset || length > entry->length ) {
+    entry->offset = sparse->end;
+    sparse->end += length;
+  }
+
+  if( libspectrum_ide_file_seek( drv->disk, entry->offset ) ||
+      fwrite( data, length, 1, drv->disk ) != 1 ) error = 1;
+
+  libspectrum_free( packed );
+
+  if( error ) return 1;
+
+  entry->length = length;
+  sparse->table_dirty = 1;
+  sparse->buffer_dirty = 0;
+
+  return 0;
+}
+
+/* Make `cluster' the buffered cluster */
+static int
+load_cluster( libspectrum_ide_drive *drv, libspectrum_dword cluster )
+{
+  libspectrum_ide_sparse *sparse = drv->sparse;
+  sparse_entry *entry = &sparse->table[ cluster ];
+
+  if( sparse->buffered == cluster ) return 0;
+
+  if( flush_cluster( drv ) ) return 1;
+
+  sparse->buffered = sparse->cluster_count;
+
+  if( !entry->offset ) {
+    memset( sparse->buffer, 0, sparse->cluster_bytes );
+  } else if( entry->length == sparse->cluster_bytes ) {
+    if( libspectrum_ide_file_seek( drv->disk, entry->offset ) ||
+        fread( sparse->buffer, sparse->cluster_bytes, 1, drv->disk ) != 1 )
+      return 1;
+  } else {
+#ifdef HAVE_ZLIB_H
+    libspectrum_byte *compressed;
+    size_t inflated_length = sparse->cluster_bytes;
+    libspectrum_error error;
+
+    compressed = libspectrum_new( libspectrum_byte, entry->length );
+    if( libspectrum_ide_file_seek( drv->disk, entry->offset ) ||
+        fread( compressed, entry->length, 1, drv->disk ) != 1 ) {
+      libspectrum_free( compressed );
+      return 1;
+    }
+
+    error = libspectrum_zlib_inflate_into( compressed, entry->length,
+                                           sparse->buffer, &inflated_length );
+    libspectrum_free( compressed );
+    if( error || inflated_length != sparse->cluster_bytes ) return 1;
+#else			/* #ifdef HAVE_ZLIB_H */
+    return 1;
+#endif			/* #ifdef HAVE_ZLIB_H */
+  }
+
+  sparse->buffered = cluster;
+
+  return 0;
+}
+
+size_t
+libspectrum_ide_sparse_read( libspectrum_ide_drive *drv,
+                             libspectrum_dword first, size_t count,
+                             libspectrum_byte *dest )
+{
+  libspectrum_ide_sparse *sparse = drv->sparse;
+  size_t i;
+
+  for( i = 0; i < count; i++ ) {
+    libspectrum_dword sector = first + i;
+
+    if( sector >= sparse->total_sectors ) break;
+    if( load_cluster( drv, sector / sparse->cluster_sectors ) ) break;
+
+    memcpy( dest + i * drv->sector_size,
+            sparse->buffer +
+              ( sector % sparse->cluster_sectors ) * drv->sector_size,
+            drv->sector_size );
+  }
+
+  return i;
+}
+
+int
+libspectrum_ide_sparse_write( libspectrum_ide_drive *drv,
+                              libspectrum_dword first, size_t count,
+                              libspectrum_byte **sectors )
+{
+  libspectrum_ide_sparse *sparse = drv->sparse;
+  size_t i;
+
+  for( i = 0; i < count; i++ ) {
+    libspectrum_dword sector = first + i;
+
+    if( sector >= sparse->total_sectors ) return 1;
+    if( load_cluster( drv, sector / sparse->cluster_sectors ) ) return 1;
+
+    memcpy( sparse->buffer +
+              ( sector % sparse->cluster_sectors ) * drv->sector_size,
+            sectors[i], drv->sector_size );
+    sparse->buffer_dirty = 1;
+  }
+
+  return 0;
+}
+
+int
+libspectrum_ide_sparse_sync( libspectrum_ide_drive *drv )
+{
+  libspectrum_ide_sparse *sparse = drv->sparse;
+
+  if( flush_cluster( drv ) ) return 1;
+
+  if( sparse->table_dirty ) {
+    if( libspectrum_ide_file_seek( drv->disk, sparse->table_offset ) ||
+        write_table( drv->disk, sparse->table, sparse->cluster_count ) )
+      return 1;
+    sparse->table_dirty = 0;
+  }
+
+  return fflush( drv->disk );
+}
+
+void
+libspectrum_ide_sparse_close( libspectrum_ide_drive *drv )
+{
+  libspectrum_ide_sparse *sparse = drv->sparse;
+
+  libspectrum_free( sparse->header );
+  libspectrum_free( sparse->table );
+  libspectrum_free( sparse->buffer );
+  libspectrum_free( sparse );
+
+  drv->sparse = NULL;
+}
+
+/* Convert the HDF image `source' into the sparse image `dest' */
+libspectrum_error
+libspectrum_hdf_to_sparse( const char *source, const char *dest,
+                           int compress )
+{
+  libspectrum_hdf_header hdf;
+  libspectrum_byte header[ SPARSE_HEADER_LENGTH ], *block = NULL;
+  libspectrum_byte *cluster = NULL;
+  libspectrum_dword header_length, total_sectors = 0, cluster_count = 0;
+  libspectrum_qword position;
+  sparse_entry *table = NULL;
+  size_t sector_size, cluster_bytes;
+  libspectrum_byte flags;
+  FILE *in, *out = NULL;
+  libspectrum_error error = LIBSPECTRUM_ERROR_UNKNOWN;
+
+  flags = compress ? SPARSE_FLAG_DEFLATE : 0;
+
+#ifndef HAVE_ZLIB_H
+  if( compress ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_UNKNOWN,
+      "libspectrum_hdf_to_sparse: zlib needed for compression"
+    );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+  }
+#endif			/* #ifndef HAVE_ZLIB_H */
+
+  in = fopen( source, "rb" );
+  if( !in ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_UNKNOWN,
+      "libspectrum_hdf_to_sparse: unable to open file '%s': %s", source,
+      strerror( errno )
+    );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+  }
+
+  if( fread( &hdf, sizeof( hdf ), 1, in ) != 1 ||
+      memcmp( &hdf.signature, "RS-IDE", 6 ) || hdf.id != 0x1a ) {
+    fclose( in );
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "libspectrum_hdf_to_sparse: '%s' is not a valid HDF file", source
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  header_length = ( hdf.datastart_hi << 8 ) | hdf.datastart_low;
+  if( header_length < sizeof( hdf ) ) header_length = sizeof( hdf );
+
+  sector_size = ( hdf.flags & 0x01 ) ? 256 : 512;
+  cluster_bytes = sector_size << SPARSE_CLUSTER_SHIFT;
+
+  block = libspectrum_new( libspectrum_byte, header_length );
+  cluster = libspectrum_new( libspectrum_byte, cluster_bytes );
+
+  if( libspectrum_ide_file_seek( in, 0 ) ||
+      fread( block, header_length, 1, in ) != 1 ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "libspectrum_hdf_to_sparse: unable to read header from '%s'", source
+    );
+    error = LIBSPECTRUM_ERROR_CORRUPT;
+    goto end;
+  }
+
+  out = fopen( dest, "wb" );
+  if( !out ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_UNKNOWN,
+      "libspectrum_hdf_to_sparse: unable to create file '%s': %s", dest,
+      strerror( errno )
+    );
+    goto end;
+  }
+
+  /* The real header is written once the table's position is known */
+  write_sparse_header( header, flags, 0, header_length, 0 );
+  if( fwrite( header, sizeof( header ), 1, out ) != 1 ||
+      fwrite( block, header_length, 1, out ) != 1 ) goto write_error;
+
+  position = SPARSE_HEADER_LENGTH + header_length;
+
+  while( 1 ) {
+    size_t bytes = fread( cluster, 1, cluster_bytes, in ), sectors;
+    sparse_entry *entry;
+
+    sectors = bytes / sector_size;
+    if( !sectors ) break;
+
+    memset( cluster + sectors * sector_size, 0,
+            cluster_bytes - sectors * sector_size );
+
+    table = libspectrum_renew( sparse_entry, table, cluster_count + 1 );
+    entry = &table[ cluster_count++ ];
+    total_sectors += sectors;
+
+    if( libspectrum_is_zero( cluster, cluster_bytes ) ) {
+      entry->offset = 0;
+      entry->length = 0;
+    } else {
+      libspectrum_byte *packed;
+      size_t length;
+
+      packed = pack_cluster( flags, cluster, cluster_bytes, &length );
+
+      if( fwrite( packed ? packed : cluster, length, 1, out ) != 1 ) {
+        libspectrum_free( packed );
+        goto write_error;
+      }
+      libspectrum_free( packed );
+
+      entry->offset = position;
+      entry->length = length;
+      position += length;
+    }
+
+    if( sectors * sector_size < cluster_bytes ) break;
+  }
+
+  if( write_table( out, table, cluster_count ) ) goto write_error;
+
+  write_sparse_header( header, flags, total_sectors, header_length,
+                       position );
+  if( libspectrum_ide_file_seek( out, 0 ) ||
+      fwrite( header, sizeof( header ), 1, out ) != 1 ) goto write_error;
+
+  if( fclose( out ) ) { out = NULL; goto write_error; }
+  out = NULL;
+
+  error = LIBSPECTRUM_ERROR_NONE;
+  goto end;
+
+ write_error:
+  libspectrum_print_error(
+    LIBSPECTRUM_ERROR_UNKNOWN,
+    "libspectrum_hdf_to_sparse: error writing to '%s'", dest
+  );
+
+ end:
+  if( out ) fclose( out );
+  fclose( in );
+  libspectrum_free( table );
+  libspectrum_free( cluster );
+  libspectrum_free( block );
+
+  return error;
+}
+
+/* Convert the sparse image `source' back into the HDF image `dest' */
+libspectrum_error
+libspectrum_sparse_to_hdf( const char *source, const char *dest )
+{
+  libspectrum_ide_drive drv;
+  libspectrum_ide_sparse *sparse;
+  libspectrum_ide_cache *cache;
+  libspectrum_byte *data = NULL;
+  libspectrum_dword sector;
+  libspectrum_error error;
+  FILE *out;
+
+  libspectrum_ide_drive_init( &drv );
+
+  error = libspectrum_ide_insert_into_drive( &drv, source );
+  if( error ) return error;
+
+  cache = libspectrum_ide_cache_alloc();
+
+  sparse = drv.sparse;
+  if( !sparse ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_INVALID,
+      "libspectrum_sparse_to_hdf: '%s' is not a sparse image", source
+    );
+    error = LIBSPECTRUM_ERROR_INVALID;
+    goto end;
+  }
+
+  out = fopen( dest, "wb" );
+  if( !out ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_UNKNOWN,
+      "libspectrum_sparse_to_hdf: unable to create file '%s': %s", dest,
+      strerror( errno )
+    );
+    error = LIBSPECTRUM_ERROR_UNKNOWN;
+    goto end;
+  }
+
+  error = LIBSPECTRUM_ERROR_NONE;
+  data = libspectrum_new( libspectrum_byte, sparse->cluster_bytes );
+
+  if( fwrite( sparse->header, sparse->header_length, 1, out ) != 1 )
+    error = LIBSPECTRUM_ERROR_UNKNOWN;
+
+  for( sector = 0;
+       !error && sector < sparse->total_sectors;
+       sector += sparse->cluster_sectors ) {
+    size_t count = sparse->total_sectors - sector;
+
+    if( count > sparse->cluster_sectors ) count = sparse->cluster_sectors;
+
+    if( libspectrum_ide_sparse_read( &drv, sector, count, data ) != count )
+      error = LIBSPECTRUM_ERROR_CORRUPT;
+    else if( fwrite( data, drv.sector_size, count, out ) != count )
+      error = LIBSPECTRUM_ERROR_UNKNOWN;
+  }
+
+  if( fclose( out ) && !error ) error = LIBSPECTRUM_ERROR_UNKNOWN;
+
+  if( error ) {
+    libspectrum_print_error(
+      error, "libspectrum_sparse_to_hdf: error converting '%s'", source
+    );
+  }
+
+ end:
+  libspectrum_free( data );
+  libspectrum_ide_eject_from_drive( &drv, cache );
+  libspectrum_ide_cache_free( cache );
+
+  return error;
+}
@@ -120,6 +120,9 @@ libspectrum_dword libspectrum_read_dword( const libspectrum_byte **buffer );
 int libspectrum_write_word( libspectrum_byte **buffer, libspectrum_word w );
 int libspectrum_write_dword( libspectrum_byte **buffer, libspectrum_dword d );
 
+/* Is every one of the `length' bytes at `data' zero? */
+int libspectrum_is_zero( const libspectrum_byte *data, size_t length );
+
 /* (de)compression routines */
 
 libspectrum_error
@@ -132,6 +135,14 @@ libspectrum_error
 libspectrum_gzip_inflate( const libspectrum_byte *gzptr, size_t gzlength,
 			  libspectrum_byte **outptr, size_t *outlength );
 
+libspectrum_error
+libspectrum_zlib_inflate_into( const libspectrum_byte *gzptr, size_t gzlength,
+			       libspectrum_byte *outptr, size_t *outlength );
+
+libspectrum_error
+libspectrum_zlib_inflate_start( const libspectrum_byte *gzptr, size_t gzlength,
+				libspectrum_byte *outptr, size_t *outlength );
+
 libspectrum_error
 libspectrum_bzip2_inflate( const libspectrum_byte *bzptr, size_t bzlength,
 			   libspectrum_byte **outptr, size_t *outlength );
@@ -163,6 +174,75 @@ int libspectrum_split_to_48k_pages( libspectrum_snap *snap,
 #define SNAPSHOT_DIVIDE_PAGES 4
 #define SNAPSHOT_DIVMMC_PAGES 64
 
+/* Page reuse for libspectrum_snap_reset() */
+
+libspectrum_byte** libspectrum_snap_spare_pages( libspectrum_snap *snap );
+void libspectrum_snap_release_page( libspectrum_snap *snap,
+                                    libspectrum_byte *page, size_t length,
+                                    int keep );
+void libspectrum_snap_free_spare_pages( libspectrum_snap *snap );
+
+/* Pages shared by libspectrum_snap_clone() */
+
+typedef struct libspectrum_snap_shared libspectrum_snap_shared;
+
+libspectrum_snap_shared**
+libspectrum_snap_shared_pages( libspectrum_snap *snap );
+int libspectrum_snap_page_is_shared( libspectrum_snap *snap,
+                                     const libspectrum_byte *page );
+void libspectrum_snap_drop_shared_pages( libspectrum_snap *snap );
+libspectrum_byte* libspectrum_snap_unshare_page( libspectrum_snap *snap,
+                                                 size_t field, size_t idx,
+                                                 size_t length );
+void libspectrum_snap_clone_data( libspectrum_snap *clone, int flags );
+
+/* Access to whole snapshots, generated from snap_accessors.txt */
+
+/* A field of a libspectrum_snap which points to data */
+typedef struct libspectrum_snap_data_field {
+  const char *name;
+  size_t count;		/* The number of pointers in the field */
+  size_t length;	/* The length of the data, or 0 if given by
+			   libspectrum_snap_data_length() */
+} libspectrum_snap_data_field;
+
+extern const libspectrum_snap_data_field libspectrum_snap_data_fields[];
+
+/* The most data one element of a data field can hold; nothing valid is
+   bigger than the Spectranet's flash */
+#define LIBSPECTRUM_SNAP_DATA_MAX_LENGTH 0x20000
+extern const size_t libspectrum_snap_data_field_count;
+
+libspectrum_byte** libspectrum_snap_data( libspectrum_snap *snap,
+                                          size_t field, size_t idx );
+size_t* libspectrum_snap_data_length( libspectrum_snap *snap, size_t field,
+                                      size_t idx );
+
+/* Every other field, serialised as little endian bytes, words and dwords */
+extern const size_t libspectrum_snap_fields_length;
+
+void libspectrum_snap_write_fields( libspectrum_buffer *buffer,
+                                    libspectrum_snap *snap );
+void libspectrum_snap_read_fields( libspectrum_snap *snap,
+                                   const libspectrum_byte **buffer );
+
+/* Hashing */
+
+libspectrum_qword libspectrum_hash( const libspectrum_byte *data,
+                                    size_t length, libspectrum_qword seed );
+
+/* The hashes of a snapshot's data kept by libspectrum_snap_hash() */
+typedef struct libspectrum_snap_hashes libspectrum_snap_hashes;
+
+libspectrum_snap_hashes**
+libspectrum_snap_hash_cache( libspectrum_snap *snap );
+void libspectrum_snap_invalidate_data_hash( libspectrum_snap *snap,
+                                            size_t field, size_t idx );
+void libspectrum_snap_free_hash_cache( libspectrum_snap *snap );
+
+/* The RAM page holding the screen which is being displayed */
+int libspectrum_snap_screen_page( libspectrum_snap *snap );
+
 /* Get memory for a snap */
 
 libspectrum_error
@@ -172,6 +252,18 @@ libspectrum_snap_write_buffer( libspectrum_buffer *buffer, int *out_flags,
 
 /* Format specific snapshot routines */
 
+libspectrum_error
+libspectrum_lss_read( libspectrum_snap *snap,
+                      const libspectrum_byte *buffer, size_t buffer_length );
+libspectrum_error
+libspectrum_lss_write( libspectrum_buffer *buffer, int *out_flags,
+                       libspectrum_snap *snap, int in_flags );
+size_t
+libspectrum_lss_compress( libspectrum_byte *dest, const libspectrum_byte *src,
+                          size_t length );
+libspectrum_error
+libspectrum_lss_uncompress( libspectrum_byte *dest, size_t length,
+                            const libspectrum_byte *src, size_t src_length );
 libspectrum_error
 libspectrum_plusd_read( libspectrum_snap *snap,
 			const libspectrum_byte *buffer, size_t buffer_length );
@@ -179,6 +271,10 @@ libspectrum_error
 internal_sna_read( libspectrum_snap *snap,
 		   const libspectrum_byte *buffer, size_t buffer_length );
 libspectrum_error
+internal_sna_read_screen( libspectrum_snap_screen *screen,
+			  const libspectrum_byte *buffer,
+			  size_t buffer_length );
+libspectrum_error
 libspectrum_sna_write( libspectrum_buffer *buffer, int *out_flags,
                        libspectrum_snap *snap, int in_flags );
 libspectrum_error
@@ -188,9 +284,17 @@ libspectrum_error
 libspectrum_sp_read( libspectrum_snap *snap,
 		     const libspectrum_byte *buffer, size_t buffer_length );
 libspectrum_error
+libspectrum_sp_read_screen( libspectrum_snap_screen *screen,
+			    const libspectrum_byte *buffer,
+			    size_t buffer_length );
+libspectrum_error
 libspectrum_szx_read( libspectrum_snap *snap,
 		      const libspectrum_byte *buffer, size_t buffer_length );
 libspectrum_error
+libspectrum_szx_read_screen( libspectrum_snap_screen *screen,
+			     const libspectrum_byte *buffer,
+			     size_t buffer_length );
+libspectrum_error
 libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
                        libspectrum_snap *snap, libspectrum_creator *creator,
                        int in_flags );
@@ -198,6 +302,10 @@ libspectrum_error
 internal_z80_read( libspectrum_snap *snap,
 		   const libspectrum_byte *buffer, size_t buffer_length );
 libspectrum_error
+internal_z80_read_screen( libspectrum_snap_screen *screen,
+			  const libspectrum_byte *buffer,
+			  size_t buffer_length );
+libspectrum_error
 libspectrum_z80_write2( libspectrum_buffer *buffer, int *out_flags,
                         libspectrum_snap *snap, int in_flags );
 libspectrum_error
@@ -228,6 +336,10 @@ libspectrum_tape_block_read_symbol_table(
 
 void libspectrum_init_bits_set( void );
 
+void libspectrum_init_screen( void );
+
+void libspectrum_timings_cleanup( void );
+
 /* Format specific tape routines */
   
 libspectrum_error
@@ -243,7 +355,8 @@ internal_tzx_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
 		   const size_t length );
 
 libspectrum_error
-internal_tzx_write( libspectrum_buffer *buffer, libspectrum_tape *tape );
+internal_tzx_write( libspectrum_buffer *buffer, libspectrum_tape *tape,
+                    int flags );
 
 libspectrum_error
 internal_warajevo_read( libspectrum_tape *tape,
@@ -267,6 +380,9 @@ libspectrum_error
 internal_pzx_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
                    const size_t length );
 
+libspectrum_error
+internal_pzx_write( libspectrum_buffer *buffer, libspectrum_tape *tape );
+
 libspectrum_tape_block*
 libspectrum_tape_block_internal_init(
                                 libspectrum_tape_block_state *iterator,
@@ -291,10 +407,145 @@ typedef struct libspectrum_hdf_header {
 
 } libspectrum_hdf_header;
   
+/* Number of sectors in each read cache extent */
+#define LIBSPECTRUM_IDE_EXTENT_SECTORS 16
+
+/* Number of extents held in each drive's read cache */
+#define LIBSPECTRUM_IDE_READ_CACHE_EXTENTS 64
+
+/* Maximum number of extents fetched by one read from the image */
+#define LIBSPECTRUM_IDE_READAHEAD_MAX 8
+
+typedef struct libspectrum_ide_extent {
+
+  libspectrum_dword first;	/* First sector held in this extent */
+  libspectrum_dword count;	/* Number of valid sectors; 0 if unused */
+  libspectrum_dword last_used;	/* Value of the cache clock when last hit */
+  libspectrum_byte *data;
+
+} libspectrum_ide_extent;
+
+typedef struct libspectrum_ide_read_cache {
+
+  libspectrum_ide_extent extents[ LIBSPECTRUM_IDE_READ_CACHE_EXTENTS ];
+  libspectrum_ide_extent *mru;
+
+  size_t sector_size;
+  libspectrum_byte *storage;	/* Data for all the extents */
+  libspectrum_byte *scratch;	/* Buffer for reads from the image */
+
+  libspectrum_dword clock;
+
+  /* Sequential access detection: the sector which would follow the most
+     recent read, and the number of extents to fetch on the next miss */
+  libspectrum_dword next_sector;
+  libspectrum_dword readahead;
+
+} libspectrum_ide_read_cache;
+
+void
+libspectrum_ide_read_cache_init( libspectrum_ide_read_cache *cache,
+                                 size_t sector_size );
+
+void
+libspectrum_ide_read_cache_end( libspectrum_ide_read_cache *cache );
+
+void
+libspectrum_ide_read_cache_invalidate( libspectrum_ide_read_cache *cache );
+
+libspectrum_byte*
+libspectrum_ide_read_cache_lookup( libspectrum_ide_read_cache *cache,
+                                   libspectrum_dword sector );
+
+int
+libspectrum_ide_read_cache_contains( libspectrum_ide_read_cache *cache,
+                                     libspectrum_dword first );
+
+void
+libspectrum_ide_read_cache_store( libspectrum_ide_read_cache *cache,
+                                  libspectrum_dword first,
+                                  const libspectrum_byte *data, size_t count );
+
+void
+libspectrum_ide_read_cache_update( libspectrum_ide_read_cache *cache,
+                                   libspectrum_dword sector,
+                                   const libspectrum_byte *data );
+
+/* The largest packed sector we will see */
+#define LIBSPECTRUM_IDE_MAX_SECTOR_SIZE 512
+
+/* log2 of the number of sectors covered by each leaf of the write cache */
+#define LIBSPECTRUM_IDE_CACHE_LEAF_BITS 10
+
+/* Number of sectors allocated at once for the write cache */
+#define LIBSPECTRUM_IDE_CACHE_SLAB_SECTORS 64
+
+typedef struct libspectrum_ide_cache_leaf libspectrum_ide_cache_leaf;
+
+typedef struct libspectrum_ide_cache {
+
+  libspectrum_ide_cache_leaf **leaves;
+  size_t leaf_count;
+
+  libspectrum_byte **slabs;
+  size_t slab_count;
+  size_t slab_used;		/* Sectors used in the last slab */
+
+  size_t dirty;			/* Number of dirty sectors */
+
+} libspectrum_ide_cache;
+
+typedef void (*libspectrum_ide_cache_fn)( libspectrum_dword sector,
+                                          libspectrum_byte *data,
+                                          void *user_data );
+
+libspectrum_ide_cache*
+libspectrum_ide_cache_alloc( void );
+
+void
+libspectrum_ide_cache_free( libspectrum_ide_cache *cache );
+
+void
+libspectrum_ide_cache_clear( libspectrum_ide_cache *cache );
+
+libspectrum_byte*
+libspectrum_ide_cache_lookup( libspectrum_ide_cache *cache,
+                              libspectrum_dword sector );
+
+libspectrum_byte*
+libspectrum_ide_cache_write( libspectrum_ide_cache *cache,
+                             libspectrum_dword sector );
+
+void
+libspectrum_ide_cache_clean( libspectrum_ide_cache *cache,
+                             libspectrum_dword sector );
+
+size_t
+libspectrum_ide_cache_dirty( libspectrum_ide_cache *cache );
+
+void
+libspectrum_ide_cache_foreach_dirty( libspectrum_ide_cache *cache,
+                                     libspectrum_ide_cache_fn func,
+                                     void *user_data );
+
+/* A write cache generation being committed in the background */
+typedef struct libspectrum_ide_flush libspectrum_ide_flush;
+
+/* An overlay file receiving writes in place of the image */
+typedef struct libspectrum_ide_journal libspectrum_ide_journal;
+
+/* The cluster table and buffers of a sparse image */
+typedef struct libspectrum_ide_sparse libspectrum_ide_sparse;
+
 typedef struct libspectrum_ide_drive {
 
   /* HDF filepointer and information */
   FILE *disk;
+  libspectrum_ide_backend requested_backend;	/* Used on the next insert */
+  libspectrum_ide_backend backend;
+  libspectrum_byte *map;	/* The whole image, if memory mapped */
+  libspectrum_qword map_length;
+  libspectrum_ide_sparse *sparse;	/* Non-NULL for sparse images */
   libspectrum_word data_offset;
   libspectrum_word sector_size;
   libspectrum_hdf_header hdf;
@@ -306,33 +557,180 @@ typedef struct libspectrum_ide_drive {
 
   libspectrum_byte error;
   libspectrum_byte status;
+
+  /* Recently read extents of the image */
+  libspectrum_ide_read_cache read_cache;
+  libspectrum_ide_cache_stats stats;
+
+  /* Activity since the image was inserted; the `cache' member is filled in
+     from `stats' when requested */
+  libspectrum_ide_io_stats io_stats;
+
+  /* Any commit in progress, and the result of the last one */
+  libspectrum_ide_flush *flush;
+  libspectrum_error commit_error;
+
+  libspectrum_ide_journal *journal;
   
 } libspectrum_ide_drive;
 
+void
+libspectrum_ide_drive_init( libspectrum_ide_drive *drv );
+
+void
+libspectrum_ide_get_drive_io_stats( libspectrum_ide_drive *drv,
+                                    libspectrum_ide_io_stats *stats );
+
+void
+libspectrum_ide_reset_drive_io_stats( libspectrum_ide_drive *drv );
+
+void
+libspectrum_ide_image_open( libspectrum_ide_drive *drv, const char *filename );
+
+void
+libspectrum_ide_image_close( libspectrum_ide_drive *drv );
+
+libspectrum_byte*
+libspectrum_ide_image_sector( libspectrum_ide_drive *drv,
+                              libspectrum_dword sector );
+
+size_t
+libspectrum_ide_image_read( libspectrum_ide_drive *drv,
+                            libspectrum_dword first, size_t count,
+                            libspectrum_byte *dest );
+
+/* Maximum number of consecutive sectors written to the image at once */
+#define LIBSPECTRUM_IDE_COMMIT_RUN 64
+
+int
+libspectrum_ide_image_write( libspectrum_ide_drive *drv,
+                             libspectrum_dword first, size_t count,
+                             libspectrum_byte **sectors );
+
+int
+libspectrum_ide_image_sync( libspectrum_ide_drive *drv );
+
+int
+libspectrum_ide_image_concurrent( libspectrum_ide_drive *drv );
+
+int
+libspectrum_ide_file_seek( FILE *f, libspectrum_qword position );
+
+int
+libspectrum_ide_file_size( FILE *f, libspectrum_qword *size );
+
+libspectrum_error
+libspectrum_ide_sparse_open( libspectrum_ide_drive *drv, FILE *f,
+                             const char *filename );
+
+void
+libspectrum_ide_sparse_close( libspectrum_ide_drive *drv );
+
+size_t
+libspectrum_ide_sparse_read( libspectrum_ide_drive *drv,
+                             libspectrum_dword first, size_t count,
+                             libspectrum_byte *dest );
+
+int
+libspectrum_ide_sparse_write( libspectrum_ide_drive *drv,
+                              libspectrum_dword first, size_t count,
+                              libspectrum_byte **sectors );
+
+int
+libspectrum_ide_sparse_sync( libspectrum_ide_drive *drv );
+
 libspectrum_error
 libspectrum_ide_insert_into_drive( libspectrum_ide_drive *drv,
                                    const char *filename );
 
 libspectrum_error
 libspectrum_ide_eject_from_drive( libspectrum_ide_drive *drv,
-                                  GHashTable *cache );
+                                  libspectrum_ide_cache *cache );
 
 int
 libspectrum_ide_read_sector_from_hdf(
     libspectrum_ide_drive *drv,
-    GHashTable *cache,
+    libspectrum_ide_cache *cache,
     libspectrum_dword sector_number,
     libspectrum_byte *dest );
 
 void
 libspectrum_ide_write_sector_to_hdf(
     libspectrum_ide_drive *drv,
-    GHashTable *cache,
+    libspectrum_ide_cache *cache,
     libspectrum_dword sector_number,
     libspectrum_byte *src );
 
+int
+libspectrum_ide_read_sectors_from_hdf(
+    libspectrum_ide_drive *drv,
+    libspectrum_ide_cache *cache,
+    libspectrum_dword first, size_t count,
+    libspectrum_byte *dest );
+
 void
-libspectrum_ide_commit_drive( libspectrum_ide_drive *drv, GHashTable *cache );
+libspectrum_ide_write_sectors_to_hdf(
+    libspectrum_ide_drive *drv,
+    libspectrum_ide_cache *cache,
+    libspectrum_dword first, size_t count,
+    libspectrum_byte *src );
+
+libspectrum_error
+libspectrum_ide_write_back( libspectrum_ide_drive *drv,
+                            libspectrum_ide_cache *cache,
+                            libspectrum_ide_progress_fn progress,
+                            void *user_data );
+
+libspectrum_error
+libspectrum_ide_commit_drive( libspectrum_ide_drive *drv,
+                              libspectrum_ide_cache *cache,
+                              libspectrum_ide_progress_fn progress,
+                              void *user_data );
+
+libspectrum_error
+libspectrum_ide_commit_drive_async( libspectrum_ide_drive *drv,
+                                    libspectrum_ide_cache *cache );
+
+int
+libspectrum_ide_commit_drive_pending( libspectrum_ide_drive *drv,
+                                      libspectrum_ide_cache *cache );
+
+libspectrum_error
+libspectrum_ide_commit_drive_wait( libspectrum_ide_drive *drv,
+                                   libspectrum_ide_cache *cache );
+
+libspectrum_error
+libspectrum_ide_journal_attach( libspectrum_ide_drive *drv,
+                                libspectrum_ide_cache *cache,
+                                const char *filename );
+
+void
+libspectrum_ide_journal_detach( libspectrum_ide_drive *drv );
+
+int
+libspectrum_ide_journal_read( libspectrum_ide_drive *drv,
+                              libspectrum_dword sector,
+                              libspectrum_byte **buffer );
+
+int
+libspectrum_ide_journal_write( libspectrum_ide_drive *drv,
+                               libspectrum_dword first, size_t count,
+                               const libspectrum_byte *data );
+
+libspectrum_error
+libspectrum_ide_journal_commit( libspectrum_ide_drive *drv,
+                                libspectrum_ide_cache *cache );
+
+libspectrum_error
+libspectrum_ide_journal_discard( libspectrum_ide_drive *drv,
+                                 libspectrum_ide_cache *cache );
+
+libspectrum_error
+libspectrum_ide_journal_merge( libspectrum_ide_drive *drv,
+                               libspectrum_ide_cache *cache );
+
+size_t
+libspectrum_ide_journal_sectors( libspectrum_ide_drive *drv );
 
 /* Crypto functions */
 
@@ -113,6 +113,7 @@ libspectrum_init( void )
 #endif				/* #ifdef HAVE_GCRYPT_H */
 
   libspectrum_init_bits_set();
+  libspectrum_init_screen();
 
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -120,6 +121,8 @@ libspectrum_init( void )
 void
 libspectrum_end( void )
 {
+  libspectrum_timings_cleanup();
+
 #ifndef HAVE_LIB_GLIB
   libspectrum_slist_cleanup();
   libspectrum_hashtable_cleanup();
@@ -521,6 +524,7 @@ libspectrum_identify_file_raw( libspectrum_id_t *type, const char *filename,
       { LIBSPECTRUM_ID_SNAPSHOT_Z80,  "slt", 3, "\0\0",		    6, 2, 1 },
       { LIBSPECTRUM_ID_SNAPSHOT_ZXS,  "zxs", 3, "SNAP",		    8, 4, 4 },
       { LIBSPECTRUM_ID_SNAPSHOT_PLUSD,"mgtsnp", 3, NULL,	    0, 0, 0 },
+      { LIBSPECTRUM_ID_SNAPSHOT_LSS,  "lss", 3, "LSS\x1a",	    0, 4, 4 },
 
       { LIBSPECTRUM_ID_CARTRIDGE_DCK, "dck", 3, NULL,		    0, 0, 0 },
       { LIBSPECTRUM_ID_CARTRIDGE_IF2, "rom", 3, NULL,		    0, 0, 0 },
@@ -713,6 +717,7 @@ libspectrum_identify_class( libspectrum_class_t *libspectrum_class,
   case LIBSPECTRUM_ID_RECORDING_RZX:
     *libspectrum_class = LIBSPECTRUM_CLASS_RECORDING; return 0;
 
+  case LIBSPECTRUM_ID_SNAPSHOT_LSS:
   case LIBSPECTRUM_ID_SNAPSHOT_PLUSD:
   case LIBSPECTRUM_ID_SNAPSHOT_SNA:
   case LIBSPECTRUM_ID_SNAPSHOT_SNP:
@@ -1041,3 +1046,11 @@ int libspectrum_write_dword( libspectrum_byte **buffer, libspectrum_dword d )
   *(*buffer)++ = ( d & 0xff000000 ) >> 24;
   return LIBSPECTRUM_ERROR_NONE;
 }
+
+int
+libspectrum_is_zero( const libspectrum_byte *data, size_t length )
+{
+  if( !length ) return 1;
+
+  return data[0] == 0 && !memcmp( data, data + 1, length - 1 );
+}
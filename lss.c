@@ -0,0 +1,416 @@
+/* lss.c: Routines for libspectrum's native savestates
+   Copyright (c) 2021 Philip Kendall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "internals.h"
+
+/* The native format is designed to be written and read quickly, for
+   rewind buffers and autosaves, rather than for interchange; it can be
+   read only by a version of libspectrum with the same set of snapshot
+   fields. All values are little endian.
+
+   Offset  Length  Contents
+   0       4       "LSS\x1a"
+   4       2       Format version (1)
+   6       2       Number of data fields in libspectrum_snap
+   8       4       Length of the fields (n)
+   12      4       Number of blocks of data (m)
+   16      n       Every field not pointing to data, as written by
+                   libspectrum_snap_write_fields()
+   16+n    32*m    A directory entry for each block of data
+   ...             The data
+
+   Each directory entry is
+
+   Offset  Length  Contents
+   0       2       Data field, as in libspectrum_snap_data_fields[]
+   2       2       Index within the field
+   4       2       Flags (see below)
+   6       2       Reserved, zero
+   8       4       Length of the data
+   12      4       Number of bytes stored
+   16      4       Offset of the stored bytes from the start of the file
+   20      4       Reserved, zero
+   24      8       libspectrum_hash() of the data, so unchanged or
+                   duplicate data can be found without reading it
+
+   Data which is all zero is not stored; other data may be run length
+   encoded (see libspectrum_lss_compress()). Data stored as is starts on
+   a 4K boundary, so it can be used directly from a mapped file. */
+
+static const char * const signature = "LSS\x1a";
+static const size_t signature_length = 4;
+
+static const libspectrum_word LSS_VERSION = 1;
+
+#define LSS_HEADER_LENGTH 16
+#define LSS_DIRECTORY_ENTRY_LENGTH 32
+#define LSS_ALIGNMENT 0x1000
+
+#define LSS_DATA_COMPRESSED 0x0001
+#define LSS_DATA_ZERO 0x0002
+
+typedef struct lss_block {
+  size_t field, idx;
+  int flags;
+  const libspectrum_byte *data;
+  size_t length;
+  libspectrum_byte *stored;	/* The compressed data, if any */
+  size_t stored_length;
+  size_t offset;
+  libspectrum_qword hash;
+} lss_block;
+
+static libspectrum_byte*
+write_literals( libspectrum_byte *dest, const libspectrum_byte *dest_end,
+                const libspectrum_byte *src, size_t length )
+{
+  size_t chunk;
+
+  while( length ) {
+    chunk = length > 128 ? 128 : length;
+    if( dest_end - dest < (ptrdiff_t)chunk + 1 ) return NULL;
+
+    *dest++ = chunk - 1;
+    memcpy( dest, src, chunk );
+    dest += chunk; src += chunk; length -= chunk;
+  }
+
+  return dest;
+}
+
+/* A byte run length encoding which is cheap in both directions: a control
+   byte 0x00-0x7f is followed by 1-128 literal bytes, while 0x80-0xff
+   repeats the following byte 3-130 times. Returns the compressed length,
+   or 0 if the data would not be made smaller. Also used for snapshot
+   deltas */
+size_t
+libspectrum_lss_compress( libspectrum_byte *dest, const libspectrum_byte *src,
+                          size_t length )
+{
+  const libspectrum_byte *end = src + length, *literal = src, *run;
+  const libspectrum_byte *dest_end = dest + length;
+  libspectrum_byte *ptr = dest;
+
+  while( src < end ) {
+
+    for( run = src + 1; run < end && *run == *src && run - src < 130; run++ )
+      ;
+
+    if( run - src < 3 ) { src = run; continue; }
+
+    ptr = write_literals( ptr, dest_end, literal, src - literal );
+    if( !ptr || dest_end - ptr < 2 ) return 0;
+
+    *ptr++ = 0x80 + ( run - src - 3 );
+    *ptr++ = *src;
+
+    src = literal = run;
+  }
+
+  ptr = write_literals( ptr, dest_end, literal, src - literal );
+  if( !ptr || ptr == dest_end ) return 0;
+
+  return ptr - dest;
+}
+
+libspectrum_error
+libspectrum_lss_uncompress( libspectrum_byte *dest, size_t length,
+                            const libspectrum_byte *src, size_t src_length )
+{
+  const libspectrum_byte *src_end = src + src_length;
+  libspectrum_byte *end = dest + length;
+  size_t count;
+
+  while( dest < end && src < src_end ) {
+
+    if( *src < 0x80 ) {
+      count = *src++ + 1;
+      if( (size_t)( src_end - src ) < count ||
+          (size_t)( end - dest ) < count ) break;
+      memcpy( dest, src, count );
+      src += count;
+    } else {
+      count = *src++ - 0x80 + 3;
+      if( src == src_end || (size_t)( end - dest ) < count ) break;
+      memset( dest, *src++, count );
+    }
+
+    dest += count;
+  }
+
+  if( dest != end || src != src_end ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                             "libspectrum_lss_uncompress: corrupt data" );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static void
+add_block( lss_block **blocks, size_t *count, size_t *allocated,
+           libspectrum_snap *snap, size_t field, size_t idx, int compress )
+{
+  const libspectrum_byte *data = *libspectrum_snap_data( snap, field, idx );
+  size_t *length_field = libspectrum_snap_data_length( snap, field, idx );
+  size_t length = length_field ? *length_field :
+                                 libspectrum_snap_data_fields[ field ].length;
+  lss_block *block;
+
+  if( !data || !length ) return;
+
+  if( *count == *allocated ) {
+    *allocated = *allocated ? 2 * *allocated : 32;
+    *blocks = libspectrum_renew( lss_block, *blocks, *allocated );
+  }
+
+  block = &(*blocks)[ (*count)++ ];
+
+  block->field = field;
+  block->idx = idx;
+  block->flags = 0;
+  block->data = data;
+  block->length = length;
+  block->stored = NULL;
+  block->stored_length = length;
+  block->hash = libspectrum_hash( data, length, 0 );
+
+  if( libspectrum_is_zero( data, length ) ) {
+    block->flags |= LSS_DATA_ZERO;
+    block->stored_length = 0;
+  } else if( compress ) {
+    block->stored = libspectrum_new( libspectrum_byte, length );
+    block->stored_length =
+      libspectrum_lss_compress( block->stored, data, length );
+    if( block->stored_length ) {
+      block->flags |= LSS_DATA_COMPRESSED;
+    } else {
+      libspectrum_free( block->stored );
+      block->stored = NULL;
+      block->stored_length = length;
+    }
+  }
+}
+
+libspectrum_error
+libspectrum_lss_write( libspectrum_buffer *buffer, int *out_flags,
+                       libspectrum_snap *snap, int in_flags )
+{
+  lss_block *blocks = NULL, *block;
+  size_t count = 0, allocated = 0, field, i, start, position;
+  int compress = !( in_flags & LIBSPECTRUM_FLAG_SNAPSHOT_NO_COMPRESSION );
+
+  /* Everything in the snapshot is saved */
+  *out_flags = 0;
+
+  for( field = 0; field < libspectrum_snap_data_field_count; field++ )
+    for( i = 0; i < libspectrum_snap_data_fields[ field ].count; i++ )
+      add_block( &blocks, &count, &allocated, snap, field, i, compress );
+
+  /* Work out where all the data will go */
+  position = LSS_HEADER_LENGTH + libspectrum_snap_fields_length +
+    count * LSS_DIRECTORY_ENTRY_LENGTH;
+
+  for( i = 0, block = blocks; i < count; i++, block++ ) {
+    if( !block->flags )
+      position = ( position + LSS_ALIGNMENT - 1 ) & ~( LSS_ALIGNMENT - 1 );
+    block->offset = position;
+    position += block->stored_length;
+  }
+
+  start = libspectrum_buffer_get_data_size( buffer );
+
+  libspectrum_buffer_write( buffer, signature, signature_length );
+  libspectrum_buffer_write_word( buffer, LSS_VERSION );
+  libspectrum_buffer_write_word( buffer, libspectrum_snap_data_field_count );
+  libspectrum_buffer_write_dword( buffer, libspectrum_snap_fields_length );
+  libspectrum_buffer_write_dword( buffer, count );
+
+  libspectrum_snap_write_fields( buffer, snap );
+
+  for( i = 0, block = blocks; i < count; i++, block++ ) {
+    libspectrum_buffer_write_word( buffer, block->field );
+    libspectrum_buffer_write_word( buffer, block->idx );
+    libspectrum_buffer_write_word( buffer, block->flags );
+    libspectrum_buffer_write_word( buffer, 0 );
+    libspectrum_buffer_write_dword( buffer, block->length );
+    libspectrum_buffer_write_dword( buffer, block->stored_length );
+    libspectrum_buffer_write_dword( buffer, block->offset );
+    libspectrum_buffer_write_dword( buffer, 0 );
+    libspectrum_buffer_write_dword( buffer, block->hash & 0xffffffff );
+    libspectrum_buffer_write_dword( buffer, block->hash >> 32 );
+  }
+
+  for( i = 0, block = blocks; i < count; i++, block++ ) {
+    if( !block->stored_length ) continue;
+
+    position = libspectrum_buffer_get_data_size( buffer ) - start;
+    libspectrum_buffer_set( buffer, 0, block->offset - position );
+
+    libspectrum_buffer_write( buffer,
+                              block->stored ? block->stored : block->data,
+                              block->stored_length );
+    libspectrum_free( block->stored );
+  }
+
+  libspectrum_free( blocks );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static libspectrum_error
+read_block( libspectrum_snap *snap, const libspectrum_byte **ptr,
+            const libspectrum_byte *buffer, size_t buffer_length )
+{
+  size_t field, idx, length, stored_length, offset, *length_field;
+  int flags;
+  libspectrum_byte **data, *page;
+  libspectrum_error error;
+
+  field = libspectrum_read_word( ptr );
+  idx = libspectrum_read_word( ptr );
+  flags = libspectrum_read_word( ptr );
+  *ptr += 2;
+  length = libspectrum_read_dword( ptr );
+  stored_length = libspectrum_read_dword( ptr );
+  offset = libspectrum_read_dword( ptr );
+  *ptr += 12;
+
+  if( field >= libspectrum_snap_data_field_count ||
+      idx >= libspectrum_snap_data_fields[ field ].count ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                             "lss_read: unknown data %lu:%lu",
+                             (unsigned long)field, (unsigned long)idx );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  length_field = libspectrum_snap_data_length( snap, field, idx );
+
+  if( !length || length > LIBSPECTRUM_SNAP_DATA_MAX_LENGTH ||
+      length != ( length_field ? *length_field :
+                                 libspectrum_snap_data_fields[ field ].length ) ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                             "lss_read: %s has wrong length %lu",
+                             libspectrum_snap_data_fields[ field ].name,
+                             (unsigned long)length );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  if( offset > buffer_length || stored_length > buffer_length - offset ||
+      ( flags & ~( LSS_DATA_COMPRESSED | LSS_DATA_ZERO ) ) ||
+      ( flags & LSS_DATA_ZERO && stored_length ) ||
+      ( !( flags & ( LSS_DATA_COMPRESSED | LSS_DATA_ZERO ) ) &&
+        stored_length != length ) ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                             "lss_read: %s has invalid data",
+                             libspectrum_snap_data_fields[ field ].name );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  data = libspectrum_snap_data( snap, field, idx );
+  if( *data ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                             "lss_read: %s duplicated",
+                             libspectrum_snap_data_fields[ field ].name );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  page = libspectrum_snap_alloc_page( snap, length );
+
+  if( flags & LSS_DATA_ZERO ) {
+    memset( page, 0, length );
+  } else if( flags & LSS_DATA_COMPRESSED ) {
+    error = libspectrum_lss_uncompress( page, length, buffer + offset,
+                                        stored_length );
+    if( error ) {
+      libspectrum_snap_release_page( snap, page, length, 1 );
+      return error;
+    }
+  } else {
+    memcpy( page, buffer + offset, length );
+  }
+
+  *data = page;
+  libspectrum_snap_invalidate_data_hash( snap, field, idx );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+libspectrum_error
+libspectrum_lss_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
+                      size_t buffer_length )
+{
+  const libspectrum_byte *ptr = buffer;
+  libspectrum_word version, field_count;
+  size_t fields_length, count, i;
+  libspectrum_error error;
+
+  if( buffer_length < LSS_HEADER_LENGTH ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                             "libspectrum_lss_read: not enough data in buffer" );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  if( memcmp( ptr, signature, signature_length ) ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_SIGNATURE,
+                             "libspectrum_lss_read: wrong signature" );
+    return LIBSPECTRUM_ERROR_SIGNATURE;
+  }
+  ptr += signature_length;
+
+  version = libspectrum_read_word( &ptr );
+  field_count = libspectrum_read_word( &ptr );
+  fields_length = libspectrum_read_dword( &ptr );
+  count = libspectrum_read_dword( &ptr );
+
+  if( version != LSS_VERSION ||
+      field_count != libspectrum_snap_data_field_count ||
+      fields_length != libspectrum_snap_fields_length ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_UNKNOWN,
+      "libspectrum_lss_read: written by a different version of libspectrum"
+    );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+  }
+
+  if( buffer_length - LSS_HEADER_LENGTH < fields_length ||
+      ( buffer_length - LSS_HEADER_LENGTH - fields_length ) /
+        LSS_DIRECTORY_ENTRY_LENGTH < count ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                             "libspectrum_lss_read: not enough data in buffer" );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  libspectrum_snap_read_fields( snap, &ptr );
+
+  for( i = 0; i < count; i++ ) {
+    error = read_block( snap, &ptr, buffer, buffer_length );
+    if( error ) return error;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
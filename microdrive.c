@@ -35,6 +35,12 @@ struct libspectrum_microdrive {
   int write_protect;
   libspectrum_byte cartridge_len;
 
+  /* The files on the cartridge; built when first asked for after any
+     change to the cartridge */
+  libspectrum_microdrive_file *files;
+  size_t file_count;
+  int catalogue_valid;
+
 };
 
 typedef struct libspectrum_microdrive_block {
@@ -64,13 +70,21 @@ static const size_t MDR_LENGTH = LIBSPECTRUM_MICRODRIVE_CARTRIDGE_LENGTH + 1;
 libspectrum_microdrive*
 libspectrum_microdrive_alloc( void )
 {
-  return libspectrum_new( libspectrum_microdrive, 1 );
+  libspectrum_microdrive *microdrive =
+    libspectrum_new( libspectrum_microdrive, 1 );
+
+  microdrive->files = NULL;
+  microdrive->file_count = 0;
+  microdrive->catalogue_valid = 0;
+
+  return microdrive;
 }
 
 /* Free a microdrive image */
 libspectrum_error
 libspectrum_microdrive_free( libspectrum_microdrive *microdrive )
 {
+  libspectrum_free( microdrive->files );
   libspectrum_free( microdrive );
 
   return LIBSPECTRUM_ERROR_NONE;
@@ -90,6 +104,24 @@ libspectrum_microdrive_set_data( libspectrum_microdrive *microdrive,
 				 size_t which, libspectrum_byte data )
 {
   microdrive->data[ which ] = data;
+  microdrive->catalogue_valid = 0;
+}
+
+const libspectrum_byte*
+libspectrum_microdrive_block_data( const libspectrum_microdrive *microdrive,
+                                   libspectrum_byte which )
+{
+  return &microdrive->data[ which * LIBSPECTRUM_MICRODRIVE_BLOCK_LEN ];
+}
+
+void
+libspectrum_microdrive_set_block_data( libspectrum_microdrive *microdrive,
+                                       libspectrum_byte which,
+                                       const libspectrum_byte *data )
+{
+  memcpy( &microdrive->data[ which * LIBSPECTRUM_MICRODRIVE_BLOCK_LEN ], data,
+          LIBSPECTRUM_MICRODRIVE_BLOCK_LEN );
+  microdrive->catalogue_valid = 0;
 }
 
 int
@@ -116,6 +148,7 @@ libspectrum_microdrive_set_cartridge_len( libspectrum_microdrive *microdrive,
 			     libspectrum_byte len )
 {
   microdrive->cartridge_len = len;
+  microdrive->catalogue_valid = 0;
 }
 
 void
@@ -172,34 +205,11 @@ libspectrum_microdrive_set_block( libspectrum_microdrive *microdrive,
   memcpy( d, block->data, 512 ); d += 512;
   *(d++) = block->datchk;
 
+  microdrive->catalogue_valid = 0;
 }
 
-int
-libspectrum_microdrive_checksum( libspectrum_microdrive *microdrive,
-				 libspectrum_byte what )
-{
-  libspectrum_byte *data;
-  unsigned int checksum, carry;
-  int i;
-
-#define DO_CHECK \
-    checksum += *data;		/* LD    A,E */ \
-				/* ADD A, (HL) */ \
-    if( checksum > 255 ) {	/* ... ADD A, (HL) --> CY*/ \
-      carry = 1;		\
-      checksum -= 256;		\
-    } else {			\
-      carry = 0;		\
-    }				\
-    data++;			/* INC HL */ \
-    checksum += carry + 1;	/* ADC A, #01 */ \
-    if( checksum == 256 ) {	/* JR Z,LSTCHK */ \
-      checksum -= 256;		/* LD E,A */\
-    } else {			\
-      checksum--;		/* DEC A */ \
-    }
-
-/*
+/* The Interface 1 ROM checksums each part of a block by adding its bytes
+   with end-around carry, avoiding the value 0xff:
 
 LOOP-C:  LD      A,E             ; fetch running sum
          ADD     A,(HL)          ; add to current location.
@@ -213,42 +223,201 @@ LOOP-C:  LD      A,E             ; fetch running sum
 
 LSTCHK   LD      E,A             ; update the 8-bit sum.
 
-*/  
-  data = &(microdrive->data[ what * LIBSPECTRUM_MICRODRIVE_BLOCK_LEN ]);
-  
-  if( ( *( data + 15 ) & 2 ) && 
-        ( *( data + 17 ) == 0 ) && ( *( data + 18 ) == 0 ) ) {
-    return -1;		/* PRESET BAD BLOCK */
+   which comes to the sum of the bytes modulo 255. The bytes are added
+   eight at a time in four 16-bit lanes, which can't overflow for up to
+   1024 bytes */
+static libspectrum_byte
+block_checksum( const libspectrum_byte *data, size_t length )
+{
+  const libspectrum_qword mask = 0x00ff00ff00ff00ffULL;
+  libspectrum_qword bytes, lanes = 0;
+  libspectrum_dword sum = 0;
+  size_t i;
+
+  for( i = 0; i + 8 <= length; i += 8 ) {
+    memcpy( &bytes, data + i, sizeof( bytes ) );
+    lanes += ( bytes & mask ) + ( ( bytes >> 8 ) & mask );
   }
 
-  checksum = 0;			/* Block header */
-  for( i = LIBSPECTRUM_MICRODRIVE_HEAD_LEN; i > 1; i-- ) {
-    DO_CHECK;
+  for( ; i < length; i++ ) sum += data[i];
+
+  sum += ( lanes & 0xffff ) + ( ( lanes >> 16 ) & 0xffff ) +
+         ( ( lanes >> 32 ) & 0xffff ) + ( lanes >> 48 );
+
+  return sum % 255;
+}
+
+int
+libspectrum_microdrive_checksum( libspectrum_microdrive *microdrive,
+				 libspectrum_byte what )
+{
+  const libspectrum_byte *data =
+    libspectrum_microdrive_block_data( microdrive, what );
+  const libspectrum_byte *record = data + LIBSPECTRUM_MICRODRIVE_HEAD_LEN;
+  const libspectrum_byte *contents = record + LIBSPECTRUM_MICRODRIVE_HEAD_LEN;
+
+  if( ( record[0] & 2 ) && record[2] == 0 && record[3] == 0 ) {
+    return -1;		/* PRESET BAD BLOCK */
   }
-  if( *(data++) != checksum ) 
+
+  if( block_checksum( data, LIBSPECTRUM_MICRODRIVE_HEAD_LEN - 1 ) !=
+      data[ LIBSPECTRUM_MICRODRIVE_HEAD_LEN - 1 ] )
     return 1;
 
-  checksum = 0;			/* Record header */
-  for( i = LIBSPECTRUM_MICRODRIVE_HEAD_LEN; i > 1; i-- ) {
-    DO_CHECK;
-  }
-  if( *(data++) != checksum ) 
+  if( block_checksum( record, LIBSPECTRUM_MICRODRIVE_HEAD_LEN - 1 ) !=
+      record[ LIBSPECTRUM_MICRODRIVE_HEAD_LEN - 1 ] )
     return 2;
 
-  if( ( *( data - 13 ) == 0 ) && ( *( data - 12 ) == 0 ) ) {
+  if( record[2] == 0 && record[3] == 0 ) {
     return 0;		/* Erased / empty block: data checksum irrelevant */
   }
 
-  checksum = 0;			/* Data */
-  for( i = LIBSPECTRUM_MICRODRIVE_DATA_LEN; i > 0; i-- ) {
-    DO_CHECK;
-  }
-  if( *data != checksum )
+  if( block_checksum( contents, LIBSPECTRUM_MICRODRIVE_DATA_LEN ) !=
+      contents[ LIBSPECTRUM_MICRODRIVE_DATA_LEN ] )
     return 3;
 
   return 0;
 }
 
+void
+libspectrum_microdrive_set_checksums( libspectrum_microdrive *microdrive,
+                                      libspectrum_byte which )
+{
+  libspectrum_byte *data =
+    &microdrive->data[ which * LIBSPECTRUM_MICRODRIVE_BLOCK_LEN ];
+  libspectrum_byte *record = data + LIBSPECTRUM_MICRODRIVE_HEAD_LEN;
+  libspectrum_byte *contents = record + LIBSPECTRUM_MICRODRIVE_HEAD_LEN;
+
+  data[ LIBSPECTRUM_MICRODRIVE_HEAD_LEN - 1 ] =
+    block_checksum( data, LIBSPECTRUM_MICRODRIVE_HEAD_LEN - 1 );
+  record[ LIBSPECTRUM_MICRODRIVE_HEAD_LEN - 1 ] =
+    block_checksum( record, LIBSPECTRUM_MICRODRIVE_HEAD_LEN - 1 );
+  contents[ LIBSPECTRUM_MICRODRIVE_DATA_LEN ] =
+    block_checksum( contents, LIBSPECTRUM_MICRODRIVE_DATA_LEN );
+
+  microdrive->catalogue_valid = 0;
+}
+
+size_t
+libspectrum_microdrive_checksum_all( libspectrum_microdrive *microdrive,
+                                     libspectrum_byte *valid )
+{
+  size_t i, count = 0;
+
+  memset( valid, 0, LIBSPECTRUM_MICRODRIVE_BITMAP_LEN );
+
+  for( i = 0; i < microdrive->cartridge_len; i++ ) {
+    if( libspectrum_microdrive_checksum( microdrive, i ) == 0 ) {
+      valid[ i / 8 ] |= 1 << ( i % 8 );
+      count++;
+    }
+  }
+
+  return count;
+}
+
+/* Catalogue routines */
+
+/* Copy a record name, without its trailing spaces */
+static void
+get_file_name( char *name, const libspectrum_byte *recnam )
+{
+  size_t length = 10;
+
+  while( length && recnam[ length - 1 ] == ' ' ) length--;
+
+  memcpy( name, recnam, length );
+  name[ length ] = '\0';
+}
+
+static void
+build_catalogue( libspectrum_microdrive *microdrive )
+{
+  libspectrum_microdrive_file *file;
+  const libspectrum_byte *d;
+  char name[11];
+  size_t i, j, reclen, allocated = microdrive->file_count;
+  libspectrum_byte recnum;
+  int check;
+
+  microdrive->file_count = 0;
+
+  for( i = 0; i < microdrive->cartridge_len; i++ ) {
+
+    /* Only intact records with some data belong to files */
+    check = libspectrum_microdrive_checksum( microdrive, i );
+    if( check != 0 ) continue;
+
+    d = libspectrum_microdrive_block_data( microdrive, i );
+    reclen = d[17] | ( d[18] << 8 );
+    if( !reclen ) continue;
+
+    /* A file can have no more records than there are blocks */
+    recnum = d[16];
+    if( recnum >= LIBSPECTRUM_MICRODRIVE_BLOCK_MAX ) continue;
+
+    get_file_name( name, &d[19] );
+
+    for( j = 0, file = microdrive->files; j < microdrive->file_count;
+         j++, file++ )
+      if( !strcmp( file->name, name ) ) break;
+
+    if( j == microdrive->file_count ) {
+      if( microdrive->file_count == allocated ) {
+        allocated = allocated ? 2 * allocated : 8;
+        microdrive->files = libspectrum_renew( libspectrum_microdrive_file,
+                                               microdrive->files, allocated );
+      }
+      file = &microdrive->files[ microdrive->file_count++ ];
+      strcpy( file->name, name );
+      file->record_count = 0;
+      file->length = 0;
+    }
+
+    /* If a record appears more than once, the first copy wins */
+    while( file->record_count <= recnum )
+      file->blocks[ file->record_count++ ] = -1;
+    if( file->blocks[ recnum ] != -1 ) continue;
+
+    file->blocks[ recnum ] = i;
+    file->length += reclen;
+  }
+
+  microdrive->catalogue_valid = 1;
+}
+
+size_t
+libspectrum_microdrive_catalogue( libspectrum_microdrive *microdrive,
+                                  const libspectrum_microdrive_file **files )
+{
+  if( !microdrive->catalogue_valid ) build_catalogue( microdrive );
+
+  *files = microdrive->files;
+  return microdrive->file_count;
+}
+
+const libspectrum_microdrive_file*
+libspectrum_microdrive_find_file( libspectrum_microdrive *microdrive,
+                                  const char *name )
+{
+  const libspectrum_microdrive_file *files;
+  libspectrum_byte recnam[10];
+  char file_name[11];
+  size_t i, count;
+
+  /* Compare names as they are stored on the cartridge */
+  memset( recnam, ' ', 10 );
+  memcpy( recnam, name, MIN( strlen( name ), 10 ) );
+  get_file_name( file_name, recnam );
+
+  count = libspectrum_microdrive_catalogue( microdrive, &files );
+
+  for( i = 0; i < count; i++ )
+    if( !strcmp( files[i].name, file_name ) ) return &files[i];
+
+  return NULL;
+}
+
 /* .mdr format routines */
 
 libspectrum_error
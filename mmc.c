@@ -34,6 +34,10 @@
 #define ERASE_SEQ_ERROR_MASK 0x10
 #define PARAMETER_ERROR_MASK 0x40
 
+/* The number of sectors fetched from or stored to the image at once during
+   a multiple block transfer */
+#define BATCH_SECTORS 16
+
 /* The states while a command is being sent to the card */
 enum command_state_t {
   WAITING_FOR_COMMAND,
@@ -54,8 +58,12 @@ enum command_byte {
   SEND_IF_COND = 8,
   SEND_CSD = 9,
   SEND_CID = 10,
+  STOP_TRANSMISSION = 12,
   READ_SINGLE_BLOCK = 17,
+  READ_MULTIPLE_BLOCK = 18,
+  SET_BLOCK_COUNT = 23,
   WRITE_BLOCK = 24,
+  WRITE_MULTIPLE_BLOCK = 25,
   ERASE_WR_BLK_START = 32,
   ERASE_WR_BLK_END = 33,
   ERASE = 38,
@@ -63,6 +71,10 @@ enum command_byte {
   READ_OCR = 58
 };
 
+/* Application specific commands are counted after the standard ones in
+   the statistics */
+#define APPLICATION_COMMAND_STATS 0x40
+
 /* Application specific commands, only some implemented
    but needed for command identification */
 enum application_command_byte {
@@ -86,7 +98,7 @@ struct libspectrum_mmc_card {
   libspectrum_ide_drive drive;
 
   /* Cache of written sectors */
-  GHashTable *cache;
+  libspectrum_ide_cache *cache;
 
   /* The C_SIZE field of the card CSD */
   libspectrum_word c_size;
@@ -133,15 +145,39 @@ struct libspectrum_mmc_card {
   /* Initial and end blocks of programmed erase */
   libspectrum_dword erase_block_start, erase_block_end;
 
+  /* CMD18/READ_MULTIPLE_BLOCK or CMD25/WRITE_MULTIPLE_BLOCK in progress */
+  int multi_read, multi_write;
+
+  /* The next sector to be transferred by a multiple block command */
+  libspectrum_dword next_sector;
+
+  /* The number of blocks left in a multiple block transfer, or 0 if the
+     transfer continues until stopped */
+  libspectrum_dword blocks_remaining;
+
+  /* The block count from CMD23/SET_BLOCK_COUNT for the next command */
+  libspectrum_dword block_count;
+
+  /* Sectors read ahead for, or waiting to be written by, a multiple block
+     transfer */
+  libspectrum_byte batch[ BATCH_SECTORS * 512 ];
+
+  /* The first sector in the batch and the number of sectors in it */
+  libspectrum_dword batch_first;
+  size_t batch_count;
+
 };
 
+static void
+flush_write_batch( libspectrum_mmc_card *card );
+
 libspectrum_mmc_card*
 libspectrum_mmc_alloc( void )
 {
-  libspectrum_mmc_card *card = libspectrum_new( libspectrum_mmc_card, 1 );
+  libspectrum_mmc_card *card = libspectrum_new0( libspectrum_mmc_card, 1 );
 
-  card->drive.disk = NULL;
-  card->cache = g_hash_table_new( g_int_hash, g_int_equal );
+  libspectrum_ide_drive_init( &card->drive );
+  card->cache = libspectrum_ide_cache_alloc();
 
   libspectrum_mmc_reset( card );
 
@@ -153,7 +189,7 @@ libspectrum_mmc_free( libspectrum_mmc_card *card )
 {
   libspectrum_mmc_eject( card );
 
-  g_hash_table_destroy( card->cache );
+  libspectrum_ide_cache_free( card->cache );
 
   libspectrum_free( card );
 }
@@ -196,9 +232,53 @@ libspectrum_mmc_insert( libspectrum_mmc_card *card, const char *filename )
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+libspectrum_error
+libspectrum_mmc_set_backend( libspectrum_mmc_card *card,
+                             libspectrum_ide_backend backend )
+{
+  card->drive.requested_backend = backend;
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+libspectrum_error
+libspectrum_mmc_attach_journal( libspectrum_mmc_card *card,
+                                const char *filename )
+{
+  return libspectrum_ide_journal_attach( &card->drive, card->cache,
+                                         filename );
+}
+
+libspectrum_error
+libspectrum_mmc_detach_journal( libspectrum_mmc_card *card )
+{
+  libspectrum_error error;
+
+  flush_write_batch( card );
+
+  error = libspectrum_ide_journal_commit( &card->drive, card->cache );
+  if( error ) return error;
+
+  libspectrum_ide_journal_detach( &card->drive );
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+libspectrum_error
+libspectrum_mmc_merge_journal( libspectrum_mmc_card *card )
+{
+  flush_write_batch( card );
+  return libspectrum_ide_journal_merge( &card->drive, card->cache );
+}
+
+libspectrum_error
+libspectrum_mmc_discard_journal( libspectrum_mmc_card *card )
+{
+  return libspectrum_ide_journal_discard( &card->drive, card->cache );
+}
+
 void
 libspectrum_mmc_eject( libspectrum_mmc_card *card )
 {
+  flush_write_batch( card );
   libspectrum_ide_eject_from_drive( &card->drive, card->cache );
   libspectrum_mmc_reset( card );
 }
@@ -206,6 +286,10 @@ libspectrum_mmc_eject( libspectrum_mmc_card *card )
 void
 libspectrum_mmc_reset( libspectrum_mmc_card *card )
 {
+  /* Sectors in a multiple block write have already been acknowledged, so
+     they mustn't be lost */
+  flush_write_batch( card );
+
   card->r1_status = IN_IDLE_STATE_MASK;
   card->command_state = WAITING_FOR_COMMAND;
   card->response_buffer_next = card->response_buffer;
@@ -215,24 +299,91 @@ libspectrum_mmc_reset( libspectrum_mmc_card *card )
   card->erase_sequence = SEQ_ERASE_NONE;
   card->erase_block_start = 0;
   card->erase_block_end = 0;
+  card->multi_read = 0;
+  card->multi_write = 0;
+  card->blocks_remaining = 0;
+  card->block_count = 0;
+  card->batch_count = 0;
 }
 
 int
 libspectrum_mmc_dirty( libspectrum_mmc_card *card )
 {
-  return g_hash_table_size( card->cache ) != 0;
+  return libspectrum_ide_cache_dirty( card->cache ) != 0 ||
+         card->drive.flush || ( card->multi_write && card->batch_count );
 }
 
 void
 libspectrum_mmc_commit( libspectrum_mmc_card *card )
 {
-  libspectrum_ide_commit_drive( &card->drive, card->cache );
+  flush_write_batch( card );
+  libspectrum_ide_commit_drive( &card->drive, card->cache, NULL, NULL );
+}
+
+libspectrum_error
+libspectrum_mmc_commit_with_progress( libspectrum_mmc_card *card,
+                                      libspectrum_ide_progress_fn progress,
+                                      void *user_data )
+{
+  flush_write_batch( card );
+  return libspectrum_ide_commit_drive( &card->drive, card->cache, progress,
+                                       user_data );
+}
+
+libspectrum_error
+libspectrum_mmc_commit_async( libspectrum_mmc_card *card )
+{
+  flush_write_batch( card );
+  return libspectrum_ide_commit_drive_async( &card->drive, card->cache );
+}
+
+int
+libspectrum_mmc_commit_pending( libspectrum_mmc_card *card )
+{
+  return libspectrum_ide_commit_drive_pending( &card->drive, card->cache );
+}
+
+libspectrum_error
+libspectrum_mmc_commit_wait( libspectrum_mmc_card *card )
+{
+  return libspectrum_ide_commit_drive_wait( &card->drive, card->cache );
+}
+
+void
+libspectrum_mmc_get_cache_stats( libspectrum_mmc_card *card,
+                                 libspectrum_ide_cache_stats *stats )
+{
+  *stats = card->drive.stats;
+}
+
+void
+libspectrum_mmc_get_io_stats( libspectrum_mmc_card *card,
+                              libspectrum_ide_io_stats *stats )
+{
+  libspectrum_ide_get_drive_io_stats( &card->drive, stats );
+}
+
+void
+libspectrum_mmc_reset_io_stats( libspectrum_mmc_card *card )
+{
+  libspectrum_ide_reset_drive_io_stats( &card->drive );
 }
 
+static void
+read_next_block( libspectrum_mmc_card *card, size_t offset );
+
 libspectrum_byte
 libspectrum_mmc_read( libspectrum_mmc_card *card )
 {
-  libspectrum_byte r = card->response_buffer_next < card->response_buffer_end ?
+  libspectrum_byte r;
+
+  /* Queue up the next block of a multiple block read once the host has
+     had all of the previous one */
+  if( card->multi_read &&
+      card->response_buffer_next >= card->response_buffer_end )
+    read_next_block( card, 0 );
+
+  r = card->response_buffer_next < card->response_buffer_end ?
     *(card->response_buffer_next)++ :
     0xff;
 
@@ -384,6 +535,10 @@ erase( libspectrum_mmc_card *card )
      depends on the card vendor */
   memset( card->send_buffer, 0x00, 512 );
 
+  card->drive.io_stats.erases++;
+  card->drive.io_stats.sectors_erased +=
+    card->erase_block_end - card->erase_block_start + 1;
+
   for( i = card->erase_block_start; i <= card->erase_block_end; i++ ) {
     libspectrum_ide_write_sector_to_hdf( &card->drive, card->cache, i,
                                          card->send_buffer );
@@ -445,6 +600,112 @@ read_single_block( libspectrum_mmc_card *card )
   card->response_buffer_end = card->response_buffer + 516;
 }
 
+/* Fetch the next sector of a multiple block read into the batch if it's not
+   already there, reading as many following sectors as will be wanted at the
+   same time */
+static int
+fill_read_batch( libspectrum_mmc_card *card )
+{
+  libspectrum_dword count;
+
+  if( card->next_sector >= card->batch_first &&
+      card->next_sector - card->batch_first < card->batch_count )
+    return 0;
+
+  count = card->total_sectors - card->next_sector;
+  if( count > BATCH_SECTORS ) count = BATCH_SECTORS;
+  if( card->blocks_remaining && count > card->blocks_remaining )
+    count = card->blocks_remaining;
+
+  card->batch_first = card->next_sector;
+  card->batch_count = 0;
+
+  if( libspectrum_ide_read_sectors_from_hdf( &card->drive, card->cache,
+                                             card->next_sector, count,
+                                             card->batch ) )
+    return 1;
+
+  card->batch_count = count;
+  return 0;
+}
+
+/* Put the next block of a multiple block read into the response buffer at
+   `offset', or an error token if it can't be read */
+static void
+read_next_block( libspectrum_mmc_card *card, size_t offset )
+{
+  libspectrum_byte *block = &card->response_buffer[ offset ];
+
+  card->response_buffer_next = card->response_buffer;
+  card->response_buffer_end = block;
+
+  /* Sector out of range */
+  if( card->next_sector >= card->total_sectors ) {
+    *block = 0x08;                      /* out of range error token */
+    card->response_buffer_end++;
+    card->multi_read = 0;
+    return;
+  }
+
+  /* Data retrieval error */
+  if( fill_read_batch( card ) ) {
+    *block = 0x01;                      /* data error token */
+    card->response_buffer_end++;
+    card->multi_read = 0;
+    return;
+  }
+
+  block[ 0 ] = 0xfe;
+  memcpy( &block[ 1 ],
+          &card->batch[ ( card->next_sector - card->batch_first ) * 512 ],
+          512 );
+
+  /* CRC */
+  memset( &block[ 513 ], 0x00, 2 );
+
+  card->response_buffer_end += 515;
+  card->next_sector++;
+
+  /* All requested blocks sent */
+  if( card->blocks_remaining && !--card->blocks_remaining )
+    card->multi_read = 0;
+}
+
+static void
+read_multiple_block( libspectrum_mmc_card *card )
+{
+  libspectrum_dword sector_number;
+
+  /* Card initialised? */
+  if( card->r1_status & IN_IDLE_STATE_MASK ) {
+    card->r1_status |= ILLEGAL_COMMAND_MASK;
+    set_response_buffer_r1( card );
+    return;
+  }
+
+  sector_number =
+    card->current_argument[ 3 ] +
+    (card->current_argument[ 2 ] << 8) +
+    (card->current_argument[ 1 ] << 16) +
+    (card->current_argument[ 0 ] << 24);
+
+  /* Sector out of range */
+  if( sector_number >= card->total_sectors ) {
+    card->r1_status |= PARAMETER_ERROR_MASK;
+    set_response_buffer_r1( card );
+    return;
+  }
+
+  card->multi_read = 1;
+  card->next_sector = sector_number;
+  card->blocks_remaining = card->block_count;
+  card->batch_count = 0;
+
+  /* R1 command response followed by the first block */
+  card->response_buffer[ 0 ] = card->r1_status;
+  read_next_block( card, 1 );
+}
+
 static void
 send_csd( libspectrum_mmc_card *card )
 {
@@ -569,6 +830,59 @@ do_application_command( libspectrum_mmc_card *card )
   return is_acmd;
 }
 
+static void
+set_block_count( libspectrum_mmc_card *card )
+{
+  /* Card initialised? */
+  if( card->r1_status & IN_IDLE_STATE_MASK ) {
+    card->r1_status |= ILLEGAL_COMMAND_MASK;
+    set_response_buffer_r1( card );
+    return;
+  }
+
+  card->block_count =
+    card->current_argument[ 3 ] +
+    (card->current_argument[ 2 ] << 8) +
+    (card->current_argument[ 1 ] << 16) +
+    (card->current_argument[ 0 ] << 24);
+
+  set_response_buffer_r1( card );
+}
+
+static void
+write_multiple_block( libspectrum_mmc_card *card )
+{
+  libspectrum_dword sector_number;
+
+  /* Card initialised? */
+  if( card->r1_status & IN_IDLE_STATE_MASK ) {
+    card->r1_status |= ILLEGAL_COMMAND_MASK;
+    set_response_buffer_r1( card );
+    return;
+  }
+
+  sector_number =
+    card->current_argument[ 3 ] +
+    (card->current_argument[ 2 ] << 8) +
+    (card->current_argument[ 1 ] << 16) +
+    (card->current_argument[ 0 ] << 24);
+
+  /* Sector out of range */
+  if( sector_number >= card->total_sectors ) {
+    card->r1_status |= PARAMETER_ERROR_MASK;
+    set_response_buffer_r1( card );
+    return;
+  }
+
+  card->multi_write = 1;
+  card->next_sector = sector_number;
+  card->blocks_remaining = card->block_count;
+  card->batch_first = sector_number;
+  card->batch_count = 0;
+
+  set_response_buffer_r1( card );
+}
+
 static void
 do_standard_command( libspectrum_mmc_card *card )
 {
@@ -590,12 +904,25 @@ do_standard_command( libspectrum_mmc_card *card )
     case SEND_CID:
       send_cid( card );
       break;
+    case STOP_TRANSMISSION:
+      /* Any multiple block read has already been stopped */
+      set_response_buffer_r1( card );
+      break;
     case READ_SINGLE_BLOCK:
       read_single_block( card );
       break;
+    case READ_MULTIPLE_BLOCK:
+      read_multiple_block( card );
+      break;
+    case SET_BLOCK_COUNT:
+      set_block_count( card );
+      break;
     case WRITE_BLOCK:
       set_response_buffer_r1( card );
       break;
+    case WRITE_MULTIPLE_BLOCK:
+      write_multiple_block( card );
+      break;
     case ERASE_WR_BLK_START:
       erase_wr_blk_start( card );
       break;
@@ -629,6 +956,9 @@ do_standard_command( libspectrum_mmc_card *card )
 static void
 do_command( libspectrum_mmc_card *card )
 {
+  /* Any command stops a multiple block read */
+  card->multi_read = 0;
+
   /* Previous APP_CMD indicates to the card that the next command is an
      application specific command rather than a standard command */
   if( card->cmd55_issued ) {
@@ -636,10 +966,16 @@ do_command( libspectrum_mmc_card *card )
 
     /* If a non-ACMD is sent, then it is respected by the card as a normal
        SD Memory Card command */
-    if( do_application_command( card ) )
+    if( do_application_command( card ) ) {
+      card->drive.io_stats.commands[ APPLICATION_COMMAND_STATS +
+                                     card->current_command ]++;
+      card->block_count = 0;
       return;
+    }
   }
 
+  card->drive.io_stats.commands[ card->current_command ]++;
+
   /* Check ongoing erase sequence */
   if( card->erase_sequence != SEQ_ERASE_NONE ) {
     switch( card->current_command ) {
@@ -657,6 +993,9 @@ do_command( libspectrum_mmc_card *card )
   }
 
   do_standard_command( card );
+
+  /* A block count applies only to the command immediately after it */
+  if( card->current_command != SET_BLOCK_COUNT ) card->block_count = 0;
 }
 
 static void
@@ -693,6 +1032,51 @@ write_single_block( libspectrum_mmc_card *card )
   card->response_buffer_end = card->response_buffer + 2;
 }
 
+/* Store any blocks buffered by a multiple block write */
+static void
+flush_write_batch( libspectrum_mmc_card *card )
+{
+  if( !card->multi_write || !card->batch_count ) return;
+
+  libspectrum_ide_write_sectors_to_hdf( &card->drive, card->cache,
+                                        card->batch_first, card->batch_count,
+                                        card->batch );
+
+  card->batch_first += card->batch_count;
+  card->batch_count = 0;
+}
+
+static void
+write_multiple_block_data( libspectrum_mmc_card *card )
+{
+  /* Sector out of range; end the transfer */
+  if( card->next_sector >= card->total_sectors ) {
+    flush_write_batch( card );
+    card->multi_write = 0;
+
+    card->response_buffer[ 0 ] = 0x0d; /* data response: write error */
+    card->response_buffer_next = card->response_buffer;
+    card->response_buffer_end = card->response_buffer + 1;
+    return;
+  }
+
+  memcpy( &card->batch[ card->batch_count++ * 512 ], card->send_buffer, 512 );
+  card->next_sector++;
+
+  if( card->batch_count == BATCH_SECTORS ) flush_write_batch( card );
+
+  /* All requested blocks received */
+  if( card->blocks_remaining && !--card->blocks_remaining ) {
+    flush_write_batch( card );
+    card->multi_write = 0;
+  }
+
+  card->response_buffer[ 0 ] = 0x05; /* data response */
+  card->response_buffer[ 1 ] = 0x01; /* busy flag (end of programming) */
+  card->response_buffer_next = card->response_buffer;
+  card->response_buffer_end = card->response_buffer + 2;
+}
+
 static void
 do_command_data( libspectrum_mmc_card *card )
 {
@@ -700,6 +1084,9 @@ do_command_data( libspectrum_mmc_card *card )
     case WRITE_BLOCK:
       write_single_block( card );
       break;
+    case WRITE_MULTIPLE_BLOCK:
+      write_multiple_block_data( card );
+      break;
     default:
       /* This should never happen as it indicates a failure in our state machine */
       libspectrum_print_error(
@@ -735,12 +1122,25 @@ libspectrum_mmc_write( libspectrum_mmc_card *card, libspectrum_byte data )
       /* reset command error flags except in_idle */
       card->r1_status &= IN_IDLE_STATE_MASK;
 
-      card->command_state = card->current_command == WRITE_BLOCK ?
+      card->command_state =
+        card->current_command == WRITE_BLOCK || card->multi_write ?
         WAITING_FOR_DATA_TOKEN :
         WAITING_FOR_COMMAND;
       break;
     case WAITING_FOR_DATA_TOKEN:
-      if( data == 0xfe ) {
+      if( card->multi_write ) {
+        if( data == 0xfc ) {
+          card->command_state = WAITING_FOR_DATA;
+          card->data_count = 0;
+        } else if( data == 0xfd ) {
+          /* Stop transmission token */
+          flush_write_batch( card );
+          card->multi_write = 0;
+          card->response_buffer_next = card->response_buffer;
+          card->response_buffer_end = card->response_buffer;
+          card->command_state = WAITING_FOR_COMMAND;
+        }
+      } else if( data == 0xfe ) {
         card->command_state = WAITING_FOR_DATA;
         card->data_count = 0;
       }
@@ -756,7 +1156,9 @@ libspectrum_mmc_write( libspectrum_mmc_card *card, libspectrum_byte data )
       break;
     case WAITING_FOR_DATA_CRC2:
       do_command_data( card );
-      card->command_state = WAITING_FOR_COMMAND;
+      card->command_state = card->multi_write ?
+        WAITING_FOR_DATA_TOKEN :
+        WAITING_FOR_COMMAND;
       break;
     }
 }
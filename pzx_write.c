@@ -0,0 +1,721 @@
+/* pzx_write.c: Routines for writing .pzx files
+   Copyright (c) 2021 Philip Kendall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "tape_block.h"
+#include "internals.h"
+
+#define PZX_HEADER "PZXT"
+#define PZX_PULSE  "PULS"
+#define PZX_DATA   "DATA"
+#define PZX_PAUSE  "PAUS"
+#define PZX_BROWSE "BRWS"
+#define PZX_STOP   "STOP"
+
+static const libspectrum_word PZXF_STOP48 = 1;
+
+/* The longest pulse and the most repeats one entry of a PULS block can
+   hold */
+static const libspectrum_dword PZX_MAX_PULSE = 0x7fffffff;
+static const size_t PZX_MAX_REPEATS = 0x7fff;
+
+/* The PZXT tags for the archive info IDs; anything else becomes a
+   comment */
+static const struct info_t {
+
+  int archive_info_id;
+  const char *id;
+
+} info_ids[] = {
+
+  { 0x01, "Publisher"  },
+  { 0x02, "Author"     },
+  { 0x03, "Year"       },
+  { 0x04, "Language"   },
+  { 0x05, "Type"       },
+  { 0x06, "Price"      },
+  { 0x07, "Protection" },
+  { 0x08, "Origin"     },
+
+};
+
+/* Used for passing internal data around */
+
+typedef struct pzx_write_state {
+
+  libspectrum_buffer *buffer;	/* The .pzx file */
+  libspectrum_buffer *pulses;	/* The PULS block being built */
+
+  int level;			/* The level of the last pulse */
+  int pending;			/* Is that pulse still being extended? */
+  libspectrum_dword length;	/* If so, its length so far */
+
+  libspectrum_dword run_length;	/* The pulse being repeated in the PULS */
+  size_t repeats;		/* block and how many times */
+
+} pzx_write_state;
+
+/*** Local function prototypes ***/
+
+static void
+write_block( libspectrum_buffer *buffer, const char *id,
+             libspectrum_buffer *block_data );
+static void
+write_string( libspectrum_buffer *buffer, const char *string );
+static void
+pzx_write_header( pzx_write_state *state, libspectrum_tape *tape );
+static void
+write_run( pzx_write_state *state );
+static void
+add_pulse( pzx_write_state *state, libspectrum_dword length );
+static void
+extend_pulse( pzx_write_state *state, libspectrum_dword tstates );
+static void
+add_edge( pzx_write_state *state, libspectrum_dword tstates, int flags );
+static void
+flush_pulses( pzx_write_state *state );
+static libspectrum_error
+pzx_write_edges( pzx_write_state *state, libspectrum_tape_block *block,
+                 libspectrum_tape *tape, libspectrum_tape_iterator iterator,
+                 int stop_at_data );
+static void
+pzx_write_data( pzx_write_state *state, const libspectrum_byte *data,
+                size_t bits, int initial_level, libspectrum_word tail,
+                size_t bit0_pulse_count, const libspectrum_word *bit0_pulses,
+                size_t bit1_pulse_count, const libspectrum_word *bit1_pulses );
+static void
+pzx_write_pause( pzx_write_state *state, libspectrum_dword tstates,
+                 int level );
+static void
+pzx_write_stop( pzx_write_state *state, libspectrum_word flags );
+static void
+pzx_write_browse( pzx_write_state *state, const char *text );
+static libspectrum_error
+pzx_write_two_pulse_data( pzx_write_state *state,
+                          libspectrum_tape_block *block,
+                          libspectrum_tape *tape,
+                          libspectrum_tape_iterator iterator,
+                          libspectrum_dword bit0_length,
+                          libspectrum_dword bit1_length,
+                          size_t bits_in_last_byte );
+static int
+symbol_pulses( libspectrum_tape_generalised_data_symbol_table *table,
+               size_t which, libspectrum_word *pulses );
+static libspectrum_error
+pzx_write_generalised_data( pzx_write_state *state,
+                            libspectrum_tape_block *block,
+                            libspectrum_tape *tape,
+                            libspectrum_tape_iterator iterator );
+static void
+pzx_write_data_block( pzx_write_state *state, libspectrum_tape_block *block );
+static void
+pzx_write_pause_block( pzx_write_state *state,
+                       libspectrum_tape_block *block );
+
+/*** Function definitions ***/
+
+/* The main write function */
+
+libspectrum_error
+internal_pzx_write( libspectrum_buffer *buffer, libspectrum_tape *tape )
+{
+  libspectrum_error error = LIBSPECTRUM_ERROR_NONE;
+  libspectrum_tape_iterator iterator, loop_start = NULL;
+  libspectrum_tape_block *block;
+  pzx_write_state state;
+  size_t loop_count = 0;
+  int offset;
+
+  state.buffer = buffer;
+  state.pulses = libspectrum_buffer_alloc();
+  state.level = 0;
+  state.pending = 0;
+  state.length = 0;
+  state.run_length = 0;
+  state.repeats = 0;
+
+  pzx_write_header( &state, tape );
+
+  for( block = libspectrum_tape_iterator_init( &iterator, tape );
+       block && !error;
+       block = libspectrum_tape_iterator_next( &iterator )       )
+  {
+    switch( libspectrum_tape_block_type( block ) ) {
+
+    case LIBSPECTRUM_TAPE_BLOCK_ROM:
+      error = pzx_write_two_pulse_data( &state, block, tape, iterator,
+                                        LIBSPECTRUM_TAPE_TIMING_DATA0,
+                                        LIBSPECTRUM_TAPE_TIMING_DATA1, 8 );
+      break;
+
+    case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+    case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
+      error = pzx_write_two_pulse_data(
+        &state, block, tape, iterator,
+        libspectrum_tape_block_bit0_length( block ),
+        libspectrum_tape_block_bit1_length( block ),
+        libspectrum_tape_block_bits_in_last_byte( block )
+      );
+      break;
+
+    case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
+      error = pzx_write_generalised_data( &state, block, tape, iterator );
+      break;
+
+    case LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK:
+      pzx_write_data_block( &state, block );
+      break;
+
+    case LIBSPECTRUM_TAPE_BLOCK_PURE_TONE:
+    case LIBSPECTRUM_TAPE_BLOCK_PULSES:
+    case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
+    case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
+    case LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE:
+    case LIBSPECTRUM_TAPE_BLOCK_SET_SIGNAL_LEVEL:
+      error = pzx_write_edges( &state, block, tape, iterator, 0 );
+      break;
+
+    case LIBSPECTRUM_TAPE_BLOCK_PAUSE:
+      pzx_write_pause_block( &state, block );
+      break;
+
+    case LIBSPECTRUM_TAPE_BLOCK_STOP48:
+      pzx_write_stop( &state, PZXF_STOP48 );
+      break;
+
+    case LIBSPECTRUM_TAPE_BLOCK_GROUP_START:
+    case LIBSPECTRUM_TAPE_BLOCK_COMMENT:
+      pzx_write_browse( &state, libspectrum_tape_block_text( block ) );
+      break;
+
+    /* PZX has no loops, so unroll them */
+    case LIBSPECTRUM_TAPE_BLOCK_LOOP_START:
+      loop_start = iterator;
+      loop_count = libspectrum_tape_block_count( block );
+      break;
+
+    case LIBSPECTRUM_TAPE_BLOCK_LOOP_END:
+      if( loop_start && loop_count > 1 ) {
+        loop_count--;
+        iterator = loop_start;
+      } else {
+        loop_start = NULL;
+      }
+      break;
+
+    /* Forward jumps just skip blocks, but PZX can't go backwards */
+    case LIBSPECTRUM_TAPE_BLOCK_JUMP:
+      offset = libspectrum_tape_block_offset( block );
+      if( offset > 0 ) {
+        while( --offset ) libspectrum_tape_iterator_next( &iterator );
+      } else {
+        libspectrum_print_error(
+          LIBSPECTRUM_ERROR_WARNING,
+          "pzx_write: skipping backward jump; tape may not work"
+        );
+      }
+      break;
+
+    /* The first archive info block went into the header, and PZX has
+       nowhere to put the rest of these */
+    case LIBSPECTRUM_TAPE_BLOCK_ARCHIVE_INFO:
+    case LIBSPECTRUM_TAPE_BLOCK_GROUP_END:
+    case LIBSPECTRUM_TAPE_BLOCK_SELECT:
+    case LIBSPECTRUM_TAPE_BLOCK_MESSAGE:
+    case LIBSPECTRUM_TAPE_BLOCK_HARDWARE:
+    case LIBSPECTRUM_TAPE_BLOCK_CUSTOM:
+      break;
+
+    default:
+      libspectrum_print_error(
+        LIBSPECTRUM_ERROR_LOGIC,
+        "pzx_write: unknown block type 0x%02x",
+        libspectrum_tape_block_type( block )
+      );
+      error = LIBSPECTRUM_ERROR_LOGIC;
+      break;
+    }
+  }
+
+  if( !error ) flush_pulses( &state );
+
+  libspectrum_buffer_free( state.pulses );
+
+  return error;
+}
+
+static void
+write_block( libspectrum_buffer *buffer, const char *id,
+             libspectrum_buffer *block_data )
+{
+  libspectrum_buffer_write( buffer, id, 4 );
+  libspectrum_buffer_write_dword( buffer,
+                                  libspectrum_buffer_get_data_size( block_data ) );
+  libspectrum_buffer_write_buffer( buffer, block_data );
+  libspectrum_buffer_clear( block_data );
+}
+
+static void
+write_string( libspectrum_buffer *buffer, const char *string )
+{
+  libspectrum_buffer_write( buffer, string, strlen( string ) + 1 );
+}
+
+/* The header block, which carries the title and other details from the
+   first archive info block on the tape */
+static void
+pzx_write_header( pzx_write_state *state, libspectrum_tape *tape )
+{
+  libspectrum_tape_iterator iterator;
+  libspectrum_tape_block *block, *info = NULL;
+  libspectrum_buffer *header = libspectrum_buffer_alloc();
+  size_t i, j, count;
+  int id;
+
+  for( block = libspectrum_tape_iterator_init( &iterator, tape );
+       block && !info;
+       block = libspectrum_tape_iterator_next( &iterator ) )
+    if( libspectrum_tape_block_type( block ) ==
+        LIBSPECTRUM_TAPE_BLOCK_ARCHIVE_INFO )
+      info = block;
+
+  /* Version 1.0 */
+  libspectrum_buffer_write_byte( header, 1 );
+  libspectrum_buffer_write_byte( header, 0 );
+
+  if( info ) {
+    count = libspectrum_tape_block_count( info );
+
+    /* The title has to come first, even if it's empty */
+    for( i = 0; i < count; i++ )
+      if( libspectrum_tape_block_ids( info, i ) == 0x00 ) break;
+    write_string( header,
+                  i < count ? libspectrum_tape_block_texts( info, i ) : "" );
+
+    for( i = 0; i < count; i++ ) {
+      id = libspectrum_tape_block_ids( info, i );
+      if( id == 0x00 ) continue;
+
+      for( j = 0; j < ARRAY_SIZE( info_ids ); j++ )
+        if( info_ids[j].archive_info_id == id ) break;
+
+      write_string( header,
+                    j < ARRAY_SIZE( info_ids ) ? info_ids[j].id : "Comment" );
+      write_string( header, libspectrum_tape_block_texts( info, i ) );
+    }
+  }
+
+  write_block( state->buffer, PZX_HEADER, header );
+  libspectrum_buffer_free( header );
+}
+
+/* Write out the run of identical pulses in the PULS block being built */
+static void
+write_run( pzx_write_state *state )
+{
+  libspectrum_dword length = state->run_length;
+
+  if( !state->repeats ) return;
+
+  if( state->repeats > 1 || length > 0x7fff )
+    libspectrum_buffer_write_word( state->pulses, 0x8000 | state->repeats );
+
+  if( length > 0x7fff ) {
+    libspectrum_buffer_write_word( state->pulses, 0x8000 | ( length >> 16 ) );
+    libspectrum_buffer_write_word( state->pulses, length & 0xffff );
+  } else {
+    libspectrum_buffer_write_word( state->pulses, length );
+  }
+
+  state->repeats = 0;
+}
+
+/* Add a finished pulse at the current level to the PULS block, counting
+   repeats of the same length */
+static void
+add_pulse( pzx_write_state *state, libspectrum_dword length )
+{
+  /* PULS blocks start low, so a block starting high needs an empty pulse
+     first */
+  if( !state->repeats && libspectrum_buffer_is_empty( state->pulses ) &&
+      state->level ) {
+    state->run_length = 0;
+    state->repeats = 1;
+  }
+
+  if( state->repeats && state->run_length == length &&
+      state->repeats < PZX_MAX_REPEATS ) {
+    state->repeats++;
+    return;
+  }
+
+  write_run( state );
+
+  state->run_length = length;
+  state->repeats = 1;
+}
+
+/* Lengthen the pulse being built, splitting it with empty pulses if it
+   gets too long for PZX */
+static void
+extend_pulse( pzx_write_state *state, libspectrum_dword tstates )
+{
+  while( tstates > PZX_MAX_PULSE - state->length ) {
+    tstates -= PZX_MAX_PULSE - state->length;
+    add_pulse( state, PZX_MAX_PULSE );
+    add_pulse( state, 0 );
+    state->length = 0;
+  }
+
+  state->length += tstates;
+}
+
+/* Add one edge, as returned by libspectrum_tape_get_next_edge(), to the
+   pulses being built */
+static void
+add_edge( pzx_write_state *state, libspectrum_dword tstates, int flags )
+{
+  int level;
+
+  if( flags & LIBSPECTRUM_TAPE_FLAGS_NO_EDGE ) {
+    if( !tstates ) return;
+    level = state->level;
+  } else if( flags & LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW ) {
+    level = 0;
+  } else if( flags & LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH ) {
+    level = 1;
+  } else {
+    level = !state->level;
+  }
+
+  if( state->pending && level == state->level ) {
+    extend_pulse( state, tstates );
+    return;
+  }
+
+  if( state->pending ) add_pulse( state, state->length );
+
+  state->level = level;
+  state->pending = 1;
+  state->length = 0;
+  extend_pulse( state, tstates );
+}
+
+/* Finish off any pulses before writing a block of another type */
+static void
+flush_pulses( pzx_write_state *state )
+{
+  if( state->pending ) {
+    add_pulse( state, state->length );
+    state->pending = 0;
+  }
+
+  write_run( state );
+
+  if( libspectrum_buffer_is_not_empty( state->pulses ) )
+    write_block( state->buffer, PZX_PULSE, state->pulses );
+}
+
+/* Write the edges of a block as pulses, optionally stopping when the block
+   gets to its data */
+static libspectrum_error
+pzx_write_edges( pzx_write_state *state, libspectrum_tape_block *block,
+                 libspectrum_tape *tape, libspectrum_tape_iterator iterator,
+                 int stop_at_data )
+{
+  libspectrum_error error;
+  libspectrum_tape_block_state it;
+  libspectrum_tape_state_type block_state;
+  libspectrum_dword tstates;
+  int flags = 0;
+
+  it.current_block = iterator;
+  error = libspectrum_tape_block_init( block, &it );
+  if( error ) return error;
+
+  while( !( flags & LIBSPECTRUM_TAPE_FLAGS_BLOCK ) ) {
+
+    if( stop_at_data ) {
+      switch( libspectrum_tape_block_type( block ) ) {
+      case LIBSPECTRUM_TAPE_BLOCK_ROM:
+        block_state = it.block_state.rom.state; break;
+      case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+        block_state = it.block_state.turbo.state; break;
+      case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
+        block_state = it.block_state.pure_data.state; break;
+      case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
+        block_state = it.block_state.generalised_data.state; break;
+      default:
+        block_state = LIBSPECTRUM_TAPE_STATE_PILOT; break;
+      }
+      if( block_state == LIBSPECTRUM_TAPE_STATE_DATA1 ||
+          block_state == LIBSPECTRUM_TAPE_STATE_PAUSE )
+        break;
+    }
+
+    error = libspectrum_tape_get_next_edge_internal( &tstates, &flags, tape,
+                                                     &it );
+    if( error ) return error;
+
+    /* The edge at the end of the tape is there just to finish the last
+       pulse */
+    if( ( flags & LIBSPECTRUM_TAPE_FLAGS_TAPE ) && !tstates ) break;
+
+    add_edge( state, tstates, flags );
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static void
+pzx_write_data( pzx_write_state *state, const libspectrum_byte *data,
+                size_t bits, int initial_level, libspectrum_word tail,
+                size_t bit0_pulse_count, const libspectrum_word *bit0_pulses,
+                size_t bit1_pulse_count, const libspectrum_word *bit1_pulses )
+{
+  libspectrum_buffer *block_data;
+  size_t i, pulses = 0;
+
+  if( !bits && !tail ) return;
+
+  flush_pulses( state );
+
+  block_data = libspectrum_buffer_alloc();
+
+  libspectrum_buffer_write_dword( block_data, bits |
+                                  ( initial_level ? 0x80000000 : 0 ) );
+  libspectrum_buffer_write_word( block_data, tail );
+  libspectrum_buffer_write_byte( block_data, bit0_pulse_count );
+  libspectrum_buffer_write_byte( block_data, bit1_pulse_count );
+  for( i = 0; i < bit0_pulse_count; i++ )
+    libspectrum_buffer_write_word( block_data, bit0_pulses[i] );
+  for( i = 0; i < bit1_pulse_count; i++ )
+    libspectrum_buffer_write_word( block_data, bit1_pulses[i] );
+  libspectrum_buffer_write( block_data, data,
+                            libspectrum_bits_to_bytes( bits ) );
+
+  write_block( state->buffer, PZX_DATA, block_data );
+  libspectrum_buffer_free( block_data );
+
+  /* Each pulse toggles the level, starting from the initial level */
+  for( i = 0; i < bits; i++ )
+    pulses += data[ i / 8 ] & ( 0x80 >> ( i % 8 ) ) ? bit1_pulse_count :
+                                                      bit0_pulse_count;
+  if( tail ) pulses++;
+
+  if( pulses ) state->level = initial_level ^ !( pulses & 1 );
+}
+
+static void
+pzx_write_pause( pzx_write_state *state, libspectrum_dword tstates,
+                 int level )
+{
+  libspectrum_buffer *block_data;
+
+  flush_pulses( state );
+
+  block_data = libspectrum_buffer_alloc();
+
+  /* Anything too long to store is split into several pauses */
+  while( tstates ) {
+    libspectrum_dword length =
+      tstates > PZX_MAX_PULSE ? PZX_MAX_PULSE : tstates;
+    libspectrum_buffer_write_dword( block_data,
+                                    length | ( level ? 0x80000000 : 0 ) );
+    write_block( state->buffer, PZX_PAUSE, block_data );
+    tstates -= length;
+  }
+
+  libspectrum_buffer_free( block_data );
+
+  state->level = level;
+}
+
+static void
+pzx_write_stop( pzx_write_state *state, libspectrum_word flags )
+{
+  libspectrum_buffer *block_data;
+
+  flush_pulses( state );
+
+  block_data = libspectrum_buffer_alloc();
+  libspectrum_buffer_write_word( block_data, flags );
+  write_block( state->buffer, PZX_STOP, block_data );
+  libspectrum_buffer_free( block_data );
+}
+
+static void
+pzx_write_browse( pzx_write_state *state, const char *text )
+{
+  libspectrum_buffer *block_data;
+
+  flush_pulses( state );
+
+  block_data = libspectrum_buffer_alloc();
+  write_string( block_data, text );
+  write_block( state->buffer, PZX_BROWSE, block_data );
+  libspectrum_buffer_free( block_data );
+}
+
+/* ROM, turbo and pure data blocks: the pilot and sync pulses go into a
+   PULS block, the data into a DATA block and the pause into a PAUS
+   block */
+static libspectrum_error
+pzx_write_two_pulse_data( pzx_write_state *state,
+                          libspectrum_tape_block *block,
+                          libspectrum_tape *tape,
+                          libspectrum_tape_iterator iterator,
+                          libspectrum_dword bit0_length,
+                          libspectrum_dword bit1_length,
+                          size_t bits_in_last_byte )
+{
+  libspectrum_error error;
+  libspectrum_word bit0_pulses[2], bit1_pulses[2];
+  libspectrum_dword pause_tstates;
+  size_t length = libspectrum_tape_block_data_length( block ), bits;
+
+  /* DATA blocks can't hold pulses this long */
+  if( bit0_length > 0xffff || bit1_length > 0xffff )
+    return pzx_write_edges( state, block, tape, iterator, 0 );
+
+  error = pzx_write_edges( state, block, tape, iterator, 1 );
+  if( error ) return error;
+
+  bit0_pulses[0] = bit0_pulses[1] = bit0_length;
+  bit1_pulses[0] = bit1_pulses[1] = bit1_length;
+  bits = length ? ( length - 1 ) * 8 + bits_in_last_byte : 0;
+
+  pzx_write_data( state, libspectrum_tape_block_data( block ), bits,
+                  !state->level, 0, 2, bit0_pulses, 2, bit1_pulses );
+
+  pause_tstates = libspectrum_tape_block_pause_tstates( block );
+  if( pause_tstates ) pzx_write_pause( state, pause_tstates, !state->level );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Get the pulses of a data symbol as they would be played, or return 0 if
+   they can't go in a DATA block */
+static int
+symbol_pulses( libspectrum_tape_generalised_data_symbol_table *table,
+               size_t which, libspectrum_word *pulses )
+{
+  libspectrum_tape_generalised_data_symbol *symbol;
+  size_t count, max_pulses =
+    libspectrum_tape_generalised_data_symbol_table_max_pulses( table );
+
+  symbol = libspectrum_tape_generalised_data_symbol_table_symbol( table,
+                                                                  which );
+
+  if( libspectrum_tape_generalised_data_symbol_type( symbol ) !=
+      LIBSPECTRUM_TAPE_GENERALISED_DATA_SYMBOL_EDGE )
+    return 0;
+
+  for( count = 0; count < max_pulses; count++ ) {
+    pulses[ count ] =
+      libspectrum_tape_generalised_data_symbol_pulse( symbol, count );
+    if( count && !pulses[ count ] ) break;
+  }
+
+  return count;
+}
+
+/* Generalised data blocks with one bit per symbol and symbols made of
+   simple edges are written with their data in a DATA block; anything else
+   is written as pulses */
+static libspectrum_error
+pzx_write_generalised_data( pzx_write_state *state,
+                            libspectrum_tape_block *block,
+                            libspectrum_tape *tape,
+                            libspectrum_tape_iterator iterator )
+{
+  libspectrum_error error;
+  libspectrum_tape_generalised_data_symbol_table *table =
+    libspectrum_tape_block_data_table( block );
+  libspectrum_word bit_pulses[2][256];
+  size_t bit_pulse_count[2] = { 0, 0 }, i, symbols;
+  libspectrum_dword pause_tstates;
+
+  symbols = libspectrum_tape_generalised_data_symbol_table_symbols_in_table(
+    table
+  );
+
+  if( libspectrum_tape_block_bits_per_data_symbol( block ) != 1 ||
+      !libspectrum_tape_generalised_data_symbol_table_symbols_in_block( table ) ||
+      symbols > 2 )
+    return pzx_write_edges( state, block, tape, iterator, 0 );
+
+  for( i = 0; i < symbols; i++ ) {
+    bit_pulse_count[i] = symbol_pulses( table, i, bit_pulses[i] );
+    if( !bit_pulse_count[i] )
+      return pzx_write_edges( state, block, tape, iterator, 0 );
+  }
+
+  error = pzx_write_edges( state, block, tape, iterator, 1 );
+  if( error ) return error;
+
+  pzx_write_data(
+    state, libspectrum_tape_block_data( block ),
+    libspectrum_tape_generalised_data_symbol_table_symbols_in_block( table ),
+    !state->level, 0, bit_pulse_count[0], bit_pulses[0], bit_pulse_count[1],
+    bit_pulses[1]
+  );
+
+  pause_tstates = libspectrum_tape_block_pause_tstates( block );
+  if( pause_tstates ) pzx_write_pause( state, pause_tstates, !state->level );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Data blocks came from DATA blocks in the first place */
+static void
+pzx_write_data_block( pzx_write_state *state, libspectrum_tape_block *block )
+{
+  libspectrum_tape_data_block *data_block = &block->types.data_block;
+  int level = data_block->initial_level;
+
+  pzx_write_data( state, data_block->data, data_block->count,
+                  level == -1 ? !state->level : level,
+                  data_block->tail_length, data_block->bit0_pulse_count,
+                  data_block->bit0_pulses, data_block->bit1_pulse_count,
+                  data_block->bit1_pulses );
+}
+
+/* A zero length pause stops the tape, which is a STOP block in PZX */
+static void
+pzx_write_pause_block( pzx_write_state *state, libspectrum_tape_block *block )
+{
+  libspectrum_dword tstates = libspectrum_tape_block_pause_tstates( block );
+  int level = libspectrum_tape_block_level( block );
+
+  if( !tstates ) {
+    pzx_write_stop( state, 0 );
+    state->level = !state->level;
+    return;
+  }
+
+  pzx_write_pause( state, tstates, level == -1 ? !state->level : level );
+}
@@ -0,0 +1,276 @@
+/* screen.c: converting the Spectrum's screen layout into pixels
+   Copyright (c) 2021 Philip Kendall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "internals.h"
+
+/* The bits of the SCLD's display mode register */
+static const libspectrum_byte SCLD_ALTDFILE = 0x01;
+static const libspectrum_byte SCLD_EXTCOLOUR = 0x02;
+static const libspectrum_byte SCLD_HIRES = 0x04;
+static const libspectrum_byte SCLD_HIRESCOLMASK = 0x38;
+
+/* Where the second display file starts */
+static const size_t SCREEN_ALTDFILE_OFFSET = 0x2000;
+
+static const size_t SCREEN_BITMAP_LENGTH = 6144;
+static const size_t SCREEN_LENGTH = 6912;
+
+/* The normal colours, in the order black, blue, red, magenta, green,
+   cyan, yellow, white and then the same again with bright set */
+static const libspectrum_byte rgb[16][3] = {
+  { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0xc0 },
+  { 0xc0, 0x00, 0x00 }, { 0xc0, 0x00, 0xc0 },
+  { 0x00, 0xc0, 0x00 }, { 0x00, 0xc0, 0xc0 },
+  { 0xc0, 0xc0, 0x00 }, { 0xc0, 0xc0, 0xc0 },
+  { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0xff },
+  { 0xff, 0x00, 0x00 }, { 0xff, 0x00, 0xff },
+  { 0x00, 0xff, 0x00 }, { 0x00, 0xff, 0xff },
+  { 0xff, 0xff, 0x00 }, { 0xff, 0xff, 0xff },
+};
+
+/* For each byte of bitmap, eight bytes which are 0xff for each set pixel
+   and 0x00 otherwise, in the order the pixels appear on screen. This
+   lets eight indexed pixels be chosen between ink and paper at once */
+static libspectrum_qword pixel_masks[256];
+
+void
+libspectrum_init_screen( void )
+{
+  libspectrum_byte mask[8];
+  int i, j;
+
+  for( i = 0; i < 256; i++ ) {
+    for( j = 0; j < 8; j++ ) mask[j] = ( i & ( 0x80 >> j ) ) ? 0xff : 0x00;
+    memcpy( &pixel_masks[i], mask, sizeof( mask ) );
+  }
+}
+
+int
+libspectrum_screen_width( libspectrum_byte scld_dec )
+{
+  return scld_dec & SCLD_HIRES ? 512 : 256;
+}
+
+static libspectrum_dword
+rgba( libspectrum_byte red, libspectrum_byte green, libspectrum_byte blue )
+{
+  libspectrum_byte bytes[4];
+  libspectrum_dword colour;
+
+  bytes[0] = red; bytes[1] = green; bytes[2] = blue; bytes[3] = 0xff;
+  memcpy( &colour, bytes, sizeof( colour ) );
+
+  return colour;
+}
+
+/* Expand 3 bits of colour to 8 */
+static libspectrum_byte
+expand_colour( libspectrum_byte value )
+{
+  return ( value << 5 ) | ( value << 2 ) | ( value >> 1 );
+}
+
+/* Fill in the RGBA value for each colour index */
+static void
+get_colours( libspectrum_dword *colours, const libspectrum_byte *ulaplus )
+{
+  libspectrum_byte blue;
+  size_t i;
+
+  if( !ulaplus ) {
+    for( i = 0; i < 16; i++ )
+      colours[i] = rgba( rgb[i][0], rgb[i][1], rgb[i][2] );
+    return;
+  }
+
+  /* ULAplus entries are GGGRRRBB; the missing blue bit is the OR of the
+     other two */
+  for( i = 0; i < 64; i++ ) {
+    blue = ( ( ulaplus[i] & 0x03 ) << 1 ) | ( ulaplus[i] & 0x03 ? 1 : 0 );
+    colours[i] = rgba( expand_colour( ( ulaplus[i] >> 2 ) & 0x07 ),
+                       expand_colour( ulaplus[i] >> 5 ),
+                       expand_colour( blue ) );
+  }
+}
+
+/* The colour indices for the ink and paper of an attribute byte */
+static void
+get_ink_paper( libspectrum_byte attr, int flash_phase,
+               const libspectrum_byte *ulaplus, libspectrum_byte *ink,
+               libspectrum_byte *paper )
+{
+  libspectrum_byte swap;
+
+  if( ulaplus ) {
+    /* Flash and bright select one of four sets of sixteen entries */
+    *ink = ( ( attr & 0xc0 ) >> 2 ) | ( attr & 0x07 );
+    *paper = ( ( attr & 0xc0 ) >> 2 ) | 0x08 | ( ( attr >> 3 ) & 0x07 );
+    return;
+  }
+
+  *ink = ( ( attr & 0x40 ) >> 3 ) | ( attr & 0x07 );
+  *paper = ( ( attr & 0x40 ) >> 3 ) | ( ( attr >> 3 ) & 0x07 );
+
+  if( ( attr & 0x80 ) && flash_phase ) {
+    swap = *ink; *ink = *paper; *paper = swap;
+  }
+}
+
+/* Write eight pixels from one byte of bitmap */
+static void
+write_indexed( libspectrum_byte *pixels, libspectrum_byte bits,
+               libspectrum_byte ink, libspectrum_byte paper )
+{
+  libspectrum_qword lanes = 0x0101010101010101ULL, value;
+
+  value = ( ( ink ^ paper ) * lanes ) & pixel_masks[ bits ];
+  value ^= paper * lanes;
+  memcpy( pixels, &value, sizeof( value ) );
+}
+
+static void
+write_rgba( libspectrum_dword *pixels, libspectrum_byte bits,
+            libspectrum_dword ink, libspectrum_dword paper )
+{
+  libspectrum_dword difference = ink ^ paper;
+  int i;
+
+  /* `mask' is all ones for ink pixels and all zeroes for paper */
+  for( i = 0; i < 8; i++ ) {
+    libspectrum_dword mask = -(libspectrum_dword)( ( bits >> ( 7 - i ) ) & 1 );
+    pixels[i] = paper ^ ( difference & mask );
+  }
+}
+
+libspectrum_error
+libspectrum_screen_decode( void *pixels, size_t pitch,
+                           libspectrum_screen_format format,
+                           const libspectrum_byte *screen, size_t length,
+                           libspectrum_byte scld_dec, int flash_phase,
+                           const libspectrum_byte *ulaplus_palette )
+{
+  libspectrum_dword colours[64];
+  const libspectrum_byte *bitmap, *attrs;
+  libspectrum_byte *row, attr, hires_attr = 0, ink, paper;
+  size_t needed, offset, x, y, columns = 32, step = 1;
+  int hires = scld_dec & SCLD_HIRES;
+
+  if( hires || ( scld_dec & SCLD_EXTCOLOUR ) ) {
+    needed = SCREEN_ALTDFILE_OFFSET + SCREEN_BITMAP_LENGTH;
+  } else if( scld_dec & SCLD_ALTDFILE ) {
+    needed = SCREEN_ALTDFILE_OFFSET + SCREEN_LENGTH;
+  } else {
+    needed = SCREEN_LENGTH;
+  }
+
+  if( length < needed ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_INVALID,
+      "libspectrum_screen_decode: need %lu bytes of screen, got %lu",
+      (unsigned long)needed, (unsigned long)length
+    );
+    return LIBSPECTRUM_ERROR_INVALID;
+  }
+
+  if( format == LIBSPECTRUM_SCREEN_FORMAT_RGBA )
+    get_colours( colours, ulaplus_palette );
+
+  bitmap = screen;
+  if( ( scld_dec & SCLD_ALTDFILE ) && !hires )
+    bitmap += SCREEN_ALTDFILE_OFFSET;
+
+  /* Hi-res mode interleaves the columns of the two display files in one
+     colour, with paper the inverse of ink */
+  if( hires ) {
+    ink = ( scld_dec & SCLD_HIRESCOLMASK ) >> 3;
+    hires_attr = 0x40 | ( ( ink ^ 0x07 ) << 3 ) | ink;
+    columns = 64; step = 2;
+  }
+
+  for( y = 0, row = pixels; y < 192; y++, row += pitch ) {
+
+    /* Each third of the screen has its character rows interleaved */
+    offset = ( ( y & 0xc0 ) << 5 ) | ( ( y & 0x07 ) << 8 ) |
+             ( ( y & 0x38 ) << 2 );
+
+    attrs = bitmap + SCREEN_BITMAP_LENGTH + ( y >> 3 ) * 32;
+
+    for( x = 0; x < columns; x++ ) {
+
+      const libspectrum_byte *bits = bitmap + offset + x / step;
+
+      if( hires ) {
+        if( x & 1 ) bits += SCREEN_ALTDFILE_OFFSET;
+        attr = hires_attr;
+      } else if( scld_dec & SCLD_EXTCOLOUR ) {
+        attr = bits[ SCREEN_ALTDFILE_OFFSET ];
+      } else {
+        attr = attrs[x];
+      }
+
+      get_ink_paper( attr, flash_phase, ulaplus_palette, &ink, &paper );
+
+      if( format == LIBSPECTRUM_SCREEN_FORMAT_RGBA ) {
+        write_rgba( (libspectrum_dword*)row + 8 * x, *bits, colours[ ink ],
+                    colours[ paper ] );
+      } else {
+        write_indexed( row + 8 * x, *bits, ink, paper );
+      }
+    }
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+libspectrum_error
+libspectrum_snap_screen_decode( void *pixels, size_t pitch,
+                                libspectrum_screen_format format,
+                                libspectrum_snap *snap, int flash_phase )
+{
+  libspectrum_byte *page, *palette = NULL, scld_dec = 0;
+  int capabilities =
+    libspectrum_machine_capabilities( libspectrum_snap_machine( snap ) );
+
+  page = libspectrum_snap_pages( snap, libspectrum_snap_screen_page( snap ) );
+  if( !page ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_INVALID,
+      "libspectrum_snap_screen_decode: no screen page"
+    );
+    return LIBSPECTRUM_ERROR_INVALID;
+  }
+
+  if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_TIMEX_VIDEO )
+    scld_dec = libspectrum_snap_out_scld_dec( snap );
+
+  if( libspectrum_snap_ulaplus_active( snap ) &&
+      libspectrum_snap_ulaplus_palette_enabled( snap ) )
+    palette = libspectrum_snap_ulaplus_palette( snap, 0 );
+
+  return libspectrum_screen_decode( pixels, pitch, format, page, 0x4000,
+                                    scld_dec, flash_phase, palette );
+}
@@ -76,6 +76,64 @@ internal_sna_read( libspectrum_snap *snap,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* The screen is in one of the pages stored directly in the file, so
+   there's no need to read anything else */
+libspectrum_error
+internal_sna_read_screen( libspectrum_snap_screen *screen,
+			  const libspectrum_byte *buffer,
+			  size_t buffer_length )
+{
+  const libspectrum_byte *page;
+  libspectrum_byte memoryport;
+  int i;
+
+  switch( buffer_length ) {
+  case 49179:
+  case 131103:
+  case 147487:
+    break;
+  default:
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+			     "internal_sna_read_screen: unknown length" );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  screen->border = buffer[26] & 0x07;
+
+  /* Page 5 is always first, so this is it unless page 7 is being shown */
+  page = buffer + LIBSPECTRUM_SNA_HEADER_LENGTH;
+
+  if( buffer_length != 49179 ) {
+
+    memoryport = page[ 0xc000 + 2 ];
+
+    if( memoryport & 0x08 ) {
+
+      if( ( memoryport & 0x07 ) == 7 ) {
+	page += 0x8000;
+      } else {
+	/* Page 7 comes after the other pages not already stored */
+	page += 0xc000 + LIBSPECTRUM_SNA_128_HEADER_LENGTH;
+	for( i = 0; i < 7; i++ )
+	  if( i != 2 && i != 5 && i != ( memoryport & 0x07 ) )
+	    page += 0x4000;
+      }
+
+      if( page + 0x4000 > buffer + buffer_length ) {
+	libspectrum_print_error(
+	  LIBSPECTRUM_ERROR_CORRUPT,
+	  "internal_sna_read_screen: not enough data in buffer"
+	);
+	return LIBSPECTRUM_ERROR_CORRUPT;
+      }
+    }
+  }
+
+  memcpy( screen->data, page, sizeof( screen->data ) );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
 static int
 identify_machine( size_t buffer_length, libspectrum_snap *snap )
 {
@@ -181,7 +239,7 @@ libspectrum_sna_read_data( const libspectrum_byte *buffer,
   case LIBSPECTRUM_MACHINE_PENT:
     
     for( i=0; i<8; i++ ) {
-      libspectrum_byte *ram = libspectrum_new( libspectrum_byte, 0x4000 );
+      libspectrum_byte *ram = libspectrum_snap_alloc_page( snap, 0x4000 );
       libspectrum_snap_set_pages( snap, i, ram );
     }
 
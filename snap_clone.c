@@ -0,0 +1,137 @@
+/* snap_clone.c: copying snapshots
+   Copyright (c) 2021 Philip Kendall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "internals.h"
+
+/* The flag which may be given to libspectrum_snap_clone() */
+const int LIBSPECTRUM_FLAG_SNAPSHOT_SHARE_PAGES = 1 << 0;
+
+/* The pages a snapshot shares with the snapshot it was cloned from. A
+   page is shared for as long as its address is still in one of the
+   snapshot's fields, so pages given to the setters are owned as usual */
+struct libspectrum_snap_shared {
+  libspectrum_byte **pages;
+  size_t count;
+};
+
+int
+libspectrum_snap_page_is_shared( libspectrum_snap *snap,
+                                 const libspectrum_byte *page )
+{
+  libspectrum_snap_shared *shared = *libspectrum_snap_shared_pages( snap );
+  size_t i;
+
+  if( !shared || !page ) return 0;
+
+  for( i = 0; i < shared->count; i++ )
+    if( shared->pages[i] == page ) return 1;
+
+  return 0;
+}
+
+/* Forget about any shared pages, leaving them to the snapshot they were
+   shared with */
+void
+libspectrum_snap_drop_shared_pages( libspectrum_snap *snap )
+{
+  libspectrum_snap_shared **shared = libspectrum_snap_shared_pages( snap );
+  libspectrum_byte **data;
+  size_t field, i;
+
+  if( !*shared ) return;
+
+  for( field = 0; field < libspectrum_snap_data_field_count; field++ )
+    for( i = 0; i < libspectrum_snap_data_fields[ field ].count; i++ ) {
+      data = libspectrum_snap_data( snap, field, i );
+      if( libspectrum_snap_page_is_shared( snap, *data ) ) *data = NULL;
+    }
+
+  libspectrum_free( (*shared)->pages );
+  libspectrum_free( *shared );
+  *shared = NULL;
+}
+
+/* Make sure the page in element `idx' of data field `field' can be
+   changed, copying it if it is shared */
+libspectrum_byte*
+libspectrum_snap_unshare_page( libspectrum_snap *snap, size_t field,
+                               size_t idx, size_t length )
+{
+  libspectrum_byte **data = libspectrum_snap_data( snap, field, idx ), *page;
+
+  if( libspectrum_snap_page_is_shared( snap, *data ) ) {
+    page = libspectrum_snap_alloc_page( snap, length );
+    memcpy( page, *data, length );
+    *data = page;
+  }
+
+  return *data;
+}
+
+/* Called by libspectrum_snap_clone() once everything else has been copied
+   to give `clone' its own pages, or a list of the pages it shares */
+void
+libspectrum_snap_clone_data( libspectrum_snap *clone, int flags )
+{
+  int share = flags & LIBSPECTRUM_FLAG_SNAPSHOT_SHARE_PAGES;
+  libspectrum_snap_shared *shared = NULL;
+  libspectrum_byte **data, *page;
+  size_t field, i, *length_field, length, allocated = 0;
+
+  for( field = 0; field < libspectrum_snap_data_field_count; field++ ) {
+    for( i = 0; i < libspectrum_snap_data_fields[ field ].count; i++ ) {
+
+      data = libspectrum_snap_data( clone, field, i );
+      if( !*data ) continue;
+
+      if( share ) {
+        if( !shared ) {
+          shared = libspectrum_new( libspectrum_snap_shared, 1 );
+          shared->pages = NULL;
+          shared->count = 0;
+        }
+        if( shared->count == allocated ) {
+          allocated = allocated ? 2 * allocated : 16;
+          shared->pages = libspectrum_renew( libspectrum_byte*, shared->pages,
+                                             allocated );
+        }
+        shared->pages[ shared->count++ ] = *data;
+        continue;
+      }
+
+      length_field = libspectrum_snap_data_length( clone, field, i );
+      length = length_field ? *length_field :
+                              libspectrum_snap_data_fields[ field ].length;
+
+      page = libspectrum_snap_alloc_page( clone, length );
+      memcpy( page, *data, length );
+      *data = page;
+    }
+  }
+
+  *libspectrum_snap_shared_pages( clone ) = shared;
+}
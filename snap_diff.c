@@ -0,0 +1,476 @@
+/* snap_diff.c: Routines for recording the differences between snapshots
+   Copyright (c) 2021 Philip Kendall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "internals.h"
+
+/* A delta records how to turn one snapshot into another, so a rewind
+   buffer need keep only one full snapshot. Like the native format, it can
+   be used only by a version of libspectrum with the same set of snapshot
+   fields. All values are little endian.
+
+   Offset  Length  Contents
+   0       4       "LSD\x1a"
+   4       2       Format version (1)
+   6       2       Number of data fields in libspectrum_snap
+   8       4       Length of the fields
+   12      4       Number of blocks of data which have changed (m)
+   16      ...     A patch for every field not pointing to data, as
+                   written by libspectrum_snap_write_fields()
+   ...     ...     m blocks
+
+   Each block is
+
+   Offset  Length  Contents
+   0       2       Data field, as in libspectrum_snap_data_fields[]
+   2       2       Index within the field
+   4       4       Length of the old data, or 0 if there was none
+   8       4       Length of the new data, or 0 if there is none
+   12      ...     If the lengths are the same, a patch for the data.
+                   Otherwise, if there is new data, the number of bytes
+                   stored (n) followed by the data, run length encoded
+                   unless n is the length of the data
+
+   A patch for data of length l splits it into c = l / 256 (rounded up)
+   chunks:
+
+   Offset  Length  Contents
+   0       c/8     A bitmap of the chunks which have changed, with chunk
+                   0 in bit 0 of the first byte (rounded up)
+   c/8     4       Number of bytes stored (n)
+   c/8+4   n       The changed chunks XORed with the old data, run
+                   length encoded unless n is the length of the chunks */
+
+static const char * const signature = "LSD\x1a";
+static const size_t signature_length = 4;
+
+static const libspectrum_word DELTA_VERSION = 1;
+
+#define DELTA_HEADER_LENGTH 16
+#define DELTA_BLOCK_HEADER_LENGTH 12
+#define DELTA_CHUNK_LENGTH 0x100
+
+/* Working space reused for each block */
+typedef struct delta_scratch {
+  libspectrum_byte *data;
+  size_t allocated;
+} delta_scratch;
+
+static libspectrum_byte*
+get_scratch( delta_scratch *scratch, size_t length )
+{
+  if( length > scratch->allocated ) {
+    scratch->data = libspectrum_renew( libspectrum_byte, scratch->data,
+                                       length );
+    scratch->allocated = length;
+  }
+
+  return scratch->data;
+}
+
+/* The data and its length for one data field of `snap', with a length of
+   0 if the field is not in use */
+static size_t
+block_length( libspectrum_snap *snap, size_t field, size_t idx,
+              libspectrum_byte ***data )
+{
+  size_t *length;
+
+  *data = libspectrum_snap_data( snap, field, idx );
+  if( !**data ) return 0;
+
+  length = libspectrum_snap_data_length( snap, field, idx );
+  return length ? *length : libspectrum_snap_data_fields[ field ].length;
+}
+
+static size_t
+chunk_count( size_t length )
+{
+  return ( length + DELTA_CHUNK_LENGTH - 1 ) / DELTA_CHUNK_LENGTH;
+}
+
+static void
+write_stored( libspectrum_buffer *buffer, const libspectrum_byte *data,
+              size_t length, delta_scratch *scratch )
+{
+  libspectrum_byte *packed = get_scratch( scratch, length );
+  size_t stored = libspectrum_lss_compress( packed, data, length );
+
+  if( !stored ) { stored = length; packed = NULL; }
+
+  libspectrum_buffer_write_dword( buffer, stored );
+  libspectrum_buffer_write( buffer, packed ? packed : data, stored );
+}
+
+static void
+write_patch( libspectrum_buffer *buffer, const libspectrum_byte *from,
+             const libspectrum_byte *to, size_t length,
+             delta_scratch *scratch )
+{
+  size_t chunks = chunk_count( length ), bitmap_length = ( chunks + 7 ) / 8;
+  size_t offset, chunk, chunk_length, changed = 0, stored, i;
+  libspectrum_byte *bitmap, *changes, *packed;
+
+  /* The changes go after the bitmap, and the compressed changes after
+     that */
+  bitmap = get_scratch( scratch, bitmap_length + 2 * length );
+  changes = bitmap + bitmap_length;
+
+  memset( bitmap, 0, bitmap_length );
+
+  for( offset = 0, chunk = 0; offset < length;
+       offset += DELTA_CHUNK_LENGTH, chunk++ ) {
+
+    chunk_length = length - offset < DELTA_CHUNK_LENGTH ?
+                   length - offset : DELTA_CHUNK_LENGTH;
+
+    if( !memcmp( from + offset, to + offset, chunk_length ) ) continue;
+
+    bitmap[ chunk / 8 ] |= 1 << ( chunk % 8 );
+
+    for( i = 0; i < chunk_length; i++ )
+      changes[ changed + i ] = from[ offset + i ] ^ to[ offset + i ];
+    changed += chunk_length;
+  }
+
+  packed = changes + length;
+  stored = changed ? libspectrum_lss_compress( packed, changes, changed ) : 0;
+  if( !stored ) { stored = changed; packed = changes; }
+
+  libspectrum_buffer_write( buffer, bitmap, bitmap_length );
+  libspectrum_buffer_write_dword( buffer, stored );
+  libspectrum_buffer_write( buffer, packed, stored );
+}
+
+/* Write the changes to one block of data, if there are any */
+static int
+write_block( libspectrum_buffer *buffer, libspectrum_snap *from,
+             libspectrum_snap *to, size_t field, size_t idx,
+             delta_scratch *scratch )
+{
+  libspectrum_byte **from_data, **to_data;
+  size_t from_length = block_length( from, field, idx, &from_data );
+  size_t to_length = block_length( to, field, idx, &to_data );
+
+  /* Nothing is written for unchanged blocks */
+  if( from_length == to_length &&
+      ( !to_length || !memcmp( *from_data, *to_data, to_length ) ) )
+    return 0;
+
+  libspectrum_buffer_write_word( buffer, field );
+  libspectrum_buffer_write_word( buffer, idx );
+  libspectrum_buffer_write_dword( buffer, from_length );
+  libspectrum_buffer_write_dword( buffer, to_length );
+
+  if( from_length == to_length ) {
+    write_patch( buffer, *from_data, *to_data, to_length, scratch );
+  } else if( to_length ) {
+    write_stored( buffer, *to_data, to_length, scratch );
+  }
+
+  return 1;
+}
+
+libspectrum_error
+libspectrum_snap_diff( libspectrum_byte **buffer, size_t *length,
+                       libspectrum_snap *from, libspectrum_snap *to )
+{
+  libspectrum_buffer *delta = libspectrum_buffer_alloc(),
+    *fields = libspectrum_buffer_alloc();
+  libspectrum_byte *ptr = *buffer, *data;
+  delta_scratch scratch = { NULL, 0 };
+  size_t count = 0, field, i;
+
+  libspectrum_buffer_write( delta, signature, signature_length );
+  libspectrum_buffer_write_word( delta, DELTA_VERSION );
+  libspectrum_buffer_write_word( delta, libspectrum_snap_data_field_count );
+  libspectrum_buffer_write_dword( delta, libspectrum_snap_fields_length );
+  libspectrum_buffer_write_dword( delta, 0 );	/* Filled in below */
+
+  libspectrum_snap_write_fields( fields, from );
+  libspectrum_snap_write_fields( fields, to );
+  data = libspectrum_buffer_get_data( fields );
+  write_patch( delta, data, data + libspectrum_snap_fields_length,
+               libspectrum_snap_fields_length, &scratch );
+
+  for( field = 0; field < libspectrum_snap_data_field_count; field++ )
+    for( i = 0; i < libspectrum_snap_data_fields[ field ].count; i++ )
+      count += write_block( delta, from, to, field, i, &scratch );
+
+  data = libspectrum_buffer_get_data( delta ) + 12;
+  libspectrum_write_dword( &data, count );
+
+  libspectrum_buffer_append( buffer, length, &ptr, delta );
+
+  libspectrum_free( scratch.data );
+  libspectrum_buffer_free( fields );
+  libspectrum_buffer_free( delta );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* A patch read from a delta */
+typedef struct delta_patch {
+  const libspectrum_byte *bitmap;
+  const libspectrum_byte *stored;
+  size_t stored_length;
+  size_t changed_length;	/* The total length of the changed chunks */
+} delta_patch;
+
+static libspectrum_error
+corrupt( void )
+{
+  libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                           "libspectrum_snap_apply: corrupt delta" );
+  return LIBSPECTRUM_ERROR_CORRUPT;
+}
+
+static libspectrum_error
+read_stored_length( size_t *stored_length, const libspectrum_byte **ptr,
+                    const libspectrum_byte *end )
+{
+  if( end - *ptr < 4 ) return corrupt();
+
+  *stored_length = libspectrum_read_dword( ptr );
+  if( (size_t)( end - *ptr ) < *stored_length ) return corrupt();
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static libspectrum_error
+read_patch( delta_patch *patch, size_t length, const libspectrum_byte **ptr,
+            const libspectrum_byte *end )
+{
+  size_t chunks = chunk_count( length ), bitmap_length = ( chunks + 7 ) / 8;
+  size_t chunk;
+  libspectrum_error error;
+
+  if( (size_t)( end - *ptr ) < bitmap_length ) return corrupt();
+
+  patch->bitmap = *ptr;
+  *ptr += bitmap_length;
+
+  patch->changed_length = 0;
+  for( chunk = 0; chunk < chunks; chunk++ ) {
+    if( !( patch->bitmap[ chunk / 8 ] & ( 1 << ( chunk % 8 ) ) ) ) continue;
+    patch->changed_length += chunk == chunks - 1 ?
+      length - chunk * DELTA_CHUNK_LENGTH : DELTA_CHUNK_LENGTH;
+  }
+
+  error = read_stored_length( &patch->stored_length, ptr, end );
+  if( error ) return error;
+
+  if( patch->stored_length > patch->changed_length ||
+      ( patch->changed_length && !patch->stored_length ) )
+    return corrupt();
+
+  patch->stored = *ptr;
+  *ptr += patch->stored_length;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Apply `patch' to `data'. `data' is not changed if the patch is corrupt */
+static libspectrum_error
+apply_patch( libspectrum_byte *data, size_t length, const delta_patch *patch,
+             delta_scratch *scratch )
+{
+  const libspectrum_byte *changes = patch->stored;
+  size_t offset, chunk, chunk_length, i;
+  libspectrum_error error;
+
+  if( patch->stored_length != patch->changed_length ) {
+    libspectrum_byte *unpacked = get_scratch( scratch, patch->changed_length );
+    error = libspectrum_lss_uncompress( unpacked, patch->changed_length,
+                                        patch->stored, patch->stored_length );
+    if( error ) return error;
+    changes = unpacked;
+  }
+
+  for( offset = 0, chunk = 0; offset < length;
+       offset += DELTA_CHUNK_LENGTH, chunk++ ) {
+
+    if( !( patch->bitmap[ chunk / 8 ] & ( 1 << ( chunk % 8 ) ) ) ) continue;
+
+    chunk_length = length - offset < DELTA_CHUNK_LENGTH ?
+                   length - offset : DELTA_CHUNK_LENGTH;
+
+    for( i = 0; i < chunk_length; i++ ) data[ offset + i ] ^= changes[ i ];
+    changes += chunk_length;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static libspectrum_error
+apply_block( libspectrum_snap *snap, const libspectrum_byte **ptr,
+             const libspectrum_byte *end, delta_scratch *scratch )
+{
+  size_t field, idx, from_length, to_length, stored_length, *length_field;
+  libspectrum_byte **data, *page;
+  delta_patch patch;
+  libspectrum_error error;
+
+  if( end - *ptr < DELTA_BLOCK_HEADER_LENGTH ) return corrupt();
+
+  field = libspectrum_read_word( ptr );
+  idx = libspectrum_read_word( ptr );
+  from_length = libspectrum_read_dword( ptr );
+  to_length = libspectrum_read_dword( ptr );
+
+  if( field >= libspectrum_snap_data_field_count ||
+      idx >= libspectrum_snap_data_fields[ field ].count ||
+      to_length > LIBSPECTRUM_SNAP_DATA_MAX_LENGTH ||
+      ( !libspectrum_snap_data_length( snap, field, idx ) && to_length &&
+        to_length != libspectrum_snap_data_fields[ field ].length ) )
+    return corrupt();
+
+  if( block_length( snap, field, idx, &data ) != from_length ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_INVALID,
+      "libspectrum_snap_apply: delta does not match snapshot %s",
+      libspectrum_snap_data_fields[ field ].name
+    );
+    return LIBSPECTRUM_ERROR_INVALID;
+  }
+
+  if( from_length == to_length ) {
+    error = read_patch( &patch, to_length, ptr, end );
+    if( error ) return error;
+    libspectrum_snap_invalidate_data_hash( snap, field, idx );
+    return apply_patch(
+      libspectrum_snap_unshare_page( snap, field, idx, to_length ), to_length,
+      &patch, scratch
+    );
+  }
+
+  page = NULL;
+
+  if( to_length ) {
+    error = read_stored_length( &stored_length, ptr, end );
+    if( error ) return error;
+
+    page = libspectrum_snap_alloc_page( snap, to_length );
+
+    if( stored_length == to_length ) {
+      memcpy( page, *ptr, to_length );
+    } else {
+      error = libspectrum_lss_uncompress( page, to_length, *ptr,
+                                          stored_length );
+      if( error ) {
+        libspectrum_snap_release_page( snap, page, to_length, 1 );
+        return error;
+      }
+    }
+
+    *ptr += stored_length;
+  }
+
+  libspectrum_snap_release_page( snap, *data, from_length, 1 );
+  *data = page;
+  libspectrum_snap_invalidate_data_hash( snap, field, idx );
+
+  /* Keep the length consistent with the data even if a later block
+     turns out to be corrupt */
+  length_field = libspectrum_snap_data_length( snap, field, idx );
+  if( length_field && to_length ) *length_field = to_length;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+libspectrum_error
+libspectrum_snap_apply( libspectrum_snap *snap,
+                        const libspectrum_byte *buffer, size_t length )
+{
+  const libspectrum_byte *ptr = buffer, *end = buffer + length;
+  libspectrum_word version, field_count;
+  size_t fields_length, count, i;
+  libspectrum_buffer *fields;
+  delta_scratch scratch = { NULL, 0 };
+  delta_patch fields_patch;
+  libspectrum_error error;
+
+  if( length < DELTA_HEADER_LENGTH ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "libspectrum_snap_apply: not enough data in buffer"
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  if( memcmp( ptr, signature, signature_length ) ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_SIGNATURE,
+                             "libspectrum_snap_apply: wrong signature" );
+    return LIBSPECTRUM_ERROR_SIGNATURE;
+  }
+  ptr += signature_length;
+
+  version = libspectrum_read_word( &ptr );
+  field_count = libspectrum_read_word( &ptr );
+  fields_length = libspectrum_read_dword( &ptr );
+  count = libspectrum_read_dword( &ptr );
+
+  if( version != DELTA_VERSION ||
+      field_count != libspectrum_snap_data_field_count ||
+      fields_length != libspectrum_snap_fields_length ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_UNKNOWN,
+      "libspectrum_snap_apply: written by a different version of libspectrum"
+    );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+  }
+
+  error = read_patch( &fields_patch, fields_length, &ptr, end );
+  if( error ) return error;
+
+  /* The patch is against the fields of the old snapshot, so they must be
+     taken before any block changes a length */
+  fields = libspectrum_buffer_alloc();
+  libspectrum_snap_write_fields( fields, snap );
+
+  for( i = 0; i < count; i++ ) {
+    error = apply_block( snap, &ptr, end, &scratch );
+    if( error ) {
+      libspectrum_buffer_free( fields );
+      libspectrum_free( scratch.data );
+      return error;
+    }
+  }
+
+  /* The fields are set last, as the lengths of the blocks are checked
+     against those in the old snapshot */
+  error = apply_patch( libspectrum_buffer_get_data( fields ), fields_length,
+                       &fields_patch, &scratch );
+  if( !error ) {
+    ptr = libspectrum_buffer_get_data( fields );
+    libspectrum_snap_read_fields( snap, &ptr );
+  }
+
+  libspectrum_buffer_free( fields );
+  libspectrum_free( scratch.data );
+
+  return error;
+}
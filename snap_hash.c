@@ -0,0 +1,149 @@
+/* snap_hash.c: hashing the contents of a snapshot
+   Copyright (c) 2021 Philip Kendall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#include "config.h"
+
+#include "internals.h"
+
+/* The hash of one page of data. The hash is valid only while the page is
+   still at the same address and of the same length; the setters for the
+   data clear `data' so a page changed in place is hashed again */
+typedef struct data_hash {
+  const libspectrum_byte *data;	/* NULL if there is no valid hash */
+  size_t length;
+  libspectrum_qword hash;
+} data_hash;
+
+struct libspectrum_snap_hashes {
+  data_hash **fields;		/* Allocated for each field when first
+				   needed */
+};
+
+void
+libspectrum_snap_invalidate_data_hash( libspectrum_snap *snap, size_t field,
+                                       size_t idx )
+{
+  libspectrum_snap_hashes *cache = *libspectrum_snap_hash_cache( snap );
+
+  if( cache && cache->fields[ field ] )
+    cache->fields[ field ][ idx ].data = NULL;
+}
+
+void
+libspectrum_snap_free_hash_cache( libspectrum_snap *snap )
+{
+  libspectrum_snap_hashes **cache = libspectrum_snap_hash_cache( snap );
+  size_t i;
+
+  if( !*cache ) return;
+
+  for( i = 0; i < libspectrum_snap_data_field_count; i++ )
+    libspectrum_free( (*cache)->fields[i] );
+
+  libspectrum_free( (*cache)->fields );
+  libspectrum_free( *cache );
+  *cache = NULL;
+}
+
+static libspectrum_snap_hashes*
+get_cache( libspectrum_snap *snap )
+{
+  libspectrum_snap_hashes **cache = libspectrum_snap_hash_cache( snap );
+  size_t i;
+
+  if( !*cache ) {
+    *cache = libspectrum_new( libspectrum_snap_hashes, 1 );
+    (*cache)->fields = libspectrum_new( data_hash*,
+                                        libspectrum_snap_data_field_count );
+    for( i = 0; i < libspectrum_snap_data_field_count; i++ )
+      (*cache)->fields[i] = NULL;
+  }
+
+  return *cache;
+}
+
+static libspectrum_qword
+page_hash( libspectrum_snap_hashes *cache, size_t field, size_t idx,
+           const libspectrum_byte *data, size_t length )
+{
+  data_hash *entry;
+  size_t i, count;
+
+  if( !cache->fields[ field ] ) {
+    count = libspectrum_snap_data_fields[ field ].count;
+    cache->fields[ field ] = libspectrum_new( data_hash, count );
+    for( i = 0; i < count; i++ ) cache->fields[ field ][i].data = NULL;
+  }
+
+  entry = &cache->fields[ field ][ idx ];
+
+  if( entry->data != data || entry->length != length ) {
+    entry->data = data;
+    entry->length = length;
+    entry->hash = libspectrum_hash( data, length, 0 );
+  }
+
+  return entry->hash;
+}
+
+/* The hash covers every field, in the form used by the .lss format, and
+   the position, length and hash of every page of data */
+libspectrum_qword
+libspectrum_snap_hash( libspectrum_snap *snap )
+{
+  libspectrum_snap_hashes *cache = get_cache( snap );
+  libspectrum_buffer *buffer = libspectrum_buffer_alloc();
+  const libspectrum_byte *data;
+  size_t field, i, *length_field, length;
+  libspectrum_qword hash;
+
+  libspectrum_snap_write_fields( buffer, snap );
+
+  for( field = 0; field < libspectrum_snap_data_field_count; field++ ) {
+    for( i = 0; i < libspectrum_snap_data_fields[ field ].count; i++ ) {
+
+      data = *libspectrum_snap_data( snap, field, i );
+      if( !data ) continue;
+
+      length_field = libspectrum_snap_data_length( snap, field, i );
+      length = length_field ? *length_field :
+                              libspectrum_snap_data_fields[ field ].length;
+      if( !length ) continue;
+
+      hash = page_hash( cache, field, i, data, length );
+
+      libspectrum_buffer_write_word( buffer, field );
+      libspectrum_buffer_write_word( buffer, i );
+      libspectrum_buffer_write_dword( buffer, length );
+      libspectrum_buffer_write_dword( buffer, hash & 0xffffffff );
+      libspectrum_buffer_write_dword( buffer, hash >> 32 );
+    }
+  }
+
+  hash = libspectrum_hash( libspectrum_buffer_get_data( buffer ),
+                           libspectrum_buffer_get_data_size( buffer ), 0 );
+
+  libspectrum_buffer_free( buffer );
+
+  return hash;
+}
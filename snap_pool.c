@@ -0,0 +1,145 @@
+/* snap_pool.c: reuse of snapshot structures and their pages
+   Copyright (c) 2021 Philip Kendall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#include "config.h"
+
+#include "internals.h"
+
+/* Spare pages are kept in a list threaded through the pages themselves;
+   the start of each page holds a pointer to the next page and the page's
+   length. Pages come from libspectrum_new(), so are suitably aligned */
+typedef struct spare_page_header {
+  libspectrum_byte *next;
+  size_t length;
+} spare_page_header;
+
+struct libspectrum_snap_pool {
+  libspectrum_snap **snaps;
+  size_t count, allocated;
+};
+
+/* Called by libspectrum_snap_reset() and libspectrum_snap_free() for each
+   page of a known `length'. The page is kept if `keep' is set */
+void
+libspectrum_snap_release_page( libspectrum_snap *snap, libspectrum_byte *page,
+                               size_t length, int keep )
+{
+  libspectrum_byte **spare = libspectrum_snap_spare_pages( snap );
+  spare_page_header *header = (spare_page_header*)page;
+
+  if( !page || libspectrum_snap_page_is_shared( snap, page ) ) return;
+
+  if( !keep || length < sizeof( *header ) ) {
+    libspectrum_free( page );
+    return;
+  }
+
+  header->next = *spare;
+  header->length = length;
+
+  *spare = page;
+}
+
+/* Get a page of `length' bytes for `snap', reusing one kept when it was
+   last reset if possible. The contents of the page are undefined */
+libspectrum_byte*
+libspectrum_snap_alloc_page( libspectrum_snap *snap, size_t length )
+{
+  libspectrum_byte **link = libspectrum_snap_spare_pages( snap ), *page;
+  spare_page_header *header;
+
+  for( ; *link; link = &header->next ) {
+    header = (spare_page_header*)*link;
+
+    if( header->length == length ) {
+      page = *link;
+      *link = header->next;
+      return page;
+    }
+  }
+
+  return libspectrum_new( libspectrum_byte, length );
+}
+
+void
+libspectrum_snap_free_spare_pages( libspectrum_snap *snap )
+{
+  libspectrum_byte **spare = libspectrum_snap_spare_pages( snap ), *page;
+
+  while( *spare ) {
+    page = *spare;
+    *spare = ( (spare_page_header*)page )->next;
+    libspectrum_free( page );
+  }
+}
+
+libspectrum_snap_pool*
+libspectrum_snap_pool_alloc( void )
+{
+  libspectrum_snap_pool *pool = libspectrum_new( libspectrum_snap_pool, 1 );
+
+  pool->snaps = NULL;
+  pool->count = pool->allocated = 0;
+
+  return pool;
+}
+
+void
+libspectrum_snap_pool_free( libspectrum_snap_pool *pool )
+{
+  size_t i;
+
+  if( !pool ) return;
+
+  for( i = 0; i < pool->count; i++ ) libspectrum_snap_free( pool->snaps[i] );
+
+  libspectrum_free( pool->snaps );
+  libspectrum_free( pool );
+}
+
+/* Get a snapshot in the same state as one fresh from
+   libspectrum_snap_alloc(), reusing one returned to the pool if possible */
+libspectrum_snap*
+libspectrum_snap_pool_get( libspectrum_snap_pool *pool )
+{
+  if( pool->count ) return pool->snaps[ --pool->count ];
+
+  return libspectrum_snap_alloc();
+}
+
+/* Return `snap' to the pool, keeping its pages for when it is next used */
+void
+libspectrum_snap_pool_put( libspectrum_snap_pool *pool, libspectrum_snap *snap )
+{
+  if( !snap ) return;
+
+  libspectrum_snap_reset( snap );
+
+  if( pool->count == pool->allocated ) {
+    pool->allocated = pool->allocated ? 2 * pool->allocated : 8;
+    pool->snaps = libspectrum_renew( libspectrum_snap*, pool->snaps,
+                                     pool->allocated );
+  }
+
+  pool->snaps[ pool->count++ ] = snap;
+}
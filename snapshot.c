@@ -35,45 +35,46 @@ const int LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS = 1 << 1;
 const int LIBSPECTRUM_FLAG_SNAPSHOT_MINOR_INFO_LOSS = 1 << 0;
 const int LIBSPECTRUM_FLAG_SNAPSHOT_MAJOR_INFO_LOSS = 1 << 1;
 
-/* Read in a snapshot, optionally guessing what type it is */
-libspectrum_error
-libspectrum_snap_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
-		       size_t length, libspectrum_id_t type,
-		       const char *filename )
+/* Work out what sort of snapshot `*buffer' holds, decompressing it into
+   `*new_buffer' if necessary */
+static libspectrum_error
+get_snapshot_data( libspectrum_id_t *type, const libspectrum_byte **buffer,
+		   size_t *length, libspectrum_byte **new_buffer,
+		   const char *filename, const char *caller )
 {
   libspectrum_id_t raw_type;
   libspectrum_class_t class;
-  libspectrum_byte *new_buffer;
   libspectrum_error error;
 
   /* If we don't know what sort of file this is, make a best guess */
-  if( type == LIBSPECTRUM_ID_UNKNOWN ) {
-    error = libspectrum_identify_file( &type, filename, buffer, length );
+  if( *type == LIBSPECTRUM_ID_UNKNOWN ) {
+    error = libspectrum_identify_file( type, filename, *buffer, *length );
     if( error ) return error;
 
     /* If we still can't identify it, give up */
-    if( type == LIBSPECTRUM_ID_UNKNOWN ) {
+    if( *type == LIBSPECTRUM_ID_UNKNOWN ) {
       libspectrum_print_error(
         LIBSPECTRUM_ERROR_UNKNOWN,
-	"libspectrum_snap_read: couldn't identify file"
+	"%s: couldn't identify file", caller
       );
       return LIBSPECTRUM_ERROR_UNKNOWN;
     }
   }
 
-  error = libspectrum_identify_class( &class, type );
+  error = libspectrum_identify_class( &class, *type );
   if( error ) return error;
 
   if( class != LIBSPECTRUM_CLASS_SNAPSHOT ) {
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
-			     "libspectrum_snap_read: not a snapshot file" );
+			     "%s: not a snapshot file", caller );
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
   /* Find out if this file needs decompression */
-  new_buffer = NULL;
+  *new_buffer = NULL;
 
-  error = libspectrum_identify_file_raw( &raw_type, filename, buffer, length );
+  error = libspectrum_identify_file_raw( &raw_type, filename, *buffer,
+					 *length );
   if( error ) return error;
 
   error = libspectrum_identify_class( &class, raw_type );
@@ -83,14 +84,33 @@ libspectrum_snap_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
 
     size_t new_length;
 
-    error = libspectrum_uncompress_file( &new_buffer, &new_length, NULL,
-					 raw_type, buffer, length, NULL );
+    error = libspectrum_uncompress_file( new_buffer, &new_length, NULL,
+					 raw_type, *buffer, *length, NULL );
     if( error ) return error;
-    buffer = new_buffer; length = new_length;
+    *buffer = *new_buffer; *length = new_length;
   }
 
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Read in a snapshot, optionally guessing what type it is */
+libspectrum_error
+libspectrum_snap_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
+		       size_t length, libspectrum_id_t type,
+		       const char *filename )
+{
+  libspectrum_byte *new_buffer;
+  libspectrum_error error;
+
+  error = get_snapshot_data( &type, &buffer, &length, &new_buffer, filename,
+			     "libspectrum_snap_read" );
+  if( error ) return error;
+
   switch( type ) {
 
+  case LIBSPECTRUM_ID_SNAPSHOT_LSS:
+    error = libspectrum_lss_read( snap, buffer, length ); break;
+
   case LIBSPECTRUM_ID_SNAPSHOT_PLUSD:
     error = libspectrum_plusd_read( snap, buffer, length ); break;
 
@@ -124,6 +144,84 @@ libspectrum_snap_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
   return error;
 }
 
+/* Read just the screen from a snapshot. The formats used for thumbnails
+   have their own routines which find and decompress only the screen page;
+   anything else is read in full */
+libspectrum_error
+libspectrum_snap_read_screen( libspectrum_snap_screen *screen,
+			      const libspectrum_byte *buffer, size_t length,
+			      libspectrum_id_t type, const char *filename )
+{
+  libspectrum_byte *new_buffer, *page, *palette;
+  libspectrum_snap *snap;
+  libspectrum_error error;
+
+  error = get_snapshot_data( &type, &buffer, &length, &new_buffer, filename,
+			     "libspectrum_snap_read_screen" );
+  if( error ) return error;
+
+  screen->border = 0;
+  screen->ulaplus_present = 0;
+
+  switch( type ) {
+
+  case LIBSPECTRUM_ID_SNAPSHOT_SNA:
+    error = internal_sna_read_screen( screen, buffer, length ); break;
+
+  case LIBSPECTRUM_ID_SNAPSHOT_SP:
+    error = libspectrum_sp_read_screen( screen, buffer, length ); break;
+
+  case LIBSPECTRUM_ID_SNAPSHOT_SZX:
+    error = libspectrum_szx_read_screen( screen, buffer, length ); break;
+
+  case LIBSPECTRUM_ID_SNAPSHOT_Z80:
+    error = internal_z80_read_screen( screen, buffer, length ); break;
+
+  default:
+    snap = libspectrum_snap_alloc();
+
+    error = libspectrum_snap_read( snap, buffer, length, type, filename );
+    if( error ) { libspectrum_snap_free( snap ); break; }
+
+    page = libspectrum_snap_pages( snap,
+				   libspectrum_snap_screen_page( snap ) );
+    if( page ) {
+      memcpy( screen->data, page, sizeof( screen->data ) );
+    } else {
+      memset( screen->data, 0, sizeof( screen->data ) );
+    }
+
+    screen->border = libspectrum_snap_out_ula( snap ) & 0x07;
+
+    palette = libspectrum_snap_ulaplus_palette( snap, 0 );
+    if( palette ) {
+      memcpy( screen->ulaplus_palette, palette,
+	      sizeof( screen->ulaplus_palette ) );
+      screen->ulaplus_present = 1;
+    }
+
+    libspectrum_snap_free( snap );
+    break;
+  }
+
+  libspectrum_free( new_buffer );
+  return error;
+}
+
+/* The RAM page holding the screen which is being displayed */
+int
+libspectrum_snap_screen_page( libspectrum_snap *snap )
+{
+  int capabilities =
+    libspectrum_machine_capabilities( libspectrum_snap_machine( snap ) );
+
+  if( ( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_128_MEMORY ) &&
+      ( libspectrum_snap_out_128_memoryport( snap ) & 0x08 ) )
+    return 7;
+
+  return 5;
+}
+
 libspectrum_error
 libspectrum_snap_write( libspectrum_byte **buffer, size_t *length,
 			int *out_flags, libspectrum_snap *snap,
@@ -159,6 +257,10 @@ libspectrum_snap_write_buffer( libspectrum_buffer *buffer, int *out_flags,
 
   switch( type ) {
 
+  case LIBSPECTRUM_ID_SNAPSHOT_LSS:
+    error = libspectrum_lss_write( buffer, out_flags, snap, in_flags );
+    break;
+
   case LIBSPECTRUM_ID_SNAPSHOT_SNA:
     error = libspectrum_sna_write( buffer, out_flags, snap, in_flags );
     break;
@@ -202,7 +304,7 @@ libspectrum_split_to_48k_pages( libspectrum_snap *snap,
   }
 
   for( i = 0; i < 3; i++ )
-    buffer[i] = libspectrum_new( libspectrum_byte, 0x4000 );
+    buffer[i] = libspectrum_snap_alloc_page( snap, 0x4000 );
 
   libspectrum_snap_set_pages( snap, 5, buffer[0] );
   libspectrum_snap_set_pages( snap, 2, buffer[1] );
@@ -29,6 +29,42 @@
 
 static const size_t SP_HEADER_LENGTH = 37;
 
+/* Where the memory dump starts */
+static const size_t SP_DATA_OFFSET = 38;
+
+/* Check the memory dump of `memory_length' bytes starting at address
+   `start' fits in both the 48K of RAM and the file */
+static libspectrum_error
+check_memory( libspectrum_word start, libspectrum_word memory_length,
+	      size_t length, const char *caller )
+{
+  if( start < 0x4000 ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT, "%s: memory dump starts in ROM", caller
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  /* Check for overrun of 48K memory */
+  if( start + (libspectrum_dword)memory_length > 0x10000 ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "%s: memory dump extends beyond 0xffff", caller
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  if( length < SP_DATA_OFFSET + (size_t)memory_length ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "%s: not enough data for memory dump", caller
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
 libspectrum_error
 libspectrum_sp_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
 		     size_t length )
@@ -59,14 +95,8 @@ libspectrum_sp_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
   memory_length = libspectrum_read_word( &buffer );
   start = libspectrum_read_word( &buffer );
 
-  /* Check for overrun of 48K memory */
-  if( start + (libspectrum_dword)memory_length > 0x10000 ) {
-    libspectrum_print_error(
-      LIBSPECTRUM_ERROR_CORRUPT,
-      "libspectrum_sp_read: memory dump extends beyond 0xffff"
-    );
-    return LIBSPECTRUM_ERROR_CORRUPT;
-  }
+  error = check_memory( start, memory_length, length, "libspectrum_sp_read" );
+  if( error ) return error;
 
   if( start + memory_length < 0x8000 ) {
     libspectrum_snap_set_machine( snap, LIBSPECTRUM_MACHINE_16 );
@@ -116,7 +146,7 @@ libspectrum_sp_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
      represented in the snap */
   memory = libspectrum_new0( libspectrum_byte, 0xc000 );
 
-  memcpy( &memory[ start ], buffer, memory_length );
+  memcpy( &memory[ start - 0x4000 ], buffer, memory_length );
 
   error = libspectrum_split_to_48k_pages( snap, memory );
   if( error ) { libspectrum_free( memory ); return error; }
@@ -125,3 +155,51 @@ libspectrum_sp_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
 
   return LIBSPECTRUM_ERROR_NONE;
 }
+
+/* Copy the part of the screen which is in the memory dump */
+libspectrum_error
+libspectrum_sp_read_screen( libspectrum_snap_screen *screen,
+			    const libspectrum_byte *buffer, size_t length )
+{
+  libspectrum_word start, memory_length;
+  libspectrum_dword from, to;
+  libspectrum_error error;
+
+  if( length < SP_HEADER_LENGTH ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "libspectrum_sp_read_screen: not enough bytes for .sp header"
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  if( buffer[0] != 'S' || buffer[1] != 'P' ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_SIGNATURE,
+      "libspectrum_sp_read_screen: 'SP' signature not present"
+    );
+    return LIBSPECTRUM_ERROR_SIGNATURE;
+  }
+
+  memory_length = buffer[2] + buffer[3] * 0x100;
+  start = buffer[4] + buffer[5] * 0x100;
+
+  error = check_memory( start, memory_length, length,
+			"libspectrum_sp_read_screen" );
+  if( error ) return error;
+
+  screen->border = buffer[34] & 0x07;
+
+  memset( screen->data, 0, sizeof( screen->data ) );
+
+  from = start > 0x4000 ? start : 0x4000;
+  to = start + (libspectrum_dword)memory_length;
+  if( to > 0x4000 + sizeof( screen->data ) )
+    to = 0x4000 + sizeof( screen->data );
+
+  if( from < to )
+    memcpy( &screen->data[ from - 0x4000 ],
+	    &buffer[ SP_DATA_OFFSET + from - start ], to - from );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
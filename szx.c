@@ -35,6 +35,30 @@ typedef struct szx_context {
 
 } szx_context;
 
+/* The RAM pages written so far, so a page which is the same as one already
+   written can be copied rather than compressed again */
+
+typedef struct szx_written_page {
+
+  const libspectrum_byte *data;
+  size_t length;
+  libspectrum_qword hash;
+  size_t offset;		/* Where the stored page is in the output */
+  size_t stored_length;
+  int compressed;
+
+} szx_written_page;
+
+#define SZX_WRITTEN_PAGES 256
+
+typedef struct szx_page_cache {
+
+  int compress;
+  size_t count;
+  szx_written_page pages[ SZX_WRITTEN_PAGES ];
+
+} szx_page_cache;
+
 /* The machine numbers used in the .szx format */
 
 typedef enum szx_machine_type {
@@ -273,14 +297,15 @@ write_keyb_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
 		  int *out_flags, libspectrum_snap *snap );
 static void
 write_ram_pages( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                 libspectrum_snap *snap, int compress );
+                 libspectrum_snap *snap, szx_page_cache *cache );
 static void
 write_ramp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress );
+                  libspectrum_snap *snap, int page, szx_page_cache *cache );
 static void
 write_ram_page( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
                 const char *id, const libspectrum_byte *data,
-                size_t data_length, int page, int compress, int extra_flags );
+                size_t data_length, int page, szx_page_cache *cache,
+                int extra_flags );
 static libspectrum_error
 write_rom_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
                  int *out_flags, libspectrum_snap *snap, int compress );
@@ -307,13 +332,13 @@ write_zxat_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
                   libspectrum_snap *snap );
 static void
 write_atrp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-		  libspectrum_snap *snap, int page, int compress );
+		  libspectrum_snap *snap, int page, szx_page_cache *cache );
 static void
 write_zxcf_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
 		  libspectrum_snap *snap );
 static void
 write_cfrp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress );
+                  libspectrum_snap *snap, int page, szx_page_cache *cache );
 static void
 write_side_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
 		  libspectrum_snap *snap );
@@ -351,19 +376,19 @@ static void
 write_dock_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
 		  libspectrum_snap *snap, int exrom_dock,
                   const libspectrum_byte *data, int page, int writeable,
-                  int compress );
+                  szx_page_cache *cache );
 static libspectrum_error
 write_dide_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
                   libspectrum_snap *snap, int compress );
 static void
 write_dirp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress );
+                  libspectrum_snap *snap, int page, szx_page_cache *cache );
 static libspectrum_error
 write_dmmc_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
                   libspectrum_snap *snap, int compress );
 static void
 write_dmrp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress );
+                  libspectrum_snap *snap, int page, szx_page_cache *cache );
 static void
 write_zxpr_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
 		  int *out_flags, libspectrum_snap *snap );
@@ -380,13 +405,14 @@ compress_data( libspectrum_buffer *dest, const libspectrum_byte *src_data,
                size_t src_data_length, int compress );
 
 static libspectrum_error
-read_ram_page( libspectrum_byte **data, size_t *page,
+read_ram_page( libspectrum_snap *snap, libspectrum_byte **data, size_t *page,
 	       const libspectrum_byte **buffer, size_t data_length,
 	       size_t uncompressed_length, libspectrum_word *flags )
 {
 #ifdef HAVE_ZLIB_H
 
   libspectrum_error error;
+  size_t inflated_length = uncompressed_length;
 
 #endif			/* #ifdef HAVE_ZLIB_H */
 
@@ -405,9 +431,14 @@ read_ram_page( libspectrum_byte **data, size_t *page,
 
 #ifdef HAVE_ZLIB_H
 
-    error = libspectrum_zlib_inflate( *buffer, data_length - 3, data,
-				      &uncompressed_length );
-    if( error ) return error;
+    *data = libspectrum_snap_alloc_page( snap, uncompressed_length );
+
+    error = libspectrum_zlib_inflate_into( *buffer, data_length - 3, *data,
+					   &inflated_length );
+    if( error ) { libspectrum_free( *data ); return error; }
+
+    /* Pages are always full size, even if the data stopped short */
+    memset( *data + inflated_length, 0, uncompressed_length - inflated_length );
 
     *buffer += data_length - 3;
 
@@ -431,7 +462,7 @@ read_ram_page( libspectrum_byte **data, size_t *page,
       return LIBSPECTRUM_ERROR_UNKNOWN;
     }
 
-    *data = libspectrum_new( libspectrum_byte, uncompressed_length );
+    *data = libspectrum_snap_alloc_page( snap, uncompressed_length );
     memcpy( *data, *buffer, uncompressed_length );
     *buffer += uncompressed_length;
 
@@ -451,7 +482,8 @@ read_atrp_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
   libspectrum_error error;
   libspectrum_word flags;
 
-  error = read_ram_page( &data, &page, buffer, data_length, 0x4000, &flags );
+  error = read_ram_page( snap, &data, &page, buffer, data_length, 0x4000,
+                         &flags );
   if( error ) return error;
 
   if( page >= SNAPSHOT_ZXATASP_PAGES ) {
@@ -1051,7 +1083,8 @@ read_cfrp_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
   libspectrum_error error;
   libspectrum_word flags;
 
-  error = read_ram_page( &data, &page, buffer, data_length, 0x4000, &flags );
+  error = read_ram_page( snap, &data, &page, buffer, data_length, 0x4000,
+                         &flags );
   if( error ) return error;
 
   if( page >= SNAPSHOT_ZXCF_PAGES ) {
@@ -1327,7 +1360,8 @@ read_ramp_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
   libspectrum_word flags;
 
 
-  error = read_ram_page( &data, &page, buffer, data_length, 0x4000, &flags );
+  error = read_ram_page( snap, &data, &page, buffer, data_length, 0x4000,
+                         &flags );
   if( error ) return error;
 
   if( page > 63 ) {
@@ -1888,7 +1922,8 @@ read_dock_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
   libspectrum_word flags;
   libspectrum_byte writeable;
 
-  error = read_ram_page( &data, &page, buffer, data_length, 0x2000, &flags );
+  error = read_ram_page( snap, &data, &page, buffer, data_length, 0x2000,
+                         &flags );
   if( error ) return error;
 
   if( page > 7 ) {
@@ -2052,7 +2087,8 @@ read_divxxx_ram_chunk( libspectrum_snap *snap, const libspectrum_byte **buffer,
   libspectrum_error error;
   libspectrum_word flags;
 
-  error = read_ram_page( &data, &page, buffer, data_length, 0x2000, &flags );
+  error = read_ram_page( snap, &data, &page, buffer, data_length, 0x2000,
+                         &flags );
   if( error ) return error;
 
   if( page >= page_count ) {
@@ -2575,18 +2611,15 @@ read_chunk( libspectrum_snap *snap, libspectrum_word version,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
-libspectrum_error
-libspectrum_szx_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
-		      size_t length )
+static libspectrum_error
+read_file_header( libspectrum_snap *snap, libspectrum_word *version,
+                  const libspectrum_byte **data,
+                  const libspectrum_byte *end )
 {
-  libspectrum_word version;
+  const libspectrum_byte *buffer = *data;
   libspectrum_byte machine;
   libspectrum_byte flags;
 
-  libspectrum_error error;
-  const libspectrum_byte *end = buffer + length;
-  szx_context *ctx;
-
   if( end - buffer < 8 ) {
     libspectrum_print_error(
       LIBSPECTRUM_ERROR_CORRUPT,
@@ -2604,7 +2637,7 @@ libspectrum_szx_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
   }
   buffer += signature_length;
 
-  version = (*buffer++) << 8; version |= *buffer++;
+  *version = (*buffer++) << 8; *version |= *buffer++;
 
   machine = *buffer++;
 
@@ -2701,6 +2734,23 @@ libspectrum_szx_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
     break;
   }
 
+  *data = buffer;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+libspectrum_error
+libspectrum_szx_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
+		      size_t length )
+{
+  libspectrum_word version;
+  libspectrum_error error;
+  const libspectrum_byte *end = buffer + length;
+  szx_context *ctx;
+
+  error = read_file_header( snap, &version, &buffer, end );
+  if( error ) return error;
+
   ctx = libspectrum_new( szx_context, 1 );
   ctx->swap_af = 0;
 
@@ -2716,6 +2766,136 @@ libspectrum_szx_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* Inflate just the start of a RAMP chunk for a screen */
+static libspectrum_error
+read_screen_page( libspectrum_snap_screen *screen,
+                  const libspectrum_byte *buffer, size_t data_length )
+{
+  libspectrum_word flags;
+  size_t length = sizeof( screen->data );
+
+  flags = libspectrum_read_word( &buffer );
+  buffer++;			/* Skip the page number */
+  data_length -= 3;
+
+  if( flags & ZXSTRF_COMPRESSED ) {
+
+#ifdef HAVE_ZLIB_H
+
+    libspectrum_error error;
+
+    error = libspectrum_zlib_inflate_start( buffer, data_length,
+                                            screen->data, &length );
+    if( error ) return error;
+
+    memset( screen->data + length, 0, sizeof( screen->data ) - length );
+
+#else			/* #ifdef HAVE_ZLIB_H */
+
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_UNKNOWN,
+      "%s:read_screen_page: zlib needed for decompression\n",
+      __FILE__
+    );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+
+#endif			/* #ifdef HAVE_ZLIB_H */
+
+  } else {
+
+    if( data_length < length ) {
+      libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
+                               "%s:read_screen_page: length %lu too short",
+                               __FILE__, (unsigned long)data_length + 3 );
+      return LIBSPECTRUM_ERROR_UNKNOWN;
+    }
+
+    memcpy( screen->data, buffer, length );
+
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Skip over everything but the chunks which say which page is being
+   shown, and then inflate only the start of that page */
+libspectrum_error
+libspectrum_szx_read_screen( libspectrum_snap_screen *screen,
+                             const libspectrum_byte *buffer, size_t length )
+{
+  libspectrum_snap *snap;
+  libspectrum_word version;
+  libspectrum_error error;
+  const libspectrum_byte *end = buffer + length, *chunk, *pages[8];
+  libspectrum_dword data_length, page_lengths[8];
+  libspectrum_byte *palette;
+  char id[5];
+  int page;
+
+  /* Just the machine, the paging and the palette are read into this */
+  snap = libspectrum_snap_alloc();
+
+  error = read_file_header( snap, &version, &buffer, end );
+  if( error ) { libspectrum_snap_free( snap ); return error; }
+
+  pages[5] = pages[7] = NULL;
+
+  while( buffer < end ) {
+
+    error = read_chunk_header( id, &data_length, &buffer, end );
+    if( error ) { libspectrum_snap_free( snap ); return error; }
+
+    if( end - buffer < data_length ) {
+      libspectrum_print_error(
+        LIBSPECTRUM_ERROR_CORRUPT,
+        "libspectrum_szx_read_screen: chunk length goes beyond end of file"
+      );
+      libspectrum_snap_free( snap );
+      return LIBSPECTRUM_ERROR_CORRUPT;
+    }
+
+    chunk = buffer;
+
+    if( !memcmp( id, ZXSTBID_SPECREGS, 4 ) ) {
+      error = read_spcr_chunk( snap, version, &chunk, end, data_length,
+                               NULL );
+    } else if( !memcmp( id, ZXSTBID_PALETTE, 4 ) ) {
+      error = read_pltt_chunk( snap, version, &chunk, end, data_length,
+                               NULL );
+    } else if( !memcmp( id, ZXSTBID_RAMPAGE, 4 ) && data_length >= 3 &&
+               ( buffer[2] == 5 || buffer[2] == 7 ) ) {
+      pages[ buffer[2] ] = buffer;
+      page_lengths[ buffer[2] ] = data_length;
+    }
+
+    if( error ) { libspectrum_snap_free( snap ); return error; }
+
+    buffer += data_length;
+  }
+
+  screen->border = libspectrum_snap_out_ula( snap ) & 0x07;
+
+  palette = libspectrum_snap_ulaplus_palette( snap, 0 );
+  if( palette ) {
+    memcpy( screen->ulaplus_palette, palette,
+            sizeof( screen->ulaplus_palette ) );
+    screen->ulaplus_present = 1;
+  }
+
+  page = libspectrum_snap_screen_page( snap );
+
+  libspectrum_snap_free( snap );
+
+  if( !pages[ page ] ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                             "libspectrum_szx_read_screen: page %d not found",
+                             page );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  return read_screen_page( screen, pages[ page ], page_lengths[ page ] );
+}
+
 libspectrum_error
 libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
                        libspectrum_snap *snap, libspectrum_creator *creator,
@@ -2725,6 +2905,7 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
   libspectrum_error error;
   size_t i;
   libspectrum_buffer *block_data;
+  szx_page_cache cache;
 
   *out_flags = 0;
 
@@ -2749,6 +2930,9 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
 
   compress = !( in_flags & LIBSPECTRUM_FLAG_SNAPSHOT_NO_COMPRESSION );
 
+  cache.compress = compress;
+  cache.count = 0;
+
   error = write_file_header( buffer, out_flags, snap );
   if( error ) return error;
 
@@ -2771,7 +2955,7 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
     }
   }
 
-  write_ram_pages( buffer, block_data, snap, compress );
+  write_ram_pages( buffer, block_data, snap, &cache );
 
   if( libspectrum_snap_fuller_box_active( snap ) ||
       libspectrum_snap_melodik_active( snap ) ||
@@ -2792,7 +2976,7 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
     write_zxat_chunk( buffer, block_data, snap );
 
     for( i = 0; i < libspectrum_snap_zxatasp_pages( snap ); i++ ) {
-      write_atrp_chunk( buffer, block_data, snap, i, compress );
+      write_atrp_chunk( buffer, block_data, snap, i, &cache );
     }
   }
 
@@ -2800,7 +2984,7 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
     write_zxcf_chunk( buffer, block_data, snap );
 
     for( i = 0; i < libspectrum_snap_zxcf_pages( snap ); i++ ) {
-      write_cfrp_chunk( buffer, block_data, snap, i, compress );
+      write_cfrp_chunk( buffer, block_data, snap, i, &cache );
     }
   }
 
@@ -2823,13 +3007,13 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
         write_dock_chunk( buffer, block_data, snap, 0,
                           libspectrum_snap_exrom_cart( snap, i ), i,
                           libspectrum_snap_exrom_ram( snap, i ),
-                          compress );
+                          &cache );
       }
       if( libspectrum_snap_dock_cart( snap, i ) ) {
         write_dock_chunk( buffer, block_data, snap, 1,
                           libspectrum_snap_dock_cart( snap, i ), i,
                           libspectrum_snap_dock_ram( snap, i ),
-                          compress );
+                          &cache );
       }
     }
   }
@@ -2878,7 +3062,7 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
     }
 
     for( i = 0; i < libspectrum_snap_divide_pages( snap ); i++ ) {
-      write_dirp_chunk( buffer, block_data, snap, i, compress );
+      write_dirp_chunk( buffer, block_data, snap, i, &cache );
     }
   }
 
@@ -2890,7 +3074,7 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
     }
 
     for( i = 0; i < libspectrum_snap_divmmc_pages( snap ); i++ ) {
-      write_dmrp_chunk( buffer, block_data, snap, i, compress );
+      write_dmrp_chunk( buffer, block_data, snap, i, &cache );
     }
   }
 
@@ -3319,7 +3503,7 @@ write_rom_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
 
 static void
 write_ram_pages( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                 libspectrum_snap *snap, int compress )
+                 libspectrum_snap *snap, szx_page_cache *cache )
 {
   libspectrum_machine machine;
   int i, capabilities; 
@@ -3327,32 +3511,32 @@ write_ram_pages( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
   machine = libspectrum_snap_machine( snap );
   capabilities = libspectrum_machine_capabilities( machine );
 
-  write_ramp_chunk( buffer, block_data, snap, 5, compress );
+  write_ramp_chunk( buffer, block_data, snap, 5, cache );
 
   if( machine != LIBSPECTRUM_MACHINE_16 ) {
-    write_ramp_chunk( buffer, block_data, snap, 2, compress );
-    write_ramp_chunk( buffer, block_data, snap, 0, compress );
+    write_ramp_chunk( buffer, block_data, snap, 2, cache );
+    write_ramp_chunk( buffer, block_data, snap, 0, cache );
   }
 
   if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_128_MEMORY ) {
-    write_ramp_chunk( buffer, block_data, snap, 1, compress );
-    write_ramp_chunk( buffer, block_data, snap, 3, compress );
-    write_ramp_chunk( buffer, block_data, snap, 4, compress );
-    write_ramp_chunk( buffer, block_data, snap, 6, compress );
-    write_ramp_chunk( buffer, block_data, snap, 7, compress );
+    write_ramp_chunk( buffer, block_data, snap, 1, cache );
+    write_ramp_chunk( buffer, block_data, snap, 3, cache );
+    write_ramp_chunk( buffer, block_data, snap, 4, cache );
+    write_ramp_chunk( buffer, block_data, snap, 6, cache );
+    write_ramp_chunk( buffer, block_data, snap, 7, cache );
 
     if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_SCORP_MEMORY ) {
       for( i = 8; i < 16; i++ ) {
-        write_ramp_chunk( buffer, block_data, snap, i, compress );
+        write_ramp_chunk( buffer, block_data, snap, i, cache );
       }
     } else if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_PENT512_MEMORY ) {
       for( i = 8; i < 32; i++ ) {
-        write_ramp_chunk( buffer, block_data, snap, i, compress );
+        write_ramp_chunk( buffer, block_data, snap, i, cache );
       }
 
       if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_PENT1024_MEMORY ) {
 	for( i = 32; i < 64; i++ ) {
-	  write_ramp_chunk( buffer, block_data, snap, i, compress );
+	  write_ramp_chunk( buffer, block_data, snap, i, cache );
 	}
       }
     }
@@ -3360,32 +3544,128 @@ write_ram_pages( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
   }
 
   if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_SE_MEMORY ) {
-    write_ramp_chunk( buffer, block_data, snap, 8, compress );
+    write_ramp_chunk( buffer, block_data, snap, 8, cache );
   }
 }
 
 static void
 write_ramp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress )
+                  libspectrum_snap *snap, int page, szx_page_cache *cache )
 {
   const libspectrum_byte *data = libspectrum_snap_pages( snap, page );
 
   write_ram_page( buffer, block_data, ZXSTBID_RAMPAGE, data, 0x4000, page,
-                  compress, 0x00 );
+                  cache, 0x00 );
+}
+
+#ifdef HAVE_ZLIB_H
+
+/* What compress2() makes of 16K and 8K of zeros, so zero pages need not be
+   compressed */
+static const libspectrum_byte zero_page_16k[] = {
+  0x78, 0xda, 0xed, 0xc1, 0x31, 0x01, 0x00, 0x00, 0x00, 0xc2, 0xa0, 0xf5,
+  0x4f, 0x6d, 0x0c, 0x1f, 0xa0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0xb7, 0x01, 0x40,
+  0x00, 0x00, 0x01
+};
+
+static const libspectrum_byte zero_page_8k[] = {
+  0x78, 0xda, 0xed, 0xc1, 0x01, 0x0d, 0x00, 0x00, 0x00, 0xc2, 0xa0, 0xf7,
+  0x4f, 0x6d, 0x0e, 0x37, 0xa0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x80, 0x77, 0x03, 0x20, 0x00, 0x00, 0x01
+};
+
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+/* Find the stored form of a page which is all zero or the same as one
+   already written; otherwise, return 0 and the hash of the page */
+static int
+find_written_page( libspectrum_buffer *buffer, szx_page_cache *cache,
+                   const libspectrum_byte *data, size_t data_length,
+                   libspectrum_qword *hash, const libspectrum_byte **stored,
+                   size_t *stored_length, int *compressed )
+{
+  szx_written_page *written;
+  size_t i;
+
+  if( !cache->compress || !data_length ) return 0;
+
+#ifdef HAVE_ZLIB_H
+
+  if( libspectrum_is_zero( data, data_length ) ) {
+    if( data_length == 0x4000 ) {
+      *stored = zero_page_16k; *stored_length = sizeof( zero_page_16k );
+      *compressed = 1;
+      return 1;
+    } else if( data_length == 0x2000 ) {
+      *stored = zero_page_8k; *stored_length = sizeof( zero_page_8k );
+      *compressed = 1;
+      return 1;
+    }
+  }
+
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+  *hash = libspectrum_hash( data, data_length, 0 );
+
+  for( i = 0, written = cache->pages; i < cache->count; i++, written++ ) {
+    if( written->hash == *hash && written->length == data_length &&
+        !memcmp( written->data, data, data_length ) ) {
+      *stored = libspectrum_buffer_get_data( buffer ) + written->offset;
+      *stored_length = written->stored_length;
+      *compressed = written->compressed;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Remember a page whose stored form has just been written to the end of
+   `buffer' */
+static void
+add_written_page( libspectrum_buffer *buffer, szx_page_cache *cache,
+                  const libspectrum_byte *data, size_t data_length,
+                  libspectrum_qword hash, size_t stored_length,
+                  int compressed )
+{
+  szx_written_page *written;
+
+  if( !cache->compress || cache->count == SZX_WRITTEN_PAGES ) return;
+
+  written = &cache->pages[ cache->count++ ];
+  written->data = data;
+  written->length = data_length;
+  written->hash = hash;
+  written->offset = libspectrum_buffer_get_data_size( buffer ) - stored_length;
+  written->stored_length = stored_length;
+  written->compressed = compressed;
 }
 
 static void
 write_ram_page( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
                 const char *id, const libspectrum_byte *data,
-                size_t data_length, int page, int compress, int extra_flags )
+                size_t data_length, int page, szx_page_cache *cache,
+                int extra_flags )
 {
-  libspectrum_buffer *data_buffer;
-  int use_compression;
+  libspectrum_buffer *data_buffer = NULL;
+  const libspectrum_byte *stored;
+  size_t stored_length;
+  libspectrum_qword hash = 0;
+  int use_compression, known;
 
   if( !data ) return;
 
-  data_buffer = libspectrum_buffer_alloc();
-  use_compression = compress_data( data_buffer, data, data_length, compress );
+  known = find_written_page( buffer, cache, data, data_length, &hash, &stored,
+                             &stored_length, &use_compression );
+
+  if( !known ) {
+    data_buffer = libspectrum_buffer_alloc();
+    use_compression = compress_data( data_buffer, data, data_length,
+                                     cache->compress );
+    stored = libspectrum_buffer_get_data( data_buffer );
+    stored_length = libspectrum_buffer_get_data_size( data_buffer );
+  }
 
   if( use_compression ) extra_flags |= ZXSTRF_COMPRESSED;
 
@@ -3393,11 +3673,15 @@ write_ram_page( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
 
   libspectrum_buffer_write_byte( block_data, (libspectrum_byte)page );
 
-  libspectrum_buffer_write_buffer( block_data, data_buffer );
+  libspectrum_buffer_write( block_data, stored, stored_length );
 
-  libspectrum_buffer_free( data_buffer );
+  if( data_buffer ) libspectrum_buffer_free( data_buffer );
 
   write_chunk( buffer, id, block_data );
+
+  if( !known )
+    add_written_page( buffer, cache, data, data_length, hash, stored_length,
+                      use_compression );
 }
 
 static void
@@ -3757,12 +4041,12 @@ write_zxat_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
 
 static void
 write_atrp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-		  libspectrum_snap *snap, int page, int compress )
+		  libspectrum_snap *snap, int page, szx_page_cache *cache )
 {
   const libspectrum_byte *data = libspectrum_snap_zxatasp_ram( snap, page );
 
   write_ram_page( buffer, block_data, ZXSTBID_ZXATASPRAMPAGE, data, 0x4000,
-                  page, compress, 0x00 );
+                  page, cache, 0x00 );
 }
 
 static void
@@ -3783,12 +4067,12 @@ write_zxcf_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
 
 static void
 write_cfrp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress )
+                  libspectrum_snap *snap, int page, szx_page_cache *cache )
 {
   const libspectrum_byte *data = libspectrum_snap_zxcf_ram( snap, page );
 
   write_ram_page( buffer, block_data, ZXSTBID_ZXCFRAMPAGE, data, 0x4000, page,
-                  compress, 0x00 );
+                  cache, 0x00 );
 }
 
 #ifdef HAVE_ZLIB_H
@@ -3824,7 +4108,7 @@ static void
 write_dock_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
 		  libspectrum_snap *snap, int exrom_dock,
                   const libspectrum_byte *data, int page, int writeable,
-                  int compress )
+                  szx_page_cache *cache )
 {
   libspectrum_byte extra_flags = 0;
 
@@ -3832,7 +4116,7 @@ write_dock_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
   if( exrom_dock ) extra_flags |= ZXSTDOCKF_EXROMDOCK;
 
   write_ram_page( buffer, block_data, ZXSTBID_DOCK, data, 0x2000, page,
-                  compress, extra_flags );
+                  cache, extra_flags );
 }
 
 static void
@@ -3946,27 +4230,27 @@ write_dmmc_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
 static void
 write_divxxx_ram_chunk( libspectrum_buffer *buffer,
                         libspectrum_buffer *block_data, libspectrum_snap *snap,
-                        int page, int compress,
+                        int page, szx_page_cache *cache,
                         libspectrum_byte* (*get_data)( libspectrum_snap*, int ),
                         const char *id )
 {
   const libspectrum_byte *data = get_data( snap, page );
-  write_ram_page( buffer, block_data, id, data, 0x2000, page, compress, 0x00 );
+  write_ram_page( buffer, block_data, id, data, 0x2000, page, cache, 0x00 );
 }
 
 static void
 write_dirp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress )
+                  libspectrum_snap *snap, int page, szx_page_cache *cache )
 {
-  write_divxxx_ram_chunk( buffer, block_data, snap, page, compress,
+  write_divxxx_ram_chunk( buffer, block_data, snap, page, cache,
                           libspectrum_snap_divide_ram, ZXSTBID_DIVIDERAMPAGE );
 }
 
 static void
 write_dmrp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress )
+                  libspectrum_snap *snap, int page, szx_page_cache *cache )
 {
-  write_divxxx_ram_chunk( buffer, block_data, snap, page, compress,
+  write_divxxx_ram_chunk( buffer, block_data, snap, page, cache,
                           libspectrum_snap_divmmc_ram, ZXSTBID_DIVMMCRAMPAGE );
 }
 
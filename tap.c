@@ -167,6 +167,7 @@ internal_tap_write( libspectrum_buffer *buffer, libspectrum_tape *tape,
     case LIBSPECTRUM_TAPE_BLOCK_PURE_TONE:
     case LIBSPECTRUM_TAPE_BLOCK_PULSES:
     case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
+    case LIBSPECTRUM_TAPE_BLOCK_CSW_RECORDING:
     case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
     case LIBSPECTRUM_TAPE_BLOCK_LOOP_START:     /* Could do better? */
     case LIBSPECTRUM_TAPE_BLOCK_LOOP_END:
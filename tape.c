@@ -263,6 +263,14 @@ libspectrum_tape_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
 libspectrum_error
 libspectrum_tape_write( libspectrum_byte **buffer, size_t *length,
 			libspectrum_tape *tape, libspectrum_id_t type )
+{
+  return libspectrum_tape_write_with_flags( buffer, length, tape, type, 0 );
+}
+
+libspectrum_error
+libspectrum_tape_write_with_flags( libspectrum_byte **buffer, size_t *length,
+                                   libspectrum_tape *tape,
+                                   libspectrum_id_t type, int flags )
 {
   libspectrum_byte *ptr = *buffer;
   libspectrum_buffer *new_buffer;
@@ -293,7 +301,11 @@ libspectrum_tape_write( libspectrum_byte **buffer, size_t *length,
     break;
 
   case LIBSPECTRUM_ID_TAPE_TZX:
-    error = internal_tzx_write( new_buffer, tape );
+    error = internal_tzx_write( new_buffer, tape, flags );
+    break;
+
+  case LIBSPECTRUM_ID_TAPE_PZX:
+    error = internal_pzx_write( new_buffer, tape );
     break;
 
   case LIBSPECTRUM_ID_TAPE_CSW:
@@ -335,6 +347,9 @@ const int LIBSPECTRUM_TAPE_FLAGS_LENGTH_LONG = 1 << 7; /* Long edge; used for
                                                           loader acceleration */
 const int LIBSPECTRUM_TAPE_FLAGS_TAPE       = 1 << 8; /* End of tape */
 
+/* The flag which may be given to libspectrum_tape_write_with_flags() */
+const int LIBSPECTRUM_FLAG_TAPE_RLE_AS_RAW_DATA = 1 << 0;
+
 libspectrum_error
 libspectrum_tape_get_next_edge_internal( libspectrum_dword *tstates,
                                          int *flags,
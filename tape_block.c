@@ -418,6 +418,7 @@ libspectrum_tape_block_metadata( libspectrum_tape_block *block )
   case LIBSPECTRUM_TAPE_BLOCK_PULSES:
   case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
   case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
+  case LIBSPECTRUM_TAPE_BLOCK_CSW_RECORDING:
   case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
   case LIBSPECTRUM_TAPE_BLOCK_PAUSE:
   case LIBSPECTRUM_TAPE_BLOCK_JUMP:
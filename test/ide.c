@@ -0,0 +1,1097 @@
+/* ide.c: IDE and MMC test routines
+   Copyright (c) 2021 Philip Kendall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+static const char *hdf_filename = DYNAMIC_TEST_PATH( "ide-test.hdf" );
+
+#define HDF_CYLINDERS 16
+#define HDF_HEADS 4
+#define HDF_SECTORS 16
+#define HDF_TOTAL_SECTORS ( HDF_CYLINDERS * HDF_HEADS * HDF_SECTORS )
+#define HDF_DATA_OFFSET 0x80
+
+static libspectrum_byte
+pattern( libspectrum_dword sector, size_t offset )
+{
+  return ( sector * 7 + offset ) & 0xff;
+}
+
+static void
+set_word( libspectrum_byte *identity, int index, libspectrum_word value )
+{
+  identity[ index * 2 ] = value & 0xff;
+  identity[ index * 2 + 1 ] = value >> 8;
+}
+
+/* Create a 512 byte per sector HDF image with known contents */
+static test_return_t
+create_hdf( const char *filename )
+{
+  libspectrum_byte header[ HDF_DATA_OFFSET ], sector[512];
+  libspectrum_dword i;
+  size_t j;
+  FILE *f;
+
+  memset( header, 0, sizeof( header ) );
+  memcpy( header, "RS-IDE", 6 );
+  header[ 0x06 ] = 0x1a;
+  header[ 0x07 ] = 0x11;
+  header[ 0x09 ] = HDF_DATA_OFFSET;
+
+  set_word( &header[ 0x16 ], 1, HDF_CYLINDERS );
+  set_word( &header[ 0x16 ], 3, HDF_HEADS );
+  set_word( &header[ 0x16 ], 6, HDF_SECTORS );
+  set_word( &header[ 0x16 ], 49, 0x0200 );
+
+  f = fopen( filename, "wb" );
+  if( !f ) {
+    fprintf( stderr, "%s: couldn't create `%s'\n", progname, filename );
+    return TEST_INCOMPLETE;
+  }
+
+  fwrite( header, 1, sizeof( header ), f );
+
+  for( i = 0; i < HDF_TOTAL_SECTORS; i++ ) {
+    for( j = 0; j < 512; j++ ) sector[j] = pattern( i, j );
+    fwrite( sector, 1, 512, f );
+  }
+
+  if( fclose( f ) ) {
+    fprintf( stderr, "%s: error writing `%s'\n", progname, filename );
+    return TEST_INCOMPLETE;
+  }
+
+  return TEST_PASS;
+}
+
+static libspectrum_ide_channel*
+open_channel_with_databus( libspectrum_ide_backend backend,
+                           libspectrum_ide_databus databus )
+{
+  libspectrum_ide_channel *chn;
+
+  if( create_hdf( hdf_filename ) ) return NULL;
+
+  chn = libspectrum_ide_alloc( databus );
+  libspectrum_ide_set_backend( chn, LIBSPECTRUM_IDE_MASTER, backend );
+
+  if( libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, hdf_filename ) ) {
+    fprintf( stderr, "%s: couldn't insert `%s'\n", progname, hdf_filename );
+    libspectrum_ide_free( chn );
+    return NULL;
+  }
+
+  libspectrum_ide_reset( chn );
+
+  return chn;
+}
+
+static libspectrum_ide_channel*
+open_channel( libspectrum_ide_backend backend )
+{
+  return open_channel_with_databus( backend, LIBSPECTRUM_IDE_DATA16 );
+}
+
+static void
+close_channel( libspectrum_ide_channel *chn )
+{
+  libspectrum_ide_free( chn );
+  remove( hdf_filename );
+}
+
+/* Issue a command for `count' sectors starting at LBA `sector' */
+static void
+issue_command( libspectrum_ide_channel *chn, libspectrum_byte command,
+               libspectrum_dword sector, libspectrum_byte count )
+{
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_HEAD_DRIVE, 0xe0 );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_SECTOR,
+                         sector & 0xff );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_CYLINDER_LOW,
+                         ( sector >> 8 ) & 0xff );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_CYLINDER_HIGH,
+                         ( sector >> 16 ) & 0xff );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_SECTOR_COUNT, count );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_COMMAND_STATUS,
+                         command );
+}
+
+/* Read `count' sectors starting at `sector' and check they match the
+   expected pattern, with `modified' (if non-negative) containing the
+   inverted pattern */
+static test_return_t
+check_sectors( libspectrum_ide_channel *chn, libspectrum_dword sector,
+               libspectrum_byte count, long modified )
+{
+  libspectrum_dword i;
+  size_t j;
+
+  issue_command( chn, 0x20, sector, count );
+
+  for( i = sector; i < sector + count; i++ ) {
+    for( j = 0; j < 512; j++ ) {
+      libspectrum_byte expected = pattern( i, j ), actual;
+
+      if( (long)i == modified ) expected ^= 0xff;
+
+      actual = libspectrum_ide_read( chn, LIBSPECTRUM_IDE_REGISTER_DATA );
+      if( actual != expected ) {
+        fprintf( stderr,
+                 "%s: sector %lu byte %lu is 0x%02x, not the expected 0x%02x\n",
+                 progname, (unsigned long)i, (unsigned long)j, actual,
+                 expected );
+        return TEST_FAIL;
+      }
+    }
+  }
+
+  return TEST_PASS;
+}
+
+static void
+write_inverted_sector( libspectrum_ide_channel *chn, libspectrum_dword sector )
+{
+  size_t j;
+
+  issue_command( chn, 0x30, sector, 1 );
+  for( j = 0; j < 512; j++ )
+    libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_DATA,
+                           pattern( sector, j ) ^ 0xff );
+}
+
+/* Sequential multi-sector reads should be served by a few large reads */
+test_return_t
+test_75( void )
+{
+  libspectrum_ide_channel *chn;
+  libspectrum_ide_cache_stats stats;
+  test_return_t r;
+
+  chn = open_channel( LIBSPECTRUM_IDE_BACKEND_STDIO );
+  if( !chn ) return TEST_INCOMPLETE;
+
+  r = check_sectors( chn, 0, 255, -1 );
+
+  if( r == TEST_PASS ) r = check_sectors( chn, 3, 2, -1 );
+
+  if( r == TEST_PASS ) {
+    libspectrum_ide_get_cache_stats( chn, LIBSPECTRUM_IDE_MASTER, &stats );
+    if( stats.hits + stats.misses != 257 ) {
+      fprintf( stderr, "%s: %lu sector reads recorded, not 257\n", progname,
+               (unsigned long)( stats.hits + stats.misses ) );
+      r = TEST_FAIL;
+    } else if( stats.reads >= 16 || !stats.readahead ) {
+      fprintf( stderr, "%s: %lu reads from the image, %lu read ahead\n",
+               progname, (unsigned long)stats.reads,
+               (unsigned long)stats.readahead );
+      r = TEST_FAIL;
+    }
+  }
+
+  close_channel( chn );
+
+  return r;
+}
+
+/* Written sectors should be visible before and after a commit */
+static test_return_t
+write_commit_reread( libspectrum_ide_backend backend )
+{
+  libspectrum_ide_channel *chn;
+  test_return_t r;
+
+  chn = open_channel( backend );
+  if( !chn ) return TEST_INCOMPLETE;
+
+  r = check_sectors( chn, 32, 16, -1 );
+
+  if( r == TEST_PASS ) {
+    write_inverted_sector( chn, 40 );
+    r = check_sectors( chn, 32, 16, 40 );
+  }
+
+  if( r == TEST_PASS ) {
+    if( !libspectrum_ide_dirty( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+      fprintf( stderr, "%s: drive not dirty after write\n", progname );
+      r = TEST_FAIL;
+    }
+  }
+
+  if( r == TEST_PASS ) {
+    libspectrum_ide_commit( chn, LIBSPECTRUM_IDE_MASTER );
+    r = check_sectors( chn, 32, 16, 40 );
+  }
+
+  if( r == TEST_PASS ) {
+    libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, hdf_filename );
+    libspectrum_ide_reset( chn );
+    r = check_sectors( chn, 39, 3, 40 );
+  }
+
+  close_channel( chn );
+
+  return r;
+}
+
+test_return_t
+test_76( void )
+{
+  return write_commit_reread( LIBSPECTRUM_IDE_BACKEND_STDIO );
+}
+
+test_return_t
+test_77( void )
+{
+  return write_commit_reread( LIBSPECTRUM_IDE_BACKEND_MMAP );
+}
+
+test_return_t
+test_78( void )
+{
+  return write_commit_reread( LIBSPECTRUM_IDE_BACKEND_MMAP_SHARED );
+}
+
+typedef struct progress_info {
+  libspectrum_dword calls, done, total;
+} progress_info;
+
+static void
+record_progress( libspectrum_dword done, libspectrum_dword total,
+                 void *user_data )
+{
+  progress_info *info = user_data;
+
+  info->calls++;
+  info->done = done;
+  info->total = total;
+}
+
+/* Adjacent dirty sectors should be committed together */
+test_return_t
+test_79( void )
+{
+  static const libspectrum_dword written[] = { 10, 11, 12, 13, 100, 500 };
+  const size_t count = sizeof( written ) / sizeof( written[0] );
+  libspectrum_ide_channel *chn;
+  progress_info info = { 0, 0, 0 };
+  test_return_t r = TEST_PASS;
+  size_t i;
+
+  chn = open_channel( LIBSPECTRUM_IDE_BACKEND_STDIO );
+  if( !chn ) return TEST_INCOMPLETE;
+
+  for( i = 0; i < count; i++ ) write_inverted_sector( chn, written[i] );
+
+  if( libspectrum_ide_commit_with_progress( chn, LIBSPECTRUM_IDE_MASTER,
+                                            record_progress, &info ) ) {
+    r = TEST_FAIL;
+  } else if( info.calls != 3 || info.done != count || info.total != count ) {
+    fprintf( stderr,
+             "%s: commit progress was %lu calls, %lu/%lu sectors\n",
+             progname, (unsigned long)info.calls, (unsigned long)info.done,
+             (unsigned long)info.total );
+    r = TEST_FAIL;
+  } else if( libspectrum_ide_dirty( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+    fprintf( stderr, "%s: drive still dirty after commit\n", progname );
+    r = TEST_FAIL;
+  }
+
+  if( r == TEST_PASS ) {
+    libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, hdf_filename );
+    libspectrum_ide_reset( chn );
+    r = check_sectors( chn, 9, 1, -1 );
+  }
+
+  for( i = 0; r == TEST_PASS && i < count; i++ )
+    r = check_sectors( chn, written[i], 1, written[i] );
+
+  if( r == TEST_PASS ) r = check_sectors( chn, 14, 86, -1 );
+
+  close_channel( chn );
+
+  return r;
+}
+
+/* Reads and writes made while a commit runs in the background should see
+   the newest data, and nothing should be lost once it completes */
+test_return_t
+test_80( void )
+{
+  libspectrum_ide_channel *chn;
+  test_return_t r;
+
+  chn = open_channel( LIBSPECTRUM_IDE_BACKEND_STDIO );
+  if( !chn ) return TEST_INCOMPLETE;
+
+  write_inverted_sector( chn, 40 );
+
+  if( libspectrum_ide_commit_async( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+    close_channel( chn );
+    return TEST_FAIL;
+  }
+
+  /* Whether or not the commit has finished yet, both of these should see
+     the written sector */
+  r = check_sectors( chn, 32, 16, 40 );
+  if( r == TEST_PASS ) {
+    write_inverted_sector( chn, 41 );
+    r = check_sectors( chn, 41, 1, 41 );
+  }
+
+  if( r == TEST_PASS &&
+      libspectrum_ide_commit_wait( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+    fprintf( stderr, "%s: background commit failed\n", progname );
+    r = TEST_FAIL;
+  }
+
+  if( r == TEST_PASS ) {
+    if( libspectrum_ide_commit_pending( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+      fprintf( stderr, "%s: commit pending after wait\n", progname );
+      r = TEST_FAIL;
+    } else if( !libspectrum_ide_dirty( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+      fprintf( stderr, "%s: later write lost after background commit\n",
+               progname );
+      r = TEST_FAIL;
+    }
+  }
+
+  if( r == TEST_PASS ) r = check_sectors( chn, 40, 1, 40 );
+
+  if( r == TEST_PASS ) {
+    /* Re-inserting without committing the second write loses it */
+    libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, hdf_filename );
+    libspectrum_ide_reset( chn );
+    r = check_sectors( chn, 39, 2, 40 );
+    if( r == TEST_PASS ) r = check_sectors( chn, 41, 1, -1 );
+  }
+
+  close_channel( chn );
+
+  return r;
+}
+
+static const char *journal_filename = DYNAMIC_TEST_PATH( "ide-test.jnl" );
+
+/* Writes with a journal attached should leave the image untouched until the
+   journal is merged, and be forgotten if it is discarded */
+test_return_t
+test_81( void )
+{
+  libspectrum_ide_channel *chn;
+  test_return_t r = TEST_PASS;
+
+  remove( journal_filename );
+
+  chn = open_channel( LIBSPECTRUM_IDE_BACKEND_STDIO );
+  if( !chn ) return TEST_INCOMPLETE;
+
+  if( libspectrum_ide_attach_journal( chn, LIBSPECTRUM_IDE_MASTER,
+                                      journal_filename ) ) {
+    close_channel( chn );
+    return TEST_INCOMPLETE;
+  }
+
+  write_inverted_sector( chn, 40 );
+  r = check_sectors( chn, 39, 3, 40 );
+
+  if( r == TEST_PASS &&
+      libspectrum_ide_dirty( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+    fprintf( stderr, "%s: journalled drive is dirty\n", progname );
+    r = TEST_FAIL;
+  }
+
+  /* The image should be untouched, but the journal survives re-insertion */
+  if( r == TEST_PASS ) {
+    libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, hdf_filename );
+    libspectrum_ide_reset( chn );
+    r = check_sectors( chn, 40, 1, -1 );
+  }
+
+  if( r == TEST_PASS ) {
+    libspectrum_ide_attach_journal( chn, LIBSPECTRUM_IDE_MASTER,
+                                    journal_filename );
+    r = check_sectors( chn, 40, 1, 40 );
+  }
+
+  /* Discarding goes back to the image */
+  if( r == TEST_PASS ) {
+    libspectrum_ide_discard_journal( chn, LIBSPECTRUM_IDE_MASTER );
+    r = check_sectors( chn, 40, 1, -1 );
+  }
+
+  /* Merging writes the journal into the image */
+  if( r == TEST_PASS ) {
+    write_inverted_sector( chn, 41 );
+    write_inverted_sector( chn, 41 );
+    if( libspectrum_ide_merge_journal( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+      r = TEST_FAIL;
+    } else {
+      libspectrum_ide_detach_journal( chn, LIBSPECTRUM_IDE_MASTER );
+      libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, hdf_filename );
+      libspectrum_ide_reset( chn );
+      r = check_sectors( chn, 40, 1, -1 );
+      if( r == TEST_PASS ) r = check_sectors( chn, 41, 1, 41 );
+    }
+  }
+
+  close_channel( chn );
+  remove( journal_filename );
+
+  return r;
+}
+
+static const char *sparse_filename = DYNAMIC_TEST_PATH( "ide-test.shd" );
+
+/* Converting to a sparse image and back should give the original image,
+   and the sparse image should be usable directly */
+static test_return_t
+sparse_round_trip( int compress )
+{
+  libspectrum_ide_channel *chn;
+  libspectrum_byte *original = NULL, *converted = NULL;
+  size_t original_length, converted_length;
+  test_return_t r;
+
+  chn = open_channel( LIBSPECTRUM_IDE_BACKEND_STDIO );
+  if( !chn ) return TEST_INCOMPLETE;
+  libspectrum_ide_eject( chn, LIBSPECTRUM_IDE_MASTER );
+
+  if( libspectrum_hdf_to_sparse( hdf_filename, sparse_filename, compress ) ) {
+    close_channel( chn );
+    return TEST_FAIL;
+  }
+
+  r = TEST_PASS;
+
+  if( libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER,
+                              sparse_filename ) ) {
+    r = TEST_FAIL;
+  } else {
+    libspectrum_ide_reset( chn );
+    r = check_sectors( chn, 0, 255, -1 );
+  }
+
+  if( r == TEST_PASS ) {
+    write_inverted_sector( chn, 700 );
+    libspectrum_ide_commit( chn, LIBSPECTRUM_IDE_MASTER );
+    libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, sparse_filename );
+    libspectrum_ide_reset( chn );
+    r = check_sectors( chn, 698, 4, 700 );
+  }
+
+  /* Converting back should give the original image plus the change */
+  if( r == TEST_PASS ) {
+    libspectrum_ide_eject( chn, LIBSPECTRUM_IDE_MASTER );
+    if( read_file( &original, &original_length, hdf_filename ) )
+      r = TEST_INCOMPLETE;
+  }
+
+  if( r == TEST_PASS ) {
+    size_t i;
+
+    for( i = 0; i < 512; i++ )
+      original[ HDF_DATA_OFFSET + 700 * 512 + i ] ^= 0xff;
+
+    if( libspectrum_sparse_to_hdf( sparse_filename, hdf_filename ) ||
+        read_file( &converted, &converted_length, hdf_filename ) ) {
+      r = TEST_FAIL;
+    } else if( converted_length != original_length ||
+               memcmp( converted, original, original_length ) ) {
+      fprintf( stderr, "%s: image changed by conversion to sparse and back\n",
+               progname );
+      r = TEST_FAIL;
+    }
+  }
+
+  libspectrum_free( converted );
+  libspectrum_free( original );
+  close_channel( chn );
+  remove( sparse_filename );
+
+  return r;
+}
+
+test_return_t
+test_82( void )
+{
+  return sparse_round_trip( 0 );
+}
+
+test_return_t
+test_83( void )
+{
+#ifdef LIBSPECTRUM_SUPPORTS_ZLIB_COMPRESSION
+  return sparse_round_trip( 1 );
+#else
+  /* Compressed sparse images need zlib */
+  return TEST_PASS;
+#endif
+}
+
+/* Send command `command' with argument `argument' to `card', returning the
+   R1 response */
+static libspectrum_byte
+mmc_command( libspectrum_mmc_card *card, libspectrum_byte command,
+             libspectrum_dword argument )
+{
+  libspectrum_mmc_write( card, 0x40 | command );
+  libspectrum_mmc_write( card, argument >> 24 );
+  libspectrum_mmc_write( card, ( argument >> 16 ) & 0xff );
+  libspectrum_mmc_write( card, ( argument >> 8 ) & 0xff );
+  libspectrum_mmc_write( card, argument & 0xff );
+  libspectrum_mmc_write( card, 0x95 );
+
+  return libspectrum_mmc_read( card );
+}
+
+/* Read the next data block from `card' and check it matches the expected
+   pattern for `sector', inverted if `inverted' is set */
+static test_return_t
+mmc_check_block( libspectrum_mmc_card *card, libspectrum_dword sector,
+                 int inverted )
+{
+  libspectrum_byte token, expected, actual;
+  size_t j;
+
+  token = libspectrum_mmc_read( card );
+  if( token != 0xfe ) {
+    fprintf( stderr, "%s: sector %lu data token is 0x%02x\n", progname,
+             (unsigned long)sector, token );
+    return TEST_FAIL;
+  }
+
+  for( j = 0; j < 512; j++ ) {
+    expected = pattern( sector, j ) ^ ( inverted ? 0xff : 0x00 );
+    actual = libspectrum_mmc_read( card );
+    if( actual != expected ) {
+      fprintf( stderr,
+               "%s: sector %lu byte %lu is 0x%02x, not the expected 0x%02x\n",
+               progname, (unsigned long)sector, (unsigned long)j, actual,
+               expected );
+      return TEST_FAIL;
+    }
+  }
+
+  /* CRC */
+  libspectrum_mmc_read( card );
+  libspectrum_mmc_read( card );
+
+  return TEST_PASS;
+}
+
+/* Send the inverted pattern for `sector' as a data block started by
+   `token', returning the data response */
+static libspectrum_byte
+mmc_write_inverted_block( libspectrum_mmc_card *card, libspectrum_byte token,
+                          libspectrum_dword sector )
+{
+  size_t j;
+
+  libspectrum_mmc_write( card, token );
+  for( j = 0; j < 512; j++ )
+    libspectrum_mmc_write( card, pattern( sector, j ) ^ 0xff );
+  libspectrum_mmc_write( card, 0x00 );
+  libspectrum_mmc_write( card, 0x00 );
+
+  return libspectrum_mmc_read( card );
+}
+
+/* Multiple block reads and writes should see the same data as single block
+   ones, and stop when told to or after the number of blocks set */
+test_return_t
+test_84( void )
+{
+  libspectrum_mmc_card *card;
+  libspectrum_dword i;
+  test_return_t r = TEST_PASS;
+
+  remove( journal_filename );
+  if( create_hdf( hdf_filename ) ) return TEST_INCOMPLETE;
+
+  card = libspectrum_mmc_alloc();
+  if( libspectrum_mmc_insert( card, hdf_filename ) ) {
+    libspectrum_mmc_free( card );
+    remove( hdf_filename );
+    return TEST_INCOMPLETE;
+  }
+
+  /* Initialise as an SDHC card */
+  mmc_command( card, 8, 0x000001aa );
+  mmc_command( card, 55, 0 );
+  if( mmc_command( card, 41, 0x40000000 ) != 0x00 ) r = TEST_INCOMPLETE;
+
+  /* CMD18 from sector 20, stopped by CMD12 after 20 blocks */
+  if( r == TEST_PASS && mmc_command( card, 18, 20 ) != 0x00 ) r = TEST_FAIL;
+  for( i = 20; r == TEST_PASS && i < 40; i++ )
+    r = mmc_check_block( card, i, 0 );
+  if( r == TEST_PASS && mmc_command( card, 12, 0 ) != 0x00 ) r = TEST_FAIL;
+  if( r == TEST_PASS && libspectrum_mmc_read( card ) != 0xff ) {
+    fprintf( stderr, "%s: data sent after CMD12\n", progname );
+    r = TEST_FAIL;
+  }
+
+  /* CMD25 to sectors 100 to 102, ended by the stop token */
+  if( r == TEST_PASS && mmc_command( card, 25, 100 ) != 0x00 ) r = TEST_FAIL;
+  for( i = 100; r == TEST_PASS && i < 103; i++ ) {
+    if( ( mmc_write_inverted_block( card, 0xfc, i ) & 0x1f ) != 0x05 ) {
+      fprintf( stderr, "%s: sector %lu not accepted\n", progname,
+               (unsigned long)i );
+      r = TEST_FAIL;
+    }
+  }
+  if( r == TEST_PASS ) libspectrum_mmc_write( card, 0xfd );
+
+  /* CMD23 limits the following CMD18 to 5 blocks */
+  if( r == TEST_PASS && mmc_command( card, 23, 5 ) != 0x00 ) r = TEST_FAIL;
+  if( r == TEST_PASS && mmc_command( card, 18, 99 ) != 0x00 ) r = TEST_FAIL;
+  for( i = 99; r == TEST_PASS && i < 104; i++ )
+    r = mmc_check_block( card, i, i >= 100 && i < 103 );
+  if( r == TEST_PASS && libspectrum_mmc_read( card ) != 0xff ) {
+    fprintf( stderr, "%s: more than 5 blocks sent after CMD23\n", progname );
+    r = TEST_FAIL;
+  }
+
+  /* Reading off the end of the card gives an out of range error token */
+  if( r == TEST_PASS && mmc_command( card, 18, HDF_TOTAL_SECTORS - 1 ) != 0 )
+    r = TEST_FAIL;
+  if( r == TEST_PASS ) r = mmc_check_block( card, HDF_TOTAL_SECTORS - 1, 0 );
+  if( r == TEST_PASS && libspectrum_mmc_read( card ) != 0x08 ) {
+    fprintf( stderr, "%s: no error reading past the end of the card\n",
+             progname );
+    r = TEST_FAIL;
+  }
+
+  /* A counted CMD25 goes straight to the journal, and ends by itself */
+  if( r == TEST_PASS &&
+      libspectrum_mmc_attach_journal( card, journal_filename ) )
+    r = TEST_INCOMPLETE;
+  if( r == TEST_PASS && mmc_command( card, 23, 2 ) != 0x00 ) r = TEST_FAIL;
+  if( r == TEST_PASS && mmc_command( card, 25, 200 ) != 0x00 ) r = TEST_FAIL;
+  for( i = 200; r == TEST_PASS && i < 202; i++ ) {
+    if( ( mmc_write_inverted_block( card, 0xfc, i ) & 0x1f ) != 0x05 )
+      r = TEST_FAIL;
+  }
+  if( r == TEST_PASS && mmc_command( card, 17, 201 ) != 0x00 ) r = TEST_FAIL;
+  if( r == TEST_PASS ) r = mmc_check_block( card, 201, 1 );
+  if( r == TEST_PASS && mmc_command( card, 17, 202 ) != 0x00 ) r = TEST_FAIL;
+  if( r == TEST_PASS ) r = mmc_check_block( card, 202, 0 );
+
+  if( r == TEST_PASS && libspectrum_mmc_dirty( card ) ) {
+    fprintf( stderr, "%s: journalled card is dirty\n", progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_mmc_free( card );
+  remove( hdf_filename );
+  remove( journal_filename );
+
+  return r;
+}
+
+#define BLOCK_TEST_SECTORS 3
+
+/* Read `length' bytes a register at a time, as `libspectrum_ide_read_block'
+   would */
+static void
+read_bytewise( libspectrum_ide_channel *chn, libspectrum_ide_databus databus,
+               libspectrum_byte *dest, size_t length )
+{
+  size_t i;
+
+  for( i = 0; i < length; i++ ) {
+    dest[i] = libspectrum_ide_read( chn, LIBSPECTRUM_IDE_REGISTER_DATA );
+    if( databus == LIBSPECTRUM_IDE_DATA16_DATA2 && ++i < length )
+      dest[i] = libspectrum_ide_read( chn, LIBSPECTRUM_IDE_REGISTER_DATA2 );
+  }
+}
+
+static void
+write_bytewise( libspectrum_ide_channel *chn, libspectrum_ide_databus databus,
+                const libspectrum_byte *src, size_t length )
+{
+  size_t i;
+
+  for( i = 0; i < length; i++ ) {
+    if( databus == LIBSPECTRUM_IDE_DATA16_DATA2 ) {
+      if( i + 1 < length )
+        libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_DATA2, src[i+1] );
+      libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_DATA, src[i++] );
+    } else {
+      libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_DATA, src[i] );
+    }
+  }
+}
+
+/* Block transfers should give the same results as register at a time ones
+   for an interface using `databus' */
+static test_return_t
+block_transfer( libspectrum_ide_databus databus )
+{
+  libspectrum_byte bytewise[ BLOCK_TEST_SECTORS * 512 ];
+  libspectrum_byte block[ BLOCK_TEST_SECTORS * 512 + 16 ];
+  libspectrum_ide_channel *chn;
+  size_t length, done, rest, i;
+  test_return_t r = TEST_PASS;
+
+  chn = open_channel_with_databus( LIBSPECTRUM_IDE_BACKEND_STDIO, databus );
+  if( !chn ) return TEST_INCOMPLETE;
+
+  length = BLOCK_TEST_SECTORS *
+    ( databus == LIBSPECTRUM_IDE_DATA8 ? 256 : 512 );
+
+  issue_command( chn, 0x20, 10, BLOCK_TEST_SECTORS );
+  read_bytewise( chn, databus, bytewise, length );
+
+  /* Chunks crossing sector boundaries, then more than is left. The chunks
+     are an even size so DATA2 interfaces always read whole pairs */
+  issue_command( chn, 0x20, 10, BLOCK_TEST_SECTORS );
+  for( done = 0; done + 78 < length; done += 78 )
+    if( libspectrum_ide_read_block( chn, block + done, 78 ) != 78 )
+      r = TEST_FAIL;
+  if( libspectrum_ide_read_block( chn, block + done, 16 + length - done ) !=
+      length - done )
+    r = TEST_FAIL;
+
+  if( r != TEST_PASS || memcmp( block, bytewise, length ) ||
+      block[ length + 15 ] != 0xff ) {
+    fprintf( stderr, "%s: block read differs for databus %d\n", progname,
+             databus );
+    r = TEST_FAIL;
+  }
+
+  /* Write the same data to two places, then read it back. The odd sized
+     chunk ends with an unpaired write for DATA2 interfaces, which takes up
+     an extra byte of the sector */
+  for( i = 0; i < length; i++ ) block[i] = bytewise[i] ^ 0x5a;
+  rest = length - 303 - ( databus == LIBSPECTRUM_IDE_DATA16_DATA2 );
+
+  if( r == TEST_PASS ) {
+    issue_command( chn, 0x30, 50, BLOCK_TEST_SECTORS );
+    if( libspectrum_ide_write_block( chn, block, 300 ) != 300 ||
+        libspectrum_ide_write_block( chn, block + 300, 3 ) != 3 ||
+        libspectrum_ide_write_block( chn, block + 303, length ) != rest )
+      r = TEST_FAIL;
+
+    issue_command( chn, 0x30, 60, BLOCK_TEST_SECTORS );
+    write_bytewise( chn, databus, block, 300 );
+    write_bytewise( chn, databus, block + 300, 3 );
+    write_bytewise( chn, databus, block + 303, rest );
+
+    issue_command( chn, 0x20, 50, BLOCK_TEST_SECTORS );
+    read_bytewise( chn, databus, bytewise, length );
+    issue_command( chn, 0x20, 60, BLOCK_TEST_SECTORS );
+    libspectrum_ide_read_block( chn, block, length );
+
+    if( r != TEST_PASS || memcmp( block, bytewise, length ) ) {
+      fprintf( stderr, "%s: block write differs for databus %d\n", progname,
+               databus );
+      r = TEST_FAIL;
+    }
+  }
+
+  close_channel( chn );
+
+  return r;
+}
+
+test_return_t
+test_85( void )
+{
+  static const libspectrum_ide_databus databuses[] = {
+    LIBSPECTRUM_IDE_DATA8, LIBSPECTRUM_IDE_DATA16,
+    LIBSPECTRUM_IDE_DATA16_BYTESWAP, LIBSPECTRUM_IDE_DATA16_DATA2,
+  };
+  const size_t count = sizeof( databuses ) / sizeof( databuses[0] );
+  test_return_t r = TEST_PASS;
+  size_t i;
+
+  for( i = 0; r == TEST_PASS && i < count; i++ )
+    r = block_transfer( databuses[i] );
+
+  return r;
+}
+
+static libspectrum_qword
+histogram_total( const libspectrum_qword *histogram )
+{
+  libspectrum_qword total = 0;
+  size_t i;
+
+  for( i = 0; i < LIBSPECTRUM_IDE_LATENCY_BUCKETS; i++ )
+    total += histogram[i];
+
+  return total;
+}
+
+/* Commands, sectors, commits and erases should all be counted, and the
+   counts should be cleared by a reset */
+test_return_t
+test_86( void )
+{
+  libspectrum_ide_channel *chn;
+  libspectrum_mmc_card *card;
+  libspectrum_ide_io_stats stats;
+  test_return_t r = TEST_PASS;
+
+  chn = open_channel( LIBSPECTRUM_IDE_BACKEND_STDIO );
+  if( !chn ) return TEST_INCOMPLETE;
+
+  r = check_sectors( chn, 0, 100, -1 );
+  write_inverted_sector( chn, 10 );
+  write_inverted_sector( chn, 11 );
+  libspectrum_ide_commit( chn, LIBSPECTRUM_IDE_MASTER );
+
+  libspectrum_ide_get_io_stats( chn, LIBSPECTRUM_IDE_MASTER, &stats );
+  if( r == TEST_PASS &&
+      ( stats.commands[ 0x20 ] != 1 || stats.commands[ 0x30 ] != 2 ||
+        stats.sectors_read != 100 || stats.sectors_written != 2 ||
+        stats.commits != 1 || stats.bytes_committed != 1024 ||
+        stats.cache.misses + stats.cache.hits != 100 ||
+        histogram_total( stats.read_latency ) != stats.cache.reads ||
+        histogram_total( stats.commit_latency ) != 1 ) ) {
+    fprintf( stderr, "%s: unexpected IDE statistics\n", progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_ide_reset_io_stats( chn, LIBSPECTRUM_IDE_MASTER );
+  libspectrum_ide_get_io_stats( chn, LIBSPECTRUM_IDE_MASTER, &stats );
+  if( r == TEST_PASS &&
+      ( stats.commands[ 0x20 ] || stats.sectors_read || stats.commits ||
+        stats.cache.reads || histogram_total( stats.read_latency ) ) ) {
+    fprintf( stderr, "%s: IDE statistics not reset\n", progname );
+    r = TEST_FAIL;
+  }
+
+  close_channel( chn );
+  if( r != TEST_PASS ) return r;
+
+  /* Erase 10 sectors from an MMC card */
+  if( create_hdf( hdf_filename ) ) return TEST_INCOMPLETE;
+
+  card = libspectrum_mmc_alloc();
+  if( libspectrum_mmc_insert( card, hdf_filename ) ) {
+    libspectrum_mmc_free( card );
+    remove( hdf_filename );
+    return TEST_INCOMPLETE;
+  }
+
+  mmc_command( card, 8, 0x000001aa );
+  mmc_command( card, 55, 0 );
+  mmc_command( card, 41, 0x40000000 );
+  mmc_command( card, 32, 10 );
+  mmc_command( card, 33, 19 );
+  mmc_command( card, 38, 0 );
+
+  libspectrum_mmc_get_io_stats( card, &stats );
+  if( stats.commands[ 38 ] != 1 || stats.commands[ 0x40 + 41 ] != 1 ||
+      stats.commands[ 41 ] || stats.erases != 1 ||
+      stats.sectors_erased != 10 || stats.sectors_written != 10 ) {
+    fprintf( stderr, "%s: unexpected MMC statistics\n", progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_mmc_free( card );
+  remove( hdf_filename );
+
+  return r;
+}
+
+/* Detaching when no journal is attached should do nothing, and in
+   particular should leave unwritten changes in the write cache */
+test_return_t
+test_103( void )
+{
+  libspectrum_ide_channel *chn;
+  libspectrum_mmc_card *card;
+  test_return_t r;
+
+  chn = open_channel( LIBSPECTRUM_IDE_BACKEND_STDIO );
+  if( !chn ) return TEST_INCOMPLETE;
+
+  write_inverted_sector( chn, 40 );
+
+  if( libspectrum_ide_detach_journal( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+    fprintf( stderr, "%s: error detaching no IDE journal\n", progname );
+    r = TEST_FAIL;
+  } else if( !libspectrum_ide_dirty( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+    fprintf( stderr, "%s: IDE write lost by detach\n", progname );
+    r = TEST_FAIL;
+  } else {
+    r = check_sectors( chn, 39, 3, 40 );
+  }
+
+  close_channel( chn );
+  if( r != TEST_PASS ) return r;
+
+  if( create_hdf( hdf_filename ) ) return TEST_INCOMPLETE;
+
+  card = libspectrum_mmc_alloc();
+  if( libspectrum_mmc_insert( card, hdf_filename ) ) {
+    libspectrum_mmc_free( card );
+    remove( hdf_filename );
+    return TEST_INCOMPLETE;
+  }
+
+  mmc_command( card, 8, 0x000001aa );
+  mmc_command( card, 55, 0 );
+  if( mmc_command( card, 41, 0x40000000 ) != 0x00 ) r = TEST_INCOMPLETE;
+
+  if( r == TEST_PASS && mmc_command( card, 24, 40 ) != 0x00 ) r = TEST_FAIL;
+  if( r == TEST_PASS &&
+      ( mmc_write_inverted_block( card, 0xfe, 40 ) & 0x1f ) != 0x05 )
+    r = TEST_FAIL;
+
+  if( r == TEST_PASS ) {
+    if( libspectrum_mmc_detach_journal( card ) ) {
+      fprintf( stderr, "%s: error detaching no MMC journal\n", progname );
+      r = TEST_FAIL;
+    } else if( !libspectrum_mmc_dirty( card ) ) {
+      fprintf( stderr, "%s: MMC write lost by detach\n", progname );
+      r = TEST_FAIL;
+    }
+  }
+
+  if( r == TEST_PASS && mmc_command( card, 17, 40 ) != 0x00 ) r = TEST_FAIL;
+  if( r == TEST_PASS ) r = mmc_check_block( card, 40, 1 );
+
+  libspectrum_mmc_free( card );
+  remove( hdf_filename );
+
+  return r;
+}
+
+/* Resetting a card part way through a multiple block write should keep the
+   blocks already accepted */
+test_return_t
+test_104( void )
+{
+  libspectrum_mmc_card *card;
+  libspectrum_dword i;
+  test_return_t r = TEST_PASS;
+
+  if( create_hdf( hdf_filename ) ) return TEST_INCOMPLETE;
+
+  card = libspectrum_mmc_alloc();
+  if( libspectrum_mmc_insert( card, hdf_filename ) ) {
+    libspectrum_mmc_free( card );
+    remove( hdf_filename );
+    return TEST_INCOMPLETE;
+  }
+
+  mmc_command( card, 8, 0x000001aa );
+  mmc_command( card, 55, 0 );
+  if( mmc_command( card, 41, 0x40000000 ) != 0x00 ) r = TEST_INCOMPLETE;
+
+  if( r == TEST_PASS && mmc_command( card, 25, 100 ) != 0x00 ) r = TEST_FAIL;
+  for( i = 100; r == TEST_PASS && i < 103; i++ ) {
+    if( ( mmc_write_inverted_block( card, 0xfc, i ) & 0x1f ) != 0x05 )
+      r = TEST_FAIL;
+  }
+
+  if( r == TEST_PASS ) {
+    libspectrum_mmc_reset( card );
+    if( !libspectrum_mmc_dirty( card ) ) {
+      fprintf( stderr, "%s: batched writes lost by reset\n", progname );
+      r = TEST_FAIL;
+    }
+  }
+
+  if( r == TEST_PASS ) {
+    mmc_command( card, 8, 0x000001aa );
+    mmc_command( card, 55, 0 );
+    if( mmc_command( card, 41, 0x40000000 ) != 0x00 ) r = TEST_FAIL;
+  }
+
+  if( r == TEST_PASS && mmc_command( card, 18, 99 ) != 0x00 ) r = TEST_FAIL;
+  for( i = 99; r == TEST_PASS && i < 104; i++ )
+    r = mmc_check_block( card, i, i >= 100 && i < 103 );
+  if( r == TEST_PASS ) mmc_command( card, 12, 0 );
+
+  libspectrum_mmc_free( card );
+  remove( hdf_filename );
+
+  return r;
+}
+
+/* A journal with a record for a sector beyond the end of the image is
+   corrupt, and attaching it should fail rather than trust the record */
+test_return_t
+test_107( void )
+{
+  libspectrum_ide_channel *chn;
+  libspectrum_byte header[16], record[4] = { 0 };
+  size_t i, sector_size;
+  FILE *f;
+  test_return_t r = TEST_PASS;
+
+  remove( journal_filename );
+
+  chn = open_channel( LIBSPECTRUM_IDE_BACKEND_STDIO );
+  if( !chn ) return TEST_INCOMPLETE;
+
+  if( libspectrum_ide_attach_journal( chn, LIBSPECTRUM_IDE_MASTER,
+                                      journal_filename ) ) {
+    close_channel( chn );
+    return TEST_INCOMPLETE;
+  }
+  write_inverted_sector( chn, 40 );
+  libspectrum_ide_detach_journal( chn, LIBSPECTRUM_IDE_MASTER );
+
+  /* Append a record for the first sector past the end of the image */
+  f = fopen( journal_filename, "rb+" );
+  if( !f || fread( header, sizeof( header ), 1, f ) != 1 ||
+      fseek( f, 0, SEEK_END ) ) {
+    r = TEST_INCOMPLETE;
+  } else {
+    sector_size = header[8] | ( header[9] << 8 );
+    record[0] = HDF_TOTAL_SECTORS & 0xff;
+    record[1] = HDF_TOTAL_SECTORS >> 8;
+    if( fwrite( record, sizeof( record ), 1, f ) != 1 ) r = TEST_INCOMPLETE;
+    for( i = 0; r == TEST_PASS && i < sector_size; i++ )
+      if( fputc( 0, f ) == EOF ) r = TEST_INCOMPLETE;
+  }
+  if( f && fclose( f ) ) r = TEST_INCOMPLETE;
+
+  if( r == TEST_PASS &&
+      libspectrum_ide_attach_journal( chn, LIBSPECTRUM_IDE_MASTER,
+                                      journal_filename ) !=
+        LIBSPECTRUM_ERROR_CORRUPT ) {
+    fprintf( stderr, "%s: journal with out of range sector attached\n",
+             progname );
+    r = TEST_FAIL;
+  }
+
+  /* The drive should be left reading the image */
+  if( r == TEST_PASS ) r = check_sectors( chn, 40, 1, -1 );
+
+  close_channel( chn );
+  remove( journal_filename );
+
+  return r;
+}
@@ -894,6 +894,1645 @@ test_72( void )
   return r;
 }
 
+static test_return_t
+test_87( void )
+{
+  const char *filename = STATIC_TEST_PATH( "random.szx" );
+  libspectrum_byte *buffer = NULL;
+  size_t filesize = 0;
+  libspectrum_snap_pool *pool;
+  libspectrum_snap *snap, *reused;
+  libspectrum_byte *pages[8], *page;
+  size_t i, j;
+  test_return_t r = TEST_INCOMPLETE;
+
+  if( read_file( &buffer, &filesize, filename ) ) return TEST_INCOMPLETE;
+
+  pool = libspectrum_snap_pool_alloc();
+  snap = libspectrum_snap_pool_get( pool );
+
+  if( libspectrum_snap_read( snap, buffer, filesize, LIBSPECTRUM_ID_UNKNOWN,
+			     filename ) != LIBSPECTRUM_ERROR_NONE ) {
+    fprintf( stderr, "%s: reading `%s' failed\n", progname, filename );
+    goto end;
+  }
+
+  for( i = 0; i < 8; i++ ) pages[i] = libspectrum_snap_pages( snap, i );
+
+  libspectrum_snap_pool_put( pool, snap );
+  reused = libspectrum_snap_pool_get( pool );
+
+  if( reused != snap ) {
+    fprintf( stderr, "%s: pool did not reuse snapshot\n", progname );
+    r = TEST_FAIL;
+    snap = reused;
+    goto end;
+  }
+
+  if( libspectrum_snap_machine( snap ) != LIBSPECTRUM_MACHINE_UNKNOWN ||
+      libspectrum_snap_pages( snap, 5 ) ) {
+    fprintf( stderr, "%s: snapshot not reset\n", progname );
+    r = TEST_FAIL;
+    goto end;
+  }
+
+  if( libspectrum_snap_read( snap, buffer, filesize, LIBSPECTRUM_ID_UNKNOWN,
+			     filename ) != LIBSPECTRUM_ERROR_NONE ) {
+    fprintf( stderr, "%s: reading `%s' failed\n", progname, filename );
+    goto end;
+  }
+
+  r = TEST_PASS;
+
+  /* Every page should be one of those from the first read */
+  for( i = 0; i < 8; i++ ) {
+    page = libspectrum_snap_pages( snap, i );
+    if( !page ) continue;
+
+    for( j = 0; j < 8 && pages[j] != page; j++ )
+      ;
+
+    if( j == 8 ) {
+      fprintf( stderr, "%s: page %lu not reused\n", progname,
+               (unsigned long)i );
+      r = TEST_FAIL;
+    }
+  }
+
+  /* And a reset snapshot should hand a page straight back */
+  page = libspectrum_snap_pages( snap, 5 );
+  libspectrum_snap_reset( snap );
+
+  libspectrum_snap_set_pages( snap, 5,
+                              libspectrum_snap_alloc_page( snap, 0x4000 ) );
+
+  if( libspectrum_snap_pages( snap, 5 ) != page ) {
+    fprintf( stderr, "%s: alloc page did not reuse page\n", progname );
+    r = TEST_FAIL;
+  }
+
+end:
+  libspectrum_snap_pool_put( pool, snap );
+  libspectrum_snap_pool_free( pool );
+  libspectrum_free( buffer );
+
+  return r;
+}
+
+static test_return_t
+write_lss( libspectrum_byte **buffer, size_t *length, libspectrum_snap *snap,
+           int flags )
+{
+  int out_flags;
+
+  *buffer = NULL; *length = 0;
+
+  if( libspectrum_snap_write( buffer, length, &out_flags, snap,
+                              LIBSPECTRUM_ID_SNAPSHOT_LSS, NULL, flags ) ||
+      out_flags ) {
+    fprintf( stderr, "%s: error writing native snapshot\n", progname );
+    libspectrum_free( *buffer );
+    return TEST_INCOMPLETE;
+  }
+
+  return TEST_PASS;
+}
+
+static test_return_t
+check_lss_roundtrip( libspectrum_snap *snap, int flags )
+{
+  libspectrum_byte *buffer, *buffer2 = NULL;
+  size_t length, length2, fields_length, count, i;
+  const libspectrum_byte *entry;
+  libspectrum_snap *snap2;
+  test_return_t r;
+
+  r = write_lss( &buffer, &length, snap, flags );
+  if( r != TEST_PASS ) return r;
+
+  /* Data stored as is should be aligned for mapping */
+  fields_length = buffer[8] | buffer[9] << 8 | buffer[10] << 16;
+  count = buffer[12] | buffer[13] << 8;
+
+  for( i = 0; i < count; i++ ) {
+    entry = buffer + 16 + fields_length + 32 * i;
+    if( !entry[4] && ( entry[16] || entry[17] & 0x0f ) ) {
+      fprintf( stderr, "%s: block %lu not aligned\n", progname,
+               (unsigned long)i );
+      r = TEST_FAIL;
+    }
+  }
+
+  snap2 = libspectrum_snap_alloc();
+
+  if( libspectrum_snap_read( snap2, buffer, length, LIBSPECTRUM_ID_UNKNOWN,
+                             NULL ) ) {
+    fprintf( stderr, "%s: error reading native snapshot\n", progname );
+    r = TEST_FAIL;
+  } else if( write_lss( &buffer2, &length2, snap2, flags ) != TEST_PASS ) {
+    r = TEST_INCOMPLETE;
+  } else if( length2 != length || memcmp( buffer, buffer2, length ) ) {
+    fprintf( stderr, "%s: native snapshot changed by reading\n", progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_snap_free( snap2 );
+  libspectrum_free( buffer2 );
+
+  /* And truncated data should be noticed */
+  if( r == TEST_PASS ) {
+    snap2 = libspectrum_snap_alloc();
+    if( libspectrum_snap_read( snap2, buffer, length - 1,
+                               LIBSPECTRUM_ID_SNAPSHOT_LSS, NULL ) !=
+        LIBSPECTRUM_ERROR_CORRUPT ) {
+      fprintf( stderr, "%s: truncated native snapshot not detected\n",
+               progname );
+      r = TEST_FAIL;
+    }
+    libspectrum_snap_free( snap2 );
+  }
+
+  libspectrum_free( buffer );
+
+  return r;
+}
+
+static test_return_t
+test_88( void )
+{
+  const char *filename = STATIC_TEST_PATH( "random.szx" );
+  libspectrum_byte *buffer = NULL;
+  size_t filesize = 0;
+  libspectrum_snap *snap;
+  test_return_t r;
+
+  if( read_file( &buffer, &filesize, filename ) ) return TEST_INCOMPLETE;
+
+  snap = libspectrum_snap_alloc();
+
+  if( libspectrum_snap_read( snap, buffer, filesize, LIBSPECTRUM_ID_UNKNOWN,
+			     filename ) != LIBSPECTRUM_ERROR_NONE ) {
+    fprintf( stderr, "%s: reading `%s' failed\n", progname, filename );
+    libspectrum_snap_free( snap );
+    libspectrum_free( buffer );
+    return TEST_INCOMPLETE;
+  }
+
+  libspectrum_free( buffer );
+
+  /* Make sure there is a zero page and a compressible page */
+  if( libspectrum_snap_pages( snap, 6 ) )
+    memset( libspectrum_snap_pages( snap, 6 ), 0, 0x4000 );
+  if( libspectrum_snap_pages( snap, 7 ) )
+    memset( libspectrum_snap_pages( snap, 7 ) + 0x100, 0xaa, 0x1000 );
+
+  r = check_lss_roundtrip( snap, 0 );
+  if( r == TEST_PASS )
+    r = check_lss_roundtrip( snap, LIBSPECTRUM_FLAG_SNAPSHOT_NO_COMPRESSION );
+
+  libspectrum_snap_free( snap );
+
+  return r;
+}
+
+static libspectrum_snap*
+load_snap( const char *filename )
+{
+  libspectrum_byte *buffer = NULL;
+  size_t filesize = 0;
+  libspectrum_snap *snap;
+
+  if( read_file( &buffer, &filesize, filename ) ) return NULL;
+
+  snap = libspectrum_snap_alloc();
+
+  if( libspectrum_snap_read( snap, buffer, filesize, LIBSPECTRUM_ID_UNKNOWN,
+			     filename ) != LIBSPECTRUM_ERROR_NONE ) {
+    fprintf( stderr, "%s: reading `%s' failed\n", progname, filename );
+    libspectrum_snap_free( snap );
+    snap = NULL;
+  }
+
+  libspectrum_free( buffer );
+
+  return snap;
+}
+
+static test_return_t
+test_89( void )
+{
+  const char *filename = STATIC_TEST_PATH( "random.szx" );
+  libspectrum_snap *from, *to, *snap;
+  libspectrum_byte *delta = NULL, *buffer = NULL, *buffer2 = NULL, *page;
+  size_t delta_length = 0, length, length2;
+  test_return_t r = TEST_INCOMPLETE;
+
+  from = load_snap( filename );
+  to = load_snap( filename );
+  snap = load_snap( filename );
+
+  if( !from || !to || !snap || !libspectrum_snap_pages( to, 0 ) ||
+      !libspectrum_snap_pages( to, 5 ) || libspectrum_snap_pages( to, 1 ) )
+    goto end;
+
+  /* A few changed bytes, a changed register, a removed page and a new
+     page */
+  page = libspectrum_snap_pages( to, 5 );
+  page[ 0x0000 ] ^= 0xff; page[ 0x1234 ] ^= 0x01; page[ 0x3fff ] ^= 0x80;
+  libspectrum_snap_set_pc( to, libspectrum_snap_pc( to ) + 1 );
+
+  libspectrum_free( libspectrum_snap_pages( to, 0 ) );
+  libspectrum_snap_set_pages( to, 0, NULL );
+
+  page = libspectrum_new( libspectrum_byte, 0x4000 );
+  memset( page, 0x55, 0x4000 );
+  libspectrum_snap_set_pages( to, 1, page );
+
+  if( libspectrum_snap_diff( &delta, &delta_length, from, to ) ) goto end;
+
+  r = TEST_PASS;
+
+  if( delta_length > 0x200 ) {
+    fprintf( stderr, "%s: delta is %lu bytes\n", progname,
+             (unsigned long)delta_length );
+    r = TEST_FAIL;
+  }
+
+  if( libspectrum_snap_apply( snap, delta, delta_length ) ) {
+    fprintf( stderr, "%s: error applying delta\n", progname );
+    r = TEST_FAIL;
+  } else if( write_lss( &buffer, &length, snap, 0 ) != TEST_PASS ||
+             write_lss( &buffer2, &length2, to, 0 ) != TEST_PASS ) {
+    r = TEST_INCOMPLETE;
+  } else if( length != length2 || memcmp( buffer, buffer2, length ) ) {
+    fprintf( stderr, "%s: delta did not reproduce snapshot\n", progname );
+    r = TEST_FAIL;
+  }
+
+  /* The delta no longer matches the snapshot */
+  if( r == TEST_PASS &&
+      libspectrum_snap_apply( snap, delta, delta_length ) !=
+        LIBSPECTRUM_ERROR_INVALID ) {
+    fprintf( stderr, "%s: mismatched delta not detected\n", progname );
+    r = TEST_FAIL;
+  }
+
+end:
+  libspectrum_free( buffer2 );
+  libspectrum_free( buffer );
+  libspectrum_free( delta );
+  if( snap ) libspectrum_snap_free( snap );
+  if( to ) libspectrum_snap_free( to );
+  if( from ) libspectrum_snap_free( from );
+
+  return r;
+}
+
+static test_return_t
+test_90( void )
+{
+  const char *filename = STATIC_TEST_PATH( "random.szx" );
+  libspectrum_snap *snap, *snap2;
+  libspectrum_byte *page, *delta = NULL;
+  size_t delta_length = 0;
+  libspectrum_qword hash;
+  test_return_t r = TEST_INCOMPLETE;
+
+  snap = load_snap( filename );
+  snap2 = load_snap( filename );
+
+  if( !snap || !snap2 || !libspectrum_snap_pages( snap, 5 ) ) goto end;
+
+  r = TEST_PASS;
+
+  /* The hash depends only on the contents of the snapshot */
+  hash = libspectrum_snap_hash( snap );
+  if( libspectrum_snap_hash( snap ) != hash ||
+      libspectrum_snap_hash( snap2 ) != hash ) {
+    fprintf( stderr, "%s: snapshot hash not stable\n", progname );
+    r = TEST_FAIL;
+  }
+
+  /* Pages changed in place are hashed again when set */
+  page = libspectrum_snap_pages( snap, 5 );
+  page[ 0x2000 ] ^= 0x01;
+  libspectrum_snap_set_pages( snap, 5, page );
+  if( libspectrum_snap_hash( snap ) == hash ) {
+    fprintf( stderr, "%s: changed page not noticed\n", progname );
+    r = TEST_FAIL;
+  }
+
+  page[ 0x2000 ] ^= 0x01;
+  libspectrum_snap_set_pages( snap, 5, page );
+  if( libspectrum_snap_hash( snap ) != hash ) {
+    fprintf( stderr, "%s: restored page gave different hash\n", progname );
+    r = TEST_FAIL;
+  }
+
+  page = libspectrum_snap_pages( snap2, 5 );
+  page[ 0x0100 ] ^= 0xff;
+  libspectrum_snap_set_pages( snap2, 5, page );
+  libspectrum_snap_set_pc( snap2, libspectrum_snap_pc( snap2 ) ^ 1 );
+  if( libspectrum_snap_hash( snap2 ) == hash ) {
+    fprintf( stderr, "%s: changed snapshot not noticed\n", progname );
+    r = TEST_FAIL;
+  }
+
+  /* Applying a delta changes pages in place */
+  if( libspectrum_snap_diff( &delta, &delta_length, snap2, snap ) ||
+      libspectrum_snap_apply( snap2, delta, delta_length ) ) {
+    r = TEST_INCOMPLETE;
+  } else if( libspectrum_snap_hash( snap2 ) != hash ) {
+    fprintf( stderr, "%s: delta not noticed\n", progname );
+    r = TEST_FAIL;
+  }
+
+end:
+  libspectrum_free( delta );
+  if( snap2 ) libspectrum_snap_free( snap2 );
+  if( snap ) libspectrum_snap_free( snap );
+
+  return r;
+}
+
+static test_return_t
+check_same_snap( libspectrum_snap *snap, libspectrum_snap *snap2 )
+{
+  libspectrum_byte *buffer = NULL, *buffer2 = NULL;
+  size_t length, length2;
+  test_return_t r;
+
+  r = write_lss( &buffer, &length, snap, 0 );
+  if( r == TEST_PASS ) r = write_lss( &buffer2, &length2, snap2, 0 );
+
+  if( r == TEST_PASS &&
+      ( length != length2 || memcmp( buffer, buffer2, length ) ) ) {
+    fprintf( stderr, "%s: snapshots differ\n", progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_free( buffer2 );
+  libspectrum_free( buffer );
+
+  return r;
+}
+
+static test_return_t
+test_91( void )
+{
+  const char *filename = STATIC_TEST_PATH( "random.szx" );
+  libspectrum_snap *snap, *original = NULL, *copy = NULL, *shared = NULL,
+    *changed = NULL;
+  libspectrum_byte *delta = NULL, *page;
+  size_t delta_length = 0;
+  test_return_t r = TEST_INCOMPLETE;
+
+  snap = load_snap( filename );
+  if( !snap || !libspectrum_snap_pages( snap, 5 ) ) goto end;
+
+  original = libspectrum_snap_clone( snap, 0 );
+  copy = libspectrum_snap_clone( snap, 0 );
+  shared = libspectrum_snap_clone( snap, LIBSPECTRUM_FLAG_SNAPSHOT_SHARE_PAGES );
+
+  r = check_same_snap( snap, copy );
+  if( r == TEST_PASS ) r = check_same_snap( snap, shared );
+  if( r != TEST_PASS ) goto end;
+
+  if( libspectrum_snap_pages( copy, 5 ) == libspectrum_snap_pages( snap, 5 ) ||
+      libspectrum_snap_pages( shared, 5 ) !=
+        libspectrum_snap_pages( snap, 5 ) ) {
+    fprintf( stderr, "%s: pages not copied or shared\n", progname );
+    r = TEST_FAIL;
+    goto end;
+  }
+
+  /* Changing a snapshot with shared pages leaves the original alone */
+  changed = libspectrum_snap_clone( snap, 0 );
+  libspectrum_snap_pages( changed, 5 )[ 0x1000 ] ^= 0x01;
+  libspectrum_snap_set_pc( changed, libspectrum_snap_pc( changed ) ^ 1 );
+
+  if( libspectrum_snap_diff( &delta, &delta_length, shared, changed ) ||
+      libspectrum_snap_apply( shared, delta, delta_length ) ) {
+    r = TEST_INCOMPLETE;
+    goto end;
+  }
+
+  r = check_same_snap( shared, changed );
+  if( r == TEST_PASS ) r = check_same_snap( snap, original );
+  if( r != TEST_PASS ) goto end;
+
+  /* Pages given to a snapshot with shared pages belong to it */
+  page = libspectrum_new( libspectrum_byte, 0x4000 );
+  memset( page, 0, 0x4000 );
+  libspectrum_snap_set_pages( shared, 1, page );
+
+  /* And freeing the copies leaves the original alone */
+  libspectrum_snap_free( copy ); copy = NULL;
+  libspectrum_snap_reset( shared );
+  libspectrum_snap_free( shared ); shared = NULL;
+
+  r = check_same_snap( snap, original );
+
+end:
+  libspectrum_free( delta );
+  if( changed ) libspectrum_snap_free( changed );
+  if( shared ) libspectrum_snap_free( shared );
+  if( copy ) libspectrum_snap_free( copy );
+  if( original ) libspectrum_snap_free( original );
+  if( snap ) libspectrum_snap_free( snap );
+
+  return r;
+}
+
+static test_return_t
+check_same_page( libspectrum_byte *page, libspectrum_byte *page2,
+                 const char *name, int idx )
+{
+  if( !page || !page2 || memcmp( page, page2, 0x4000 ) ) {
+    fprintf( stderr, "%s: %s page %d not restored\n", progname, name, idx );
+    return TEST_FAIL;
+  }
+
+  return TEST_PASS;
+}
+
+static test_return_t
+test_92( void )
+{
+  const char *filename = STATIC_TEST_PATH( "random.szx" );
+  libspectrum_snap *snap, *snap2 = NULL;
+  libspectrum_byte *buffer = NULL, *page;
+  size_t length = 0;
+  int i, out_flags;
+  test_return_t r = TEST_INCOMPLETE;
+
+  snap = load_snap( filename );
+  if( !snap || !libspectrum_snap_pages( snap, 5 ) ) goto end;
+
+  /* Zero pages and copies of page 5, in RAM and on a ZXCF card */
+  libspectrum_snap_set_machine( snap, LIBSPECTRUM_MACHINE_128 );
+  libspectrum_snap_set_zxcf_active( snap, 1 );
+  libspectrum_snap_set_zxcf_pages( snap, 4 );
+
+  for( i = 0; i < 8; i++ ) {
+    if( libspectrum_snap_pages( snap, i ) ) continue;
+    page = libspectrum_new( libspectrum_byte, 0x4000 );
+    if( i & 1 ) {
+      memcpy( page, libspectrum_snap_pages( snap, 5 ), 0x4000 );
+    } else {
+      memset( page, 0, 0x4000 );
+    }
+    libspectrum_snap_set_pages( snap, i, page );
+  }
+
+  for( i = 0; i < 4; i++ ) {
+    page = libspectrum_new( libspectrum_byte, 0x4000 );
+    memcpy( page, libspectrum_snap_pages( snap, i == 3 ? 5 : 4 ), 0x4000 );
+    if( i == 2 ) page[ 0x3fff ] = 1;
+    libspectrum_snap_set_zxcf_ram( snap, i, page );
+  }
+
+  if( libspectrum_snap_write( &buffer, &length, &out_flags, snap,
+                              LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL, 0 ) ) {
+    fprintf( stderr, "%s: error writing .szx snapshot\n", progname );
+    goto end;
+  }
+
+  snap2 = libspectrum_snap_alloc();
+  if( libspectrum_snap_read( snap2, buffer, length, LIBSPECTRUM_ID_UNKNOWN,
+                             NULL ) ) {
+    fprintf( stderr, "%s: error reading .szx snapshot\n", progname );
+    r = TEST_FAIL;
+    goto end;
+  }
+
+  r = TEST_PASS;
+
+  for( i = 0; i < 8 && r == TEST_PASS; i++ )
+    r = check_same_page( libspectrum_snap_pages( snap, i ),
+                         libspectrum_snap_pages( snap2, i ), "RAM", i );
+
+  for( i = 0; i < 4 && r == TEST_PASS; i++ )
+    r = check_same_page( libspectrum_snap_zxcf_ram( snap, i ),
+                         libspectrum_snap_zxcf_ram( snap2, i ), "ZXCF", i );
+
+end:
+  libspectrum_free( buffer );
+  if( snap2 ) libspectrum_snap_free( snap2 );
+  if( snap ) libspectrum_snap_free( snap );
+
+  return r;
+}
+
+struct screen_test {
+  libspectrum_machine machine;
+  libspectrum_byte memoryport;
+  libspectrum_id_t type;
+  int uncompressed;
+};
+
+static test_return_t
+check_screen( libspectrum_snap *snap, const struct screen_test *t )
+{
+  libspectrum_byte *buffer = NULL, *palette;
+  libspectrum_snap_screen screen;
+  size_t length = 0;
+  int flags, out_flags, page;
+  test_return_t r = TEST_INCOMPLETE;
+
+  flags = t->uncompressed ? LIBSPECTRUM_FLAG_SNAPSHOT_NO_COMPRESSION : 0;
+
+  libspectrum_snap_set_machine( snap, t->machine );
+  libspectrum_snap_set_out_128_memoryport( snap, t->memoryport );
+
+  if( libspectrum_snap_write( &buffer, &length, &out_flags, snap, t->type,
+                              NULL, flags ) ) {
+    fprintf( stderr, "%s: error writing snapshot type %d\n", progname,
+             t->type );
+    goto end;
+  }
+
+  if( libspectrum_snap_read_screen( &screen, buffer, length, t->type,
+                                    NULL ) ) {
+    fprintf( stderr, "%s: error reading screen from snapshot type %d\n",
+             progname, t->type );
+    r = TEST_FAIL;
+    goto end;
+  }
+
+  page = ( t->machine == LIBSPECTRUM_MACHINE_48 || !( t->memoryport & 0x08 ) )
+         ? 5 : 7;
+  palette = libspectrum_snap_ulaplus_palette( snap, 0 );
+
+  if( memcmp( screen.data, libspectrum_snap_pages( snap, page ),
+              sizeof( screen.data ) ) ) {
+    fprintf( stderr, "%s: wrong screen from snapshot type %d, port 0x%02x\n",
+             progname, t->type, t->memoryport );
+    r = TEST_FAIL;
+  } else if( screen.border != ( libspectrum_snap_out_ula( snap ) & 0x07 ) ) {
+    fprintf( stderr, "%s: wrong border from snapshot type %d\n", progname,
+             t->type );
+    r = TEST_FAIL;
+  } else if( t->type == LIBSPECTRUM_ID_SNAPSHOT_SZX &&
+             ( !screen.ulaplus_present ||
+               memcmp( screen.ulaplus_palette, palette, 64 ) ) ) {
+    fprintf( stderr, "%s: wrong ULAplus palette from .szx snapshot\n",
+             progname );
+    r = TEST_FAIL;
+  } else {
+    r = TEST_PASS;
+  }
+
+end:
+  libspectrum_free( buffer );
+
+  return r;
+}
+
+static test_return_t
+test_93( void )
+{
+  static const struct screen_test cases[] = {
+    { LIBSPECTRUM_MACHINE_48,  0x00, LIBSPECTRUM_ID_SNAPSHOT_SNA, 0 },
+    { LIBSPECTRUM_MACHINE_PENT, 0x08, LIBSPECTRUM_ID_SNAPSHOT_SNA, 0 },
+    { LIBSPECTRUM_MACHINE_PENT, 0x0f, LIBSPECTRUM_ID_SNAPSHOT_SNA, 0 },
+    { LIBSPECTRUM_MACHINE_PENT, 0x0d, LIBSPECTRUM_ID_SNAPSHOT_SNA, 0 },
+    { LIBSPECTRUM_MACHINE_PENT, 0x05, LIBSPECTRUM_ID_SNAPSHOT_SNA, 0 },
+    { LIBSPECTRUM_MACHINE_48,  0x00, LIBSPECTRUM_ID_SNAPSHOT_Z80, 0 },
+    { LIBSPECTRUM_MACHINE_128, 0x0b, LIBSPECTRUM_ID_SNAPSHOT_Z80, 0 },
+    { LIBSPECTRUM_MACHINE_128, 0x0b, LIBSPECTRUM_ID_SNAPSHOT_Z80, 1 },
+    { LIBSPECTRUM_MACHINE_48,  0x00, LIBSPECTRUM_ID_SNAPSHOT_SZX, 0 },
+    { LIBSPECTRUM_MACHINE_128, 0x08, LIBSPECTRUM_ID_SNAPSHOT_SZX, 0 },
+    { LIBSPECTRUM_MACHINE_128, 0x08, LIBSPECTRUM_ID_SNAPSHOT_SZX, 1 },
+  };
+  libspectrum_snap *snap, *snap2 = NULL;
+  libspectrum_byte *page, sp[ 38 + 0xc000 ];
+  libspectrum_snap_screen screen;
+  libspectrum_dword seed = 1;
+  size_t i, j;
+  test_return_t r = TEST_INCOMPLETE;
+
+  snap = libspectrum_snap_alloc();
+
+  /* Pages with some runs and some noise, so both compressed and
+     uncompressed data are seen */
+  for( i = 0; i < 8; i++ ) {
+    page = libspectrum_snap_alloc_page( snap, 0x4000 );
+    for( j = 0; j < 0x4000; j++ ) {
+      seed = seed * 1103515245 + 12345;
+      page[j] = ( j & 0x400 ) ? i * 0x10 + j / 0x100 : seed >> 16;
+    }
+    libspectrum_snap_set_pages( snap, i, page );
+  }
+
+  page = libspectrum_new( libspectrum_byte, 64 );
+  for( i = 0; i < 64; i++ ) page[i] = i * 3;
+  libspectrum_snap_set_ulaplus_active( snap, 1 );
+  libspectrum_snap_set_ulaplus_palette( snap, 0, page );
+
+  libspectrum_snap_set_sp( snap, 0x8000 );
+  libspectrum_snap_set_out_ula( snap, 0x03 );
+
+  r = TEST_PASS;
+
+  for( i = 0; i < ARRAY_SIZE( cases ) && r == TEST_PASS; i++ )
+    r = check_screen( snap, &cases[i] );
+
+  if( r != TEST_PASS ) goto end;
+
+  /* There's no .sp writer, so make a file by hand */
+  memset( sp, 0, sizeof( sp ) );
+  sp[0] = 'S'; sp[1] = 'P';
+  sp[2] = 0x00; sp[3] = 0xc0;		/* Length */
+  sp[4] = 0x00; sp[5] = 0x40;		/* Start */
+  sp[34] = 0x06;			/* Border */
+  for( i = 0; i < 0xc000; i++ ) sp[ 38 + i ] = i * 7;
+
+  snap2 = libspectrum_snap_alloc();
+
+  if( libspectrum_snap_read( snap2, sp, sizeof( sp ),
+                             LIBSPECTRUM_ID_SNAPSHOT_SP, NULL ) ||
+      libspectrum_snap_read_screen( &screen, sp, sizeof( sp ),
+                                    LIBSPECTRUM_ID_SNAPSHOT_SP, NULL ) ) {
+    fprintf( stderr, "%s: error reading .sp snapshot\n", progname );
+    r = TEST_FAIL;
+    goto end;
+  }
+
+  if( memcmp( screen.data, sp + 38, sizeof( screen.data ) ) ||
+      memcmp( libspectrum_snap_pages( snap2, 5 ), sp + 38, 0x4000 ) ||
+      screen.border != 6 ) {
+    fprintf( stderr, "%s: wrong screen from .sp snapshot\n", progname );
+    r = TEST_FAIL;
+  }
+
+end:
+  if( snap2 ) libspectrum_snap_free( snap2 );
+  libspectrum_snap_free( snap );
+
+  return r;
+}
+
+/* What libspectrum_screen_decode() should give for one pixel */
+static int
+screen_pixel( const libspectrum_byte *screen, libspectrum_byte scld_dec,
+              int flash_phase, int ulaplus, int x, int y )
+{
+  int address, attr, ink, paper, bit;
+
+  if( scld_dec & 0x04 ) {
+    address = ( ( x / 8 ) & 1 ? 0x2000 : 0 ) + x / 16;
+    bit = 7 - x % 8;
+    ink = ( scld_dec & 0x38 ) >> 3;
+    attr = 0x40 | ( ( 7 - ink ) << 3 ) | ink;
+  } else {
+    address = ( scld_dec & 0x01 ? 0x2000 : 0 ) + x / 8;
+    bit = 7 - x % 8;
+    attr = scld_dec & 0x02 ? -1 :
+           screen[ address + 6144 + ( y / 8 ) * 32 ];
+  }
+
+  address += ( y / 64 ) * 2048 + ( y % 8 ) * 256 + ( ( y / 8 ) % 8 ) * 32;
+  if( attr == -1 ) attr = screen[ address + 0x2000 ];
+
+  if( ulaplus ) {
+    ink = ( attr & 0xc0 ) / 4 + ( attr & 7 );
+    paper = ( attr & 0xc0 ) / 4 + 8 + ( ( attr / 8 ) & 7 );
+  } else {
+    ink = ( attr & 0x40 ? 8 : 0 ) + ( attr & 7 );
+    paper = ( attr & 0x40 ? 8 : 0 ) + ( ( attr / 8 ) & 7 );
+    if( ( attr & 0x80 ) && flash_phase ) {
+      int swap = ink; ink = paper; paper = swap;
+    }
+  }
+
+  return ( screen[ address ] >> bit ) & 1 ? ink : paper;
+}
+
+static test_return_t
+test_94( void )
+{
+  static const libspectrum_byte modes[][3] = {
+    /* SCLD, flash phase, ULAplus */
+    { 0x00, 0, 0 }, { 0x00, 1, 0 }, { 0x01, 1, 0 }, { 0x02, 0, 0 },
+    { 0x06, 0, 0 }, { 0x1e, 0, 0 }, { 0x00, 1, 1 }, { 0x02, 0, 1 },
+  };
+  libspectrum_byte *screen, *indexed, palette[64];
+  libspectrum_dword *rgba, colours[64];
+  libspectrum_dword seed = 1;
+  size_t i, x, y, width;
+  int expected, seen[64];
+  test_return_t r = TEST_FAIL;
+
+  screen = libspectrum_new( libspectrum_byte, 0x4000 );
+  indexed = libspectrum_new( libspectrum_byte, 512 * 192 );
+  rgba = libspectrum_new( libspectrum_dword, 512 * 192 );
+
+  for( i = 0; i < 0x4000; i++ ) {
+    seed = seed * 1103515245 + 12345;
+    screen[i] = seed >> 16;
+  }
+  for( i = 0; i < 64; i++ ) palette[i] = i * 4 + 3;
+
+  for( i = 0; i < ARRAY_SIZE( modes ); i++ ) {
+
+    const libspectrum_byte *ulaplus = modes[i][2] ? palette : NULL;
+
+    width = libspectrum_screen_width( modes[i][0] );
+
+    if( libspectrum_screen_decode( indexed, width,
+                                   LIBSPECTRUM_SCREEN_FORMAT_INDEXED, screen,
+                                   0x4000, modes[i][0], modes[i][1],
+                                   ulaplus ) ||
+        libspectrum_screen_decode( rgba, width * 4,
+                                   LIBSPECTRUM_SCREEN_FORMAT_RGBA, screen,
+                                   0x4000, modes[i][0], modes[i][1],
+                                   ulaplus ) ) {
+      fprintf( stderr, "%s: error decoding screen mode %lu\n", progname,
+               (unsigned long)i );
+      goto end;
+    }
+
+    for( x = 0; x < 64; x++ ) seen[x] = 0;
+
+    for( y = 0; y < 192; y++ )
+      for( x = 0; x < width; x++ ) {
+
+        expected = screen_pixel( screen, modes[i][0], modes[i][1],
+                                 modes[i][2], x, y );
+
+        if( indexed[ y * width + x ] != expected ) {
+          fprintf( stderr, "%s: mode %lu pixel (%lu,%lu) is %d, not %d\n",
+                   progname, (unsigned long)i, (unsigned long)x,
+                   (unsigned long)y, indexed[ y * width + x ], expected );
+          goto end;
+        }
+
+        /* Each index should always give the same colour */
+        if( !seen[ expected ] ) {
+          colours[ expected ] = rgba[ y * width + x ];
+          seen[ expected ] = 1;
+        } else if( colours[ expected ] != rgba[ y * width + x ] ) {
+          fprintf( stderr, "%s: mode %lu colour %d is inconsistent\n",
+                   progname, (unsigned long)i, expected );
+          goto end;
+        }
+      }
+
+    /* Check a couple of colours */
+    if( !ulaplus &&
+        ( ( seen[0] && memcmp( &colours[0], "\x00\x00\x00\xff", 4 ) ) ||
+          ( seen[15] && memcmp( &colours[15], "\xff\xff\xff\xff", 4 ) ) ) ) {
+      fprintf( stderr, "%s: wrong RGBA colours in mode %lu\n", progname,
+               (unsigned long)i );
+      goto end;
+    }
+
+    /* Entry 3 is green 0, red 0, blue 3 */
+    if( ulaplus && seen[0] &&
+        memcmp( &colours[0], "\x00\x00\xff\xff", 4 ) ) {
+      fprintf( stderr, "%s: wrong ULAplus colour in mode %lu\n", progname,
+               (unsigned long)i );
+      goto end;
+    }
+  }
+
+  r = TEST_PASS;
+
+end:
+  libspectrum_free( rgba );
+  libspectrum_free( indexed );
+  libspectrum_free( screen );
+
+  return r;
+}
+
+static test_return_t
+test_95( void )
+{
+  const libspectrum_byte *memory, *io;
+  const libspectrum_word *floating_bus;
+  libspectrum_dword i, frame_length;
+  libspectrum_word idle = LIBSPECTRUM_TIMINGS_FLOATING_BUS_IDLE;
+
+  memory = libspectrum_timings_memory_contention( LIBSPECTRUM_MACHINE_48 );
+  io = libspectrum_timings_io_contention( LIBSPECTRUM_MACHINE_48 );
+  floating_bus = libspectrum_timings_floating_bus( LIBSPECTRUM_MACHINE_48 );
+
+  if( !memory || !io || !floating_bus ||
+      memory[14334] != 0 || memory[14335] != 6 || memory[14336] != 5 ||
+      memory[14341] != 0 || memory[14342] != 0 || memory[14343] != 6 ||
+      memory[14335 + 128] != 0 || memory[14335 + 224] != 6 ||
+      io[14335] != 6 ||
+      floating_bus[14337] != idle || floating_bus[14338] != 0x0000 ||
+      floating_bus[14339] != 0x1800 || floating_bus[14340] != 0x0001 ||
+      floating_bus[14341] != 0x1801 || floating_bus[14342] != idle ||
+      floating_bus[14346] != 0x0002 || floating_bus[14338 + 224] != 0x0100 ||
+      floating_bus[14338 + 8 * 224] != 0x0020 ||
+      floating_bus[14338 + 191 * 224 + 120] != 0x17fe ) {
+    fprintf( stderr, "%s: wrong 48K tables\n", progname );
+    return TEST_FAIL;
+  }
+
+  memory = libspectrum_timings_memory_contention( LIBSPECTRUM_MACHINE_PLUS3 );
+  io = libspectrum_timings_io_contention( LIBSPECTRUM_MACHINE_PLUS3 );
+  floating_bus = libspectrum_timings_floating_bus( LIBSPECTRUM_MACHINE_PLUS3 );
+  frame_length =
+    libspectrum_timings_tstates_per_frame( LIBSPECTRUM_MACHINE_PLUS3 );
+
+  if( !memory || memory[14364] != 0 || memory[14365] != 1 ||
+      memory[14366] != 0 || memory[14367] != 7 ) {
+    fprintf( stderr, "%s: wrong +3 memory contention\n", progname );
+    return TEST_FAIL;
+  }
+
+  for( i = 0; i < frame_length; i++ )
+    if( io[i] || floating_bus[i] != idle ) {
+      fprintf( stderr, "%s: +3 I/O contended or floating bus at %lu\n",
+               progname, (unsigned long)i );
+      return TEST_FAIL;
+    }
+
+  memory = libspectrum_timings_memory_contention( LIBSPECTRUM_MACHINE_PENT );
+  frame_length =
+    libspectrum_timings_tstates_per_frame( LIBSPECTRUM_MACHINE_PENT );
+
+  for( i = 0; i < frame_length; i++ )
+    if( memory[i] ) {
+      fprintf( stderr, "%s: Pentagon memory contended at %lu\n", progname,
+               (unsigned long)i );
+      return TEST_FAIL;
+    }
+
+  if( libspectrum_timings_memory_contention( LIBSPECTRUM_MACHINE_UNKNOWN ) ) {
+    fprintf( stderr, "%s: got table for unknown machine\n", progname );
+    return TEST_FAIL;
+  }
+
+  return TEST_PASS;
+}
+
+static test_return_t
+test_96( void )
+{
+  libspectrum_snap *snap = libspectrum_snap_alloc();
+  libspectrum_snap_z80_state z80;
+  libspectrum_snap_ay_state ay;
+  libspectrum_snap_joystick_state joystick;
+  test_return_t r = TEST_FAIL;
+
+  libspectrum_snap_set_pc( snap, 0x1234 );
+  libspectrum_snap_set_iy( snap, 0x5c3a );
+  libspectrum_snap_set_halted( snap, 1 );
+  libspectrum_snap_set_ay_registers( snap, 15, 0xaa );
+
+  libspectrum_snap_get_z80_state( snap, &z80 );
+  libspectrum_snap_get_ay_state( snap, &ay );
+
+  if( z80.pc != 0x1234 || z80.iy != 0x5c3a || !z80.halted ||
+      z80.tstates != 69664 || ay.out_ay_registerport != 0x0e ||
+      ay.ay_registers[15] != 0xaa ) {
+    fprintf( stderr, "%s: wrong state got\n", progname );
+    goto end;
+  }
+
+  z80.sp = 0xfffe; z80.im = 2; z80.last_instruction_ei = 1;
+  libspectrum_snap_set_z80_state( snap, &z80 );
+
+  joystick.joystick_active_count = 1;
+  memset( joystick.joystick_list, 0, sizeof( joystick.joystick_list ) );
+  memset( joystick.joystick_inputs, 0, sizeof( joystick.joystick_inputs ) );
+  joystick.joystick_list[0] = LIBSPECTRUM_JOYSTICK_KEMPSTON;
+  joystick.joystick_inputs[0] = LIBSPECTRUM_JOYSTICK_INPUT_JOYSTICK_1;
+  libspectrum_snap_set_joystick_state( snap, &joystick );
+
+  if( libspectrum_snap_sp( snap ) != 0xfffe ||
+      libspectrum_snap_im( snap ) != 2 ||
+      !libspectrum_snap_last_instruction_ei( snap ) ||
+      libspectrum_snap_pc( snap ) != 0x1234 ||
+      libspectrum_snap_joystick_active_count( snap ) != 1 ||
+      libspectrum_snap_joystick_list( snap, 0 ) !=
+        LIBSPECTRUM_JOYSTICK_KEMPSTON ||
+      libspectrum_snap_joystick_inputs( snap, 0 ) !=
+        LIBSPECTRUM_JOYSTICK_INPUT_JOYSTICK_1 ) {
+    fprintf( stderr, "%s: wrong state set\n", progname );
+    goto end;
+  }
+
+  r = TEST_PASS;
+
+end:
+  libspectrum_snap_free( snap );
+  return r;
+}
+
+/* Check two tapes have the same edges up to the end of their first block */
+static test_return_t
+compare_first_block_edges( libspectrum_tape *tape1, libspectrum_tape *tape2 )
+{
+  libspectrum_dword tstates1, tstates2;
+  int flags1 = 0, flags2 = 0;
+
+  while( !( flags1 & LIBSPECTRUM_TAPE_FLAGS_BLOCK ) ) {
+    if( libspectrum_tape_get_next_edge( &tstates1, &flags1, tape1 ) ||
+        libspectrum_tape_get_next_edge( &tstates2, &flags2, tape2 ) )
+      return TEST_INCOMPLETE;
+    if( tstates1 != tstates2 || flags1 != flags2 ) {
+      fprintf( stderr, "%s: got edge %lu (flags 0x%x), expected %lu (0x%x)\n",
+               progname, (unsigned long)tstates2, flags2,
+               (unsigned long)tstates1, flags1 );
+      return TEST_FAIL;
+    }
+  }
+
+  return TEST_PASS;
+}
+
+static test_return_t
+test_97( void )
+{
+  libspectrum_byte csw[ 32 + 1000 ], *buffer = NULL, *raw = NULL;
+  size_t length = 0, raw_length = 0, i;
+  libspectrum_tape *tape = libspectrum_tape_alloc(),
+    *tzx_tape = libspectrum_tape_alloc();
+  test_return_t r = TEST_INCOMPLETE;
+
+  /* A version 1.01 .csw file at 44100 Hz with a long pulse in the middle */
+  memcpy( csw, "Compressed Square Wave\x1a\x01\x01\x44\xac\x01\x00\x00\x00\x00",
+          32 );
+  for( i = 32; i < sizeof( csw ); i++ ) csw[i] = 10 + i % 7;
+  memcpy( &csw[ 500 ], "\x00\x40\x42\x0f\x00", 5 );
+
+  if( libspectrum_tape_read( tape, csw, sizeof( csw ), LIBSPECTRUM_ID_TAPE_CSW,
+                             NULL ) ||
+      libspectrum_tape_write( &buffer, &length, tape,
+                              LIBSPECTRUM_ID_TAPE_TZX ) ||
+      libspectrum_tape_write_with_flags(
+        &raw, &raw_length, tape, LIBSPECTRUM_ID_TAPE_TZX,
+        LIBSPECTRUM_FLAG_TAPE_RLE_AS_RAW_DATA ) )
+    goto end;
+
+  if( buffer[10] != LIBSPECTRUM_TAPE_BLOCK_CSW_RECORDING ||
+      raw[10] != LIBSPECTRUM_TAPE_BLOCK_RAW_DATA || length >= raw_length ) {
+    fprintf( stderr,
+             "%s: wrote blocks 0x%02x and 0x%02x of %lu and %lu bytes\n",
+             progname, buffer[10], raw[10], (unsigned long)length,
+             (unsigned long)raw_length );
+    r = TEST_FAIL;
+    goto end;
+  }
+
+  if( libspectrum_tape_read( tzx_tape, buffer, length,
+                             LIBSPECTRUM_ID_TAPE_TZX, NULL ) )
+    goto end;
+
+  r = compare_first_block_edges( tape, tzx_tape );
+
+end:
+  libspectrum_free( raw );
+  libspectrum_free( buffer );
+  libspectrum_tape_free( tzx_tape );
+  libspectrum_tape_free( tape );
+  return r;
+}
+
+/* Play a tape through to its end, collecting the length of each stretch
+   of the signal at one level */
+static test_return_t
+get_tape_signal( libspectrum_tape *tape, libspectrum_dword **lengths,
+                 size_t *count )
+{
+  libspectrum_dword tstates;
+  size_t allocated = 0;
+  int flags = 0, level = 0, previous = -1;
+
+  *lengths = NULL; *count = 0;
+
+  while( !( flags & LIBSPECTRUM_TAPE_FLAGS_TAPE ) ) {
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) )
+      return TEST_INCOMPLETE;
+
+    if( flags & LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW ) {
+      level = 0;
+    } else if( flags & LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH ) {
+      level = 1;
+    } else if( !( flags & LIBSPECTRUM_TAPE_FLAGS_NO_EDGE ) ) {
+      level = !level;
+    }
+
+    if( !tstates ) continue;
+
+    if( level == previous ) {
+      (*lengths)[ *count - 1 ] += tstates;
+      continue;
+    }
+
+    if( *count == allocated ) {
+      allocated = allocated ? 2 * allocated : 1024;
+      *lengths = libspectrum_renew( libspectrum_dword, *lengths, allocated );
+    }
+    (*lengths)[ (*count)++ ] = tstates;
+    previous = level;
+  }
+
+  return TEST_PASS;
+}
+
+static test_return_t
+test_98( void )
+{
+  const char *filename = DYNAMIC_TEST_PATH( "complete-tzx.tzx" );
+  libspectrum_byte *tzx = NULL, *buffer = NULL;
+  libspectrum_dword *tzx_lengths = NULL, *pzx_lengths = NULL;
+  size_t tzx_length, length = 0, tzx_count, pzx_count, i;
+  libspectrum_tape *tape = libspectrum_tape_alloc(),
+    *pzx_tape = libspectrum_tape_alloc();
+  test_return_t r = TEST_INCOMPLETE;
+
+  if( read_file( &tzx, &tzx_length, filename ) ) goto end;
+
+  if( libspectrum_tape_read( tape, tzx, tzx_length, LIBSPECTRUM_ID_UNKNOWN,
+                             filename ) ||
+      libspectrum_tape_write( &buffer, &length, tape,
+                              LIBSPECTRUM_ID_TAPE_PZX ) ||
+      libspectrum_tape_read( pzx_tape, buffer, length,
+                             LIBSPECTRUM_ID_TAPE_PZX, NULL ) )
+    goto end;
+
+  r = get_tape_signal( tape, &tzx_lengths, &tzx_count );
+  if( r ) goto end;
+  r = get_tape_signal( pzx_tape, &pzx_lengths, &pzx_count );
+  if( r ) goto end;
+
+  if( pzx_count != tzx_count ) {
+    fprintf( stderr, "%s: .pzx file has %lu pulses, expected %lu\n",
+             progname, (unsigned long)pzx_count, (unsigned long)tzx_count );
+    r = TEST_FAIL;
+    goto end;
+  }
+
+  for( i = 0; i < tzx_count; i++ ) {
+    if( pzx_lengths[i] != tzx_lengths[i] ) {
+      fprintf( stderr, "%s: pulse %lu is %lu tstates, expected %lu\n",
+               progname, (unsigned long)i, (unsigned long)pzx_lengths[i],
+               (unsigned long)tzx_lengths[i] );
+      r = TEST_FAIL;
+      goto end;
+    }
+  }
+
+end:
+  libspectrum_free( pzx_lengths );
+  libspectrum_free( tzx_lengths );
+  libspectrum_free( buffer );
+  libspectrum_free( tzx );
+  libspectrum_tape_free( pzx_tape );
+  libspectrum_tape_free( tape );
+  return r;
+}
+
+/* Fill in a microdrive block with good checksums, which are the sum of
+   the bytes modulo 255 */
+static void
+make_microdrive_block( libspectrum_byte *block, libspectrum_byte number,
+                       const char *name, libspectrum_byte record,
+                       libspectrum_word length )
+{
+  size_t i, sum;
+
+  memset( block, 0, LIBSPECTRUM_MICRODRIVE_BLOCK_LEN );
+
+  block[0] = 0x01; block[1] = number;
+  memcpy( &block[4], "cartridge ", 10 );
+  block[16] = record;
+  block[17] = length & 0xff; block[18] = length >> 8;
+  memset( &block[19], ' ', 10 );
+  memcpy( &block[19], name, strlen( name ) );
+  for( i = 0; i < length; i++ ) block[ 30 + i ] = i * 7;
+
+  for( i = 0, sum = 0; i < 14; i++ ) sum += block[i];
+  block[14] = sum % 255;
+  for( i = 15, sum = 0; i < 29; i++ ) sum += block[i];
+  block[29] = sum % 255;
+  for( i = 30, sum = 0; i < 542; i++ ) sum += block[i];
+  block[542] = sum % 255;
+}
+
+static test_return_t
+test_99( void )
+{
+  libspectrum_microdrive *mdr = libspectrum_microdrive_alloc();
+  libspectrum_byte block[ LIBSPECTRUM_MICRODRIVE_BLOCK_LEN ];
+  libspectrum_byte valid[ LIBSPECTRUM_MICRODRIVE_BITMAP_LEN ];
+  const libspectrum_microdrive_file *files, *file;
+  size_t i, count, good;
+  test_return_t r = TEST_FAIL;
+
+  libspectrum_microdrive_set_cartridge_len( mdr, 10 );
+  for( i = 0; i < 10; i++ ) {
+    make_microdrive_block( block, 10 - i, "", 0, 0 );
+    libspectrum_microdrive_set_block_data( mdr, i, block );
+  }
+
+  /* "hello" has its records out of order, and there's a bad copy of
+     "world" */
+  make_microdrive_block( block, 5, "hello", 1, 100 );
+  libspectrum_microdrive_set_block_data( mdr, 5, block );
+  make_microdrive_block( block, 2, "hello", 0, 512 );
+  libspectrum_microdrive_set_block_data( mdr, 2, block );
+  make_microdrive_block( block, 7, "world", 0, 42 );
+  libspectrum_microdrive_set_block_data( mdr, 7, block );
+  block[14]++;
+  libspectrum_microdrive_set_block_data( mdr, 9, block );
+
+  if( memcmp( libspectrum_microdrive_block_data( mdr, 7 ), block, 14 ) ||
+      libspectrum_microdrive_data( mdr, 7 * LIBSPECTRUM_MICRODRIVE_BLOCK_LEN +
+                                        19 ) != 'w' ) {
+    fprintf( stderr, "%s: block 7 not as set\n", progname );
+    goto end;
+  }
+
+  good = libspectrum_microdrive_checksum_all( mdr, valid );
+  if( good != 9 || valid[0] != 0xff || valid[1] != 0x01 ) {
+    fprintf( stderr, "%s: %lu good blocks, bitmap 0x%02x 0x%02x\n",
+             progname, (unsigned long)good, valid[0], valid[1] );
+    goto end;
+  }
+  for( i = 2; i < LIBSPECTRUM_MICRODRIVE_BITMAP_LEN; i++ ) {
+    if( valid[i] ) {
+      fprintf( stderr, "%s: bitmap byte %lu set\n", progname,
+               (unsigned long)i );
+      goto end;
+    }
+  }
+
+  count = libspectrum_microdrive_catalogue( mdr, &files );
+  if( count != 2 || strcmp( files[0].name, "hello" ) ||
+      files[0].record_count != 2 || files[0].blocks[0] != 2 ||
+      files[0].blocks[1] != 5 || files[0].length != 612 ||
+      strcmp( files[1].name, "world" ) || files[1].record_count != 1 ||
+      files[1].blocks[0] != 7 ) {
+    fprintf( stderr, "%s: catalogue not as expected\n", progname );
+    goto end;
+  }
+
+  /* Changing the cartridge changes the catalogue */
+  make_microdrive_block( block, 5, "hello", 3, 1 );
+  libspectrum_microdrive_set_block_data( mdr, 5, block );
+
+  file = libspectrum_microdrive_find_file( mdr, "hello     " );
+  if( !file || file->record_count != 4 || file->blocks[1] != -1 ||
+      file->blocks[3] != 5 || file->length != 513 ||
+      libspectrum_microdrive_find_file( mdr, "hell" ) ) {
+    fprintf( stderr, "%s: changed catalogue not as expected\n", progname );
+    goto end;
+  }
+
+  r = TEST_PASS;
+
+end:
+  libspectrum_microdrive_free( mdr );
+  return r;
+}
+
+/* The Interface 1 ROM's checksum, a byte at a time */
+static libspectrum_byte
+rom_microdrive_checksum( const libspectrum_byte *data, size_t length )
+{
+  unsigned int sum = 0;
+  size_t i;
+
+  for( i = 0; i < length; i++ ) {
+    sum += data[i];
+    sum = sum > 255 ? sum - 256 + 2 : sum + 1;
+    sum = sum == 256 ? 0 : sum - 1;
+  }
+
+  return sum;
+}
+
+static test_return_t
+test_100( void )
+{
+  libspectrum_microdrive *mdr = libspectrum_microdrive_alloc();
+  libspectrum_byte valid[ LIBSPECTRUM_MICRODRIVE_BITMAP_LEN ];
+  const libspectrum_byte *block;
+  size_t i, j;
+  libspectrum_dword seed = 1;
+  test_return_t r = TEST_FAIL;
+
+  libspectrum_microdrive_set_cartridge_len( mdr,
+                                            LIBSPECTRUM_MICRODRIVE_BLOCK_MAX );
+
+  /* Blocks full of bytes with lots of carries, always with some data */
+  for( i = 0; i < LIBSPECTRUM_MICRODRIVE_CARTRIDGE_LENGTH; i++ ) {
+    seed = seed * 1103515245 + 12345;
+    libspectrum_microdrive_set_data( mdr, i, ( seed >> 16 ) | 0xc0 );
+  }
+
+  for( i = 0; i < LIBSPECTRUM_MICRODRIVE_BLOCK_MAX; i++ ) {
+    libspectrum_microdrive_set_data(
+      mdr, i * LIBSPECTRUM_MICRODRIVE_BLOCK_LEN + 15, 0
+    );
+    libspectrum_microdrive_set_checksums( mdr, i );
+
+    block = libspectrum_microdrive_block_data( mdr, i );
+    if( block[14] != rom_microdrive_checksum( block, 14 ) ||
+        block[29] != rom_microdrive_checksum( block + 15, 14 ) ||
+        block[542] != rom_microdrive_checksum( block + 30, 512 ) ) {
+      fprintf( stderr, "%s: checksums of block %lu not as expected\n",
+               progname, (unsigned long)i );
+      goto end;
+    }
+  }
+
+  if( libspectrum_microdrive_checksum_all( mdr, valid ) !=
+      LIBSPECTRUM_MICRODRIVE_BLOCK_MAX ) {
+    fprintf( stderr, "%s: not all blocks good\n", progname );
+    goto end;
+  }
+
+  /* Break each part of a block in turn */
+  for( i = 0; i < 3; i++ ) {
+    j = 100 * LIBSPECTRUM_MICRODRIVE_BLOCK_LEN + i * 15 + 3;
+    libspectrum_microdrive_set_data( mdr, j,
+                                     libspectrum_microdrive_data( mdr, j ) ^ 1 );
+    if( libspectrum_microdrive_checksum( mdr, 100 ) != (int)i + 1 ) {
+      fprintf( stderr, "%s: breaking part %lu gave checksum result %d\n",
+               progname, (unsigned long)i,
+               libspectrum_microdrive_checksum( mdr, 100 ) );
+      goto end;
+    }
+    libspectrum_microdrive_set_checksums( mdr, 100 );
+  }
+
+  r = TEST_PASS;
+
+end:
+  libspectrum_microdrive_free( mdr );
+  return r;
+}
+
+static test_return_t
+test_101( void )
+{
+  libspectrum_byte file[ 9 + 2 * 0x2000 ];
+  libspectrum_dck *dck = libspectrum_dck_alloc(), *clone = NULL,
+    *copied = libspectrum_dck_alloc(), local;
+  libspectrum_dck_block *block;
+  int i;
+  test_return_t r = TEST_FAIL;
+
+  /* One dock bank with a ROM page, an initialised RAM page and an
+     uninitialised RAM page */
+  memset( file, 0, 9 );
+  file[0] = LIBSPECTRUM_DCK_BANK_DOCK;
+  file[1] = LIBSPECTRUM_DCK_PAGE_ROM;
+  file[2] = LIBSPECTRUM_DCK_PAGE_RAM;
+  file[4] = LIBSPECTRUM_DCK_PAGE_RAM_EMPTY;
+  memset( &file[9], 0xaa, 0x2000 );
+  memset( &file[ 9 + 0x2000 ], 0x55, 0x2000 );
+
+  if( libspectrum_dck_read_with_flags( dck, file, sizeof( file ), "test.dck",
+                                       LIBSPECTRUM_FLAG_DCK_SHARE_PAGES ) ||
+      libspectrum_dck_read2( copied, file, sizeof( file ), "test.dck" ) ) {
+    r = TEST_INCOMPLETE;
+    goto end;
+  }
+
+  block = dck->dck[0];
+  if( !block || dck->dck[1] ||
+      !libspectrum_dck_page_is_shared( dck, block->pages[0] ) ||
+      libspectrum_dck_page_is_shared( dck, block->pages[1] ) ||
+      libspectrum_dck_page_is_shared( dck, block->pages[3] ) ||
+      libspectrum_dck_page_is_shared( copied, copied->dck[0]->pages[0] ) ||
+      memcmp( block->pages[0], copied->dck[0]->pages[0], 0x2000 ) ||
+      memcmp( block->pages[1], copied->dck[0]->pages[1], 0x2000 ) ) {
+    fprintf( stderr, "%s: shared pages not as expected\n", progname );
+    goto end;
+  }
+
+  clone = libspectrum_dck_clone( dck );
+  if( clone->dck[0]->pages[0] != block->pages[0] ||
+      clone->dck[0]->pages[1] == block->pages[1] ||
+      memcmp( clone->dck[0]->pages[1], block->pages[1], 0x2000 ) ||
+      clone->dck[0]->access[3] != LIBSPECTRUM_DCK_PAGE_RAM_EMPTY ||
+      clone->dck[1] ) {
+    fprintf( stderr, "%s: clone not as expected\n", progname );
+    goto end;
+  }
+
+  /* The clone keeps the shared pages when the original goes */
+  libspectrum_dck_free( dck, 0 );
+  libspectrum_free( dck );
+  dck = NULL;
+
+  if( clone->dck[0]->pages[0][0x1fff] != 0xaa ) {
+    fprintf( stderr, "%s: shared page lost\n", progname );
+    goto end;
+  }
+
+  /* A structure not from libspectrum_dck_alloc() shares pages only when
+     asked to */
+  memset( &local, 0xff, sizeof( local ) );
+  if( libspectrum_dck_read2( &local, file, sizeof( file ), "test.dck" ) ) {
+    r = TEST_INCOMPLETE;
+    goto end;
+  }
+  i = libspectrum_dck_page_is_shared( &local, local.dck[0]->pages[0] );
+  libspectrum_dck_free( &local, 0 );
+  if( i ) {
+    fprintf( stderr, "%s: page shared in local structure\n", progname );
+    goto end;
+  }
+
+  if( libspectrum_dck_read_with_flags( &local, file, sizeof( file ),
+                                       "test.dck",
+                                       LIBSPECTRUM_FLAG_DCK_SHARE_PAGES ) ) {
+    r = TEST_INCOMPLETE;
+    goto end;
+  }
+  i = libspectrum_dck_page_is_shared( &local, local.dck[0]->pages[0] );
+  libspectrum_dck_free( &local, 0 );
+  if( !i ) {
+    fprintf( stderr, "%s: page not shared in local structure\n", progname );
+    goto end;
+  }
+
+  r = TEST_PASS;
+
+end:
+  if( clone ) { libspectrum_dck_free( clone, 0 ); libspectrum_free( clone ); }
+  if( dck ) { libspectrum_dck_free( dck, 0 ); libspectrum_free( dck ); }
+  libspectrum_dck_free( copied, 0 );
+  libspectrum_free( copied );
+  return r;
+}
+
+static test_return_t
+test_102( void )
+{
+  libspectrum_microdrive *mdr = libspectrum_microdrive_alloc();
+  size_t length = 10 * LIBSPECTRUM_MICRODRIVE_BLOCK_LEN + 1;
+  libspectrum_byte *buffer, *block;
+  const libspectrum_microdrive_file *files;
+  size_t i, count;
+  test_return_t r = TEST_INCOMPLETE;
+
+  buffer = libspectrum_new( libspectrum_byte, length );
+  for( i = 0; i < 10; i++ )
+    make_microdrive_block( buffer + i * LIBSPECTRUM_MICRODRIVE_BLOCK_LEN,
+                           10 - i, "", 0, 0 );
+  buffer[ length - 1 ] = 0;
+
+  /* A record number past the end of any file, a record with a bad
+     data checksum and one good record */
+  block = buffer + 3 * LIBSPECTRUM_MICRODRIVE_BLOCK_LEN;
+  make_microdrive_block( block, 7, "big", 255, 100 );
+  block = buffer + 4 * LIBSPECTRUM_MICRODRIVE_BLOCK_LEN;
+  make_microdrive_block( block, 6, "bad", 0, 100 );
+  block[ 542 ]++;
+  block = buffer + 5 * LIBSPECTRUM_MICRODRIVE_BLOCK_LEN;
+  make_microdrive_block( block, 5, "good", 0, 100 );
+
+  if( libspectrum_microdrive_mdr_read( mdr, buffer, length ) ) goto end;
+
+  r = TEST_FAIL;
+
+  count = libspectrum_microdrive_catalogue( mdr, &files );
+  if( count != 1 || strcmp( files[0].name, "good" ) ||
+      files[0].record_count != 1 || files[0].blocks[0] != 5 ) {
+    fprintf( stderr, "%s: catalogue not as expected\n", progname );
+    goto end;
+  }
+
+  r = TEST_PASS;
+
+end:
+  libspectrum_microdrive_free( mdr );
+  libspectrum_free( buffer );
+  return r;
+}
+
+/* Give `snap' a first ROM of `length' bytes, all `value' */
+static void
+set_rom( libspectrum_snap *snap, size_t length, libspectrum_byte value )
+{
+  libspectrum_byte *rom = libspectrum_new( libspectrum_byte, length );
+
+  memset( rom, value, length );
+  libspectrum_free( libspectrum_snap_roms( snap, 0 ) );
+  libspectrum_snap_set_roms( snap, 0, rom );
+  libspectrum_snap_set_rom_length( snap, 0, length );
+}
+
+/* Apply the delta from `from' to `to' to `snap', which starts the same as
+   `from', and check its ROM ends up as in `to' */
+static test_return_t
+check_rom_delta( libspectrum_snap *snap, libspectrum_snap *from,
+                 libspectrum_snap *to )
+{
+  libspectrum_byte *delta = NULL;
+  size_t delta_length = 0, length = libspectrum_snap_rom_length( to, 0 );
+  test_return_t r = TEST_PASS;
+
+  if( libspectrum_snap_diff( &delta, &delta_length, from, to ) )
+    return TEST_INCOMPLETE;
+
+  if( libspectrum_snap_apply( snap, delta, delta_length ) ) {
+    fprintf( stderr, "%s: error applying delta\n", progname );
+    r = TEST_FAIL;
+  } else if( libspectrum_snap_rom_length( snap, 0 ) != length ||
+             memcmp( libspectrum_snap_roms( snap, 0 ),
+                     libspectrum_snap_roms( to, 0 ), length ) ) {
+    fprintf( stderr, "%s: ROM length 0x%lx after delta, not 0x%lx\n",
+             progname, (unsigned long)libspectrum_snap_rom_length( snap, 0 ),
+             (unsigned long)length );
+    r = TEST_FAIL;
+  } else if( libspectrum_snap_hash( snap ) != libspectrum_snap_hash( to ) ) {
+    fprintf( stderr, "%s: hash differs after delta\n", progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_free( delta );
+
+  return r;
+}
+
+static test_return_t
+check_huge_rom_delta( libspectrum_snap *snap, libspectrum_snap *from,
+                      libspectrum_snap *to )
+{
+  static const libspectrum_byte lengths[] = {
+    0x00, 0x40, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00
+  };
+  libspectrum_byte *delta = NULL;
+  size_t delta_length = 0, i;
+  test_return_t r = TEST_INCOMPLETE;
+
+  if( libspectrum_snap_diff( &delta, &delta_length, from, to ) )
+    return TEST_INCOMPLETE;
+
+  for( i = 0; i + sizeof( lengths ) <= delta_length; i++ ) {
+    if( memcmp( delta + i, lengths, sizeof( lengths ) ) ) continue;
+
+    delta[ i + 5 ] = 0x00; delta[ i + 7 ] = 0x01;
+
+    r = TEST_PASS;
+    if( libspectrum_snap_apply( snap, delta, delta_length ) !=
+        LIBSPECTRUM_ERROR_CORRUPT ) {
+      fprintf( stderr, "%s: delta with huge block not rejected\n",
+               progname );
+      r = TEST_FAIL;
+    }
+    break;
+  }
+
+  libspectrum_free( delta );
+
+  return r;
+}
+
+static test_return_t
+test_105( void )
+{
+  const char *filename = STATIC_TEST_PATH( "random.szx" );
+  libspectrum_snap *small, *large, *snap;
+  test_return_t r = TEST_INCOMPLETE;
+
+  small = load_snap( filename );
+  large = load_snap( filename );
+  snap = load_snap( filename );
+
+  if( !small || !large || !snap ) goto end;
+
+  set_rom( small, 0x4000, 0xaa );
+  set_rom( large, 0x8000, 0x55 );
+  set_rom( snap, 0x4000, 0xaa );
+
+  r = check_rom_delta( snap, small, large );
+  if( r == TEST_PASS ) r = check_rom_delta( snap, large, small );
+
+  /* A delta asking for a huge block is corrupt */
+  if( r == TEST_PASS ) r = check_huge_rom_delta( snap, small, large );
+
+end:
+  if( snap ) libspectrum_snap_free( snap );
+  if( large ) libspectrum_snap_free( large );
+  if( small ) libspectrum_snap_free( small );
+
+  return r;
+}
+
+/* Check that `snap', written as a native snapshot and then corrupted by
+   `corrupt', can't be read back */
+static test_return_t
+check_corrupt_lss( libspectrum_snap *snap,
+                   int (*corrupt)( libspectrum_byte *buffer, size_t length ),
+                   const char *what )
+{
+  libspectrum_byte *buffer;
+  size_t length;
+  libspectrum_snap *snap2;
+  libspectrum_error error;
+  test_return_t r;
+
+  r = write_lss( &buffer, &length, snap, 0 );
+  if( r != TEST_PASS ) return r;
+
+  if( corrupt( buffer, length ) ) {
+    libspectrum_free( buffer );
+    return TEST_INCOMPLETE;
+  }
+
+  snap2 = libspectrum_snap_alloc();
+  error = libspectrum_snap_read( snap2, buffer, length,
+                                 LIBSPECTRUM_ID_SNAPSHOT_LSS, NULL );
+  if( error != LIBSPECTRUM_ERROR_CORRUPT ) {
+    fprintf( stderr, "%s: native snapshot with %s read with error %d\n",
+             progname, what, error );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_snap_free( snap2 );
+  libspectrum_free( buffer );
+
+  return r;
+}
+
+/* The directory entry of the first block of `length' bytes in a native
+   snapshot, or NULL if there is none */
+static libspectrum_byte*
+find_lss_entry( libspectrum_byte *buffer, size_t length )
+{
+  size_t fields_length = buffer[8] | buffer[9] << 8 | buffer[10] << 16;
+  size_t count = buffer[12] | buffer[13] << 8, i;
+  libspectrum_byte *entry;
+
+  for( i = 0; i < count; i++ ) {
+    entry = buffer + 16 + fields_length + 32 * i;
+    if( ( entry[8] | entry[9] << 8 | entry[10] << 16 ) == length )
+      return entry;
+  }
+
+  return NULL;
+}
+
+/* Set an unknown flag on the compressed ROM */
+static int
+set_unknown_flag( libspectrum_byte *buffer, size_t length )
+{
+  libspectrum_byte *entry = find_lss_entry( buffer, 0x1234 );
+
+  if( !entry || entry[4] != 0x01 ) return 1;
+
+  entry[4] = 0x04;
+  return 0;
+}
+
+/* Make the zero ROM 16Mb long, both in its entry and in the fields */
+static int
+set_huge_length( libspectrum_byte *buffer, size_t length )
+{
+  static const libspectrum_byte rom_length[] = { 0x34, 0x12, 0x00, 0x00 };
+  size_t fields_length = buffer[8] | buffer[9] << 8 | buffer[10] << 16, i;
+  libspectrum_byte *entry = find_lss_entry( buffer, 0x1234 );
+
+  if( !entry || entry[4] != 0x02 ) return 1;
+  entry[8] = 0x00; entry[9] = 0x00; entry[11] = 0x01;
+
+  for( i = 16; i + 4 <= 16 + fields_length; i++ ) {
+    if( !memcmp( buffer + i, rom_length, 4 ) ) {
+      buffer[i] = 0x00; buffer[ i + 1 ] = 0x00; buffer[ i + 3 ] = 0x01;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static test_return_t
+test_106( void )
+{
+  libspectrum_snap *snap = load_snap( STATIC_TEST_PATH( "random.szx" ) );
+  test_return_t r;
+
+  if( !snap ) return TEST_INCOMPLETE;
+
+  /* An odd length ROM, so it can be found */
+  set_rom( snap, 0x1234, 0xaa );
+  r = check_corrupt_lss( snap, set_unknown_flag, "unknown flag" );
+
+  if( r == TEST_PASS ) {
+    set_rom( snap, 0x1234, 0x00 );
+    r = check_corrupt_lss( snap, set_huge_length, "huge block" );
+  }
+
+  libspectrum_snap_free( snap );
+
+  return r;
+}
+
 struct test_description {
 
   test_fn test;
@@ -976,7 +2615,40 @@ static struct test_description tests[] = {
   { test_71, "Write RZX with incompressible snap", 0 },
   { test_72, "Tape peek next block", 0 },
   { test_73, "Read TZX RAW block edge handling", 0 },
-  { test_74, "Trailing pause block TZX file", 0 }
+  { test_74, "Trailing pause block TZX file", 0 },
+  { test_75, "IDE sequential read through read cache", 0 },
+  { test_76, "IDE write, commit and re-read", 0 },
+  { test_77, "IDE write, commit and re-read with mapped image", 0 },
+  { test_78, "IDE write, commit and re-read with shared mapped image", 0 },
+  { test_79, "IDE commit coalesces adjacent sectors", 0 },
+  { test_80, "IDE background commit", 0 },
+  { test_81, "IDE overlay journal", 0 },
+  { test_82, "IDE sparse image conversion", 0 },
+  { test_83, "IDE compressed sparse image conversion", 0 },
+  { test_84, "MMC multiple block read and write", 0 },
+  { test_85, "IDE data register block transfers", 0 },
+  { test_86, "IDE and MMC activity statistics", 0 },
+  { test_87, "Snapshot reset and pool reuse", 0 },
+  { test_88, "Native snapshot write and read", 0 },
+  { test_89, "Snapshot diff and apply", 0 },
+  { test_90, "Snapshot hash", 0 },
+  { test_91, "Snapshot clone", 0 },
+  { test_92, ".szx zero and duplicate pages", 0 },
+  { test_93, "Reading snapshot screens", 0 },
+  { test_94, "Decoding screens to pixels", 0 },
+  { test_95, "Contention and floating bus tables", 0 },
+  { test_96, "Getting and setting snapshot state structures", 0 },
+  { test_97, "Writing RLE blocks as TZX CSW recordings", 0 },
+  { test_98, "Writing tapes as PZX files", 0 },
+  { test_99, "Microdrive catalogue and checksums", 0 },
+  { test_100, "Setting microdrive checksums", 0 },
+  { test_101, "Sharing DCK ROM pages", 0 },
+  { test_102, "Microdrive catalogue of damaged cartridge", 0 },
+  { test_103, "IDE and MMC detach with no journal", 0 },
+  { test_104, "MMC reset during multiple block write", 0 },
+  { test_105, "Snapshot delta changing a block's length", 0 },
+  { test_106, "Reading corrupt native snapshots", 0 },
+  { test_107, "IDE journal with out of range sector", 0 }
 };
 
 static size_t test_count = ARRAY_SIZE( tests );
@@ -994,11 +2666,12 @@ parse_test_specs( char **specs, int count )
     if( dash ) {
       int begin = atoi( spec ), end = atoi( dash + 1 );
       if( begin < 1 ) begin = 1;
-      if( end == 0 || end > test_count ) end = test_count;
+      if( end == 0 || ( end > 0 && (size_t)end > test_count ) )
+        end = test_count;
       for( j = begin; j <= end; j++ ) tests[j-1].active = 1;
     } else {
       int test = atoi( spec );
-      if( test < 1 || test > test_count ) continue;
+      if( test < 1 || (size_t)test > test_count ) continue;
       tests[ test - 1 ].active = 1;
     }
     
@@ -78,4 +78,21 @@ test_return_t test_68( void );
 test_return_t test_69( void );
 test_return_t test_70( void );
 
+/* IDE tests */
+test_return_t test_75( void );
+test_return_t test_76( void );
+test_return_t test_77( void );
+test_return_t test_78( void );
+test_return_t test_79( void );
+test_return_t test_80( void );
+test_return_t test_81( void );
+test_return_t test_82( void );
+test_return_t test_83( void );
+test_return_t test_84( void );
+test_return_t test_85( void );
+test_return_t test_86( void );
+test_return_t test_103( void );
+test_return_t test_104( void );
+test_return_t test_107( void );
+
 #endif
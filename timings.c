@@ -26,6 +26,10 @@
 
 #include <string.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif			/* #ifdef HAVE_PTHREAD_H */
+
 #include "internals.h"
 
 typedef struct timings_frame_t {
@@ -108,6 +112,38 @@ static const timings_frame_t timings_frame_scorpion =
   36, 14336
 };
 
+/* How the ULA of a machine shares memory with the processor */
+typedef struct timings_ula_t {
+
+  /* The delay for an access at each tstate of an 8 tstate cycle */
+  libspectrum_byte pattern[8];
+
+  /* How many tstates before the top-left pixel contention starts */
+  libspectrum_word offset;
+
+  /* Is I/O to the ULA contended? */
+  int io_contention;
+
+  /* Does the ULA's screen fetch appear on the floating bus? */
+  int floating_bus;
+
+} timings_ula_t;
+
+static const timings_ula_t timings_ula_ferranti =
+{
+  { 6, 5, 4, 3, 2, 1, 0, 0 }, 1, 1, 1
+};
+
+static const timings_ula_t timings_ula_timex_scld =
+{
+  { 6, 5, 4, 3, 2, 1, 0, 0 }, 1, 1, 0
+};
+
+static const timings_ula_t timings_ula_amstrad_asic =
+{
+  { 1, 0, 7, 6, 5, 4, 3, 2 }, 0, 0, 0
+};
+
 /* The frame timings of a machine */
 typedef struct timings_t {
 
@@ -119,47 +155,57 @@ typedef struct timings_t {
 
   const timings_frame_t *frame_timings;
 
+  /* NULL if memory is not contended */
+  const timings_ula_t *ula;
+
 } timings_t;
 
 /* The actual data from which the full timings are constructed */
 static const timings_t base_timings[] = {
 
   /* 48K */
-  { 3500000,       0, &timings_frame_ferranti_5c_6c },
+  { 3500000,       0, &timings_frame_ferranti_5c_6c, &timings_ula_ferranti },
   /* TC2048 */
-  { 3500000,       0, &timings_frame_timex_scld_50hz },
+  { 3500000,       0, &timings_frame_timex_scld_50hz,
+    &timings_ula_timex_scld },
   /* 128K */
-  { 3546900, 1773400, &timings_frame_ferranti_7c },
+  { 3546900, 1773400, &timings_frame_ferranti_7c, &timings_ula_ferranti },
   /* +2 */
-  { 3546900, 1773400, &timings_frame_ferranti_7c },
+  { 3546900, 1773400, &timings_frame_ferranti_7c, &timings_ula_ferranti },
   /* Pentagon */
-  { 3584000, 1792000, &timings_frame_pentagon },
+  { 3584000, 1792000, &timings_frame_pentagon, NULL },
   /* +2A */
-  { 3546900, 1773400, &timings_frame_amstrad_asic },
+  { 3546900, 1773400, &timings_frame_amstrad_asic,
+    &timings_ula_amstrad_asic },
   /* +3 */
-  { 3546900, 1773400, &timings_frame_amstrad_asic },
+  { 3546900, 1773400, &timings_frame_amstrad_asic,
+    &timings_ula_amstrad_asic },
   /* Unknown machine */
-  { 0, 0, NULL },
+  { 0, 0, NULL, NULL },
   /* 16K */
-  { 3500000,       0, &timings_frame_ferranti_5c_6c },
+  { 3500000,       0, &timings_frame_ferranti_5c_6c, &timings_ula_ferranti },
   /* TC2068 */
-  { 3500000, 1750000, &timings_frame_timex_scld_50hz },
+  { 3500000, 1750000, &timings_frame_timex_scld_50hz,
+    &timings_ula_timex_scld },
   /* Scorpion */
-  { 3500000, 1750000, &timings_frame_scorpion },
+  { 3500000, 1750000, &timings_frame_scorpion, NULL },
   /* +3e */
-  { 3546900, 1773400, &timings_frame_amstrad_asic },
+  { 3546900, 1773400, &timings_frame_amstrad_asic,
+    &timings_ula_amstrad_asic },
   /* SE */
-  { 3500000, 1750000, &timings_frame_se },
+  { 3500000, 1750000, &timings_frame_se, &timings_ula_timex_scld },
   /* TS2068 */
-  { 3528000, 1764000, &timings_frame_timex_scld_60hz },
+  { 3528000, 1764000, &timings_frame_timex_scld_60hz,
+    &timings_ula_timex_scld },
   /* Pentagon 512K */
-  { 3584000, 1792000, &timings_frame_pentagon },
+  { 3584000, 1792000, &timings_frame_pentagon, NULL },
   /* Pentagon 1024K */
-  { 3584000, 1792000, &timings_frame_pentagon },
+  { 3584000, 1792000, &timings_frame_pentagon, NULL },
   /* 48K NTSC */
-  { 3527500,       0, &timings_frame_ferranti_60hz },
+  { 3527500,       0, &timings_frame_ferranti_60hz, &timings_ula_ferranti },
   /* 128Ke */
-  { 3546900, 1773400, &timings_frame_amstrad_asic },
+  { 3546900, 1773400, &timings_frame_amstrad_asic,
+    &timings_ula_amstrad_asic },
 };
 
 libspectrum_dword
@@ -280,3 +326,134 @@ libspectrum_timings_tstates_per_frame( libspectrum_machine machine )
   return libspectrum_timings_tstates_per_line( machine ) *
     ( (libspectrum_dword)libspectrum_timings_lines_per_frame( machine ) );
 }
+
+/* The value in the floating bus table when the ULA isn't reading */
+const libspectrum_word LIBSPECTRUM_TIMINGS_FLOATING_BUS_IDLE = 0xffff;
+
+/* The per-tstate tables of a machine, built the first time they are
+   asked for */
+typedef struct timings_tables_t {
+
+  libspectrum_byte *contention;
+  libspectrum_byte *no_contention;
+  libspectrum_word *floating_bus;
+
+} timings_tables_t;
+
+static timings_tables_t tables[ ARRAY_SIZE( base_timings ) ];
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif			/* #ifdef HAVE_PTHREAD_H */
+
+static void
+build_tables( libspectrum_machine machine, timings_tables_t *t )
+{
+  const timings_frame_t *f = base_timings[ machine ].frame_timings;
+  const timings_ula_t *ula = base_timings[ machine ].ula;
+  libspectrum_dword frame_length, start, tstate;
+  libspectrum_word line_length, y, x, bitmap, attr;
+
+  frame_length = libspectrum_timings_tstates_per_frame( machine );
+  line_length = libspectrum_timings_tstates_per_line( machine );
+
+  t->no_contention = libspectrum_new0( libspectrum_byte, frame_length );
+  t->contention = t->no_contention;
+
+  t->floating_bus = libspectrum_new( libspectrum_word, frame_length );
+  for( tstate = 0; tstate < frame_length; tstate++ )
+    t->floating_bus[ tstate ] = LIBSPECTRUM_TIMINGS_FLOATING_BUS_IDLE;
+
+  if( !ula ) return;
+
+  t->contention = libspectrum_new0( libspectrum_byte, frame_length );
+
+  for( y = 0; y < f->vertical_screen; y++ ) {
+
+    /* Contention is in the same pattern across each line of the screen */
+    start = f->top_left_pixel - ula->offset + y * line_length;
+    for( x = 0; x < f->horizontal_screen; x++ )
+      t->contention[ start + x ] = ula->pattern[ x % 8 ];
+
+    if( !ula->floating_bus ) continue;
+
+    /* Each 8 tstates, the ULA reads two bitmap and two attribute bytes,
+       starting 2 tstates after the first pixel */
+    start = f->top_left_pixel + y * line_length;
+    bitmap = ( ( y & 0xc0 ) << 5 ) | ( ( y & 0x07 ) << 8 ) |
+             ( ( y & 0x38 ) << 2 );
+    attr = 0x1800 + ( y >> 3 ) * 32;
+
+    for( x = 0; x < f->horizontal_screen; x += 8 ) {
+      t->floating_bus[ start + x + 2 ] = bitmap + x / 4;
+      t->floating_bus[ start + x + 3 ] = attr + x / 4;
+      t->floating_bus[ start + x + 4 ] = bitmap + x / 4 + 1;
+      t->floating_bus[ start + x + 5 ] = attr + x / 4 + 1;
+    }
+  }
+}
+
+static const timings_tables_t*
+get_tables( libspectrum_machine machine )
+{
+  timings_tables_t *t;
+
+  if( (size_t)machine >= ARRAY_SIZE( base_timings ) ||
+      !base_timings[ machine ].frame_timings )
+    return NULL;
+
+  t = &tables[ machine ];
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock( &tables_lock );
+#endif			/* #ifdef HAVE_PTHREAD_H */
+
+  if( !t->floating_bus ) build_tables( machine, t );
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock( &tables_lock );
+#endif			/* #ifdef HAVE_PTHREAD_H */
+
+  return t;
+}
+
+const libspectrum_byte*
+libspectrum_timings_memory_contention( libspectrum_machine machine )
+{
+  const timings_tables_t *t = get_tables( machine );
+  if( !t ) return NULL;
+  return t->contention;
+}
+
+const libspectrum_byte*
+libspectrum_timings_io_contention( libspectrum_machine machine )
+{
+  const timings_tables_t *t = get_tables( machine );
+  if( !t ) return NULL;
+  return base_timings[ machine ].ula &&
+         base_timings[ machine ].ula->io_contention ?
+         t->contention : t->no_contention;
+}
+
+const libspectrum_word*
+libspectrum_timings_floating_bus( libspectrum_machine machine )
+{
+  const timings_tables_t *t = get_tables( machine );
+  if( !t ) return NULL;
+  return t->floating_bus;
+}
+
+void
+libspectrum_timings_cleanup( void )
+{
+  size_t i;
+
+  for( i = 0; i < ARRAY_SIZE( tables ); i++ ) {
+    if( tables[i].contention != tables[i].no_contention )
+      libspectrum_free( tables[i].contention );
+    libspectrum_free( tables[i].no_contention );
+    libspectrum_free( tables[i].floating_bus );
+    tables[i].contention = tables[i].no_contention = NULL;
+    tables[i].floating_bus = NULL;
+  }
+}
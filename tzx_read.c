@@ -54,6 +54,9 @@ static libspectrum_error
 tzx_read_raw_data( libspectrum_tape *tape, const libspectrum_byte **ptr,
 		   const libspectrum_byte *end );
 static libspectrum_error
+tzx_read_csw_recording( libspectrum_tape *tape, const libspectrum_byte **ptr,
+			const libspectrum_byte *end );
+static libspectrum_error
 tzx_read_generalised_data( libspectrum_tape *tape,
 			   const libspectrum_byte **ptr,
 			   const libspectrum_byte *end );
@@ -174,6 +177,11 @@ internal_tzx_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
       if( error ) { libspectrum_tape_clear( tape ); return error; }
       break;
 
+    case LIBSPECTRUM_TAPE_BLOCK_CSW_RECORDING:
+      error = tzx_read_csw_recording( tape, &ptr, end );
+      if( error ) { libspectrum_tape_clear( tape ); return error; }
+      break;
+
     case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
       error = tzx_read_generalised_data( tape, &ptr, end );
       if( error ) { libspectrum_tape_clear( tape ); return error; }
@@ -538,6 +546,113 @@ tzx_read_raw_data (libspectrum_tape *tape, const libspectrum_byte **ptr,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* CSW recordings are read into RLE pulse blocks, which have the same
+   pulse encoding */
+static libspectrum_error
+tzx_read_csw_recording( libspectrum_tape *tape, const libspectrum_byte **ptr,
+			const libspectrum_byte *end )
+{
+  libspectrum_tape_block *block;
+  libspectrum_dword block_length, sample_rate, scale;
+  libspectrum_word pause;
+  libspectrum_byte compression, *data = NULL;
+  const libspectrum_byte *csw;
+  size_t length;
+
+  /* Check there's enough left in the buffer for all the metadata */
+  if( end - (*ptr) < 14 ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "tzx_read_csw_recording: not enough data in buffer"
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  block_length = libspectrum_read_dword( ptr );
+  if( block_length < 10 || end - (*ptr) < (ptrdiff_t)block_length ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "tzx_read_csw_recording: not enough data in buffer"
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  pause = libspectrum_read_word( ptr );
+  sample_rate = (*ptr)[0] | (*ptr)[1] << 8 | (*ptr)[2] << 16;
+  compression = (*ptr)[3];
+
+  /* Skip the number of pulses, which we don't need */
+  csw = (*ptr) + 8;
+  length = block_length - 10;
+  (*ptr) += block_length - 2;
+
+  scale = sample_rate ? 3500000 / sample_rate : 0;
+  if( !scale ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+			     "tzx_read_csw_recording: bad sample rate %lu",
+			     (unsigned long)sample_rate );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  switch( compression ) {
+
+  case 1:			/* RLE */
+    if( length ) {
+      data = libspectrum_new( libspectrum_byte, length );
+      memcpy( data, csw, length );
+    }
+    break;
+
+  case 2:			/* Z-RLE */
+#ifdef HAVE_ZLIB_H
+    if( length ) {
+      libspectrum_error error;
+      const libspectrum_byte *compressed = csw;
+      size_t compressed_length = length;
+
+      length = 0;
+      error = libspectrum_zlib_inflate( compressed, compressed_length, &data,
+					&length );
+      if( error ) return error;
+    }
+    break;
+#else
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_UNKNOWN,
+      "tzx_read_csw_recording: zlib not available to decompress recording"
+    );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+#endif
+
+  default:
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "tzx_read_csw_recording: unknown compression type %d", compression
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  if( length ) {
+    block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE );
+    libspectrum_tape_block_set_scale( block, scale );
+    libspectrum_tape_block_set_data_length( block, length );
+    libspectrum_tape_block_set_data( block, data );
+    libspectrum_tape_append_block( tape, block );
+  } else {
+    libspectrum_free( data );
+  }
+
+  /* RLE pulse blocks don't have a pause, so follow the block with one */
+  if( pause ) {
+    block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PAUSE );
+    libspectrum_set_pause_ms( block, pause );
+    libspectrum_tape_block_set_level( block, -1 );
+    libspectrum_tape_append_block( tape, block );
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
 static libspectrum_error
 tzx_read_generalised_data( libspectrum_tape *tape,
 			   const libspectrum_byte **ptr,
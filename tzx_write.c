@@ -79,6 +79,9 @@ tzx_write_rle( libspectrum_tape_block *block, libspectrum_buffer* buffer,
                libspectrum_tape *tape,
                libspectrum_tape_iterator iterator );
 static void
+tzx_write_csw_recording( libspectrum_tape_block *block,
+                         libspectrum_buffer *buffer );
+static void
 add_pulses_block( size_t pulse_count, libspectrum_dword *lengths,
                   libspectrum_tape_block *block, libspectrum_buffer* buffer );
 static void
@@ -100,7 +103,8 @@ tzx_write_string( libspectrum_buffer* buffer, char *string );
 /* The main write function */
 
 libspectrum_error
-internal_tzx_write( libspectrum_buffer* buffer, libspectrum_tape *tape )
+internal_tzx_write( libspectrum_buffer* buffer, libspectrum_tape *tape,
+                    int flags )
 {
   libspectrum_error error;
   libspectrum_tape_iterator iterator;
@@ -200,8 +204,12 @@ internal_tzx_write( libspectrum_buffer* buffer, libspectrum_tape *tape )
       break;
 
     case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
-      error = tzx_write_rle( block, buffer, tape, iterator );
-      if( error != LIBSPECTRUM_ERROR_NONE ) { return error; }
+      if( flags & LIBSPECTRUM_FLAG_TAPE_RLE_AS_RAW_DATA ) {
+        error = tzx_write_rle( block, buffer, tape, iterator );
+        if( error != LIBSPECTRUM_ERROR_NONE ) { return error; }
+      } else {
+        tzx_write_csw_recording( block, buffer );
+      }
       break;
 
     case LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE:
@@ -633,39 +641,38 @@ typedef struct {
   size_t length; /* size of the buffer used so far */
 } rle_write_state;
 
-static rle_write_state rle_state;
-
 /* write a pulse of pulse_length bits into the tape_buffer */
 static void
-write_pulse( libspectrum_dword pulse_length )
+write_pulse( rle_write_state *state, libspectrum_dword pulse_length )
 {
   int i;
-  size_t target_size = rle_state.length + pulse_length/8;
+  size_t target_size = state->length + pulse_length/8;
 
-  if( rle_state.tape_length <= target_size ) {
-    rle_state.tape_length = target_size * 2;
-    rle_state.tape_buffer = libspectrum_renew( libspectrum_byte,
-					       rle_state.tape_buffer,
-					       rle_state.tape_length );
+  if( state->tape_length <= target_size ) {
+    state->tape_length = target_size * 2;
+    state->tape_buffer = libspectrum_renew( libspectrum_byte,
+					    state->tape_buffer,
+					    state->tape_length );
   }
 
   for( i = pulse_length; i > 0; i-- ) {
-    if( rle_state.level ) 
-      *(rle_state.tape_buffer + rle_state.length) |=
-        1 << (7 - rle_state.bits_used);
-    rle_state.bits_used++;
-
-    if( rle_state.bits_used == 8 ) {
-      rle_state.length++;
-      *(rle_state.tape_buffer + rle_state.length) = 0;
-      rle_state.bits_used = 0;
+    if( state->level ) 
+      *(state->tape_buffer + state->length) |=
+        1 << (7 - state->bits_used);
+    state->bits_used++;
+
+    if( state->bits_used == 8 ) {
+      state->length++;
+      *(state->tape_buffer + state->length) = 0;
+      state->bits_used = 0;
     }
   }
 
-  rle_state.level = !rle_state.level;
+  state->level = !state->level;
 }
 
-/* Convert RLE block to a TZX DRB as TZX CSW block support is limited :/ */
+/* Convert RLE block to a TZX DRB, for programs which can't handle TZX CSW
+   blocks */
 static libspectrum_error
 tzx_write_rle( libspectrum_tape_block *block, libspectrum_buffer *buffer,
                libspectrum_tape *tape,
@@ -677,6 +684,7 @@ tzx_write_rle( libspectrum_tape_block *block, libspectrum_buffer *buffer,
   libspectrum_dword pulse_tstates = 0;
   libspectrum_dword balance_tstates = 0;
   int flags = 0;
+  rle_write_state rle_state;
 
   libspectrum_tape_block *raw_block = 
     libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_RAW_DATA );
@@ -720,7 +728,7 @@ tzx_write_rle( libspectrum_tape_block *block, libspectrum_buffer *buffer,
     balance_tstates = balance_tstates % scale;
 
     /* write pulse_length bits of the current level into the buffer */
-    write_pulse( pulse_length );
+    write_pulse( &rle_state, pulse_length );
   }
 
   if( rle_state.length || rle_state.bits_used ) {
@@ -762,6 +770,68 @@ tzx_write_rle( libspectrum_tape_block *block, libspectrum_buffer *buffer,
   return libspectrum_tape_block_free( raw_block );
 }
 
+/* Count the pulses in the CSW encoded data of an RLE block; a zero byte
+   is followed by the length of the pulse as a dword */
+static libspectrum_dword
+count_csw_pulses( const libspectrum_byte *data, size_t length )
+{
+  libspectrum_dword pulses = 0;
+  size_t i;
+
+  for( i = 0; i < length; i += data[i] ? 1 : 5 ) pulses++;
+
+  return pulses;
+}
+
+/* RLE blocks have the same pulse encoding as TZX CSW recording blocks, so
+   their data can be written as it stands */
+static void
+tzx_write_csw_recording( libspectrum_tape_block *block,
+                         libspectrum_buffer *buffer )
+{
+  libspectrum_byte *data = libspectrum_tape_block_data( block );
+  size_t length = libspectrum_tape_block_data_length( block );
+  libspectrum_dword scale = libspectrum_tape_block_scale( block );
+  libspectrum_dword sample_rate = scale ? 3500000 / scale : 0;
+  libspectrum_byte *compressed = NULL;
+  size_t compressed_length = 0;
+  int compression = 1;		/* RLE */
+
+#ifdef HAVE_ZLIB_H
+  if( length &&
+      libspectrum_zlib_compress( data, length, &compressed,
+                                 &compressed_length ) ==
+        LIBSPECTRUM_ERROR_NONE &&
+      compressed_length < length ) {
+    compression = 2;		/* Z-RLE */
+  }
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+  libspectrum_buffer_write_byte( buffer,
+                                 LIBSPECTRUM_TAPE_BLOCK_CSW_RECORDING );
+  libspectrum_buffer_write_dword(
+    buffer, 10 + ( compression == 2 ? compressed_length : length )
+  );
+
+  /* Any pause is in a block of its own */
+  libspectrum_buffer_write_word( buffer, 0 );
+
+  /* The sample rate is only three bytes */
+  libspectrum_buffer_write_byte( buffer, sample_rate & 0xff );
+  libspectrum_buffer_write_word( buffer, ( sample_rate >> 8 ) & 0xffff );
+
+  libspectrum_buffer_write_byte( buffer, compression );
+  libspectrum_buffer_write_dword( buffer, count_csw_pulses( data, length ) );
+
+  if( compression == 2 ) {
+    libspectrum_buffer_write( buffer, compressed, compressed_length );
+  } else {
+    libspectrum_buffer_write( buffer, data, length );
+  }
+
+  libspectrum_free( compressed );
+}
+
 static void
 add_pulses_block( size_t pulse_count, libspectrum_dword *lengths,
                   libspectrum_tape_block *block, libspectrum_buffer *buffer )
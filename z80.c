@@ -153,8 +153,9 @@ read_v1_block( const libspectrum_byte *buffer, int is_compressed,
 	       const libspectrum_byte **next_block,
 	       const libspectrum_byte *end );
 static libspectrum_error
-read_v2_block( const libspectrum_byte *buffer, libspectrum_byte **block,
-	       size_t *length, int *page, const libspectrum_byte **next_block,
+read_v2_block( libspectrum_snap *snap, const libspectrum_byte *buffer,
+	       libspectrum_byte **block, size_t *length, int *page,
+	       const libspectrum_byte **next_block,
 	       const libspectrum_byte *end );
 
 static libspectrum_error
@@ -183,6 +184,9 @@ compress_block( libspectrum_byte **dest, size_t *dest_length,
 static void
 uncompress_block( libspectrum_byte **dest, size_t *dest_length,
 		  const libspectrum_byte *src, size_t src_length);
+static void
+uncompress_start( libspectrum_byte *dest, size_t dest_length,
+		  const libspectrum_byte *src, size_t src_length );
 
 /* The various things which can appear in the .slt data */
 enum slt_type {
@@ -219,6 +223,97 @@ internal_z80_read( libspectrum_snap *snap,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* Find the block holding the screen and decompress only as much of it as
+   is needed */
+libspectrum_error
+internal_z80_read_screen( libspectrum_snap_screen *screen,
+			  const libspectrum_byte *buffer,
+			  size_t buffer_length )
+{
+  libspectrum_snap *snap;
+  libspectrum_error error;
+  const libspectrum_byte *data, *end = buffer + buffer_length;
+  size_t length;
+  int version, compressed = 1, page;
+
+  if( buffer_length < (size_t)LIBSPECTRUM_Z80_HEADER_LENGTH + 2 ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "internal_z80_read_screen: not enough data in buffer"
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  /* The header is small, so just read it all to find out which page is
+     being shown */
+  snap = libspectrum_snap_alloc();
+
+  error = read_header( buffer, snap, &data, &version, &compressed );
+  if( error ) { libspectrum_snap_free( snap ); return error; }
+
+  screen->border = libspectrum_snap_out_ula( snap ) & 0x07;
+
+  /* In both 48K and 128K files, RAM page n is stored as page n + 3 */
+  page = libspectrum_snap_screen_page( snap ) + 3;
+
+  libspectrum_snap_free( snap );
+
+  if( data > end ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "internal_z80_read_screen: not enough data in buffer"
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  /* Version 1 files are a single 48K block starting with the screen */
+  if( version == 1 ) {
+
+    if( compressed ) {
+      uncompress_start( screen->data, sizeof( screen->data ), data,
+			end - data );
+    } else {
+      if( (size_t)( end - data ) < sizeof( screen->data ) ) {
+	libspectrum_print_error(
+	  LIBSPECTRUM_ERROR_CORRUPT,
+	  "internal_z80_read_screen: not enough data in buffer"
+	);
+	return LIBSPECTRUM_ERROR_CORRUPT;
+      }
+      memcpy( screen->data, data, sizeof( screen->data ) );
+    }
+
+    return LIBSPECTRUM_ERROR_NONE;
+  }
+
+  /* Stop at the end of the file or the start of any .slt data */
+  while( end - data >= 3 && ( data[0] || data[1] || data[2] ) ) {
+
+    length = data[0] + data[1] * 0x100;
+
+    if( data[2] == page ) {
+
+      /* A length of 0xffff => 16384 bytes of uncompressed data */
+      if( length == 0xffff ) {
+	if( (size_t)( end - data ) < 3 + sizeof( screen->data ) ) break;
+	memcpy( screen->data, data + 3, sizeof( screen->data ) );
+      } else {
+	if( (size_t)( end - data ) < 3 + length ) break;
+	uncompress_start( screen->data, sizeof( screen->data ), data + 3,
+			  length );
+      }
+
+      return LIBSPECTRUM_ERROR_NONE;
+    }
+
+    data += 3 + ( length == 0xffff ? 0x4000 : length );
+  }
+
+  libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+			   "internal_z80_read_screen: screen page not found" );
+  return LIBSPECTRUM_ERROR_CORRUPT;
+}
+
 static libspectrum_error
 read_header( const libspectrum_byte *buffer, libspectrum_snap *snap,
 	     const libspectrum_byte **data, int *version, int *compressed )
@@ -880,8 +975,8 @@ read_block( const libspectrum_byte *buffer, libspectrum_snap *snap,
     size_t length;
     int page;
 
-    error = read_v2_block( buffer, &uncompressed, &length, &page, next_block,
-			   end );
+    error = read_v2_block( snap, buffer, &uncompressed, &length, &page,
+			   next_block, end );
     if( error != LIBSPECTRUM_ERROR_NONE ) return error;
 
     if( page <= 0 || page > 18 ) {
@@ -1056,8 +1151,9 @@ read_v1_block( const libspectrum_byte *buffer, int is_compressed,
 }
 
 static libspectrum_error
-read_v2_block( const libspectrum_byte *buffer, libspectrum_byte **block,
-	       size_t *length, int *page, const libspectrum_byte **next_block,
+read_v2_block( libspectrum_snap *snap, const libspectrum_byte *buffer,
+	       libspectrum_byte **block, size_t *length, int *page,
+	       const libspectrum_byte **next_block,
 	       const libspectrum_byte *end )
 {
   size_t length2;
@@ -1085,7 +1181,8 @@ read_v2_block( const libspectrum_byte *buffer, libspectrum_byte **block,
       return LIBSPECTRUM_ERROR_CORRUPT;
     }
 
-    *length = 0;
+    *block = libspectrum_snap_alloc_page( snap, 0x4000 );
+    *length = 0x4000;
     uncompress_block( block, length, buffer + 3, length2 );
 
     *next_block = buffer + 3 + length2;
@@ -1099,7 +1196,7 @@ read_v2_block( const libspectrum_byte *buffer, libspectrum_byte **block,
       return LIBSPECTRUM_ERROR_CORRUPT;
     }
 
-    *block = libspectrum_new( libspectrum_byte, 0x4000 );
+    *block = libspectrum_snap_alloc_page( snap, 0x4000 );
     memcpy( *block, buffer + 3, 0x4000 );
 
     *length = 0x4000;
@@ -1860,3 +1957,36 @@ uncompress_block( libspectrum_byte **dest, size_t *dest_length,
 
   *dest_length = out_ptr - *dest;
 }
+
+/* As uncompress_block(), but stops once the `dest_length' bytes at `dest'
+   are full. Anything not covered by the data is zeroed */
+static void
+uncompress_start( libspectrum_byte *dest, size_t dest_length,
+		  const libspectrum_byte *src, size_t src_length )
+{
+  const libspectrum_byte *in_ptr = src, *in_end = src + src_length;
+  libspectrum_byte *out_ptr = dest, *out_end = dest + dest_length;
+  size_t run_length;
+
+  while( in_ptr < in_end && out_ptr < out_end ) {
+
+    /* Two successive 0xed bytes are a run; anything else is copied */
+    if( in_end - in_ptr >= 4 && in_ptr[0] == 0xed && in_ptr[1] == 0xed ) {
+
+      run_length = in_ptr[2];
+      if( run_length > (size_t)( out_end - out_ptr ) )
+	run_length = out_end - out_ptr;
+
+      memset( out_ptr, in_ptr[3], run_length );
+      out_ptr += run_length; in_ptr += 4;
+
+    } else {
+
+      *out_ptr++ = *in_ptr++;
+
+    }
+
+  }
+
+  memset( out_ptr, 0, out_end - out_ptr );
+}
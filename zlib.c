@@ -47,7 +47,8 @@ skip_null_terminated_string( const libspectrum_byte **ptr, size_t *length,
 			     const char *name );
 static libspectrum_error
 zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
-	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack );
+	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack,
+	      int caller_buffer, int partial );
 
 libspectrum_error 
 libspectrum_zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
@@ -60,7 +61,25 @@ libspectrum_zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
  * Returns:	error flag (libspectrum_error)
  */
 {
-  return zlib_inflate( gzptr, gzlength, outptr, outlength, 0 );
+  return zlib_inflate( gzptr, gzlength, outptr, outlength, 0, 0, 0 );
+}
+
+/* As libspectrum_zlib_inflate(), but inflates into the `*outlength' bytes
+   at `outptr' rather than allocating memory */
+libspectrum_error
+libspectrum_zlib_inflate_into( const libspectrum_byte *gzptr, size_t gzlength,
+			       libspectrum_byte *outptr, size_t *outlength )
+{
+  return zlib_inflate( gzptr, gzlength, &outptr, outlength, 0, 1, 0 );
+}
+
+/* As libspectrum_zlib_inflate_into(), but stops once the `*outlength' bytes
+   at `outptr' are full, without inflating the rest of the stream */
+libspectrum_error
+libspectrum_zlib_inflate_start( const libspectrum_byte *gzptr, size_t gzlength,
+				libspectrum_byte *outptr, size_t *outlength )
+{
+  return zlib_inflate( gzptr, gzlength, &outptr, outlength, 0, 1, 1 );
 }
 
 libspectrum_error
@@ -71,19 +90,20 @@ libspectrum_gzip_inflate( const libspectrum_byte *gzptr, size_t gzlength,
 
   error = skip_gzip_header( &gzptr, &gzlength ); if( error ) return error;
 
-  return zlib_inflate( gzptr, gzlength, outptr, outlength, 1 );
+  return zlib_inflate( gzptr, gzlength, outptr, outlength, 1, 0, 0 );
 }
 
 libspectrum_error
 libspectrum_zip_inflate( const libspectrum_byte *zipptr, size_t ziplength,
                          libspectrum_byte **outptr, size_t *outlength )
 {
-  return zlib_inflate( zipptr, ziplength, outptr, outlength, 1 );
+  return zlib_inflate( zipptr, ziplength, outptr, outlength, 1, 0, 0 );
 }
 
 static libspectrum_error
 zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
-	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack )
+	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack,
+	      int caller_buffer, int partial )
 {
   z_stream stream;
   int error;
@@ -133,9 +153,15 @@ zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
 
   if( *outlength ) {
 
-    *outptr = libspectrum_new( libspectrum_byte, *outlength );
+    if( !caller_buffer )
+      *outptr = libspectrum_new( libspectrum_byte, *outlength );
     stream.next_out = *outptr; stream.avail_out = *outlength;
-    error = inflate( &stream, Z_FINISH );
+    error = inflate( &stream, partial ? Z_SYNC_FLUSH : Z_FINISH );
+
+    /* Stopping with the buffer full is fine if that's all we wanted */
+    if( partial && !stream.avail_out &&
+        ( error == Z_OK || error == Z_BUF_ERROR ) )
+      error = Z_STREAM_END;
 
   } else {
 
@@ -158,7 +184,8 @@ zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
   }
 
   *outlength = stream.next_out - *outptr;
-  *outptr = libspectrum_renew( libspectrum_byte, *outptr, *outlength );
+  if( !caller_buffer )
+    *outptr = libspectrum_renew( libspectrum_byte, *outptr, *outlength );
 
   switch( error ) {
 
@@ -167,27 +194,27 @@ zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
   case Z_NEED_DICT:
     libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
 			     "gzip inflation needs dictionary" );
-    libspectrum_free( *outptr );
+    if( !caller_buffer ) libspectrum_free( *outptr );
     inflateEnd( &stream );
     return LIBSPECTRUM_ERROR_UNKNOWN;
 
   case Z_DATA_ERROR:
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT, "corrupt gzip data" );
-    libspectrum_free( *outptr );
+    if( !caller_buffer ) libspectrum_free( *outptr );
     inflateEnd( &stream );
     return LIBSPECTRUM_ERROR_CORRUPT;
 
   case Z_MEM_ERROR:
     libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
 			     "out of memory at %s:%d", __FILE__, __LINE__ );
-    libspectrum_free( *outptr );
+    if( !caller_buffer ) libspectrum_free( *outptr );
     inflateEnd( &stream );
     return LIBSPECTRUM_ERROR_MEMORY;
 
   case Z_BUF_ERROR:
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
 			     "not enough space in gzip output buffer" );
-    libspectrum_free( *outptr );
+    if( !caller_buffer ) libspectrum_free( *outptr );
     inflateEnd( &stream );
     return LIBSPECTRUM_ERROR_CORRUPT;
 
@@ -195,7 +222,7 @@ zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
     libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
 			     "gzip error from inflate: %s",
 			     stream.msg );
-    libspectrum_free( *outptr );
+    if( !caller_buffer ) libspectrum_free( *outptr );
     inflateEnd( &stream );
     return LIBSPECTRUM_ERROR_LOGIC;
 
@@ -205,7 +232,7 @@ zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
   if( error != Z_OK ) {
     libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
 			     "gzip error from inflateEnd: %s", stream.msg );
-    libspectrum_free( *outptr );
+    if( !caller_buffer ) libspectrum_free( *outptr );
     inflateEnd( &stream );
     return LIBSPECTRUM_ERROR_LOGIC;
   }